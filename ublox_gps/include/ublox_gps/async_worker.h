@@ -31,11 +31,18 @@
 
 #include <ublox_gps/gps.h>
 
+#include <errno.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <time.h>
+
 #include <boost/asio.hpp>
 #include <boost/bind.hpp>
 #include <boost/format.hpp>
 #include <boost/thread.hpp>
 #include <boost/thread/condition.hpp>
+#include <boost/type_traits/is_same.hpp>
 
 
 #include "worker.h"
@@ -44,6 +51,52 @@ namespace ublox_gps {
 
 int debug; //!< Used to determine which debug messages to display
 
+/**
+ * @brief Receive from a socket without blocking, along with the kernel
+ * receive timestamp.
+ * @param fd the socket file descriptor
+ * @param data the buffer to receive into
+ * @param size the size of the buffer
+ * @param stamp set to the time the kernel received the data, if the
+ * SO_TIMESTAMPNS option of the socket is enabled
+ * @param truncated if not NULL, set to the number of bytes of the datagram
+ * which did not fit in the buffer and were discarded
+ * @return the number of bytes received, or -1 on error (see errno)
+ */
+inline ssize_t receiveStamped(int fd, unsigned char* data, std::size_t size,
+                              ros::Time& stamp,
+                              std::size_t* truncated = NULL) {
+  iovec iov;
+  iov.iov_base = data;
+  iov.iov_len = size;
+  char control[CMSG_SPACE(sizeof(timespec))];
+  msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  if (truncated) *truncated = 0;
+  // With MSG_TRUNC a datagram socket returns the full size of the datagram
+  ssize_t n = recvmsg(fd, &msg, MSG_DONTWAIT | (truncated ? MSG_TRUNC : 0));
+  if (n <= 0) return n;
+  if (truncated && (msg.msg_flags & MSG_TRUNC)) {
+    *truncated = n - size;
+    n = size;
+  }
+  for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET
+        && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+      timespec ts;
+      memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+      stamp = ros::Time(ts.tv_sec, ts.tv_nsec);
+    }
+  }
+  return n;
+}
+
 /**
  * @brief Handles Asynchronous I/O reading and writing.
  */
@@ -68,7 +121,7 @@ class AsyncWorker : public Worker {
    * @brief Set the callback function which handles input messages.
    * @param callback the read callback which handles received messages
    */
-  void setCallback(const Callback& callback) { read_callback_ = callback; }
+  void setCallback(const ReadCallback& callback) { read_callback_ = callback; }
 
   /**
    * @brief Set the callback function which handles raw data.
@@ -82,6 +135,15 @@ class AsyncWorker : public Worker {
    * @param size the size of the buffer
    */
   bool send(const unsigned char* data, const unsigned int size);
+
+  /**
+   * @brief Send the data bytes via the I/O stream, ahead of the data queued
+   * by send() which is not being written yet.
+   * @param data the buffer of data bytes to send
+   * @param size the size of the buffer
+   */
+  bool sendPriority(const unsigned char* data, const unsigned int size);
+
   /**
    * @brief Wait for incoming messages.
    * @param timeout the maximum time to wait
@@ -90,12 +152,50 @@ class AsyncWorker : public Worker {
 
   bool isOpen() const { return stream_->is_open(); }
 
+  /**
+   * @brief Trade latency for fewer wakeups of the I/O thread.
+   *
+   * @details After the first bytes of a burst are received, the stream is not
+   * read again until the timeout expires; the kernel buffers the rest of the
+   * burst, which is then read and dispatched at once. Data is dispatched
+   * without waiting if it reaches the minimum size or contains the end of
+   * an epoch (UBX-NAV-EOE). In epoch mode, the worker keeps waiting in steps
+   * of the timeout until the epoch ends, for at most kMaxCoalesceWaitMs.
+   * @param min_bytes dispatch once this many bytes are pending, 0 for no limit
+   * @param timeout_ms the time to wait for more data [ms], 0 disables
+   * coalescing
+   * @param epoch whether to wait for the end of the navigation epoch, which
+   * requires NAV-EOE to be enabled on the device
+   */
+  void setCoalescing(std::size_t min_bytes, unsigned int timeout_ms,
+                     bool epoch);
+
  protected:
+  //! Maximum time data is held back in epoch mode [ms]
+  constexpr static unsigned int kMaxCoalesceWaitMs = 1000;
+  //! Period of the wakeup and CPU load reports [s]
+  constexpr static double kStatsPeriod = 60.0;
+
+  /**
+   * @brief Account for a received datagram before it is added to the input
+   * buffer. Does nothing for stream I/O.
+   * @param size the number of bytes in the datagram
+   * @param truncated the number of bytes of the datagram which did not fit
+   * in the input buffer
+   */
+  void datagramReceived(std::size_t size, std::size_t truncated) {}
+
   /**
    * @brief Read the input stream.
    */
   void doRead();
 
+  /**
+   * @brief Drop the input buffer if it is still full after the callbacks,
+   * as nothing could be read into it. Call with read_mutex_ locked.
+   */
+  void dropIfFull();
+
   /**
    * @brief Process messages read from the input stream.
    * @param error_code an error code for read failures
@@ -103,8 +203,64 @@ class AsyncWorker : public Worker {
    */
   void readEnd(const boost::system::error_code&, std::size_t);
 
+  /**
+   * @brief Receive from a socket which became readable, along with the kernel
+   * receive timestamp, then process the data as readEnd.
+   * @param error_code an error code for read failures
+   */
+  void receiveEnd(const boost::system::error_code&);
+
+  /**
+   * @brief Read the data buffered while coalescing and dispatch it once
+   * ready.
+   * @param error_code an error code, set if the timer was cancelled
+   */
+  void coalesceEnd(const boost::system::error_code&);
+
+  /**
+   * @brief Read the bytes already available without blocking.
+   */
+  void readAvailable();
+
+  /**
+   * @brief Whether the pending data should be dispatched without waiting.
+   */
+  bool readyToDispatch() const;
+
+  /**
+   * @brief Pass the pending data to the raw data and read callbacks.
+   */
+  void dispatch();
+
+  /**
+   * @brief Log the wakeup and dispatch rates and the CPU load of the I/O
+   * thread, once per kStatsPeriod.
+   */
+  void reportStats();
+
+  /**
+   * @brief Get the time of the given clock in seconds.
+   */
+  static double clockSeconds(clockid_t clock) {
+    timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+  }
+
+  /**
+   * @brief Add the data bytes to the output buffer.
+   * @param data the buffer of data bytes to send
+   * @param size the size of the buffer
+   * @param priority whether to add the data in front of the queued data
+   */
+  bool queueWrite(const unsigned char* data, const unsigned int size,
+                  bool priority);
+
   /**
    * @brief Send all the data in the output buffer.
+   *
+   * @details The output buffer is swapped with the write buffer, so send()
+   * does not wait for the port while the data is written.
    */
   void doWrite();
 
@@ -121,30 +277,75 @@ class AsyncWorker : public Worker {
   std::vector<unsigned char> in_; //!< The input buffer
   std::size_t in_buffer_size_; //!< number of bytes currently in the input
                                //!< buffer
+  std::size_t pending_; //!< number of bytes at the end of the input buffer
+                        //!< not yet dispatched
+  ArrivalTimes arrivals_; //!< Arrival times of the bytes in the input buffer
+  //! Kernel receive time of the bytes being read, zero if not available
+  ros::Time read_stamp_;
+  //! Bytes of the datagram being read which did not fit in the input buffer
+  std::size_t read_truncated_;
+
+  // Coalescing, see setCoalescing
+  //! Minimum number of bytes to dispatch, 0 for no limit
+  std::size_t coalesce_bytes_;
+  //! Time to wait for more data, 0 if coalescing is disabled
+  boost::posix_time::time_duration coalesce_timeout_;
+  //! Whether to wait for the end of the navigation epoch
+  bool coalesce_epoch_;
+  //! Timer which ends the wait for more data
+  boost::shared_ptr<boost::asio::deadline_timer> coalesce_timer_;
+  //! Whether the worker waits for the timer instead of reading
+  bool coalesce_wait_;
+  //! When the first pending byte was received
+  boost::posix_time::ptime burst_start_;
+
+  // Load statistics, reported by reportStats
+  std::size_t wakeups_; //!< Number of read and timer handler calls
+  std::size_t dispatches_; //!< Number of read callback calls
+  double stats_start_; //!< Start of the report period [s, monotonic]
+  double stats_cpu_start_; //!< I/O thread CPU time at stats_start_ [s]
 
   Mutex write_mutex_; //!< Lock for the output buffer
   boost::condition write_condition_;
   std::vector<unsigned char> out_; //!< The output buffer
+  //! The data being written, only used by the I/O thread
+  std::vector<unsigned char> writing_;
 
   boost::shared_ptr<boost::thread> background_thread_; //!< thread for the I/O
                                                        //!< service
-  Callback read_callback_; //!< Callback function to handle received messages
+  ReadCallback read_callback_; //!< Callback function to handle received
+                               //!< messages
   Callback write_callback_; //!< Callback function to handle raw data
 
   bool stopping_; //!< Whether or not the I/O service is closed
+
+  // Datagram statistics, only used for datagram sockets
+  //! Number of datagrams received
+  std::size_t datagrams_;
+  //! Datagrams which started a new message while a partial message was
+  //! pending, i.e. a previous datagram was lost or arrived out of order
+  std::size_t datagram_gaps_;
+  //! Datagrams which did not fit in the input buffer and were truncated
+  std::size_t datagrams_truncated_;
 };
 
 template <typename StreamT>
 AsyncWorker<StreamT>::AsyncWorker(boost::shared_ptr<StreamT> stream,
         boost::shared_ptr<boost::asio::io_service> io_service,
         std::size_t buffer_size)
-    : stopping_(false) {
+    : pending_(0), read_truncated_(0), coalesce_bytes_(0), coalesce_epoch_(false),
+      coalesce_wait_(false), wakeups_(0), dispatches_(0), stats_start_(0),
+      stats_cpu_start_(0), stopping_(false), datagrams_(0),
+      datagram_gaps_(0), datagrams_truncated_(0) {
   stream_ = stream;
   io_service_ = io_service;
   in_.resize(buffer_size);
   in_buffer_size_ = 0;
+  coalesce_timeout_ = boost::posix_time::milliseconds(0);
+  coalesce_timer_.reset(new boost::asio::deadline_timer(*io_service_));
 
   out_.reserve(buffer_size);
+  writing_.reserve(buffer_size);
 
   io_service_->post(boost::bind(&AsyncWorker<StreamT>::doRead, this));
   background_thread_.reset(new boost::thread(
@@ -161,6 +362,19 @@ AsyncWorker<StreamT>::~AsyncWorker() {
 template <typename StreamT>
 bool AsyncWorker<StreamT>::send(const unsigned char* data,
                                 const unsigned int size) {
+  return queueWrite(data, size, false);
+}
+
+template <typename StreamT>
+bool AsyncWorker<StreamT>::sendPriority(const unsigned char* data,
+                                        const unsigned int size) {
+  return queueWrite(data, size, true);
+}
+
+template <typename StreamT>
+bool AsyncWorker<StreamT>::queueWrite(const unsigned char* data,
+                                      const unsigned int size,
+                                      bool priority) {
   ScopedLock lock(write_mutex_);
   if(size == 0) {
     ROS_ERROR("Ublox AsyncWorker::send: Size of message to send is 0");
@@ -171,7 +385,10 @@ bool AsyncWorker<StreamT>::send(const unsigned char* data,
     ROS_ERROR("Ublox AsyncWorker::send: Output buffer too full to send message");
     return false;
   }
-  out_.insert(out_.end(), data, data + size);
+  // The buffer only holds whole messages, the one being written was swapped
+  // out by doWrite
+  out_.insert(priority ? out_.begin() : out_.end(), data, data + size);
+  UBLOX_TRACE2(send_queued, size, priority);
 
   io_service_->post(boost::bind(&AsyncWorker<StreamT>::doWrite, this));
   return true;
@@ -179,30 +396,37 @@ bool AsyncWorker<StreamT>::send(const unsigned char* data,
 
 template <typename StreamT>
 void AsyncWorker<StreamT>::doWrite() {
-  ScopedLock lock(write_mutex_);
-  // Do nothing if out buffer is empty
-  if (out_.size() == 0) {
-    return;
+  {
+    ScopedLock lock(write_mutex_);
+    // Do nothing if out buffer is empty
+    if (out_.size() == 0) {
+      return;
+    }
+    writing_.swap(out_);
   }
   // Write all the data in the out buffer
-  boost::asio::write(*stream_, boost::asio::buffer(out_.data(), out_.size()));
+  boost::asio::write(*stream_,
+                     boost::asio::buffer(writing_.data(), writing_.size()));
+  UBLOX_TRACE1(send_completed, writing_.size());
 
   if (debug >= 2) {
     // Print the data that was sent
     std::ostringstream oss;
-    for (std::vector<unsigned char>::iterator it = out_.begin();
-         it != out_.end(); ++it)
+    for (std::vector<unsigned char>::iterator it = writing_.begin();
+         it != writing_.end(); ++it)
       oss << boost::format("%02x") % static_cast<unsigned int>(*it) << " ";
-    ROS_DEBUG("U-Blox sent %li bytes: \n%s", out_.size(), oss.str().c_str());
+    ROS_DEBUG("U-Blox sent %li bytes: \n%s", writing_.size(),
+              oss.str().c_str());
   }
-  // Clear the buffer & unlock
-  out_.clear();
+  // Clear the buffer
+  writing_.clear();
   write_condition_.notify_all();
 }
 
 template <typename StreamT>
 void AsyncWorker<StreamT>::doRead() {
   ScopedLock lock(read_mutex_);
+  dropIfFull();
   stream_->async_read_some(
       boost::asio::buffer(in_.data() + in_buffer_size_,
                           in_.size() - in_buffer_size_),
@@ -211,41 +435,230 @@ void AsyncWorker<StreamT>::doRead() {
                               boost::asio::placeholders::bytes_transferred));
 }
 
+template <typename StreamT>
+void AsyncWorker<StreamT>::dropIfFull() {
+  if (in_buffer_size_ < in_.size()) return;
+  // Data held back by coalescing still goes to the callbacks
+  dispatch();
+  if (in_buffer_size_ < in_.size()) return;
+  ROS_ERROR("U-Blox ASIO input buffer full, dropping %lu bytes",
+            in_buffer_size_);
+  if (recorder_)
+    recorder_->event("Input buffer full, dropped %lu bytes", in_buffer_size_);
+  if (metrics_) metrics_->add(Metrics::kDroppedBytes, in_buffer_size_);
+  in_buffer_size_ = 0;
+  arrivals_.clear();
+}
+
 template <typename StreamT>
 void AsyncWorker<StreamT>::readEnd(const boost::system::error_code& error,
                                    std::size_t bytes_transfered) {
   ScopedLock lock(read_mutex_);
+  // Stamp serial data as soon as possible, sockets use the kernel stamp
+  ros::Time stamp = read_stamp_.isZero() ? ros::Time::now() : read_stamp_;
+  read_stamp_ = ros::Time();
+  ++wakeups_;
   if (error) {
     ROS_ERROR("U-Blox ASIO input buffer read error: %s, %li",
               error.message().c_str(),
               bytes_transfered);
+    if (recorder_)
+      recorder_->event("Read error: %s", error.message().c_str());
+    if (metrics_) metrics_->add(Metrics::kReadErrors);
   } else if (bytes_transfered > 0) {
+    datagramReceived(bytes_transfered, read_truncated_);
+    read_truncated_ = 0;
     in_buffer_size_ += bytes_transfered;
+    pending_ += bytes_transfered;
+    arrivals_.add(in_buffer_size_, stamp);
+
+    if (coalesce_timeout_.total_microseconds() == 0 || readyToDispatch()) {
+      dispatch();
+    } else {
+      // Let the kernel buffer the rest of the burst
+      if (pending_ == bytes_transfered)
+        burst_start_ = boost::posix_time::microsec_clock::universal_time();
+      coalesce_timer_->expires_from_now(coalesce_timeout_);
+      coalesce_timer_->async_wait(
+          boost::bind(&AsyncWorker<StreamT>::coalesceEnd, this,
+                      boost::asio::placeholders::error));
+      coalesce_wait_ = true;
+    }
+  }
+  reportStats();
 
-    unsigned char *pRawDataStart = &(*(in_.begin() + (in_buffer_size_ - bytes_transfered)));
-    std::size_t raw_data_stream_size = bytes_transfered;
+  // Read again directly, this handler already runs on the I/O thread
+  if (!stopping_ && !coalesce_wait_) {
+    lock.unlock();
+    doRead();
+  }
+}
 
-    if (write_callback_)
-      write_callback_(pRawDataStart, raw_data_stream_size);
+template <typename StreamT>
+void AsyncWorker<StreamT>::coalesceEnd(const boost::system::error_code& error) {
+  ScopedLock lock(read_mutex_);
+  coalesce_wait_ = false;
+  if (error || stopping_) return;
+  ++wakeups_;
+
+  readAvailable();
+  boost::posix_time::time_duration waited =
+      boost::posix_time::microsec_clock::universal_time() - burst_start_;
+  if (!coalesce_epoch_ || readyToDispatch()
+      || waited.total_milliseconds() >= kMaxCoalesceWaitMs) {
+    dispatch();
+  } else {
+    // The epoch has not ended yet
+    coalesce_timer_->expires_from_now(coalesce_timeout_);
+    coalesce_timer_->async_wait(
+        boost::bind(&AsyncWorker<StreamT>::coalesceEnd, this,
+                    boost::asio::placeholders::error));
+    coalesce_wait_ = true;
+  }
+  reportStats();
+
+  if (!coalesce_wait_) {
+    lock.unlock();
+    doRead();
+  }
+}
 
-    if (debug >= 4) {
-      std::ostringstream oss;
-      for (std::vector<unsigned char>::iterator it =
-               in_.begin() + in_buffer_size_ - bytes_transfered;
-           it != in_.begin() + in_buffer_size_; ++it)
-        oss << boost::format("%02x") % static_cast<unsigned int>(*it) << " ";
-      ROS_DEBUG("U-Blox received %li bytes \n%s", bytes_transfered,
-               oss.str().c_str());
+template <typename StreamT>
+void AsyncWorker<StreamT>::readAvailable() {
+  int available = 0;
+  boost::system::error_code error;
+  while (in_buffer_size_ < in_.size()
+         && ioctl(stream_->native_handle(), FIONREAD, &available) == 0
+         && available > 0) {
+    std::size_t space = in_.size() - in_buffer_size_;
+    std::size_t size = stream_->read_some(
+        boost::asio::buffer(in_.data() + in_buffer_size_,
+                            std::min<std::size_t>(available, space)),
+        error);
+    if (error) {
+      ROS_ERROR("U-Blox ASIO input buffer read error: %s",
+                error.message().c_str());
+      if (metrics_) metrics_->add(Metrics::kReadErrors);
+      break;
     }
+    in_buffer_size_ += size;
+    pending_ += size;
+    arrivals_.add(in_buffer_size_, ros::Time::now());
+  }
+}
+
+template <typename StreamT>
+void AsyncWorker<StreamT>::receiveEnd(const boost::system::error_code& error) {
+  if (error) {
+    readEnd(error, 0);
+    return;
+  }
+  ssize_t n;
+  {
+    ScopedLock lock(read_mutex_);
+    n = receiveStamped(stream_->native_handle(), in_.data() + in_buffer_size_,
+                       in_.size() - in_buffer_size_, read_stamp_,
+                       boost::is_same<StreamT,
+                                      boost::asio::ip::udp::socket>::value
+                           ? &read_truncated_ : NULL);
+  }
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    doRead();
+  } else if (n < 0) {
+    readEnd(boost::system::error_code(errno, boost::system::system_category()),
+            0);
+  } else if (n == 0 && !boost::is_same<StreamT,
+                                       boost::asio::ip::udp::socket>::value) {
+    // End of file for stream sockets, a datagram may be empty
+    readEnd(boost::asio::error::eof, 0);
+  } else {
+    readEnd(boost::system::error_code(), n);
+  }
+}
 
-    if (read_callback_)
-      read_callback_(in_.data(), in_buffer_size_);
+template <typename StreamT>
+bool AsyncWorker<StreamT>::readyToDispatch() const {
+  if (in_buffer_size_ == in_.size())
+    return true;
+  if (coalesce_bytes_ > 0 && pending_ >= coalesce_bytes_)
+    return true;
+  // The epoch ended, in any mode. Look for a complete NAV-EOE message (6 byte
+  // header, 4 byte payload and 2 byte checksum) in the pending data.
+  const std::size_t kEoeSize = 12;
+  const unsigned char* end = in_.data() + in_buffer_size_;
+  for (const unsigned char* it = end - pending_; it + kEoeSize <= end; ++it)
+    if (it[0] == ublox::DEFAULT_SYNC_A && it[1] == ublox::DEFAULT_SYNC_B
+        && it[2] == 0x01 && it[3] == 0x61)
+      return true;
+  return false;
+}
 
-    read_condition_.notify_all();
+template <typename StreamT>
+void AsyncWorker<StreamT>::dispatch() {
+  if (pending_ == 0) return;
+  unsigned char *pRawDataStart = in_.data() + in_buffer_size_ - pending_;
+  std::size_t raw_data_stream_size = pending_;
+  pending_ = 0;
+
+  if (write_callback_)
+    write_callback_(pRawDataStart, raw_data_stream_size,
+                    arrivals_.at(in_buffer_size_ - raw_data_stream_size));
+
+  if (debug >= 4) {
+    std::ostringstream oss;
+    for (unsigned char* it = pRawDataStart;
+         it != in_.data() + in_buffer_size_; ++it)
+      oss << boost::format("%02x") % static_cast<unsigned int>(*it) << " ";
+    ROS_DEBUG("U-Blox received %li bytes \n%s", raw_data_stream_size,
+             oss.str().c_str());
   }
 
-  if (!stopping_)
-    io_service_->post(boost::bind(&AsyncWorker<StreamT>::doRead, this));
+  if (read_callback_) {
+    std::size_t size = in_buffer_size_;
+    UBLOX_TRACE1(read_dispatch, raw_data_stream_size);
+    read_callback_(in_.data(), in_buffer_size_, arrivals_);
+    arrivals_.consume(size - in_buffer_size_);
+  }
+  ++dispatches_;
+
+  read_condition_.notify_all();
+}
+
+template <typename StreamT>
+void AsyncWorker<StreamT>::reportStats() {
+  double now = clockSeconds(CLOCK_MONOTONIC);
+  if (stats_start_ == 0) {
+    stats_start_ = now;
+    stats_cpu_start_ = clockSeconds(CLOCK_THREAD_CPUTIME_ID);
+    return;
+  }
+  double period = now - stats_start_;
+  if (period < kStatsPeriod) return;
+
+  double cpu = clockSeconds(CLOCK_THREAD_CPUTIME_ID);
+  if (coalesce_timeout_.total_microseconds() > 0) {
+    ROS_INFO("U-Blox I/O: %.1f wakeups/s, %.1f dispatches/s, %.1f%% CPU",
+             wakeups_ / period, dispatches_ / period,
+             100.0 * (cpu - stats_cpu_start_) / period);
+  } else {
+    ROS_DEBUG("U-Blox I/O: %.1f wakeups/s, %.1f dispatches/s, %.1f%% CPU",
+              wakeups_ / period, dispatches_ / period,
+              100.0 * (cpu - stats_cpu_start_) / period);
+  }
+  wakeups_ = 0;
+  dispatches_ = 0;
+  stats_start_ = now;
+  stats_cpu_start_ = cpu;
+}
+
+template <typename StreamT>
+void AsyncWorker<StreamT>::setCoalescing(std::size_t min_bytes,
+                                         unsigned int timeout_ms,
+                                         bool epoch) {
+  ScopedLock lock(read_mutex_);
+  coalesce_bytes_ = std::min(min_bytes, in_.size());
+  coalesce_timeout_ = boost::posix_time::milliseconds(timeout_ms);
+  coalesce_epoch_ = epoch;
 }
 
 template <typename StreamT>
@@ -253,10 +666,133 @@ void AsyncWorker<StreamT>::doClose() {
   ScopedLock lock(read_mutex_);
   stopping_ = true;
   boost::system::error_code error;
+  coalesce_timer_->cancel(error);
   stream_->close(error);
   if(error)
     ROS_ERROR_STREAM(
         "Error while closing the AsyncWorker stream: " << error.message());
+  if (datagrams_ > 0)
+    ROS_INFO("U-Blox received %lu datagrams, %lu gaps, %lu truncated",
+             datagrams_, datagram_gaps_, datagrams_truncated_);
+}
+
+//
+// TCP sockets: wait until readable, then receive with the kernel timestamp
+//
+template <>
+inline void AsyncWorker<boost::asio::ip::tcp::socket>::doRead() {
+  ScopedLock lock(read_mutex_);
+  dropIfFull();
+  stream_->async_read_some(
+      boost::asio::null_buffers(),
+      boost::bind(&AsyncWorker<boost::asio::ip::tcp::socket>::receiveEnd, this,
+                  boost::asio::placeholders::error));
+}
+
+//
+// Datagram (UDP) sockets: each datagram is treated as a chunk of the byte
+// stream sent by the device
+//
+template <>
+inline void AsyncWorker<boost::asio::ip::udp::socket>::doRead() {
+  ScopedLock lock(read_mutex_);
+  dropIfFull();
+  // Wait until readable, then receive with the kernel timestamp
+  stream_->async_receive(
+      boost::asio::null_buffers(),
+      boost::bind(&AsyncWorker<boost::asio::ip::udp::socket>::receiveEnd, this,
+                  boost::asio::placeholders::error));
+}
+
+template <>
+inline void AsyncWorker<boost::asio::ip::udp::socket>::doWrite() {
+  //! Maximum datagram payload, chosen to avoid IP fragmentation
+  const std::size_t kMaxDatagramSize = 1400;
+
+  {
+    ScopedLock lock(write_mutex_);
+    // Do nothing if out buffer is empty
+    if (out_.size() == 0) {
+      return;
+    }
+    writing_.swap(out_);
+  }
+  // Split the data into datagrams, the device reassembles the byte stream
+  boost::system::error_code error;
+  for (std::size_t i = 0; i < writing_.size() && !error;
+       i += kMaxDatagramSize) {
+    std::size_t size = std::min(kMaxDatagramSize, writing_.size() - i);
+    stream_->send(boost::asio::buffer(writing_.data() + i, size), 0, error);
+  }
+  if (error)
+    ROS_ERROR("U-Blox UDP send error: %s", error.message().c_str());
+  else
+    ROS_DEBUG_COND(debug >= 2, "U-Blox sent %li bytes", writing_.size());
+  UBLOX_TRACE1(send_completed, writing_.size());
+  // Clear the buffer
+  writing_.clear();
+  write_condition_.notify_all();
+}
+
+template <>
+inline void AsyncWorker<boost::asio::ip::udp::socket>::datagramReceived(
+    std::size_t size, std::size_t truncated) {
+  ++datagrams_;
+  unsigned char* datagram = in_.data() + in_buffer_size_;
+  if (truncated > 0) {
+    ++datagrams_truncated_;
+    ROS_DEBUG_COND(debug >= 2, "U-Blox UDP datagram truncated, dropped %lu "
+                   "bytes", truncated);
+    if (recorder_)
+      recorder_->event("UDP datagram truncated, dropped %lu bytes",
+                       truncated);
+    if (metrics_) metrics_->add(Metrics::kDroppedBytes, truncated);
+  }
+  // A partial message may be pending, but this datagram starts a new
+  // message. The rest of the pending message was lost (or will arrive out
+  // of order), so drop it instead of letting it consume the new message.
+  if (in_buffer_size_ > 0 && size >= 2
+      && datagram[0] == ublox::DEFAULT_SYNC_A
+      && datagram[1] == ublox::DEFAULT_SYNC_B) {
+    // Data held back by coalescing still goes to the callbacks, only what
+    // they leave is a partial message
+    dispatch();
+    if (in_buffer_size_ > 0) {
+      ++datagram_gaps_;
+      ROS_DEBUG_COND(debug >= 2,
+                     "U-Blox UDP gap, dropping %lu bytes of a partial message",
+                     in_buffer_size_);
+      if (recorder_)
+        recorder_->event("UDP gap, dropped %lu bytes of a partial message",
+                         in_buffer_size_);
+      if (metrics_) metrics_->add(Metrics::kDroppedBytes, in_buffer_size_);
+    }
+    std::copy(datagram, datagram + size, in_.begin());
+    in_buffer_size_ = 0;
+    arrivals_.clear();
+  }
+}
+
+template <>
+inline void AsyncWorker<boost::asio::ip::udp::socket>::readAvailable() {
+  boost::system::error_code error;
+  while (in_buffer_size_ < in_.size() && stream_->available(error) > 0) {
+    ros::Time stamp = ros::Time::now();
+    std::size_t truncated;
+    ssize_t size = receiveStamped(stream_->native_handle(),
+                                  in_.data() + in_buffer_size_,
+                                  in_.size() - in_buffer_size_, stamp,
+                                  &truncated);
+    if (size < 0) {
+      ROS_ERROR("U-Blox UDP receive error: %s", strerror(errno));
+      if (metrics_) metrics_->add(Metrics::kReadErrors);
+      break;
+    }
+    datagramReceived(size, truncated);
+    in_buffer_size_ += size;
+    pending_ += size;
+    arrivals_.add(in_buffer_size_, stamp);
+  }
 }
 
 template <typename StreamT>
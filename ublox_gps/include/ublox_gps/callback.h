@@ -31,6 +31,11 @@
 
 #include <ros/console.h>
 #include <ublox/serialization/ublox_msgs.h>
+#include <ublox_gps/flight_recorder.h>
+#include <ublox_gps/latency.h>
+#include <ublox_gps/metrics.h>
+#include <ublox_gps/tracepoints.h>
+#include <ublox_gps/worker.h>
 #include <boost/format.hpp>
 #include <boost/function.hpp>
 #include <boost/thread.hpp>
@@ -44,8 +49,9 @@ class CallbackHandler {
  public:
   /**
    * @brief Decode the u-blox message.
+   * @return false if the message could not be decoded
    */
-  virtual void handle(ublox::Reader& reader) = 0;
+  virtual bool handle(ublox::Reader& reader) = 0;
 
   /**
    * @brief Wait for on the condition.
@@ -55,9 +61,19 @@ class CallbackHandler {
     return condition_.timed_wait(lock, timeout);
   }
 
+  /**
+   * @brief Set the latency stats of the decode & callback stages.
+   * @param latency the latency stats, empty to not measure
+   */
+  void setLatencyStats(const boost::shared_ptr<LatencyStats>& latency) {
+    latency_ = latency;
+  }
+
  protected:
   boost::mutex mutex_; //!< Lock for the handler
   boost::condition_variable condition_; //!< Condition for the handler lock
+  //! Measures the decode & callback stages, if set
+  boost::shared_ptr<LatencyStats> latency_;
 };
 
 /**
@@ -83,8 +99,9 @@ class CallbackHandler_ : public CallbackHandler {
   /**
    * @brief Decode the U-Blox message & call the callback function if it exists.
    * @param reader a reader to decode the message buffer
+   * @return false if the message could not be decoded
    */
-  void handle(ublox::Reader& reader) {
+  bool handle(ublox::Reader& reader) {
     boost::mutex::scoped_lock lock(mutex_);
     try {
       if (!reader.read<T>(message_)) {
@@ -94,7 +111,7 @@ class CallbackHandler_ : public CallbackHandler {
                        static_cast<unsigned int>(reader.messageId()),
                        reader.length());
         condition_.notify_all();
-        return;
+        return false;
       }
     } catch (std::runtime_error& e) {
       ROS_DEBUG_COND(debug >= 2, 
@@ -103,11 +120,20 @@ class CallbackHandler_ : public CallbackHandler {
                      static_cast<unsigned int>(reader.messageId()),
                      reader.length());
       condition_.notify_all();
-      return;
+      return false;
+    }
+    if (latency_) {
+      latency_->mark(LatencyStats::kDecoded);
+      latency_->name(ros::message_traits::datatype<T>());
     }
 
-    if (func_) func_(message_);
+    if (func_) {
+      if (latency_) latency_->mark(LatencyStats::kCallbackStarted);
+      func_(message_);
+      if (latency_) latency_->mark(LatencyStats::kCallbackFinished);
+    }
     condition_.notify_all();
+    return true;
   }
   
  private:
@@ -129,6 +155,7 @@ class CallbackHandlers {
   void insert(typename CallbackHandler_<T>::Callback callback) {
     boost::mutex::scoped_lock lock(callback_mutex_);
     CallbackHandler_<T>* handler = new CallbackHandler_<T>(callback);
+    handler->setLatencyStats(latency_);
     callbacks_.insert(
       std::make_pair(std::make_pair(T::CLASS_ID, T::MESSAGE_ID),
                      boost::shared_ptr<CallbackHandler>(handler)));
@@ -148,6 +175,7 @@ class CallbackHandlers {
       unsigned int message_id) {
     boost::mutex::scoped_lock lock(callback_mutex_);
     CallbackHandler_<T>* handler = new CallbackHandler_<T>(callback);
+    handler->setLatencyStats(latency_);
     callbacks_.insert(
       std::make_pair(std::make_pair(T::CLASS_ID, message_id),
                      boost::shared_ptr<CallbackHandler>(handler)));
@@ -162,9 +190,24 @@ class CallbackHandlers {
     boost::mutex::scoped_lock lock(callback_mutex_);
     Callbacks::key_type key =
         std::make_pair(reader.classId(), reader.messageId());
+    bool decoded = true;
+    UBLOX_TRACE2(handler_dispatch, key.first, key.second);
     for (Callbacks::iterator callback = callbacks_.lower_bound(key);
          callback != callbacks_.upper_bound(key); ++callback)
-      callback->second->handle(reader);
+      decoded = callback->second->handle(reader) && decoded;
+    UBLOX_TRACE2(handler_done, key.first, key.second);
+    if (!decoded) {
+      // Only failed messages are checked again, to tell checksum errors apart
+      uint16_t checksum;
+      ublox::calculateChecksum(reader.pos() + 2, reader.length() + 4,
+                               checksum);
+      bool checksum_failed = checksum != reader.checksum();
+      if (checksum_failed)
+        UBLOX_TRACE3(checksum_failed, key.first, key.second, reader.length());
+      if (metrics_)
+        metrics_->add(checksum_failed ? Metrics::kChecksumErrors
+                                      : Metrics::kDecodeErrors);
+    }
   }
 
   /**
@@ -178,6 +221,7 @@ class CallbackHandlers {
     // Create a callback handler for this message
     callback_mutex_.lock();
     CallbackHandler_<T>* handler = new CallbackHandler_<T>();
+    handler->setLatencyStats(latency_);
     Callbacks::iterator callback = callbacks_.insert(
       (std::make_pair(std::make_pair(T::CLASS_ID, T::MESSAGE_ID),
                       boost::shared_ptr<CallbackHandler>(handler))));
@@ -201,11 +245,26 @@ class CallbackHandlers {
    * messages from the buffer.
    * @param data the buffer of u-blox messages to process
    * @param size the size of the buffer
+   * @param arrivals the arrival times of the bytes in the buffer
    */
-  void readCallback(unsigned char* data, std::size_t& size) {
+  void readCallback(unsigned char* data, std::size_t& size,
+                    const ArrivalTimes& arrivals) {
     ublox::Reader reader(data, size);
+    // Where the next message starts, unless bytes are skipped
+    ublox::Reader::iterator next = data;
+    if (latency_) latency_->dispatched();
     // Read all U-Blox messages in buffer
     while (reader.search() != reader.end() && reader.found()) {
+      recordSkipped(next, reader.pos());
+      if (metrics_) metrics_->frame(reader.classId(), reader.messageId());
+      UBLOX_TRACE3(frame_found, reader.classId(), reader.messageId(),
+                   reader.length());
+      // Stamp the message with the arrival of its first byte
+      arrival_time_ = arrivals.at(reader.pos() - data);
+      // Measure the latencies from the arrival of its last byte
+      if (latency_)
+        latency_->begin(reader.classId(), reader.messageId(),
+                        arrivals.at(reader.pos() - data + reader.length() + 7));
       if (debug >= 3) {
         // Print the received bytes
         std::ostringstream oss;
@@ -217,20 +276,88 @@ class CallbackHandlers {
       }
 
       handle(reader);
+      if (latency_) latency_->end();
+      next = reader.pos() + reader.length() + 8;
     }
+    recordSkipped(next, reader.pos());
+    arrival_time_ = ros::Time();
 
     // delete read bytes from ASIO input buffer
     std::copy(reader.pos(), reader.end(), data);
     size -= reader.pos() - data;
   }
 
+  /**
+   * @brief Get the arrival time of the message being handled.
+   * @return the time the first byte of the message was received, or zero
+   * outside of a message callback or if unknown
+   */
+  const ros::Time& arrivalTime() const { return arrival_time_; }
+
+  /**
+   * @brief Set the flight recorder of skipped bytes. Call before the I/O is
+   * initialized.
+   * @param recorder the flight recorder, empty to not record
+   */
+  void setFlightRecorder(const boost::shared_ptr<FlightRecorder>& recorder) {
+    recorder_ = recorder;
+  }
+
+  /**
+   * @brief Set the latency stats of the received messages. Call before the
+   * I/O is initialized.
+   * @param latency the latency stats, empty to not measure
+   */
+  void setLatencyStats(const boost::shared_ptr<LatencyStats>& latency) {
+    boost::mutex::scoped_lock lock(callback_mutex_);
+    latency_ = latency;
+    for (Callbacks::iterator callback = callbacks_.begin();
+         callback != callbacks_.end(); ++callback)
+      callback->second->setLatencyStats(latency);
+  }
+
+  /**
+   * @brief Set the metrics of the received messages, skipped bytes and
+   * decoding errors. Call before the I/O is initialized.
+   * @param metrics the metrics, empty to not count
+   */
+  void setMetrics(const boost::shared_ptr<Metrics>& metrics) {
+    metrics_ = metrics;
+  }
+
  private:
+  /**
+   * @brief Record and count the bytes skipped while searching for the next
+   * message. NMEA sentences are not counted as skipped.
+   * @param begin where the next message would have started
+   * @param end where it starts
+   */
+  void recordSkipped(ublox::Reader::iterator begin,
+                     ublox::Reader::iterator end) {
+    if (end <= begin || *begin == '$') return;
+    if (recorder_)
+      recorder_->event("Resync, skipped %ld bytes", (long) (end - begin));
+    if (metrics_) {
+      metrics_->add(Metrics::kResyncs);
+      metrics_->add(Metrics::kResyncBytes, end - begin);
+    }
+  }
+
   typedef std::multimap<std::pair<uint8_t, uint8_t>,
                         boost::shared_ptr<CallbackHandler> > Callbacks;
 
   // Call back handlers for u-blox messages
   Callbacks callbacks_;
   boost::mutex callback_mutex_;
+  //! The arrival time of the message being handled, only accessed from the
+  //! I/O thread
+  ros::Time arrival_time_;
+  //! Records skipped bytes, if set
+  boost::shared_ptr<FlightRecorder> recorder_;
+  //! Measures the latencies of the received messages, if set
+  boost::shared_ptr<LatencyStats> latency_;
+  //! Counts the received messages and errors, if set
+  boost::shared_ptr<Metrics> metrics_;
 };
 
 }  // namespace ublox_gps
@@ -0,0 +1,189 @@
+//==============================================================================
+// Copyright (c) 2012, Johannes Meyer, TU Darmstadt
+// All rights reserved.
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * Neither the name of the Flight Systems and Automatic Control group,
+//       TU Darmstadt, nor the names of its contributors may be used to
+//       endorse or promote products derived from this software without
+//       specific prior written permission.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//==============================================================================
+
+#ifndef UBLOX_GPS_CLOCK_ESTIMATOR_H
+#define UBLOX_GPS_CLOCK_ESTIMATOR_H
+
+#include <algorithm>
+#include <deque>
+#include <limits>
+#include <utility>
+
+#include <ros/time.h>
+
+namespace ublox_gps {
+
+/**
+ * @brief Estimates the offset and drift between a device clock and the host
+ * clock.
+ *
+ * @details The host arrival time of a message is its device time, plus the
+ * clock offset, plus a variable transport and queueing delay which is never
+ * negative. The estimator therefore fits the lower envelope of the observed
+ * delays (arrival - device time) over a sliding window: the drift is the slope
+ * between the smallest delays of the two halves of the window, and the offset
+ * puts that line through the smallest delay. The result still contains the
+ * minimal latency of the device, which can not be observed from the arrival
+ * times alone, but no longer the variable part of the delay.
+ */
+class ClockEstimator {
+ public:
+  /**
+   * @brief Construct a clock estimator.
+   * @param window the length of the sliding window [s of device time]
+   * @param max_gap the device time gap after which the estimate is reset [s]
+   * @param min_samples the number of samples needed for a valid estimate
+   */
+  ClockEstimator(double window = 60.0, double max_gap = 10.0,
+                 std::size_t min_samples = 5)
+      : window_(window), max_gap_(max_gap), min_samples_(min_samples),
+        valid_(false), offset_(0), drift_(0), reference_(0) {}
+
+  /**
+   * @brief Add a sample. Of several samples with the same device time, the
+   * one with the smallest delay is kept.
+   * @param device_time the device time of the message [s]
+   * @param arrival the host time the message was received
+   */
+  void update(double device_time, const ros::Time& arrival) {
+    double delay = arrival.toSec() - device_time;
+    if (!samples_.empty()) {
+      double step = device_time - samples_.back().first;
+      if (step == 0) {
+        if (delay < samples_.back().second) {
+          samples_.back().second = delay;
+          estimate();
+        }
+        return;
+      }
+      // The device clock was reset, jumped or wrapped around
+      if (step < 0 || step > max_gap_) reset();
+    }
+    samples_.push_back(std::make_pair(device_time, delay));
+    while (device_time - samples_.front().first > window_)
+      samples_.pop_front();
+    estimate();
+  }
+
+  /**
+   * @brief Convert a device time to host time.
+   * @param device_time the device time [s]
+   * @return the host time, only meaningful if the estimate is valid
+   */
+  ros::Time toHost(double device_time) const {
+    return ros::Time(device_time + offset_
+                     + drift_ * (device_time - reference_));
+  }
+
+  /**
+   * @brief Whether enough samples were collected for an estimate.
+   */
+  bool valid() const { return valid_; }
+
+  /**
+   * @brief Get the offset of the host clock at the latest sample [s].
+   */
+  double offset() const { return offset_; }
+
+  /**
+   * @brief Get the drift of the host clock relative to the device clock.
+   */
+  double drift() const { return drift_; }
+
+  /**
+   * @brief Discard all samples.
+   */
+  void reset() {
+    samples_.clear();
+    valid_ = false;
+  }
+
+ private:
+  //! Minimum time between the envelope points to estimate the drift [s]
+  constexpr static double kMinDriftSpan = 10.0;
+  //! Maximum plausible drift between the clocks
+  constexpr static double kMaxDrift = 1e-3;
+
+  /**
+   * @brief Fit the lower envelope of the delays in the window.
+   */
+  void estimate() {
+    if (samples_.size() < min_samples_) {
+      valid_ = false;
+      return;
+    }
+    double start = samples_.front().first;
+    reference_ = samples_.back().first;
+    double middle = (start + reference_) / 2;
+
+    // Smallest delay in each half of the window
+    Samples::const_iterator first = samples_.begin();
+    Samples::const_iterator second = samples_.end();
+    for (Samples::const_iterator it = samples_.begin(); it != samples_.end();
+         ++it) {
+      if (it->first < middle) {
+        if (it->second < first->second) first = it;
+      } else if (second == samples_.end() || it->second < second->second) {
+        second = it;
+      }
+    }
+    drift_ = 0;
+    if (second != samples_.end()
+        && second->first - first->first >= kMinDriftSpan) {
+      drift_ = (second->second - first->second)
+               / (second->first - first->first);
+      if (drift_ > kMaxDrift) drift_ = kMaxDrift;
+      if (drift_ < -kMaxDrift) drift_ = -kMaxDrift;
+    }
+
+    // Put the line through the smallest delay
+    offset_ = std::numeric_limits<double>::max();
+    for (Samples::const_iterator it = samples_.begin(); it != samples_.end();
+         ++it)
+      offset_ = std::min(offset_,
+                         it->second - drift_ * (it->first - reference_));
+    valid_ = true;
+  }
+
+  typedef std::deque<std::pair<double, double> > Samples;
+  //! Device time and delay (arrival - device time) of each sample [s]
+  Samples samples_;
+
+  double window_; //!< Length of the sliding window [s]
+  double max_gap_; //!< Device time gap which resets the estimate [s]
+  std::size_t min_samples_; //!< Samples needed for a valid estimate
+
+  bool valid_; //!< Whether the estimate is valid
+  double offset_; //!< Host time - device time at reference_ [s]
+  double drift_; //!< Drift of the host clock relative to the device clock
+  double reference_; //!< Device time of the latest sample [s]
+};
+
+}  // namespace ublox_gps
+
+#endif  // UBLOX_GPS_CLOCK_ESTIMATOR_H
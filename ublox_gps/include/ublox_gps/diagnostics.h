@@ -0,0 +1,239 @@
+//==============================================================================
+// Copyright (c) 2012, Johannes Meyer, TU Darmstadt
+// All rights reserved.
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * Neither the name of the Flight Systems and Automatic Control group,
+//       TU Darmstadt, nor the names of its contributors may be used to
+//       endorse or promote products derived from this software without
+//       specific prior written permission.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//==============================================================================
+
+#ifndef UBLOX_GPS_DIAGNOSTICS_H
+#define UBLOX_GPS_DIAGNOSTICS_H
+
+#include <deque>
+#include <limits>
+#include <string>
+#include <utility>
+
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <diagnostic_updater/diagnostic_updater.h>
+#include <ros/time.h>
+
+namespace ublox_gps {
+
+/**
+ * @brief Topic frequency and time stamp diagnostic which can be ticked from
+ * the I/O thread.
+ *
+ * @details tick() only updates atomic counters. The frequency and the time
+ * stamp delays are evaluated when the diagnostic updater runs the task, so the
+ * cost of the diagnostic does not grow with the message rate. Reports the same
+ * status as diagnostic_updater's FrequencyStatus and TimeStampStatus.
+ */
+class RateDiagnostic : public diagnostic_updater::DiagnosticTask {
+ public:
+  /**
+   * @brief Construct a frequency diagnostic.
+   * @param topic the ROS topic
+   * @param min_freq the minimum acceptable frequency [Hz]
+   * @param max_freq the maximum acceptable frequency [Hz]
+   * @param tolerance the tolerance of the frequency [fraction]
+   * @param window the number of updates to evaluate the frequency over
+   */
+  RateDiagnostic(const std::string& topic, double min_freq, double max_freq,
+                 double tolerance, int window)
+      : DiagnosticTask(topic + " topic status"), min_freq_(min_freq),
+        max_freq_(max_freq), tolerance_(tolerance), window_(window),
+        check_stamps_(false), stamp_min_(0), stamp_max_(0), count_(0) {
+    resetDelays();
+  }
+
+  /**
+   * @brief Construct a frequency and time stamp diagnostic.
+   * @param topic the ROS topic
+   * @param min_freq the minimum acceptable frequency [Hz]
+   * @param max_freq the maximum acceptable frequency [Hz]
+   * @param tolerance the tolerance of the frequency [fraction]
+   * @param window the number of updates to evaluate the frequency over
+   * @param stamp_min the minimum acceptable delay of the time stamps [s]
+   * @param stamp_max the maximum acceptable delay of the time stamps [s]
+   */
+  RateDiagnostic(const std::string& topic, double min_freq, double max_freq,
+                 double tolerance, int window, double stamp_min,
+                 double stamp_max)
+      : DiagnosticTask(topic + " topic status"), min_freq_(min_freq),
+        max_freq_(max_freq), tolerance_(tolerance), window_(window),
+        check_stamps_(true), stamp_min_(stamp_min), stamp_max_(stamp_max),
+        count_(0) {
+    resetDelays();
+  }
+
+  /**
+   * @brief Count a message.
+   */
+  void tick() {
+    count_.fetch_add(1, boost::memory_order_relaxed);
+  }
+
+  /**
+   * @brief Count a message and record the delay of its time stamp.
+   * @param stamp the time stamp of the message
+   */
+  void tick(const ros::Time& stamp) {
+    tick();
+    boost::int64_t delay = (ros::Time::now() - stamp).toNSec();
+    boost::int64_t min = min_delay_.load(boost::memory_order_relaxed);
+    while (delay < min && !min_delay_.compare_exchange_weak(
+        min, delay, boost::memory_order_relaxed)) {}
+    boost::int64_t max = max_delay_.load(boost::memory_order_relaxed);
+    while (delay > max && !max_delay_.compare_exchange_weak(
+        max, delay, boost::memory_order_relaxed)) {}
+  }
+
+  /**
+   * @brief Evaluate the frequency and the time stamp delays.
+   */
+  void run(diagnostic_updater::DiagnosticStatusWrapper& stat) {
+    ros::Time now = ros::Time::now();
+    boost::uint64_t count = count_.load(boost::memory_order_relaxed);
+    history_.push_back(std::make_pair(now, count));
+    while (history_.size() > window_ + 1)
+      history_.pop_front();
+
+    boost::uint64_t events = count - history_.front().second;
+    double window = (now - history_.front().first).toSec();
+    double freq = window > 0 ? events / window : 0;
+    if (events == 0) {
+      stat.summary(diagnostic_msgs::DiagnosticStatus::ERROR,
+                   "No events recorded.");
+    } else if (freq < min_freq_ * (1 - tolerance_)) {
+      stat.summary(diagnostic_msgs::DiagnosticStatus::WARN,
+                   "Frequency too low.");
+    } else if (freq > max_freq_ * (1 + tolerance_)) {
+      stat.summary(diagnostic_msgs::DiagnosticStatus::WARN,
+                   "Frequency too high.");
+    } else {
+      stat.summary(diagnostic_msgs::DiagnosticStatus::OK,
+                   "Desired frequency met");
+    }
+    stat.addf("Events in window", "%lu", (unsigned long) events);
+    stat.addf("Events since startup", "%lu", (unsigned long) count);
+    stat.addf("Duration of window (s)", "%f", window);
+    stat.addf("Actual frequency (Hz)", "%f", freq);
+    if (min_freq_ == max_freq_) {
+      stat.addf("Target frequency (Hz)", "%f", min_freq_);
+    } else {
+      stat.addf("Minimum acceptable frequency (Hz)", "%f",
+                min_freq_ * (1 - tolerance_));
+      stat.addf("Maximum acceptable frequency (Hz)", "%f",
+                max_freq_ * (1 + tolerance_));
+    }
+
+    if (!check_stamps_)
+      return;
+    boost::int64_t min = min_delay_.exchange(
+        std::numeric_limits<boost::int64_t>::max());
+    boost::int64_t max = max_delay_.exchange(
+        std::numeric_limits<boost::int64_t>::min());
+    if (max < min) {
+      stat.mergeSummary(diagnostic_msgs::DiagnosticStatus::WARN,
+                        "No data since last update.");
+      return;
+    }
+    if (min * 1e-9 < stamp_min_)
+      stat.mergeSummary(diagnostic_msgs::DiagnosticStatus::ERROR,
+                        "Timestamps too far in future seen.");
+    if (max * 1e-9 > stamp_max_)
+      stat.mergeSummary(diagnostic_msgs::DiagnosticStatus::ERROR,
+                        "Timestamps too far in past seen.");
+    stat.addf("Earliest timestamp delay:", "%f", min * 1e-9);
+    stat.addf("Latest timestamp delay:", "%f", max * 1e-9);
+  }
+
+ private:
+  /**
+   * @brief Clear the recorded time stamp delays.
+   */
+  void resetDelays() {
+    min_delay_.store(std::numeric_limits<boost::int64_t>::max());
+    max_delay_.store(std::numeric_limits<boost::int64_t>::min());
+  }
+
+  double min_freq_; //!< Minimum acceptable frequency [Hz]
+  double max_freq_; //!< Maximum acceptable frequency [Hz]
+  double tolerance_; //!< Tolerance of the frequency [fraction]
+  std::size_t window_; //!< Number of updates to evaluate the frequency over
+  bool check_stamps_; //!< Whether to check the time stamp delays
+  double stamp_min_; //!< Minimum acceptable time stamp delay [s]
+  double stamp_max_; //!< Maximum acceptable time stamp delay [s]
+
+  //! Number of messages since startup
+  boost::atomic<boost::uint64_t> count_;
+  //! Smallest time stamp delay since the last update [ns]
+  boost::atomic<boost::int64_t> min_delay_;
+  //! Largest time stamp delay since the last update [ns]
+  boost::atomic<boost::int64_t> max_delay_;
+  //! Time and message count of the last updates, only used by run()
+  std::deque<std::pair<ros::Time, boost::uint64_t> > history_;
+};
+
+/**
+ * @brief The last value of a message, written by the I/O thread and read by
+ * the diagnostic updater.
+ *
+ * @details Writing never blocks: a value which arrives while the diagnostics
+ * copy the previous one is dropped, the next message replaces it.
+ */
+template <typename T>
+class LastValue {
+ public:
+  /**
+   * @brief Store the value, unless it is being read.
+   */
+  void set(const T& value) {
+    boost::unique_lock<boost::mutex> lock(mutex_, boost::try_to_lock);
+    if (lock.owns_lock())
+      value_ = value;
+  }
+
+  /**
+   * @brief Get a copy of the last stored value.
+   */
+  T get() const {
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    return value_;
+  }
+
+ private:
+  //! Lock of value_
+  mutable boost::mutex mutex_;
+  //! The last stored value
+  T value_;
+};
+
+}  // namespace ublox_gps
+
+#endif  // UBLOX_GPS_DIAGNOSTICS_H
@@ -0,0 +1,190 @@
+//==============================================================================
+// Copyright (c) 2012, Johannes Meyer, TU Darmstadt
+// All rights reserved.
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * Neither the name of the Flight Systems and Automatic Control group,
+//       TU Darmstadt, nor the names of its contributors may be used to
+//       endorse or promote products derived from this software without
+//       specific prior written permission.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//==============================================================================
+
+#ifndef UBLOX_GPS_ESF_H
+#define UBLOX_GPS_ESF_H
+
+#include <cmath>
+#include <cstddef>
+#include <stdint.h>
+
+#include <sensor_msgs/Imu.h>
+#include <ublox_msgs/EsfMEAS.h>
+
+namespace ublox_gps {
+
+//! Axes of the inertial sensor samples in ESF messages
+enum EsfAxis {
+  ESF_GYRO_X,
+  ESF_GYRO_Y,
+  ESF_GYRO_Z,
+  ESF_ACCEL_X,
+  ESF_ACCEL_Y,
+  ESF_ACCEL_Z,
+  ESF_NUM_AXES
+};
+
+//! Mask of the gyroscope axes
+static const unsigned kEsfGyroAxes = (1 << ESF_GYRO_X) | (1 << ESF_GYRO_Y) |
+                                     (1 << ESF_GYRO_Z);
+//! Mask of the accelerometer axes
+static const unsigned kEsfAccelAxes = (1 << ESF_ACCEL_X) |
+                                      (1 << ESF_ACCEL_Y) | (1 << ESF_ACCEL_Z);
+//! Mask of all inertial axes
+static const unsigned kEsfImuAxes = kEsfGyroAxes | kEsfAccelAxes;
+
+/**
+ * @brief Get the type of an ESF data word.
+ */
+inline uint8_t esfDataType(uint32_t word) {
+  return word >> 24;
+}
+
+/**
+ * @brief Get the sign extended 24 bit data field of an ESF data word.
+ */
+inline int32_t esfDataValue(uint32_t word) {
+  return static_cast<int32_t>(word << 8) >> 8;
+}
+
+/**
+ * @brief Encode an ESF data word.
+ * @param type the data type
+ * @param value the data field, truncated to a signed 24 bit value
+ */
+inline uint32_t esfDataWord(uint8_t type, int32_t value) {
+  return static_cast<uint32_t>(type) << 24
+         | (static_cast<uint32_t>(value) & 0xFFFFFF);
+}
+
+/**
+ * @brief Decodes the inertial sensor samples of ESF-MEAS and ESF-RAW data
+ * words.
+ *
+ * @details The axis and the scale to SI units (rad/s, m/s^2) of each data type
+ * are looked up in a table, so decoding a word does not branch on its type.
+ * Other data types, e.g. wheel ticks & temperature, are skipped.
+ */
+class EsfImuDecoder {
+ public:
+  EsfImuDecoder() {
+    for (int i = 0; i < 256; ++i) {
+      axis_[i] = ESF_NUM_AXES;
+      scale_[i] = 0;
+    }
+    const double gyro = std::pow(2, -12) * M_PI / 180; // [deg/s] to [rad/s]
+    const double accel = std::pow(2, -10);
+    set(ublox_msgs::EsfMEAS::DATA_TYPE_GYRO_ANG_RATE_X, ESF_GYRO_X, gyro);
+    set(ublox_msgs::EsfMEAS::DATA_TYPE_GYRO_ANG_RATE_Y, ESF_GYRO_Y, gyro);
+    set(ublox_msgs::EsfMEAS::DATA_TYPE_Z_AXIS_GYRO, ESF_GYRO_Z, gyro);
+    set(ublox_msgs::EsfMEAS::DATA_TYPE_ACCELEROMETER_X, ESF_ACCEL_X, accel);
+    set(ublox_msgs::EsfMEAS::DATA_TYPE_ACCELEROMETER_Y, ESF_ACCEL_Y, accel);
+    set(ublox_msgs::EsfMEAS::DATA_TYPE_ACCELEROMETER_Z, ESF_ACCEL_Z, accel);
+  }
+
+  /**
+   * @brief Decode a data word into its axis value.
+   * @param word the data word
+   * @param values the values of the axes, only the decoded axis is written.
+   * The array needs one spare element after the axes, which is clobbered.
+   * @return the mask of the decoded axis, 0 if the word is not inertial
+   */
+  unsigned decode(uint32_t word, double (&values)[ESF_NUM_AXES + 1]) const {
+    uint8_t type = esfDataType(word);
+    // Skipped types write to the spare element
+    values[axis_[type]] = esfDataValue(word) * scale_[type];
+    return (1u << axis_[type]) & kEsfImuAxes;
+  }
+
+  /**
+   * @brief Decode data words into per axis values.
+   * @param words the data words
+   * @param size the number of data words
+   * @param values the values of the axes, only the decoded axes are written.
+   * The array needs one spare element after the axes, which is clobbered.
+   * @return the mask of the decoded axes, bit i is set if axis i was decoded
+   */
+  unsigned decode(const uint32_t* words, std::size_t size,
+                  double (&values)[ESF_NUM_AXES + 1]) const {
+    unsigned axes = 0;
+    for (std::size_t i = 0; i < size; ++i)
+      axes |= decode(words[i], values);
+    return axes;
+  }
+
+  /**
+   * @brief Get the axis of a data type, ESF_NUM_AXES if it is not inertial.
+   */
+  EsfAxis axis(uint8_t type) const {
+    return static_cast<EsfAxis>(axis_[type]);
+  }
+
+  /**
+   * @brief Get the scale of a data type to SI units.
+   */
+  double scale(uint8_t type) const {
+    return scale_[type];
+  }
+
+ private:
+  void set(uint8_t type, EsfAxis axis, double scale) {
+    axis_[type] = axis;
+    scale_[type] = scale;
+  }
+
+  //! The axis of each data type, ESF_NUM_AXES for other types
+  uint8_t axis_[256];
+  //! The scale of each data type to SI units
+  double scale_[256];
+};
+
+/**
+ * @brief Set the angular velocity and linear acceleration of an Imu message.
+ *
+ * @details The covariance of a group without decoded axes is set to -1, the
+ * orientation is never provided.
+ * @param values the values of the axes
+ * @param axes the mask of the decoded axes
+ * @param imu the message to set
+ */
+inline void setImu(const double (&values)[ESF_NUM_AXES + 1], unsigned axes,
+                   sensor_msgs::Imu& imu) {
+  imu.orientation_covariance[0] = -1;
+  imu.angular_velocity.x = values[ESF_GYRO_X];
+  imu.angular_velocity.y = values[ESF_GYRO_Y];
+  imu.angular_velocity.z = values[ESF_GYRO_Z];
+  imu.angular_velocity_covariance[0] = axes & kEsfGyroAxes ? 0 : -1;
+  imu.linear_acceleration.x = values[ESF_ACCEL_X];
+  imu.linear_acceleration.y = values[ESF_ACCEL_Y];
+  imu.linear_acceleration.z = values[ESF_ACCEL_Z];
+  imu.linear_acceleration_covariance[0] = axes & kEsfAccelAxes ? 0 : -1;
+}
+
+}  // namespace ublox_gps
+
+#endif  // UBLOX_GPS_ESF_H
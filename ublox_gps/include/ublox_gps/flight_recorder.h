@@ -0,0 +1,314 @@
+//==============================================================================
+// Copyright (c) 2012, Johannes Meyer, TU Darmstadt
+// All rights reserved.
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * Neither the name of the Flight Systems and Automatic Control group,
+//       TU Darmstadt, nor the names of its contributors may be used to
+//       endorse or promote products derived from this software without
+//       specific prior written permission.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//==============================================================================
+
+#ifndef UBLOX_GPS_FLIGHT_RECORDER_H
+#define UBLOX_GPS_FLIGHT_RECORDER_H
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+#include <ros/console.h>
+#include <ros/time.h>
+
+namespace ublox_gps {
+
+/**
+ * @brief Keeps the latest received and sent bytes and internal events in a
+ * fixed size ring, and dumps them to files when something went wrong.
+ *
+ * @details Recording only stamps the data and copies it into the ring under
+ * a short lock, the oldest records are overwritten once the ring is full. So
+ * the recorder can always be on, unlike the debug hex dumps.
+ *
+ * A dump copies the ring and writes two files from a background thread.
+ * <name>.log holds the received bytes, which can be replayed and converted
+ * like a raw data log. <name>.txt lists the records in order with their ROS
+ * time: the sent bytes and the events in full, the received bytes by their
+ * offset in the .log file.
+ */
+class FlightRecorder {
+ public:
+  //! The types of records
+  enum RecordType {
+    kReceived = 0, //!< Bytes received from the device
+    kSent = 1, //!< Bytes sent to the device
+    kEvent = 2 //!< A text event
+  };
+
+  /**
+   * @param dir the directory of the dumps
+   * @param size the size of the ring, rounded down to a power of 2 [bytes]
+   */
+  FlightRecorder(const std::string& dir, std::size_t size)
+      : dir_(dir), head_(0), tail_(0), dumping_(false) {
+    if (!dir_.empty() && dir_[dir_.size() - 1] != '/')
+      dir_ += '/';
+    std::size_t ring_size = 4 * kMaxRecord;
+    while (ring_size * 2 <= size) ring_size *= 2;
+    ring_.resize(ring_size);
+  }
+
+  /**
+   * @brief Wait for the dump being written, if any.
+   */
+  ~FlightRecorder() {
+    if (thread_) thread_->join();
+  }
+
+  /**
+   * @brief Record bytes received from the device.
+   */
+  void received(const unsigned char* data, std::size_t size) {
+    record(kReceived, data, size);
+  }
+
+  /**
+   * @brief Record bytes sent to the device.
+   */
+  void sent(const unsigned char* data, std::size_t size) {
+    record(kSent, data, size);
+  }
+
+  /**
+   * @brief Record a text event, formatted like printf.
+   */
+  void event(const char* format, ...)
+      __attribute__((format(printf, 2, 3))) {
+    char text[256];
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+    if (n < 0) return;
+    record(kEvent, reinterpret_cast<const unsigned char*>(text),
+           std::min<std::size_t>(n, sizeof(text) - 1));
+  }
+
+  /**
+   * @brief Dump the recorded data to files in the dump directory.
+   * @param reason why the data is dumped, written at the top of the dump
+   * @param wait whether to write the files before returning, e.g. when the
+   * process is about to terminate. A dump still being written is finished
+   * first instead of skipping this one.
+   * @return the name of the dump without extension, or an empty string if
+   * the previous dump is still being written and wait is false
+   */
+  std::string dump(const std::string& reason, bool wait = false) {
+    if (dumping_.exchange(true) && !wait) {
+      ROS_WARN("U-Blox flight recorder is still dumping, not dumping: %s",
+               reason.c_str());
+      return std::string();
+    }
+    boost::mutex::scoped_lock dump_lock(dump_mutex_);
+    // The writer of the previous dump clears dumping_ when it is done
+    if (thread_ && thread_->get_id() != boost::this_thread::get_id()) {
+      thread_->join();
+      thread_.reset();
+    }
+    dumping_ = true;
+    event("Dump: %s", reason.c_str());
+    std::string name = dumpName();
+    boost::shared_ptr<std::vector<unsigned char> > records(
+        new std::vector<unsigned char>);
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      records->resize(head_ - tail_);
+      copyOut(tail_, records->data(), records->size());
+    }
+    if (wait) {
+      write(name, reason, records);
+    } else {
+      thread_.reset(new boost::thread(boost::bind(
+          &FlightRecorder::write, this, name, reason, records)));
+    }
+    return name;
+  }
+
+ private:
+  //! The header of a record in the ring, followed by the data padded to 8
+  //! bytes
+  struct Record {
+    int64_t stamp; //!< ROS time of the record [ns]
+    uint32_t size; //!< Size of the data [bytes]
+    uint32_t type; //!< The RecordType
+  };
+  //! Maximum size of the data of a record, longer data is split [bytes]
+  static const std::size_t kMaxRecord = 4096;
+  //! Number of bytes printed per line of the dump
+  static const std::size_t kBytesPerLine = 32;
+
+  /**
+   * @brief Get the size of a record in the ring.
+   */
+  static uint64_t recordSize(std::size_t size) {
+    return sizeof(Record) + ((size + 7) & ~static_cast<std::size_t>(7));
+  }
+
+  /**
+   * @brief Append a record to the ring, overwriting the oldest records.
+   */
+  void record(RecordType type, const unsigned char* data, std::size_t size) {
+    Record record;
+    record.stamp = ros::Time::now().toNSec();
+    record.type = type;
+    boost::mutex::scoped_lock lock(mutex_);
+    do {
+      record.size = size < kMaxRecord ? size : kMaxRecord;
+      uint64_t record_size = recordSize(record.size);
+      while (head_ + record_size - tail_ > ring_.size()) {
+        Record oldest;
+        copyOut(tail_, &oldest, sizeof(oldest));
+        tail_ += recordSize(oldest.size);
+      }
+      copyIn(head_, &record, sizeof(record));
+      copyIn(head_ + sizeof(record), data, record.size);
+      head_ += record_size;
+      data += record.size;
+      size -= record.size;
+    } while (size > 0);
+  }
+
+  /**
+   * @brief Copy data into the ring at a position, wrapping around its end.
+   */
+  void copyIn(uint64_t position, const void* data, std::size_t size) {
+    std::size_t offset = position & (ring_.size() - 1);
+    std::size_t n = std::min(size, ring_.size() - offset);
+    memcpy(&ring_[offset], data, n);
+    memcpy(&ring_[0], static_cast<const unsigned char*>(data) + n, size - n);
+  }
+
+  /**
+   * @brief Copy data out of the ring from a position, wrapping around its
+   * end.
+   */
+  void copyOut(uint64_t position, void* data, std::size_t size) const {
+    std::size_t offset = position & (ring_.size() - 1);
+    std::size_t n = std::min(size, ring_.size() - offset);
+    memcpy(data, &ring_[offset], n);
+    memcpy(static_cast<unsigned char*>(data) + n, &ring_[0], size - n);
+  }
+
+  /**
+   * @brief Get the name of a new dump in the dump directory, named after the
+   * local time.
+   */
+  std::string dumpName() const {
+    time_t t = time(NULL);
+    struct tm time_struct;
+    localtime_r(&t, &time_struct);
+    char name[48];
+    strftime(name, sizeof(name), "flight_%Y_%m_%d_%H%M%S", &time_struct);
+    std::string base = dir_ + name;
+    // Dumps within the same second get a counter
+    std::string dump_name = base;
+    struct stat stat_info;
+    for (int i = 1; stat((dump_name + ".txt").c_str(), &stat_info) == 0; ++i) {
+      char suffix[16];
+      snprintf(suffix, sizeof(suffix), "_%d", i);
+      dump_name = base + suffix;
+    }
+    return dump_name;
+  }
+
+  /**
+   * @brief Write the copied records of a dump.
+   */
+  void write(const std::string& name, const std::string& reason,
+             boost::shared_ptr<std::vector<unsigned char> > records) {
+    FILE* text = fopen((name + ".txt").c_str(), "w");
+    FILE* log = fopen((name + ".log").c_str(), "w");
+    if (!text || !log) {
+      ROS_ERROR("Can't write the u-blox flight recorder dump %s: %s",
+                name.c_str(), strerror(errno));
+    } else {
+      fprintf(text, "# %s\n# time type size (received: offset in %s.log)\n",
+              reason.c_str(), name.substr(name.rfind('/') + 1).c_str());
+      uint64_t log_offset = 0;
+      const unsigned char* data = records->data();
+      const unsigned char* end = data + records->size();
+      while (data + sizeof(Record) <= end) {
+        Record record;
+        memcpy(&record, data, sizeof(record));
+        const unsigned char* bytes = data + sizeof(record);
+        data += recordSize(record.size);
+        fprintf(text, "%ld.%09ld ", (long) (record.stamp / 1000000000),
+                (long) (record.stamp % 1000000000));
+        if (record.type == kReceived) {
+          fwrite(bytes, 1, record.size, log);
+          fprintf(text, "RX %u %lu\n", record.size,
+                  (unsigned long) log_offset);
+          log_offset += record.size;
+        } else if (record.type == kSent) {
+          fprintf(text, "TX %u", record.size);
+          for (std::size_t i = 0; i < record.size; ++i)
+            fprintf(text, "%s%02x", i % kBytesPerLine ? " " : "\n  ",
+                    bytes[i]);
+          fprintf(text, "\n");
+        } else {
+          fprintf(text, "EV %.*s\n", (int) record.size, bytes);
+        }
+      }
+      ROS_WARN("Dumped the u-blox flight recorder to %s.txt: %s",
+               name.c_str(), reason.c_str());
+    }
+    if (text) fclose(text);
+    if (log) fclose(log);
+    dumping_ = false;
+  }
+
+  std::string dir_; //!< The directory of the dumps, ending with a '/'
+  std::vector<unsigned char> ring_; //!< The records
+  uint64_t head_; //!< Total bytes appended to the ring
+  uint64_t tail_; //!< Position of the oldest record
+  boost::mutex mutex_; //!< Lock for ring_, head_ & tail_
+
+  boost::atomic<bool> dumping_; //!< Whether a dump is being written
+  boost::mutex dump_mutex_; //!< Lock for thread_
+  boost::scoped_ptr<boost::thread> thread_; //!< Writes the dump
+};
+
+}  // namespace ublox_gps
+
+#endif  // UBLOX_GPS_FLIGHT_RECORDER_H
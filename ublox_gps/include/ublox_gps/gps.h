@@ -36,16 +36,23 @@
 #include <stdexcept>
 // Boost
 #include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/ip/udp.hpp>
 #include <boost/asio/serial_port.hpp>
 #include <boost/asio/io_service.hpp>
 #include <boost/atomic.hpp>
+#include <boost/thread/mutex.hpp>
 // ROS
 #include <ros/console.h>
+#include <ros/time.h>
 // Other u-blox packages
 #include <ublox/serialization/ublox_msgs.h>
 // u-blox gps
 #include <ublox_gps/async_worker.h>
 #include <ublox_gps/callback.h>
+#include <ublox_gps/flight_recorder.h>
+#include <ublox_gps/latency.h>
+#include <ublox_gps/metrics.h>
+#include <ublox_gps/startup_profiler.h>
 
 /**
  * @namespace ublox_gps
@@ -73,6 +80,9 @@ class Gps {
   constexpr static double kDefaultAckTimeout = 1.0;
   //! Size of write buffer for output messages
   constexpr static int kWriterSize = 2056;
+  //! Size of the I/O buffers for UDP, must hold a partial message plus a
+  //! maximum size datagram
+  constexpr static int kUdpBufferSize = 131072;
 
   Gps();
   virtual ~Gps();
@@ -91,6 +101,77 @@ class Gps {
    */
   void setConfigOnStartup(const bool config_on_startup) { config_on_startup_flag_ = config_on_startup; }
 
+  /**
+   * @brief Use the low latency Linux serial worker instead of the ASIO worker
+   * for serial ports. Must be called before initializeSerial.
+   * @param low_latency whether to use the low latency serial worker
+   * @param spin_us how long the worker busy-polls for more bytes after a
+   * read [us], 0 disables busy-polling
+   */
+  void setLowLatencySerial(bool low_latency, unsigned int spin_us = 0) {
+    low_latency_serial_ = low_latency;
+    serial_spin_us_ = spin_us;
+  }
+
+  /**
+   * @brief Use the io_uring worker for serial ports, which batches port
+   * reads, port writes and raw data log appends. Must be called before
+   * initializeSerial. Falls back to the low latency serial worker if the
+   * package was built without io_uring support.
+   * @param io_uring whether to use the io_uring worker
+   */
+  void setIoUringSerial(bool io_uring) { io_uring_serial_ = io_uring; }
+
+  /**
+   * @brief Set how the ASIO worker coalesces reads to wake up less often.
+   * Must be called before the I/O is initialized.
+   * @see AsyncWorker::setCoalescing
+   */
+  void setCoalescing(std::size_t min_bytes, unsigned int timeout_ms,
+                     bool epoch) {
+    coalesce_bytes_ = min_bytes;
+    coalesce_timeout_ms_ = timeout_ms;
+    coalesce_epoch_ = epoch;
+  }
+
+  /**
+   * @brief Record the received and sent bytes, ACKs, skipped bytes and
+   * dropped data. Must be called before the I/O is initialized.
+   * @param recorder the flight recorder
+   */
+  void setFlightRecorder(const boost::shared_ptr<FlightRecorder>& recorder) {
+    recorder_ = recorder;
+    callbacks_.setFlightRecorder(recorder);
+  }
+
+  /**
+   * @brief Measure the latencies of the received messages, from the arrival
+   * of their last byte until decoded & handled by the callbacks.
+   * @param latency the latency stats
+   */
+  void setLatencyStats(const boost::shared_ptr<LatencyStats>& latency) {
+    callbacks_.setLatencyStats(latency);
+  }
+
+  /**
+   * @brief Count the received and sent bytes, messages, errors and ACKs.
+   * Must be called before the I/O is initialized.
+   * @param metrics the metrics
+   */
+  void setMetrics(const boost::shared_ptr<Metrics>& metrics) {
+    metrics_ = metrics;
+    callbacks_.setMetrics(metrics);
+  }
+
+  /**
+   * @brief Time the baud rate steps and the configuration and poll round
+   * trips. Must be called before the I/O is initialized.
+   * @param profiler the startup profiler
+   */
+  void setStartupProfiler(const boost::shared_ptr<StartupProfiler>& profiler) {
+    profiler_ = profiler;
+  }
+
   /**
    * @brief Initialize TCP I/O.
    * @param host the TCP host
@@ -98,6 +179,17 @@ class Gps {
    */
   void initializeTcp(std::string host, std::string port);
 
+  /**
+   * @brief Initialize UDP I/O.
+   *
+   * @details Binds to the given port and exchanges datagrams with the given
+   * host, e.g. a serial-to-Ethernet bridge. Each datagram is processed as a
+   * chunk of the device byte stream.
+   * @param host the UDP host
+   * @param port the UDP port
+   */
+  void initializeUdp(std::string host, std::string port);
+
   /**
    * @brief Initialize the Serial I/O port.
    * @param port the device port address
@@ -108,8 +200,38 @@ class Gps {
   void initializeSerial(std::string port, unsigned int baudrate,
                         uint16_t uart_in, uint16_t uart_out);
 
+  /**
+   * @brief Initialize the replay of a raw data log instead of device I/O.
+   *
+   * @details No data is replayed until startReplay is called, polls are
+   * answered from the log until then.
+   * @param log_name the name of the log file
+   * @param speed the replay speed relative to the recording, 0 to replay as
+   * fast as possible
+   * @throws std::runtime_error if the log can not be read
+   * @see ReplayWorker
+   */
+  void initializeReplay(std::string log_name, double speed);
+
+  /**
+   * @brief Start replaying the log, if the I/O is a replayed log.
+   */
+  void startReplay();
+
   bool sendRtcm(const std::vector<uint8_t> &message);
 
+  /**
+   * @brief Send external sensor measurements, e.g. wheel ticks or speed, to
+   * the device.
+   *
+   * @details The measurements are encoded into as few buffers as fit them and
+   * each buffer is written at once, ahead of other queued output which is not
+   * being written yet.
+   * @param measurements the ESF-MEAS input messages
+   * @return true if all the measurements were encoded and queued
+   */
+  bool sendSensorData(const std::vector<ublox_msgs::EsfMEAS>& measurements);
+
   /**
    * @brief Reset the Serial I/O port after u-blox reset.
    * @param port the device port address
@@ -251,9 +373,11 @@ class Gps {
    * @param class_id the class identifier of the message
    * @param message_id the message identifier
    * @param rate the updated rate in Hz
-   * @return true on ACK, false on other conditions.
+   * @param wait if true, wait for an ACK
+   * @return true on ACK or if wait is false, false on other conditions.
    */
-  bool setRate(uint8_t class_id, uint8_t message_id, uint8_t rate);
+  bool setRate(uint8_t class_id, uint8_t message_id, uint8_t rate,
+               bool wait = true);
 
   /**
    * @brief Set the device dynamic model.
@@ -403,10 +527,32 @@ class Gps {
 
   /**
    * @brief Set the callback function which handles raw data.
-   * @param callback the write callback which handles raw data
+   * @param callback the write callback which handles raw data, given the
+   * arrival time of its first byte
    */
   void setRawDataCallback(const Worker::Callback& callback);
 
+  /**
+   * @brief Get the arrival time of the message being handled. Call from
+   * within a message callback.
+   * @return the time the first byte of the message was received, or the
+   * current time if it is unknown
+   */
+  ros::Time arrivalTime() const {
+    const ros::Time& stamp = callbacks_.arrivalTime();
+    return stamp.isZero() ? ros::Time::now() : stamp;
+  }
+
+  /**
+   * @brief Let the I/O worker append the raw data to the given file, if it
+   * supports it.
+   * @param fd the file descriptor of the log file, owned by the worker if
+   * accepted
+   * @return true if the worker logs the raw data, false if the caller must
+   * log it
+   */
+  bool setRawDataLog(int fd);
+
  private:
   //! Types for ACK/NACK messages, WAIT is used when waiting for an ACK
   enum AckType {
@@ -422,12 +568,76 @@ class Gps {
     uint8_t msg_id; //!< The message ID of the ACK
   };
 
+  /**
+   * @brief Initialize the serial port with the low latency serial worker or
+   * the io_uring worker.
+   * @see initializeSerial
+   */
+  void initializeLowLatencySerial(std::string port, unsigned int baudrate,
+                                  uint16_t uart_in, uint16_t uart_out);
+
+  /**
+   * @brief Open the serial port with the low latency serial worker or the
+   * io_uring worker.
+   * @param port the device port address
+   * @param get_baudrate set to a function which returns the port baudrate
+   * @param set_baudrate set to a function which sets the port baudrate
+   * @return the worker
+   */
+  boost::shared_ptr<Worker> createLowLatencySerial(
+      const std::string& port, boost::function<unsigned int()>& get_baudrate,
+      boost::function<bool(unsigned int)>& set_baudrate);
+
   /**
    * @brief Set the I/O worker
    * @param an I/O handler
    */
   void setWorker(const boost::shared_ptr<Worker>& worker);
 
+  /**
+   * @brief Set an ASIO I/O worker and apply the coalescing settings to it.
+   * @param worker an ASIO I/O handler
+   */
+  template <typename StreamT>
+  void setAsyncWorker(const boost::shared_ptr<AsyncWorker<StreamT> >& worker) {
+    worker->setCoalescing(coalesce_bytes_, coalesce_timeout_ms_,
+                          coalesce_epoch_);
+    setWorker(worker);
+  }
+
+  /**
+   * @brief Send the data to the device, recording it if there is a flight
+   * recorder.
+   * @param data the bytes to send
+   * @param size the number of bytes
+   * @param priority whether to send the data ahead of the queued data
+   * @return true if the data was sent or queued
+   */
+  bool send(const unsigned char* data, unsigned int size,
+            bool priority = false) {
+    if (recorder_) recorder_->sent(data, size);
+    bool sent = priority ? worker_->sendPriority(data, size)
+                         : worker_->send(data, size);
+    if (!sent && recorder_)
+      recorder_->event("Failed to send %u bytes", size);
+    if (metrics_)
+      metrics_->add(sent ? Metrics::kBytesSent : Metrics::kSendsFailed,
+                    sent ? size : 1);
+    return sent;
+  }
+
+  /**
+   * @brief Record and count the received bytes and pass them to the raw data
+   * callback.
+   */
+  void recordRawData(unsigned char* data, std::size_t& size,
+                     const ros::Time& stamp) {
+    if (recorder_) recorder_->received(data, size);
+    if (metrics_) metrics_->add(Metrics::kBytesReceived, size);
+    boost::mutex::scoped_lock lock(raw_data_mutex_);
+    if (raw_data_callback_) raw_data_callback_(data, size, stamp);
+  }
+
   /**
    * @brief Subscribe to ACK/NACK messages and UPD-SOS-ACK messages.
    */
@@ -471,6 +681,18 @@ class Gps {
   bool save_on_shutdown_;
   //!< Whether or not initial configuration to the hardware is done
   bool config_on_startup_flag_;
+  //! Whether to use the low latency serial worker for serial ports
+  bool low_latency_serial_;
+  //! Busy-poll budget of the low latency serial worker [us]
+  unsigned int serial_spin_us_;
+  //! Whether to use the io_uring worker for serial ports
+  bool io_uring_serial_;
+  //! Minimum number of bytes the ASIO worker dispatches when coalescing
+  std::size_t coalesce_bytes_;
+  //! How long the ASIO worker waits for more data, 0 disables coalescing [ms]
+  unsigned int coalesce_timeout_ms_;
+  //! Whether the ASIO worker waits for the end of the navigation epoch
+  bool coalesce_epoch_;
 
 
   //! The default timeout for ACK messages
@@ -480,8 +702,20 @@ class Gps {
 
   //! Callback handlers for u-blox messages
   CallbackHandlers callbacks_;
+  //! Records the I/O and events, if set
+  boost::shared_ptr<FlightRecorder> recorder_;
+  //! Counts the I/O, messages and errors, if set
+  boost::shared_ptr<Metrics> metrics_;
+  //! Times the startup round trips, if set
+  boost::shared_ptr<StartupProfiler> profiler_;
+  //! Handles the raw data after it is recorded
+  Worker::Callback raw_data_callback_;
+  //! Lock for raw_data_callback_, set while the worker calls it
+  boost::mutex raw_data_mutex_;
 
   std::string host_, port_;
+  //! Whether host_ and port_ refer to a UDP (instead of TCP) endpoint
+  bool udp_;
 };
 
 template <typename T>
@@ -506,8 +740,13 @@ template <typename ConfigT>
 bool Gps::poll(ConfigT& message,
                const std::vector<uint8_t>& payload,
                const boost::posix_time::time_duration& timeout) {
+  double start = profiler_ ? StartupProfiler::now() : 0;
   if (!poll(ConfigT::CLASS_ID, ConfigT::MESSAGE_ID, payload)) return false;
-  return read(message, timeout);
+  bool result = read(message, timeout);
+  if (profiler_)
+    profiler_->roundTrip("POLL", ConfigT::CLASS_ID, ConfigT::MESSAGE_ID,
+                         StartupProfiler::now() - start, result);
+  return result;
 }
 
 template <typename T>
@@ -520,11 +759,14 @@ template <typename ConfigT>
 bool Gps::configure(const ConfigT& message, bool wait) {
   if (!worker_) return false;
 
-  // Reset ack
-  Ack ack;
-  ack.type = WAIT;
-  ack_.store(ack, boost::memory_order_seq_cst);
+  // Reset ack, unless another caller may be waiting for it
+  if (wait) {
+    Ack ack;
+    ack.type = WAIT;
+    ack_.store(ack, boost::memory_order_seq_cst);
+  }
 
+  double start = profiler_ ? StartupProfiler::now() : 0;
   // Encode the message
   std::vector<unsigned char> out(kWriterSize);
   ublox::Writer writer(out.data(), out.size());
@@ -534,14 +776,18 @@ bool Gps::configure(const ConfigT& message, bool wait) {
     return false;
   }
   // Send the message to the device
-  worker_->send(out.data(), writer.end() - out.data());
+  send(out.data(), writer.end() - out.data());
 
   if (!wait) return true;
 
   // Wait for an acknowledgment and return whether or not it was received
-  return waitForAcknowledge(default_timeout_,
-                            message.CLASS_ID,
-                            message.MESSAGE_ID);
+  bool acked = waitForAcknowledge(default_timeout_,
+                                  message.CLASS_ID,
+                                  message.MESSAGE_ID);
+  if (profiler_)
+    profiler_->roundTrip("CFG", message.CLASS_ID, message.MESSAGE_ID,
+                         StartupProfiler::now() - start, acked);
+  return acked;
 }
 
 }  // namespace ublox_gps
@@ -0,0 +1,333 @@
+//==============================================================================
+// Copyright (c) 2012, Johannes Meyer, TU Darmstadt
+// All rights reserved.
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * Neither the name of the Flight Systems and Automatic Control group,
+//       TU Darmstadt, nor the names of its contributors may be used to
+//       endorse or promote products derived from this software without
+//       specific prior written permission.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//==============================================================================
+
+#ifndef UBLOX_GPS_LATENCY_H
+#define UBLOX_GPS_LATENCY_H
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <ros/time.h>
+
+namespace ublox_gps {
+
+/**
+ * @brief A histogram of latencies with a bounded relative error, like an HDR
+ * histogram.
+ *
+ * @details Latencies are counted in microseconds. Below 64 us each value has
+ * its own bucket, above each power of 2 is split into 32 buckets, so the
+ * reported percentiles are within 1/32 of the recorded values. Recording
+ * only increments a counter.
+ */
+class LatencyHistogram {
+ public:
+  LatencyHistogram() : counts_(kBuckets, 0), count_(0), max_(0) {}
+
+  /**
+   * @brief Count a latency.
+   * @param us the latency [us], negative latencies are counted as 0
+   */
+  void record(int64_t us) {
+    if (us < 0) us = 0;
+    if (us > kMaxValue) us = kMaxValue;
+    ++counts_[bucket(us)];
+    ++count_;
+    if (us > max_) max_ = us;
+  }
+
+  /**
+   * @brief Get the number of recorded latencies.
+   */
+  uint64_t count() const { return count_; }
+
+  /**
+   * @brief Get the largest recorded latency [us].
+   */
+  int64_t max() const { return max_; }
+
+  /**
+   * @brief Get a percentile of the recorded latencies.
+   * @param percentile the percentile, from 0 to 100
+   * @return the highest value of the bucket which holds the percentile, at
+   * most the largest recorded latency, or 0 if nothing was recorded [us]
+   */
+  int64_t percentile(double percentile) const {
+    uint64_t rank = static_cast<uint64_t>(percentile / 100 * count_ + 0.5);
+    if (rank < 1) rank = 1;
+    uint64_t seen = 0;
+    for (std::size_t i = 0; i < counts_.size(); ++i) {
+      seen += counts_[i];
+      if (seen >= rank) return std::min<int64_t>(value(i + 1) - 1, max_);
+    }
+    return max_;
+  }
+
+ private:
+  //! Number of bits of the buckets within each power of 2
+  static const int kSubBucketBits = 6;
+  //! Largest value counted, larger values are counted as it [us]
+  static const int64_t kMaxValue = (1LL << 31) - 1;
+  //! Number of buckets up to kMaxValue
+  static const std::size_t kBuckets = (32 - kSubBucketBits + 1)
+                                      << (kSubBucketBits - 1);
+
+  /**
+   * @brief Get the bucket of a value.
+   */
+  static std::size_t bucket(int64_t value) {
+    int msb = 63 - __builtin_clzll(value | 1);
+    if (msb < kSubBucketBits) return value;
+    int shift = msb - kSubBucketBits + 1;
+    return (shift << (kSubBucketBits - 1)) + (value >> shift);
+  }
+
+  /**
+   * @brief Get the lowest value of a bucket.
+   */
+  static int64_t value(std::size_t bucket) {
+    if (bucket < (1u << kSubBucketBits)) return bucket;
+    int shift = (bucket >> (kSubBucketBits - 1)) - 1;
+    return static_cast<int64_t>(bucket - (shift << (kSubBucketBits - 1)))
+           << shift;
+  }
+
+  std::vector<uint32_t> counts_; //!< Count of each bucket
+  uint64_t count_; //!< Number of recorded latencies
+  int64_t max_; //!< Largest recorded latency [us]
+};
+
+/**
+ * @brief Measures how long after the arrival of its last byte each u-blox
+ * message reaches each stage of its handling, per message type.
+ *
+ * @details The I/O thread begins a message when it has found its frame,
+ * marks the later stages as it handles it and records them when it is done.
+ * Marks from other threads, e.g. publishing from a timer, are ignored: the
+ * message being handled is only known to the thread handling it.
+ * The checksum is verified while decoding, so it is part of the decoded
+ * stage.
+ */
+class LatencyStats {
+ public:
+  //! The stages of handling a message
+  enum Stage {
+    kDispatched, //!< The worker passed the data to the read callback
+    kFramed, //!< The frame was found in the input buffer
+    kDecoded, //!< The checksum was verified and the message decoded
+    kCallbackStarted, //!< The first callback was called
+    kCallbackFinished, //!< The last callback returned
+    kPublished, //!< A ROS message was last published from the callbacks
+    kStages //!< Number of stages
+  };
+
+  LatencyStats() : name_(0), dispatched_(0) {}
+
+  /**
+   * @brief Get the name of a stage.
+   */
+  static const char* stageName(int stage) {
+    static const char* const kNames[kStages] = {
+        "dispatched", "framed", "decoded", "callback started",
+        "callback finished", "published"};
+    return kNames[stage];
+  }
+
+  /**
+   * @brief Note that the worker dispatched received data. Call from the I/O
+   * thread.
+   */
+  void dispatched() { dispatched_ = now(); }
+
+  /**
+   * @brief Begin measuring a message whose frame was found. Call from the
+   * I/O thread.
+   * @param class_id the class ID of the message
+   * @param message_id the message ID of the message
+   * @param arrival the arrival time of the last byte of the message
+   */
+  void begin(uint8_t class_id, uint8_t message_id, const ros::Time& arrival) {
+    key_ = class_id << 8 | message_id;
+    arrival_ = arrival.isZero() ? 0 : arrival.toNSec();
+    for (int i = 0; i < kStages; ++i) stamps_[i] = 0;
+    stamps_[kDispatched] = dispatched_;
+    stamps_[kFramed] = now();
+    handling() = arrival_ != 0 ? this : 0;
+  }
+
+  /**
+   * @brief Mark a stage of the message being handled. The decoded and
+   * callback started stages keep their first mark, the others their last.
+   * @param stage the stage
+   */
+  void mark(Stage stage) {
+    if (handling() != this) return;
+    if ((stage == kDecoded || stage == kCallbackStarted) && stamps_[stage])
+      return;
+    stamps_[stage] = now();
+  }
+
+  /**
+   * @brief Name the type of the message being handled, once it is decoded.
+   * @param name the name of the message type
+   */
+  void name(const char* name) {
+    if (handling() != this) return;
+    name_ = name;
+  }
+
+  /**
+   * @brief Record the marked stages of the message being handled.
+   */
+  void end() {
+    if (handling() != this) return;
+    handling() = 0;
+    boost::mutex::scoped_lock lock(mutex_);
+    boost::shared_ptr<Type>& type = types_[key_];
+    if (!type) type.reset(new Type);
+    if (type->name.empty() && name_) type->name = name_;
+    name_ = 0;
+    for (int i = 0; i < kStages; ++i)
+      if (stamps_[i]) type->stages[i].record((stamps_[i] - arrival_) / 1000);
+  }
+
+  /**
+   * @brief Get the summary of a message type and stage.
+   */
+  struct Summary {
+    std::string type; //!< The name of the message type
+    int stage; //!< The stage
+    uint64_t count; //!< Number of messages which reached the stage
+    int64_t p50; //!< Median latency [us]
+    int64_t p99; //!< 99th percentile latency [us]
+    int64_t max; //!< Largest latency [us]
+  };
+
+  /**
+   * @brief Get the summaries of the recorded stages.
+   * @param last_only whether to only get the last recorded stage of each
+   * message type
+   */
+  std::vector<Summary> summaries(bool last_only = false) const {
+    std::vector<Summary> summaries;
+    boost::mutex::scoped_lock lock(mutex_);
+    for (Types::const_iterator it = types_.begin(); it != types_.end(); ++it) {
+      char id[16];
+      snprintf(id, sizeof(id), "0x%02x / 0x%02x", it->first >> 8,
+               it->first & 0xff);
+      std::string type = it->second->name.empty()
+                         ? std::string(id)
+                         : it->second->name + " (" + id + ")";
+      for (int i = kStages - 1; i >= 0; --i) {
+        const LatencyHistogram& histogram = it->second->stages[i];
+        if (histogram.count() == 0) continue;
+        Summary summary;
+        summary.type = type;
+        summary.stage = i;
+        summary.count = histogram.count();
+        summary.p50 = histogram.percentile(50);
+        summary.p99 = histogram.percentile(99);
+        summary.max = histogram.max();
+        summaries.push_back(summary);
+        if (last_only) break;
+      }
+    }
+    return summaries;
+  }
+
+  /**
+   * @brief Get a table of the latencies of each message type and stage.
+   */
+  std::string report() const {
+    std::vector<Summary> summaries = this->summaries();
+    std::string report =
+        "Latency after the last byte arrived [us], per message type & stage\n";
+    char line[160];
+    // Stages in order
+    for (std::size_t i = 0; i < summaries.size(); ++i) {
+      std::size_t j = i;
+      while (j + 1 < summaries.size()
+             && summaries[j + 1].type == summaries[i].type)
+        ++j;
+      report += summaries[i].type + "\n";
+      for (std::size_t k = j + 1; k-- > i;) {
+        snprintf(line, sizeof(line),
+                 "  %-18s %10lu  p50 %8ld  p99 %8ld  max %8ld\n",
+                 stageName(summaries[k].stage),
+                 (unsigned long) summaries[k].count, (long) summaries[k].p50,
+                 (long) summaries[k].p99, (long) summaries[k].max);
+        report += line;
+      }
+      i = j;
+    }
+    return report;
+  }
+
+ private:
+  //! The histograms of a message type
+  struct Type {
+    std::string name; //!< The name of the message type, if known
+    LatencyHistogram stages[kStages]; //!< The latencies of each stage
+  };
+  typedef std::map<uint16_t, boost::shared_ptr<Type> > Types;
+
+  /**
+   * @brief Get the current time [ns], on the clock of the arrival times.
+   */
+  static int64_t now() { return ros::Time::now().toNSec(); }
+
+  /**
+   * @brief Get the stats whose message the calling thread is handling, or 0.
+   */
+  static LatencyStats*& handling() {
+    static thread_local LatencyStats* stats = 0;
+    return stats;
+  }
+
+  // The message being handled, only accessed from the I/O thread
+  uint16_t key_; //!< The class & message ID of the message
+  const char* name_; //!< The name of the message type, once decoded
+  int64_t arrival_; //!< The arrival time of the last byte [ns]
+  int64_t dispatched_; //!< The time of the last dispatch [ns]
+  int64_t stamps_[kStages]; //!< The time of each marked stage, or 0 [ns]
+
+  mutable boost::mutex mutex_; //!< Lock for types_
+  Types types_; //!< The histograms of each message type
+};
+
+}  // namespace ublox_gps
+
+#endif  // UBLOX_GPS_LATENCY_H
@@ -0,0 +1,517 @@
+//==============================================================================
+// Copyright (c) 2012, Johannes Meyer, TU Darmstadt
+// All rights reserved.
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * Neither the name of the Flight Systems and Automatic Control group,
+//       TU Darmstadt, nor the names of its contributors may be used to
+//       endorse or promote products derived from this software without
+//       specific prior written permission.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//==============================================================================
+
+#ifndef UBLOX_GPS_LOG_INDEX_H
+#define UBLOX_GPS_LOG_INDEX_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <boost/cstdint.hpp>
+
+#include <ros/console.h>
+
+namespace ublox_gps {
+
+/**
+ * @brief An entry of a raw data log index.
+ *
+ * @details Index files start with kLogIndexMagic, followed by the entries in
+ * the order of their offsets, in host byte order.
+ */
+struct LogIndexEntry {
+  //! Offset of the frame in the log file [bytes]
+  uint64_t offset;
+  //! Host time the frame was completely received [ns since the epoch]
+  int64_t stamp;
+  //! GPS time of week of the latest navigation message [ms], kUnknownTow if
+  //! none was received yet
+  uint32_t iTOW;
+  //! The u-blox class ID
+  uint8_t class_id;
+  //! The u-blox message ID
+  uint8_t message_id;
+  //! Length of the payload [bytes]
+  uint16_t length;
+
+  //! Value of iTOW before the first navigation message
+  static const uint32_t kUnknownTow = 0xFFFFFFFF;
+};
+
+static_assert(sizeof(LogIndexEntry) == 24, "LogIndexEntry must be packed");
+
+//! Start of index files, includes the format version
+static const char kLogIndexMagic[8] = {'U', 'B', 'X', 'I', 'D', 'X', '0', '1'};
+
+/**
+ * @brief Get the name of the index of a log file.
+ * @param log_name the name of the log file
+ */
+inline std::string logIndexName(const std::string& log_name) {
+  std::size_t dot = log_name.rfind('.');
+  if (dot == std::string::npos || log_name.find('/', dot) != std::string::npos)
+    return log_name + ".idx";
+  return log_name.substr(0, dot) + ".idx";
+}
+
+/**
+ * @brief Finds UBX frames in a byte stream which arrives in pieces.
+ *
+ * @details Frames are reported once their checksum is verified. Bytes which
+ * do not belong to a UBX frame, e.g. NMEA or RTCM, are skipped. When a
+ * candidate frame turns out not to be one, e.g. its checksum is wrong, the
+ * search resumes after its first sync character, so a frame which starts
+ * within it is still found.
+ */
+class UbxFramer {
+ public:
+  //! Frames with longer payloads are taken as false sync characters [bytes]
+  static const uint16_t kMaxLength = 8192;
+
+  UbxFramer() {
+    frame_.reserve(kMaxLength + 8);
+    reset();
+  }
+
+  /**
+   * @brief Forget the partial frame, e.g. after a gap in the stream.
+   */
+  void reset() {
+    state_ = SYNC_A;
+    frame_.clear();
+  }
+
+  /**
+   * @brief Parse the next bytes of the stream.
+   * @param data the bytes
+   * @param size the number of bytes
+   * @param offset the stream offset of the first byte
+   * @param callback called as callback(offset, class_id, message_id, length,
+   * iTOW) for each complete frame, where offset is the stream offset of its
+   * first sync character and iTOW is LogIndexEntry::kUnknownTow unless the
+   * frame is a navigation message with an iTOW
+   */
+  template <typename Callback>
+  void parse(const uint8_t* data, std::size_t size, uint64_t offset,
+             Callback&& callback) {
+    for (std::size_t i = 0; i < size; ++i) {
+      if (advance(data[i], offset + i, callback)) continue;
+      // Parse the bytes after the false sync character again, along with
+      // the bytes after them which are parsed again themselves
+      std::deque<uint8_t> again;
+      uint64_t again_offset = 0;
+      bool framed = false;
+      while (!framed) {
+        again.insert(again.begin(), frame_.begin() + 1, frame_.end());
+        again_offset = frame_offset_ + 1;
+        state_ = SYNC_A;
+        framed = true;
+        while (!again.empty() && framed) {
+          uint8_t byte = again.front();
+          again.pop_front();
+          framed = advance(byte, again_offset++, callback);
+        }
+      }
+    }
+  }
+
+ private:
+  enum State {
+    SYNC_A, SYNC_B, CLASS, ID, LENGTH_A, LENGTH_B, PAYLOAD, CK_A, CK_B
+  };
+
+  /**
+   * @brief Parse the next byte of the stream.
+   * @return false if the byte shows that the candidate frame is not a frame
+   */
+  template <typename Callback>
+  bool advance(uint8_t byte, uint64_t offset, Callback& callback) {
+    if (state_ == SYNC_A) {
+      if (byte == 0xB5) {
+        frame_offset_ = offset;
+        frame_.clear();
+        frame_.push_back(byte);
+        state_ = SYNC_B;
+      }
+      return true;
+    }
+    frame_.push_back(byte);
+    switch (state_) {
+      case SYNC_A:
+        break;
+      case SYNC_B:
+        if (byte != 0x62) return false;
+        state_ = CLASS;
+        break;
+      case CLASS:
+        class_id_ = byte;
+        ck_a_ = ck_b_ = 0;
+        checksum(byte);
+        state_ = ID;
+        break;
+      case ID:
+        message_id_ = byte;
+        checksum(byte);
+        state_ = LENGTH_A;
+        break;
+      case LENGTH_A:
+        length_ = byte;
+        checksum(byte);
+        state_ = LENGTH_B;
+        break;
+      case LENGTH_B:
+        length_ |= byte << 8;
+        checksum(byte);
+        read_ = 0;
+        if (length_ > kMaxLength) return false;
+        state_ = length_ > 0 ? PAYLOAD : CK_A;
+        break;
+      case PAYLOAD:
+        checksum(byte);
+        if (++read_ == length_) state_ = CK_A;
+        break;
+      case CK_A:
+        if (byte != ck_a_) return false;
+        state_ = CK_B;
+        break;
+      case CK_B:
+        if (byte != ck_b_) return false;
+        callback(frame_offset_, class_id_, message_id_, length_, tow());
+        state_ = SYNC_A;
+        break;
+    }
+    return true;
+  }
+
+  /**
+   * @brief Add a byte to the checksum.
+   */
+  void checksum(uint8_t byte) {
+    ck_a_ += byte;
+    ck_b_ += ck_a_;
+  }
+
+  /**
+   * @brief Get the iTOW of the frame, if it is a navigation message.
+   */
+  uint32_t tow() const {
+    if (class_id_ != 0x01) return LogIndexEntry::kUnknownTow;
+    // NAV-ODO, NAV-HPPOSECEF, NAV-HPPOSLLH, NAV-SVIN & NAV-RELPOSNED start
+    // with a version
+    std::size_t i = message_id_ == 0x09 || message_id_ == 0x13
+                    || message_id_ == 0x14 || message_id_ == 0x3B
+                    || message_id_ == 0x3C ? 4 : 0;
+    if (length_ < i + 4) return LogIndexEntry::kUnknownTow;
+    // The payload starts after the 6 byte header
+    const uint8_t* tow = &frame_[6 + i];
+    return tow[0] | tow[1] << 8 | tow[2] << 16 | (uint32_t) tow[3] << 24;
+  }
+
+  State state_; //!< The next expected part of the frame
+  uint64_t frame_offset_; //!< Stream offset of the frame
+  uint8_t class_id_; //!< Class ID of the frame
+  uint8_t message_id_; //!< Message ID of the frame
+  uint16_t length_; //!< Payload length of the frame
+  uint16_t read_; //!< Number of payload bytes read
+  uint8_t ck_a_, ck_b_; //!< Running checksum
+  std::vector<uint8_t> frame_; //!< The bytes of the frame read so far
+};
+
+/**
+ * @brief Writes the index of a raw data log while the log is written.
+ *
+ * @details Every interval-th frame and every frame of the selected message
+ * types is indexed.
+ */
+class LogIndexWriter {
+ public:
+  /**
+   * @brief Construct an index writer.
+   * @param interval index every interval-th frame, 0 to only index the
+   * selected types
+   * @param types the types to index every frame of, as class_id << 8 |
+   * message_id
+   */
+  LogIndexWriter(std::size_t interval = 100,
+                 const std::set<uint16_t>& types = std::set<uint16_t>())
+      : interval_(interval), types_(types), fd_(-1), offset_(0), frames_(0),
+        iTOW_(LogIndexEntry::kUnknownTow), stamp_(0) {}
+
+  ~LogIndexWriter() { close(); }
+
+  /**
+   * @brief Create the index of a new log file.
+   * @param log_name the name of the log file
+   * @return true if the index was created
+   */
+  bool open(const std::string& log_name) {
+    close();
+    std::string name = logIndexName(log_name);
+    fd_ = ::open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd_ < 0) {
+      ROS_ERROR("Can't create raw data log index \"%s\": %s", name.c_str(),
+                strerror(errno));
+      return false;
+    }
+    entries_.assign(kLogIndexMagic, kLogIndexMagic + sizeof(kLogIndexMagic));
+    framer_.reset();
+    offset_ = 0;
+    frames_ = 0;
+    return true;
+  }
+
+  /**
+   * @brief Close the index, after writing the pending entries.
+   */
+  void close() {
+    if (fd_ < 0) return;
+    flush();
+    ::close(fd_);
+    fd_ = -1;
+  }
+
+  /**
+   * @brief Index the next bytes of the log.
+   * @param data the bytes, as appended to the log file
+   * @param size the number of bytes
+   * @param stamp the host time the last of the bytes was received
+   * [ns since the epoch]
+   */
+  void add(const uint8_t* data, std::size_t size, int64_t stamp) {
+    if (fd_ < 0) return;
+    stamp_ = stamp;
+    framer_.parse(data, size, offset_, *this);
+    offset_ += size;
+  }
+
+  /**
+   * @brief Append the pending entries to the index file.
+   */
+  void flush() {
+    std::size_t offset = 0;
+    while (fd_ >= 0 && offset < entries_.size()) {
+      ssize_t n = ::write(fd_, entries_.data() + offset,
+                          entries_.size() - offset);
+      if (n < 0) {
+        if (errno == EINTR) continue;
+        ROS_ERROR_THROTTLE(10, "U-Blox raw data log index write error: %s",
+                           strerror(errno));
+        break;
+      }
+      offset += n;
+    }
+    entries_.clear();
+  }
+
+  /**
+   * @brief Handle a frame found by the framer.
+   */
+  void operator()(uint64_t offset, uint8_t class_id, uint8_t message_id,
+                  uint16_t length, uint32_t iTOW) {
+    if (iTOW != LogIndexEntry::kUnknownTow) iTOW_ = iTOW;
+    uint16_t type = class_id << 8 | message_id;
+    bool index = frames_ == 0 || (interval_ > 0 && frames_ % interval_ == 0)
+                 || types_.count(type);
+    ++frames_;
+    if (!index) return;
+
+    LogIndexEntry entry;
+    entry.offset = offset;
+    entry.stamp = stamp_;
+    entry.iTOW = iTOW_;
+    entry.class_id = class_id;
+    entry.message_id = message_id;
+    entry.length = length;
+    const char* bytes = reinterpret_cast<const char*>(&entry);
+    entries_.insert(entries_.end(), bytes, bytes + sizeof(entry));
+  }
+
+ private:
+  std::size_t interval_; //!< Index every interval-th frame
+  std::set<uint16_t> types_; //!< Types to index every frame of
+  int fd_; //!< The index file, -1 if not open
+  UbxFramer framer_; //!< Finds the frames in the log
+  uint64_t offset_; //!< Offset of the next byte in the log file
+  std::size_t frames_; //!< Number of frames in the log file
+  uint32_t iTOW_; //!< iTOW of the latest navigation message [ms]
+  int64_t stamp_; //!< Arrival time of the bytes being indexed [ns]
+  std::vector<char> entries_; //!< Entries not written yet
+};
+
+/**
+ * @brief Reads the index of a raw data log.
+ *
+ * @details The index is mapped into memory. Lookups by time are binary
+ * searches; lookups by message type search a per type list of the entries,
+ * which is built when the index is opened. A log can be read from the offset
+ * of the found entry, frames which are not indexed follow their preceding
+ * entry.
+ */
+class LogIndex {
+ public:
+  /**
+   * @brief Map the index of a log file.
+   * @param log_name the name of the log file
+   * @throws std::runtime_error if the index can not be read
+   */
+  explicit LogIndex(const std::string& log_name)
+      : data_(0), entries_(0), size_(0), map_size_(0) {
+    std::string name = logIndexName(log_name);
+    int fd = ::open(name.c_str(), O_RDONLY);
+    if (fd < 0)
+      throw std::runtime_error("Can't open log index " + name + ": "
+                               + strerror(errno));
+    struct stat stat_info;
+    if (fstat(fd, &stat_info) != 0
+        || stat_info.st_size < (off_t) sizeof(kLogIndexMagic)) {
+      ::close(fd);
+      throw std::runtime_error("Invalid log index " + name);
+    }
+    map_size_ = stat_info.st_size;
+    data_ = mmap(0, map_size_, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (data_ == MAP_FAILED) {
+      data_ = 0;
+      throw std::runtime_error("Can't map log index " + name + ": "
+                               + strerror(errno));
+    }
+    if (memcmp(data_, kLogIndexMagic, sizeof(kLogIndexMagic)) != 0) {
+      munmap(data_, map_size_);
+      data_ = 0;
+      throw std::runtime_error("Invalid log index " + name);
+    }
+    // A partial entry at the end, e.g. after a crash, is ignored
+    entries_ = reinterpret_cast<const LogIndexEntry*>(
+        static_cast<const char*>(data_) + sizeof(kLogIndexMagic));
+    size_ = (map_size_ - sizeof(kLogIndexMagic)) / sizeof(LogIndexEntry);
+    for (std::size_t i = 0; i < size_; ++i)
+      types_[type(entries_[i])].push_back(i);
+  }
+
+  ~LogIndex() {
+    if (data_) munmap(data_, map_size_);
+  }
+
+  //! Number of entries
+  std::size_t size() const { return size_; }
+
+  //! Get an entry
+  const LogIndexEntry& operator[](std::size_t i) const { return entries_[i]; }
+
+  /**
+   * @brief Find the first entry received at or after the given host time.
+   * @param stamp the host time [ns since the epoch]
+   * @return the index of the entry, size() if there is none
+   */
+  std::size_t findStamp(int64_t stamp) const {
+    return std::lower_bound(entries_, entries_ + size_, stamp, StampLess())
+           - entries_;
+  }
+
+  /**
+   * @brief Find the first entry at or after the given GPS time of week.
+   * @details The log must not span the end of a GPS week.
+   * @param iTOW the GPS time of week [ms]
+   * @return the index of the entry, size() if there is none
+   */
+  std::size_t findTow(uint32_t iTOW) const {
+    // Entries before the first navigation message have an unknown iTOW
+    const LogIndexEntry* begin = std::partition_point(
+        entries_, entries_ + size_, UnknownTow());
+    return std::lower_bound(begin, entries_ + size_, iTOW, TowLess())
+           - entries_;
+  }
+
+  /**
+   * @brief Find the first entry of a message type at or after another entry.
+   * @param class_id the u-blox class ID
+   * @param message_id the u-blox message ID
+   * @param start the index of the entry to start at
+   * @return the index of the entry, size() if there is none
+   */
+  std::size_t findType(uint8_t class_id, uint8_t message_id,
+                       std::size_t start = 0) const {
+    std::map<uint16_t, std::vector<std::size_t> >::const_iterator it =
+        types_.find(class_id << 8 | message_id);
+    if (it == types_.end()) return size_;
+    std::vector<std::size_t>::const_iterator i =
+        std::lower_bound(it->second.begin(), it->second.end(), start);
+    return i == it->second.end() ? size_ : *i;
+  }
+
+ private:
+  // Not copyable, owns the mapping
+  LogIndex(const LogIndex&);
+  LogIndex& operator=(const LogIndex&);
+
+  //! Get the type of an entry as class_id << 8 | message_id
+  static uint16_t type(const LogIndexEntry& entry) {
+    return entry.class_id << 8 | entry.message_id;
+  }
+
+  struct StampLess {
+    bool operator()(const LogIndexEntry& entry, int64_t stamp) const {
+      return entry.stamp < stamp;
+    }
+  };
+
+  struct TowLess {
+    bool operator()(const LogIndexEntry& entry, uint32_t iTOW) const {
+      return entry.iTOW < iTOW;
+    }
+  };
+
+  struct UnknownTow {
+    bool operator()(const LogIndexEntry& entry) const {
+      return entry.iTOW == LogIndexEntry::kUnknownTow;
+    }
+  };
+
+  void* data_; //!< The mapped index file
+  const LogIndexEntry* entries_; //!< The entries in the mapped file
+  std::size_t size_; //!< Number of entries
+  std::size_t map_size_; //!< Size of the mapping [bytes]
+  //! Entries of each type, as class_id << 8 | message_id
+  std::map<uint16_t, std::vector<std::size_t> > types_;
+};
+
+}  // namespace ublox_gps
+
+#endif  // UBLOX_GPS_LOG_INDEX_H
@@ -0,0 +1,401 @@
+//==============================================================================
+// Copyright (c) 2012, Johannes Meyer, TU Darmstadt
+// All rights reserved.
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * Neither the name of the Flight Systems and Automatic Control group,
+//       TU Darmstadt, nor the names of its contributors may be used to
+//       endorse or promote products derived from this software without
+//       specific prior written permission.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//==============================================================================
+
+#ifndef UBLOX_GPS_LOG_READER_H
+#define UBLOX_GPS_LOG_READER_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <ros/console.h>
+
+#if defined(UBLOX_GPS_LZ4)
+#include <lz4.h>
+#elif defined(UBLOX_GPS_ZSTD)
+#include <zstd.h>
+#endif
+
+namespace ublox_gps {
+
+//! Magic of each block of a compressed raw data log, "UBZ1"
+static const uint32_t kLogBlockMagic = 0x315A4255;
+
+//! Codec of a block of a compressed raw data log
+enum LogBlockCodec {
+  kLogBlockStored = 0, //!< Not compressed, since it would not get smaller
+  kLogBlockLz4 = 1, //!< LZ4 block format
+  kLogBlockZstd = 2 //!< Zstandard frame
+};
+
+//! Header of each block of a compressed raw data log
+struct LogBlockHeader {
+  uint32_t magic; //!< kLogBlockMagic
+  uint32_t codec; //!< The LogBlockCodec
+  uint32_t raw_size; //!< Size of the uncompressed data [bytes]
+  uint32_t stored_size; //!< Size of the data following the header [bytes]
+};
+
+//! Entry of the block index of a compressed raw data log
+struct LogBlockEntry {
+  uint64_t offset; //!< Offset of the block in the uncompressed log
+  uint64_t file_offset; //!< Offset of the block header in the file
+};
+
+/**
+ * @brief Get the name of the block index of a compressed log.
+ * @param log_name the name of the log file
+ */
+inline std::string logBlocksName(const std::string& log_name) {
+  std::size_t dot = log_name.rfind('.');
+  if (dot == std::string::npos || log_name.find('/', dot) != std::string::npos)
+    return log_name + ".blk";
+  return log_name.substr(0, dot) + ".blk";
+}
+
+/**
+ * @brief Get the codec built in with UBLOX_GPS_LOG_COMPRESSION.
+ * @return the codec, kLogBlockStored if compression is not built in
+ */
+inline LogBlockCodec logBlockCodec() {
+#if defined(UBLOX_GPS_LZ4)
+  return kLogBlockLz4;
+#elif defined(UBLOX_GPS_ZSTD)
+  return kLogBlockZstd;
+#else
+  return kLogBlockStored;
+#endif
+}
+
+/**
+ * @brief Compresses the blocks of a raw data log with the built in codec.
+ *
+ * @details Each block is compressed independently, so it can be decompressed
+ * without the data before it.
+ */
+class LogBlockCompressor {
+ public:
+  /**
+   * @param level the Zstandard compression level, 0 for the default, LZ4
+   * does not have levels
+   */
+  explicit LogBlockCompressor(int level = 0) : level_(level) {
+#if defined(UBLOX_GPS_ZSTD)
+    context_ = ZSTD_createCCtx();
+#endif
+  }
+
+  ~LogBlockCompressor() {
+#if defined(UBLOX_GPS_ZSTD)
+    ZSTD_freeCCtx(context_);
+#endif
+  }
+
+  /**
+   * @brief Compress a block.
+   * @param data the bytes of the block
+   * @param size the number of bytes, at most 2^31
+   * @param out set to the block header followed by the stored data, which
+   * is the uncompressed data if compressing does not make it smaller
+   */
+  void compress(const uint8_t* data, std::size_t size,
+                std::vector<uint8_t>& out) {
+    LogBlockHeader header;
+    header.magic = kLogBlockMagic;
+    header.codec = logBlockCodec();
+    header.raw_size = size;
+    std::size_t stored = 0;
+#if defined(UBLOX_GPS_LZ4)
+    std::size_t bound = LZ4_compressBound(size);
+    out.resize(sizeof(header) + bound);
+    int n = LZ4_compress_default(
+        reinterpret_cast<const char*>(data),
+        reinterpret_cast<char*>(out.data() + sizeof(header)), size, bound);
+    stored = n > 0 ? n : 0;
+#elif defined(UBLOX_GPS_ZSTD)
+    std::size_t bound = ZSTD_compressBound(size);
+    out.resize(sizeof(header) + bound);
+    std::size_t n = ZSTD_compressCCtx(context_, out.data() + sizeof(header),
+                                      bound, data, size, level_);
+    stored = ZSTD_isError(n) ? 0 : n;
+#endif
+    if (stored == 0 || stored >= size) {
+      out.resize(sizeof(header) + size);
+      std::copy(data, data + size, out.begin() + sizeof(header));
+      header.codec = kLogBlockStored;
+      stored = size;
+    }
+    header.stored_size = stored;
+    out.resize(sizeof(header) + stored);
+    memcpy(out.data(), &header, sizeof(header));
+  }
+
+ private:
+  int level_; //!< The Zstandard compression level
+#if defined(UBLOX_GPS_ZSTD)
+  ZSTD_CCtx* context_; //!< Reused between blocks
+#endif
+};
+
+/**
+ * @brief Decompress a block of a raw data log.
+ * @param header the block header
+ * @param stored the data following the header
+ * @param out the uncompressed data, header.raw_size bytes
+ * @throws std::runtime_error if the block is corrupt or its codec is not
+ * built in
+ */
+inline void decompressLogBlock(const LogBlockHeader& header,
+                               const uint8_t* stored, uint8_t* out) {
+  switch (header.codec) {
+    case kLogBlockStored:
+      if (header.stored_size != header.raw_size) break;
+      memcpy(out, stored, header.raw_size);
+      return;
+    case kLogBlockLz4:
+#if defined(UBLOX_GPS_LZ4)
+      if (LZ4_decompress_safe(reinterpret_cast<const char*>(stored),
+                              reinterpret_cast<char*>(out),
+                              header.stored_size, header.raw_size)
+          == (int) header.raw_size)
+        return;
+      break;
+#else
+      throw std::runtime_error("The log is compressed with LZ4, build with "
+                               "UBLOX_GPS_LOG_COMPRESSION=lz4 to read it");
+#endif
+    case kLogBlockZstd:
+#if defined(UBLOX_GPS_ZSTD)
+      if (ZSTD_decompress(out, header.raw_size, stored, header.stored_size)
+          == header.raw_size)
+        return;
+      break;
+#else
+      throw std::runtime_error("The log is compressed with Zstandard, build "
+                               "with UBLOX_GPS_LOG_COMPRESSION=zstd to read "
+                               "it");
+#endif
+  }
+  throw std::runtime_error("Corrupt compressed log block");
+}
+
+/**
+ * @brief Reads raw data logs, which may be compressed.
+ *
+ * @details The log is mapped into memory. A compressed log is a sequence of
+ * independently compressed blocks (see LogBlockHeader), and reads only
+ * decompress the blocks they cover. The blocks are located with the block
+ * index next to the log (see logBlocksName), and by following the block
+ * headers after the last indexed block, e.g. if the logger stopped before
+ * the index was written. A truncated last block is ignored.
+ *
+ * Offsets and sizes always refer to the uncompressed data, like the offsets
+ * of the log index. Reads are thread safe.
+ */
+class LogReader {
+ public:
+  /**
+   * @brief Map a log and locate its blocks if it is compressed.
+   * @param log_name the name of the log file
+   * @throws std::runtime_error if the log can not be mapped or is empty
+   */
+  explicit LogReader(const std::string& log_name)
+      : data_(0), file_size_(0), size_(0) {
+    int fd = ::open(log_name.c_str(), O_RDONLY);
+    if (fd < 0)
+      throw std::runtime_error("Can't open log " + log_name + ": "
+                               + strerror(errno));
+    struct stat stat_info;
+    if (fstat(fd, &stat_info) != 0 || stat_info.st_size == 0) {
+      ::close(fd);
+      throw std::runtime_error("Log " + log_name + " is empty");
+    }
+    file_size_ = stat_info.st_size;
+    void* data = mmap(0, file_size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED)
+      throw std::runtime_error("Can't map log " + log_name + ": "
+                               + strerror(errno));
+    data_ = static_cast<const uint8_t*>(data);
+
+    uint32_t magic = 0;
+    if (file_size_ >= sizeof(magic)) memcpy(&magic, data_, sizeof(magic));
+    if (magic == kLogBlockMagic)
+      locateBlocks(log_name);
+    else
+      size_ = file_size_;
+    if (size_ == 0) {
+      munmap(const_cast<uint8_t*>(data_), file_size_);
+      throw std::runtime_error("Log " + log_name + " has no complete block");
+    }
+  }
+
+  ~LogReader() {
+    munmap(const_cast<uint8_t*>(data_), file_size_);
+  }
+
+  /**
+   * @brief Get the size of the uncompressed log [bytes].
+   */
+  uint64_t size() const { return size_; }
+
+  /**
+   * @brief Whether the log is compressed.
+   */
+  bool compressed() const { return !blocks_.empty(); }
+
+  /**
+   * @brief Advise the kernel how the log file will be accessed.
+   * @param advice the madvise advice, e.g. MADV_SEQUENTIAL
+   */
+  void advise(int advice) const {
+    madvise(const_cast<uint8_t*>(data_), file_size_, advice);
+  }
+
+  /**
+   * @brief Read a range of the uncompressed log.
+   * @param offset the offset of the range
+   * @param size the size of the range, offset + size must not exceed size()
+   * @param buffer holds the decompressed blocks, unused if the log is not
+   * compressed
+   * @return the bytes of the range, valid while the reader and the buffer
+   * are unchanged
+   * @throws std::runtime_error if a block is corrupt
+   */
+  const uint8_t* read(uint64_t offset, std::size_t size,
+                      std::vector<uint8_t>& buffer) const {
+    if (blocks_.empty()) return data_ + offset;
+    // The last block starting at or before offset
+    std::vector<LogBlockEntry>::const_iterator first = std::upper_bound(
+        blocks_.begin(), blocks_.end(), offset, startsAfter) - 1;
+    std::vector<LogBlockEntry>::const_iterator last = first;
+    uint64_t end = offset + size;
+    while (last + 1 != blocks_.end() && (last + 1)->offset < end) ++last;
+
+    uint64_t begin = first->offset;
+    uint64_t last_end = last + 1 != blocks_.end() ? (last + 1)->offset
+                                                  : size_;
+    if (buffer.size() < last_end - begin) buffer.resize(last_end - begin);
+    for (std::vector<LogBlockEntry>::const_iterator block = first;
+         block <= last; ++block) {
+      LogBlockHeader header;
+      memcpy(&header, data_ + block->file_offset, sizeof(header));
+      decompressLogBlock(header, data_ + block->file_offset + sizeof(header),
+                         buffer.data() + (block->offset - begin));
+    }
+    return buffer.data() + (offset - begin);
+  }
+
+ private:
+  /**
+   * @brief Whether a block starts after an offset.
+   */
+  static bool startsAfter(uint64_t offset, const LogBlockEntry& block) {
+    return offset < block.offset;
+  }
+
+  /**
+   * @brief Check the block header at a file offset.
+   * @param file_offset the offset of the header
+   * @param header set to the header
+   * @return true if the block is complete
+   */
+  bool validBlock(uint64_t file_offset, LogBlockHeader& header) const {
+    if (file_offset + sizeof(header) > file_size_) return false;
+    memcpy(&header, data_ + file_offset, sizeof(header));
+    return header.magic == kLogBlockMagic
+           && file_offset + sizeof(header) + header.stored_size <= file_size_;
+  }
+
+  /**
+   * @brief Locate the blocks with the block index, then by following the
+   * headers after the last indexed block.
+   */
+  void locateBlocks(const std::string& log_name) {
+    std::string index_name = logBlocksName(log_name);
+    int fd = ::open(index_name.c_str(), O_RDONLY);
+    if (fd >= 0) {
+      struct stat stat_info;
+      if (fstat(fd, &stat_info) == 0) {
+        blocks_.resize(stat_info.st_size / sizeof(LogBlockEntry));
+        ssize_t n = ::read(fd, blocks_.data(),
+                           blocks_.size() * sizeof(LogBlockEntry));
+        blocks_.resize(n > 0 ? n / sizeof(LogBlockEntry) : 0);
+      }
+      ::close(fd);
+    }
+
+    // Keep the indexed blocks which are consistent with the log
+    uint64_t file_offset = 0;
+    LogBlockHeader header;
+    std::size_t valid = 0;
+    for (; valid < blocks_.size(); ++valid) {
+      const LogBlockEntry& block = blocks_[valid];
+      if (block.offset != size_ || block.file_offset != file_offset
+          || !validBlock(file_offset, header))
+        break;
+      size_ += header.raw_size;
+      file_offset += sizeof(header) + header.stored_size;
+    }
+    if (valid < blocks_.size())
+      ROS_WARN("Block index %s does not match the log, ignoring %lu of its "
+               "entries", index_name.c_str(),
+               (unsigned long) (blocks_.size() - valid));
+    blocks_.resize(valid);
+
+    while (validBlock(file_offset, header)) {
+      LogBlockEntry block;
+      block.offset = size_;
+      block.file_offset = file_offset;
+      blocks_.push_back(block);
+      size_ += header.raw_size;
+      file_offset += sizeof(header) + header.stored_size;
+    }
+    if (file_offset < file_size_)
+      ROS_WARN("Ignoring %lu bytes of a truncated block at the end of %s",
+               (unsigned long) (file_size_ - file_offset), log_name.c_str());
+  }
+
+  const uint8_t* data_; //!< The mapped log file
+  uint64_t file_size_; //!< Size of the log file [bytes]
+  uint64_t size_; //!< Size of the uncompressed log [bytes]
+  //! The blocks of a compressed log, empty if it is not compressed
+  std::vector<LogBlockEntry> blocks_;
+};
+
+}  // namespace ublox_gps
+
+#endif  // UBLOX_GPS_LOG_READER_H
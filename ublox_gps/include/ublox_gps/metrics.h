@@ -0,0 +1,382 @@
+//==============================================================================
+// Copyright (c) 2012, Johannes Meyer, TU Darmstadt
+// All rights reserved.
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * Neither the name of the Flight Systems and Automatic Control group,
+//       TU Darmstadt, nor the names of its contributors may be used to
+//       endorse or promote products derived from this software without
+//       specific prior written permission.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//==============================================================================
+
+#ifndef UBLOX_GPS_METRICS_H
+#define UBLOX_GPS_METRICS_H
+
+#include <stdint.h>
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/thread.hpp>
+
+#include <ros/console.h>
+
+namespace ublox_gps {
+
+/**
+ * @brief Counters of the I/O and of the u-blox protocol, shared by the
+ * worker, the callback handlers and the Gps.
+ *
+ * @details Counting is a relaxed atomic increment, so the counters can be
+ * updated from any thread without a lock. The counters of each message class
+ * are allocated when the first message of the class is counted.
+ */
+class Metrics {
+ public:
+  //! The counters
+  enum Counter {
+    kBytesReceived, //!< Bytes received from the device
+    kBytesSent, //!< Bytes sent or queued to the device
+    kSendsFailed, //!< Sends which failed, e.g. the output buffer was full
+    kReadErrors, //!< Errors reading from the device
+    kChecksumErrors, //!< Messages with a wrong checksum
+    kDecodeErrors, //!< Messages which could not be decoded
+    kResyncs, //!< Times bytes were skipped to find the next message
+    kResyncBytes, //!< Bytes skipped to find the next message
+    kDroppedBytes, //!< Received bytes dropped, e.g. by a datagram gap
+    kAcks, //!< ACKs received
+    kNacks, //!< NACKs received
+    kAckTimeouts, //!< Waits for an ACK which ended without an ACK or NACK
+    kAckWaits, //!< Waits for an ACK
+    kAckWaitMicroseconds, //!< Total time waited for ACKs [us]
+    kRtcmBytes, //!< RTCM correction bytes sent to the device
+    kCounters //!< Number of counters
+  };
+
+  //! The count of a message type
+  struct FrameCount {
+    uint8_t class_id; //!< The class ID of the message
+    uint8_t message_id; //!< The message ID of the message
+    uint64_t count; //!< Number of messages received
+  };
+
+  Metrics() {
+    for (int i = 0; i < kCounters; ++i) counters_[i] = 0;
+    for (int i = 0; i < 256; ++i) frames_[i] = 0;
+  }
+
+  ~Metrics() {
+    for (int i = 0; i < 256; ++i) delete frames_[i].load();
+  }
+
+  /**
+   * @brief Get the name of a counter, e.g. to publish it.
+   */
+  static const char* name(Counter counter) { return info(counter).name; }
+
+  /**
+   * @brief Add to a counter.
+   */
+  void add(Counter counter, uint64_t n = 1) {
+    counters_[counter].fetch_add(n, boost::memory_order_relaxed);
+  }
+
+  /**
+   * @brief Get the value of a counter.
+   */
+  uint64_t get(Counter counter) const {
+    return counters_[counter].load(boost::memory_order_relaxed);
+  }
+
+  /**
+   * @brief Count a received message.
+   * @param class_id the class ID of the message
+   * @param message_id the message ID of the message
+   */
+  void frame(uint8_t class_id, uint8_t message_id) {
+    Frames* frames = frames_[class_id].load(boost::memory_order_acquire);
+    if (!frames) {
+      // Another thread may allocate the class at the same time
+      Frames* expected = 0;
+      frames = new Frames;
+      if (!frames_[class_id].compare_exchange_strong(
+              expected, frames, boost::memory_order_acq_rel)) {
+        delete frames;
+        frames = expected;
+      }
+    }
+    frames->counts[message_id].fetch_add(1, boost::memory_order_relaxed);
+  }
+
+  /**
+   * @brief Get the counts of the received message types, by class and
+   * message ID.
+   */
+  std::vector<FrameCount> frames() const {
+    std::vector<FrameCount> frames;
+    for (int i = 0; i < 256; ++i) {
+      const Frames* counts = frames_[i].load(boost::memory_order_acquire);
+      if (!counts) continue;
+      for (int j = 0; j < 256; ++j) {
+        FrameCount frame;
+        frame.class_id = i;
+        frame.message_id = j;
+        frame.count = counts->counts[j].load(boost::memory_order_relaxed);
+        if (frame.count > 0) frames.push_back(frame);
+      }
+    }
+    return frames;
+  }
+
+  /**
+   * @brief Get the counters in the Prometheus text exposition format.
+   */
+  std::string prometheus() const {
+    std::string text;
+    char line[256];
+    for (int i = 0; i < kCounters; ++i) {
+      Counter counter = static_cast<Counter>(i);
+      const Info& info = this->info(counter);
+      if (info.help) {
+        snprintf(line, sizeof(line), "# HELP ublox_%s %s\n# TYPE ublox_%s %s\n",
+                 info.family, info.help, info.family, info.type);
+        text += line;
+      }
+      if (info.scale != 1)
+        snprintf(line, sizeof(line), "ublox_%s %.6f\n", info.sample,
+                 get(counter) * info.scale);
+      else
+        snprintf(line, sizeof(line), "ublox_%s %lu\n", info.sample,
+                 (unsigned long) get(counter));
+      text += line;
+    }
+    text += "# HELP ublox_frames_total Messages received, by class and "
+            "message ID\n# TYPE ublox_frames_total counter\n";
+    std::vector<FrameCount> frames = this->frames();
+    for (std::size_t i = 0; i < frames.size(); ++i) {
+      snprintf(line, sizeof(line),
+               "ublox_frames_total{class=\"0x%02x\",id=\"0x%02x\"} %lu\n",
+               frames[i].class_id, frames[i].message_id,
+               (unsigned long) frames[i].count);
+      text += line;
+    }
+    return text;
+  }
+
+ private:
+  //! The counts of the messages of a class, by message ID
+  struct Frames {
+    Frames() {
+      for (int i = 0; i < 256; ++i) counts[i] = 0;
+    }
+    boost::atomic<uint64_t> counts[256];
+  };
+
+  //! How a counter is exported
+  struct Info {
+    const char* name; //!< Short name, e.g. for a ROS message
+    const char* family; //!< Name of the Prometheus metric family
+    const char* type; //!< Type of the Prometheus metric family
+    const char* sample; //!< Name of the Prometheus sample
+    const char* help; //!< Help text, if the counter starts a family
+    double scale; //!< Unit of the counter in the sample's unit
+  };
+
+  /**
+   * @brief Get how a counter is exported.
+   */
+  static const Info& info(Counter counter) {
+    static const Info kInfo[kCounters] = {
+        {"bytes_received", "bytes_received_total", "counter",
+         "bytes_received_total", "Bytes received from the device", 1},
+        {"bytes_sent", "bytes_sent_total", "counter", "bytes_sent_total",
+         "Bytes sent or queued to the device", 1},
+        {"sends_failed", "sends_failed_total", "counter", "sends_failed_total",
+         "Sends which failed, e.g. because the output buffer was full", 1},
+        {"read_errors", "read_errors_total", "counter", "read_errors_total",
+         "Errors reading from the device", 1},
+        {"checksum_errors", "checksum_errors_total", "counter",
+         "checksum_errors_total", "Messages with a wrong checksum", 1},
+        {"decode_errors", "decode_errors_total", "counter",
+         "decode_errors_total", "Messages which could not be decoded", 1},
+        {"resyncs", "resyncs_total", "counter", "resyncs_total",
+         "Times bytes were skipped to find the next message", 1},
+        {"resync_bytes", "resync_bytes_total", "counter", "resync_bytes_total",
+         "Bytes skipped to find the next message", 1},
+        {"dropped_bytes", "dropped_bytes_total", "counter",
+         "dropped_bytes_total",
+         "Received bytes dropped, e.g. by a datagram gap", 1},
+        {"acks", "acks_total", "counter", "acks_total", "ACKs received", 1},
+        {"nacks", "nacks_total", "counter", "nacks_total", "NACKs received",
+         1},
+        {"ack_timeouts", "ack_timeouts_total", "counter",
+         "ack_timeouts_total",
+         "Waits for an ACK which ended without an ACK or NACK", 1},
+        {"ack_waits", "ack_wait_seconds", "summary", "ack_wait_seconds_count",
+         "Time waited for an ACK", 1},
+        {"ack_wait_us", 0, 0, "ack_wait_seconds_sum", 0, 1e-6},
+        {"rtcm_bytes", "rtcm_bytes_total", "counter", "rtcm_bytes_total",
+         "RTCM correction bytes sent to the device", 1}};
+    return kInfo[counter];
+  }
+
+  boost::atomic<uint64_t> counters_[kCounters]; //!< The counters
+  //! The counts of each message class, allocated on first use
+  boost::atomic<Frames*> frames_[256];
+};
+
+/**
+ * @brief Serves the metrics in the Prometheus text format over HTTP.
+ *
+ * @details Each request is answered with the metrics, whatever its path, and
+ * the connection is closed. Requests are handled one at a time on the
+ * server's own thread, which is enough for a scraper.
+ */
+class MetricsServer {
+ public:
+  /**
+   * @param metrics the metrics to serve
+   * @param address the address to listen on, e.g. 127.0.0.1
+   * @param port the TCP port to listen on
+   * @throws std::exception if the address can't be bound
+   */
+  MetricsServer(const boost::shared_ptr<Metrics>& metrics,
+                const std::string& address, unsigned short port)
+      : metrics_(metrics), acceptor_(io_service_), socket_(io_service_),
+        deadline_(io_service_) {
+    boost::asio::ip::tcp::endpoint endpoint(
+        boost::asio::ip::address::from_string(address), port);
+    acceptor_.open(endpoint.protocol());
+    acceptor_.set_option(boost::asio::ip::tcp::acceptor::reuse_address(true));
+    acceptor_.bind(endpoint);
+    acceptor_.listen();
+    accept();
+    thread_.reset(new boost::thread(
+        boost::bind(&boost::asio::io_service::run, &io_service_)));
+  }
+
+  ~MetricsServer() {
+    io_service_.stop();
+    thread_->join();
+  }
+
+ private:
+  //! Maximum time to serve a connection [s]
+  static const int kRequestTimeout = 1;
+
+  /**
+   * @brief Wait for the next connection.
+   */
+  void accept() {
+    acceptor_.async_accept(socket_, boost::bind(&MetricsServer::acceptEnd,
+        this, boost::asio::placeholders::error));
+  }
+
+  /**
+   * @brief Read the request of a new connection.
+   *
+   * @details The connection is closed if it is not served within
+   * kRequestTimeout, so a silent or slow client can't block the server.
+   */
+  void acceptEnd(const boost::system::error_code& error) {
+    if (error == boost::asio::error::operation_aborted) return;
+    if (error) {
+      ROS_WARN("U-Blox metrics server: %s", error.message().c_str());
+      accept();
+      return;
+    }
+    deadline_.expires_from_now(boost::posix_time::seconds(kRequestTimeout));
+    deadline_.async_wait(boost::bind(&MetricsServer::deadlineEnd, this,
+        boost::asio::placeholders::error));
+    request_.consume(request_.size());
+    boost::asio::async_read_until(socket_, request_, "\r\n\r\n",
+        boost::bind(&MetricsServer::readEnd, this,
+                    boost::asio::placeholders::error));
+  }
+
+  /**
+   * @brief Answer the request with the current metrics.
+   */
+  void readEnd(const boost::system::error_code& error) {
+    if (error) {
+      close();
+      return;
+    }
+    std::string body = metrics_->prometheus();
+    char header[160];
+    snprintf(header, sizeof(header),
+             "HTTP/1.0 200 OK\r\n"
+             "Content-Type: text/plain; version=0.0.4\r\n"
+             "Content-Length: %lu\r\n\r\n", (unsigned long) body.size());
+    response_ = std::string(header) + body;
+    boost::asio::async_write(socket_, boost::asio::buffer(response_),
+        boost::bind(&MetricsServer::writeEnd, this,
+                    boost::asio::placeholders::error));
+  }
+
+  /**
+   * @brief Close the answered connection.
+   */
+  void writeEnd(const boost::system::error_code& error) {
+    close();
+  }
+
+  /**
+   * @brief Close a connection which was not served in time. Its pending read
+   * or write then ends with an error.
+   */
+  void deadlineEnd(const boost::system::error_code& error) {
+    if (error == boost::asio::error::operation_aborted) return;
+    // The deadline may have been moved after this wait expired
+    typedef boost::asio::deadline_timer::traits_type Traits;
+    if (deadline_.expires_at() > Traits::now()) return;
+    boost::system::error_code ignored;
+    socket_.close(ignored);
+  }
+
+  /**
+   * @brief Close the connection and wait for the next one.
+   */
+  void close() {
+    boost::system::error_code ignored;
+    deadline_.cancel(ignored);
+    socket_.close(ignored);
+    accept();
+  }
+
+  boost::shared_ptr<Metrics> metrics_; //!< The metrics to serve
+  boost::asio::io_service io_service_; //!< Runs the server
+  boost::asio::ip::tcp::acceptor acceptor_; //!< Accepts connections
+  boost::asio::ip::tcp::socket socket_; //!< The connection being served
+  boost::asio::deadline_timer deadline_; //!< Closes a connection not served
+                                         //!< in time
+  boost::asio::streambuf request_; //!< The request of the connection
+  std::string response_; //!< The response to the connection
+  boost::shared_ptr<boost::thread> thread_; //!< Runs io_service_
+};
+
+}  // namespace ublox_gps
+
+#endif  // UBLOX_GPS_METRICS_H
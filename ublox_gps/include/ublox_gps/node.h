@@ -33,7 +33,7 @@
 // STL
 #include <vector>
 #include <set>
-#include <fstream>
+#include <csignal>
 // Boost
 #include <boost/algorithm/string.hpp>
 #include <boost/lexical_cast.hpp>
@@ -44,17 +44,32 @@
 #include <ros/serialization.h>
 #include <diagnostic_updater/diagnostic_updater.h>
 #include <diagnostic_updater/publisher.h>
+#include <diagnostic_msgs/DiagnosticStatus.h>
 // ROS messages
 #include <geometry_msgs/TwistWithCovarianceStamped.h>
 #include <geometry_msgs/Vector3Stamped.h>
+#include <nav_msgs/Odometry.h>
 #include <sensor_msgs/NavSatFix.h>
 #include <sensor_msgs/TimeReference.h>
 #include <sensor_msgs/Imu.h>
-#include <std_msgs/String.h>
+#include <std_srvs/Trigger.h>
 // Other U-Blox package includes
 #include <ublox_msgs/ublox_msgs.h>
+#include <ublox_msgs/NavEpoch.h>
+#include <std_msgs/String.h>
+#include <ublox_msgs/RawData.h>
 // Ublox GPS includes
+#include <ublox_gps/clock_estimator.h>
+#include <ublox_gps/diagnostics.h>
+#include <ublox_gps/esf.h>
+#include <ublox_gps/flight_recorder.h>
+#include <ublox_gps/latency.h>
 #include <ublox_gps/gps.h>
+#include <ublox_gps/metrics.h>
+#include <ublox_gps/raw_logger.h>
+#include <ublox_gps/rinex_writer.h>
+#include <ublox_gps/startup_profiler.h>
+#include <ublox_gps/tracepoints.h>
 #include <ublox_gps/utils.h>
 
 // This file declares the ComponentInterface which acts as a high level
@@ -98,6 +113,9 @@ constexpr static uint32_t kNavSvInfoSubscribeRate = 20;
 boost::shared_ptr<diagnostic_updater::Updater> updater;
 //! Node Handle for GPS node
 boost::shared_ptr<ros::NodeHandle> nh;
+//! Set on SIGINT or at the end of a replay, the node shuts down while ROS is
+//! still running so the last data is published
+volatile sig_atomic_t shutdown_requested = 0;
 
 //! Handles communication with the U-Blox Device
 ublox_gps::Gps gps;
@@ -126,12 +144,33 @@ std::vector<uint8_t> rtcm_rates;
 std::string raw_data_stream_dir_;
 //! Filename for storing raw data
 std::string raw_data_stream_filename_;
-//!< Handle for file access
-std::ofstream raw_data_stream_file_;
-//! Flag for publishing raw data 
+//! Options of the raw data log
+ublox_gps::RawLogger::Options raw_data_log_options_;
+//! Writes the raw data log, unless the io_uring worker does
+boost::shared_ptr<ublox_gps::RawLogger> raw_data_logger_;
+//! Flag for publishing raw data chunks on raw_data_chunks
 bool raw_data_stream_flag_;
+//! Flag for publishing each read as std_msgs/String on raw_data_stream
+bool raw_data_string_flag_;
+//! Size at which raw data chunks are published [bytes]
+uint32_t raw_data_chunk_size_;
+//! Age at which raw data chunks are published [s]
+double raw_data_chunk_period_;
 //! Flag for enabling configuration on startup
 bool config_on_startup_flag_;
+//! Whether to stamp outputs with their measurement time in host time
+bool estimate_clock;
+//! Host time of the GNSS time of week, estimated from the navigation messages
+ublox_gps::ClockEstimator gnss_clock;
+//! Records the latest I/O and events, if enabled
+boost::shared_ptr<ublox_gps::FlightRecorder> flight_recorder;
+//! Minimum period between flight recorder dumps on fix degradation, 0 to not
+//! dump on fix degradation [s]
+double flight_recorder_fix_period;
+//! Measures the latencies of the received messages, if enabled
+boost::shared_ptr<ublox_gps::LatencyStats> latency_stats;
+//! Counts the I/O, messages and errors, if enabled
+boost::shared_ptr<ublox_gps::Metrics> metrics;
 
 
 //! Topic diagnostics for u-blox messages
@@ -150,11 +189,9 @@ struct UbloxTopicDiagnostic {
     const double target_freq = 1.0 / (meas_rate * 1e-3 * nav_rate); // Hz
     min_freq = target_freq;
     max_freq = target_freq;
-    diagnostic_updater::FrequencyStatusParam freq_param(&min_freq, &max_freq,
-                                                        freq_tol, freq_window);
-    diagnostic = new diagnostic_updater::HeaderlessTopicDiagnostic(topic,
-                                                                   *updater,
-                                                                   freq_param);
+    diagnostic = new ublox_gps::RateDiagnostic(topic, min_freq, max_freq,
+                                               freq_tol, freq_window);
+    updater->add(*diagnostic);
   }
 
   /**
@@ -171,15 +208,13 @@ struct UbloxTopicDiagnostic {
                    double freq_tol, int freq_window) {
     min_freq = freq_min;
     max_freq = freq_max;
-    diagnostic_updater::FrequencyStatusParam freq_param(&min_freq, &max_freq,
-                                                        freq_tol, freq_window);
-    diagnostic = new diagnostic_updater::HeaderlessTopicDiagnostic(topic,
-                                                                   *updater,
-                                                                   freq_param);
+    diagnostic = new ublox_gps::RateDiagnostic(topic, min_freq, max_freq,
+                                               freq_tol, freq_window);
+    updater->add(*diagnostic);
   }
 
   //! Topic frequency diagnostic updater
-  diagnostic_updater::HeaderlessTopicDiagnostic *diagnostic;
+  ublox_gps::RateDiagnostic *diagnostic;
   //! Minimum allow frequency of topic
   double min_freq;
   //! Maximum allow frequency of topic
@@ -204,18 +239,15 @@ struct FixDiagnostic {
     const double target_freq = 1.0 / (meas_rate * 1e-3 * nav_rate); // Hz
     min_freq = target_freq;
     max_freq = target_freq;
-    diagnostic_updater::FrequencyStatusParam freq_param(&min_freq, &max_freq,
-                                                        freq_tol, freq_window);
     double stamp_max = meas_rate * 1e-3 * (1 + freq_tol);
-    diagnostic_updater::TimeStampStatusParam time_param(stamp_min, stamp_max);
-    diagnostic = new diagnostic_updater::TopicDiagnostic(name,
-                                                         *updater,
-                                                         freq_param,
-                                                         time_param);
+    diagnostic = new ublox_gps::RateDiagnostic(name, min_freq, max_freq,
+                                               freq_tol, freq_window,
+                                               stamp_min, stamp_max);
+    updater->add(*diagnostic);
   }
 
-  //! Topic frequency diagnostic updater
-  diagnostic_updater::TopicDiagnostic *diagnostic;
+  //! Topic frequency & time stamp diagnostic updater
+  ublox_gps::RateDiagnostic *diagnostic;
   //! Minimum allow frequency of topic
   double min_freq;
   //! Maximum allow frequency of topic
@@ -253,6 +285,33 @@ uint8_t modelFromString(const std::string& model);
  */
 uint8_t fixModeFromString(const std::string& mode);
 
+/**
+ * @brief Update the GNSS clock estimate with the navigation message being
+ * handled and get the host time of its epoch.
+ * @param iTOW the GPS time of week of the navigation epoch, rounded to ms
+ * @param nano the signed fraction of the UTC second of the epoch [ns], if
+ * the message has one. Its part below a ms refines iTOW, as GPS and UTC
+ * time differ by whole seconds.
+ * @return the epoch in host time, or the arrival time of the message if
+ * clock estimation is disabled or the estimate is not valid yet
+ */
+ros::Time epochStamp(uint32_t iTOW, int32_t nano = 0);
+
+/**
+ * @brief Record the fix quality in the flight recorder and dump the recorder
+ * when the quality drops, at most once per flight_recorder_fix_period.
+ * @param quality 0 for no fix, 1 for a fix, 2 for a float carrier phase
+ * solution and 3 for a fixed one
+ */
+void recordFixQuality(int quality);
+
+/**
+ * @brief Mark the message being handled as published in the latency stats
+ * and fire the publish tracepoint. Call after publishing a ROS message from
+ * a u-blox message callback.
+ */
+void recordPublished();
+
 /**
  * @brief Check that the parameter is above the minimum.
  * @param val the value to check
@@ -425,6 +484,189 @@ void publish(const MessageT& m, const std::string& topic) {
   static ros::Publisher publisher = nh->advertise<MessageT>(topic,
                                                             kROSQueueSize);
   publisher.publish(m);
+  recordPublished();
+}
+
+/**
+ * @brief Publishes the raw byte stream of the device in chunks.
+ *
+ * @details Reads of the I/O thread are appended to the pending chunk, which
+ * is published once it reaches the chunk size or is older than the chunk
+ * period, checked on each read and by a timer when no bytes arrive. A chunk
+ * is stamped with the arrival time of its first byte. The bytes are copied
+ * once, into the message which is published by pointer, so subscribers in the
+ * same process receive it without serialization.
+ */
+class RawDataPublisher {
+ public:
+  /**
+   * @brief Advertise the topic.
+   * @param topic the topic to publish the chunks on
+   * @param chunk_size publish a chunk once it has this many bytes
+   * @param chunk_period publish a chunk once its first byte is this old [s]
+   */
+  void initialize(const std::string& topic, std::size_t chunk_size,
+                  double chunk_period);
+
+  /**
+   * @brief Add received bytes to the pending chunk, and publish the chunk if
+   * it is complete.
+   * @param data the received bytes
+   * @param size the number of bytes
+   * @param stamp the arrival time of the first byte
+   */
+  void add(const unsigned char* data, std::size_t size,
+           const ros::Time& stamp);
+
+  /**
+   * @brief Publish the pending chunk, if any, e.g. at shutdown.
+   */
+  void flush();
+
+ private:
+  /**
+   * @brief Publish the pending chunk if it is older than the chunk period.
+   */
+  void checkAge(const ros::TimerEvent& event);
+
+  /**
+   * @brief Publish the pending chunk and start a new one. Call with mutex_
+   * locked.
+   */
+  void publishChunk();
+
+  //! Publisher of the chunks
+  ros::Publisher publisher_;
+  //! Publishes chunks which stopped growing
+  ros::Timer timer_;
+  //! Lock for the chunk, added to by the I/O thread and published by the
+  //! timer
+  boost::mutex mutex_;
+  //! The pending chunk, null until initialize is called
+  ublox_msgs::RawDataPtr chunk_;
+  //! Size at which a chunk is published [bytes]
+  std::size_t chunk_size_ = 0;
+  //! Age at which a chunk is published
+  ros::Duration chunk_period_;
+  //! Sequence number of the pending chunk
+  uint32_t sequence_ = 0;
+  //! Stream offset of the pending chunk [bytes]
+  uint64_t offset_ = 0;
+};
+
+/**
+ * @brief Switches the output of u-blox messages on and off at runtime,
+ * following the number of subscribers to their ROS topics.
+ *
+ * @details A message is enabled as soon as its topic has a subscriber, and
+ * disabled once its topic had no subscribers for kIdleTimeout. Subscribers
+ * which briefly reconnect therefore do not toggle the device output.
+ * Messages which components use internally, e.g. to assemble epochs, are
+ * never disabled. The rate is set from the timer of the ROS spin thread, so
+ * it is sent without waiting for the ACK; a NACK is logged when received.
+ */
+class RateManager {
+ public:
+  //! How often to check the number of subscribers [s]
+  constexpr static double kCheckPeriod = 1.0;
+  //! How long a topic must be unsubscribed before disabling its message [s]
+  constexpr static double kIdleTimeout = 10.0;
+
+  /**
+   * @brief Manage the output rate of the given message. The message is
+   * disabled until its topic has a subscriber.
+   * @param topic the topic the message is published on
+   * @param rate the rate of the message while its topic has subscribers
+   */
+  template <typename MessageT>
+  void add(const std::string& topic, uint8_t rate) {
+    Output output;
+    output.publisher = nh->advertise<MessageT>(topic, kROSQueueSize);
+    output.class_id = MessageT::CLASS_ID;
+    output.message_id = MessageT::MESSAGE_ID;
+    output.rate = rate;
+    output.on = true;
+    setOutput(output, false);
+    outputs_.push_back(output);
+  }
+
+  /**
+   * @brief Count an internal user of the given message, which keeps the
+   * message enabled regardless of its topic.
+   */
+  template <typename MessageT>
+  void addUser() {
+    ++users_[key(MessageT::CLASS_ID, MessageT::MESSAGE_ID)];
+  }
+
+  /**
+   * @brief Start checking the number of subscribers.
+   */
+  void start();
+
+ private:
+  //! A message whose output rate is managed
+  struct Output {
+    //! Publisher of the topic, used to count its subscribers
+    ros::Publisher publisher;
+    uint8_t class_id; //!< The class ID of the message
+    uint8_t message_id; //!< The message ID of the message
+    uint8_t rate; //!< The rate of the message while its topic is subscribed
+    bool on; //!< Whether the message is enabled on the device
+    //! When the topic lost its last subscriber, zero if it has subscribers
+    ros::Time idle_since;
+  };
+
+  /**
+   * @brief Get the key of a message in users_.
+   */
+  static uint16_t key(uint8_t class_id, uint8_t message_id) {
+    return class_id << 8 | message_id;
+  }
+
+  /**
+   * @brief Enable or disable the output of a message. A message with
+   * internal users is not disabled.
+   * @param output the message
+   * @param on whether to enable the message
+   */
+  void setOutput(Output& output, bool on);
+
+  /**
+   * @brief Enable the messages whose topics have subscribers and disable
+   * the messages whose topics are idle.
+   */
+  void update(const ros::TimerEvent& event);
+
+  //! The managed messages
+  std::vector<Output> outputs_;
+  //! Number of internal users of each message, by class & message ID
+  std::map<uint16_t, int> users_;
+  //! Timer to check the number of subscribers
+  ros::Timer timer_;
+};
+
+//! Whether to enable messages only while their topics have subscribers
+bool on_demand;
+//! Manages the output rates of messages when on_demand is set
+RateManager rate_manager;
+
+/**
+ * @brief Subscribe to a u-blox message and publish it on a ROS topic.
+ *
+ * @details If on_demand is set, the message is only enabled on the device
+ * while the topic has subscribers.
+ * @param topic the topic to publish the message on
+ * @param rate the rate of the message
+ */
+template <typename MessageT>
+void subscribeTopic(const std::string& topic, uint8_t rate) {
+  if (on_demand) {
+    gps.subscribe<MessageT>(boost::bind(publish<MessageT>, _1, topic));
+    rate_manager.add<MessageT>(topic, rate);
+  } else {
+    gps.subscribe<MessageT>(boost::bind(publish<MessageT>, _1, topic), rate);
+  }
 }
 
 /**
@@ -587,6 +829,21 @@ class UbloxNode : public virtual ComponentInterface {
    */
   void pollMessages(const ros::TimerEvent& event);
 
+  /**
+   * @brief Run the diagnostic updater.
+   *
+   * @details The diagnostics are only updated from this timer, the message
+   * callbacks only count messages and store their last values.
+   * @param event a timer indicating how often to update the diagnostics
+   */
+  void updateDiagnostics(const ros::TimerEvent& event);
+
+  /**
+   * @brief Shut the node down once the replayed log is finished.
+   * @param event a timer indicating how often to check the replay
+   */
+  void checkReplay(const ros::TimerEvent& event);
+
   /**
    * @brief Configure INF messages, call after subscribe.
    */
@@ -596,8 +853,66 @@ class UbloxNode : public virtual ComponentInterface {
    * @brief Callback function which handles raw data.
    * @param data the buffer of u-blox messages to process
    * @param size the size of the buffer
+   * @param stamp the arrival time of the first byte
+   */
+  void rawDataCallback(const unsigned char* data, const std::size_t size,
+                       const ros::Time& stamp);
+
+  /**
+   * @brief Dump the flight recorder on request.
+   * @param res set to the name of the dump
+   */
+  bool dumpFlightRecorder(std_srvs::Trigger::Request& req,
+                          std_srvs::Trigger::Response& res);
+
+  /**
+   * @brief Add the latency of each message type to the diagnostics.
+   */
+  void latencyDiagnostics(diagnostic_updater::DiagnosticStatusWrapper& stat);
+
+  /**
+   * @brief Report the latency stats on request.
+   * @param res set to the table of the latencies
+   */
+  bool dumpLatency(std_srvs::Trigger::Request& req,
+                   std_srvs::Trigger::Response& res);
+
+  /**
+   * @brief End the startup profile and report it in the log, as JSON in the
+   * startup/report parameter and in the startup/report_file, if set.
    */
-  void rawDataCallback(const unsigned char* data, const std::size_t size);
+  void reportStartup();
+
+  /**
+   * @brief Publish the metrics counters and their rates since the last call.
+   * @param event a timer indicating how often to publish the metrics
+   */
+  void publishMetrics(const ros::TimerEvent& event);
+
+  //! Publishes the raw data stream if raw_data_stream_flag_ is set
+  RawDataPublisher raw_data_publisher_;
+  //! Dumps the flight recorder on request
+  ros::ServiceServer dump_service_;
+  //! Reports the latency stats on request
+  ros::ServiceServer latency_service_;
+  //! Times the phases of initialize()
+  boost::shared_ptr<ublox_gps::StartupProfiler> startup_profiler_;
+  //! Publishes the metrics
+  ros::Publisher metrics_publisher_;
+  //! Serves the metrics over HTTP, if enabled
+  boost::shared_ptr<ublox_gps::MetricsServer> metrics_server_;
+  //! The counters at the last publish of the metrics
+  std::vector<uint64_t> last_metrics_;
+  //! The message counts at the last publish of the metrics
+  std::vector<ublox_gps::Metrics::FrameCount> last_frames_;
+  //! The time of the last publish of the metrics
+  ros::WallTime last_metrics_time_;
+  //! Period of the metrics topic, 0 to not publish it [s]
+  double metrics_period_;
+  //! TCP port of the metrics HTTP endpoint, 0 to not serve it
+  uint32_t metrics_port_;
+  //! Address of the metrics HTTP endpoint
+  std::string metrics_address_;
 
   //! The u-blox node components
   /*!
@@ -611,6 +926,10 @@ class UbloxNode : public virtual ComponentInterface {
   // Variables set from parameter server
   //! Device port
   std::string device_;
+  //! Replay speed of a log device, 0 to replay as fast as possible
+  double replay_speed_;
+  //! Whether to shut down once the replayed log is finished
+  bool replay_exit_;
   //! dynamic model type
   std::string dynamic_model_;
   //! Fix mode type
@@ -625,6 +944,18 @@ class UbloxNode : public virtual ComponentInterface {
   uint16_t uart_in_;
   //! UART out protocol (see CfgPRT message for constants)
   uint16_t uart_out_;
+  //! Whether to use the low latency serial worker instead of ASIO
+  bool low_latency_serial_;
+  //! Microseconds to keep polling the port after a read (low latency only)
+  uint32_t serial_spin_us_;
+  //! Whether to use the io_uring worker for serial I/O and raw data logging
+  bool io_uring_serial_;
+  //! Minimum number of bytes to dispatch when coalescing reads
+  uint32_t coalesce_bytes_;
+  //! How long to wait for more data before dispatching, 0 disables [ms]
+  uint32_t coalesce_timeout_ms_;
+  //! Whether to coalesce reads up to the end of the navigation epoch
+  bool coalesce_epoch_;
   //! USB TX Ready Pin configuration (see CfgPRT message for constants)
   uint16_t usb_tx_;
   //! Whether to configure the USB port
@@ -656,6 +987,13 @@ class UbloxNode : public virtual ComponentInterface {
   ublox_msgs::CfgCFG save_;
   //! rate for TIM-TM2
   uint8_t tim_rate_;
+  // Resolved from enabled when subscribing, so the poll timer needs no lookup
+  //! Whether to poll AID ALM messages
+  bool poll_aid_alm_ = false;
+  //! Whether to poll AID EPH messages
+  bool poll_aid_eph_ = false;
+  //! Whether to poll AID HUI messages
+  bool poll_aid_hui_ = false;
 };
 
 /**
@@ -710,7 +1048,7 @@ class UbloxFirmware6 : public UbloxFirmware {
 
  private:
   /**
-   * @brief Publish the fix and call the fix diagnostic updater.
+   * @brief Publish the fix and count it for the fix diagnostics.
    *
    * @details Also updates the last known position and publishes the NavPosLLH
    * message if publishing is enabled.
@@ -740,6 +1078,9 @@ class UbloxFirmware6 : public UbloxFirmware {
   ublox_msgs::NavVELNED last_nav_vel_;
   //! The last received num SVs used
   ublox_msgs::NavSOL last_nav_sol_;
+  //! Copies of the last position & solution for the fix diagnostics
+  ublox_gps::LastValue<ublox_msgs::NavPOSLLH> diag_nav_pos_;
+  ublox_gps::LastValue<ublox_msgs::NavSOL> diag_nav_sol_;
   //! The last NavSatFix based on last_nav_pos_
   sensor_msgs::NavSatFix fix_;
   //! The last Twist based on last_nav_vel_
@@ -749,6 +1090,13 @@ class UbloxFirmware6 : public UbloxFirmware {
   ublox_msgs::CfgNMEA6 cfg_nmea_;
   //! Whether or not to configure the NMEA settings
   bool set_nmea_;
+  // Resolved from enabled when subscribing, so the callbacks need no lookup
+  //! Whether to publish NavPOSLLH messages
+  bool publish_nav_posllh_ = false;
+  //! Whether to publish NavVELNED messages
+  bool publish_nav_velned_ = false;
+  //! Whether to publish NavSOL messages
+  bool publish_nav_sol_ = false;
 };
 
 /**
@@ -768,15 +1116,16 @@ class UbloxFirmware7Plus : public UbloxFirmware {
    *
    * @details If a fixed carrier phase solution is available, the NavSatFix
    * status is set to GBAS fixed. If NavPVT publishing is enabled, the message
-   * is published. This function also calls the ROS diagnostics updater.
+   * is published. This function also updates the fix diagnostics.
    * @param m the message to publish
    */
   void callbackNavPvt(const NavPVT& m) {
-    if(enabled["nav_pvt"]) {
+    if(publish_nav_pvt_) {
       // NavPVT publisher
       static ros::Publisher publisher = nh->advertise<NavPVT>("navpvt",
                                                               kROSQueueSize);
       publisher.publish(m);
+      recordPublished();
     }
 
     //
@@ -789,7 +1138,11 @@ class UbloxFirmware7Plus : public UbloxFirmware {
     fix.header.frame_id = frame_id;
     // set the timestamp
     uint8_t valid_time = m.VALID_DATE | m.VALID_TIME | m.VALID_FULLY_RESOLVED;
-    if (((m.valid & valid_time) == valid_time) &&
+    if (estimate_clock) {
+      // Use the measurement epoch in host time
+      fix.header.stamp = epochStamp(m.iTOW,
+                                    (m.valid & m.VALID_TIME) ? m.nano : 0);
+    } else if (((m.valid & valid_time) == valid_time) &&
         (m.flags2 & m.FLAGS2_CONFIRMED_AVAILABLE)) {
       // Use NavPVT timestamp since it is valid
       // The time in nanoseconds from the NavPVT message can be between -1e9 and 1e9
@@ -804,8 +1157,8 @@ class UbloxFirmware7Plus : public UbloxFirmware {
         fix.header.stamp.nsec = (uint32_t)(m.nano);
       }
     } else {
-      // Use ROS time since NavPVT timestamp is not valid
-      fix.header.stamp = ros::Time::now();
+      // Use the arrival time since NavPVT timestamp is not valid
+      fix.header.stamp = gps.arrivalTime();
     }
     // Set the LLA
     fix.latitude = m.lat * 1e-7; // to deg
@@ -823,6 +1176,12 @@ class UbloxFirmware7Plus : public UbloxFirmware {
     }
     // Set the service based on GNSS configuration
     fix.status.service = fix_status_service;
+    if (flight_recorder) {
+      int carrier = m.flags & m.FLAGS_CARRIER_PHASE_MASK;
+      recordFixQuality(fix.status.status == fix.status.STATUS_NO_FIX ? 0
+                       : carrier == m.CARRIER_PHASE_FIXED ? 3
+                       : carrier == m.CARRIER_PHASE_FLOAT ? 2 : 1);
+    }
 
     // Set the position covariance
     const double varH = pow(m.hAcc / 1000.0, 2); // to [m^2]
@@ -834,6 +1193,7 @@ class UbloxFirmware7Plus : public UbloxFirmware {
         sensor_msgs::NavSatFix::COVARIANCE_TYPE_DIAGONAL_KNOWN;
 
     fixPublisher.publish(fix);
+    recordPublished();
 
     //
     // Twist message
@@ -858,13 +1218,13 @@ class UbloxFirmware7Plus : public UbloxFirmware {
     velocity.twist.covariance[cols * 3 + 3] = -1;  //  angular rate unsupported
 
     velocityPublisher.publish(velocity);
+    recordPublished();
 
     //
     // Update diagnostics
     //
-    last_nav_pvt_ = m;
+    last_nav_pvt_.set(m);
     freq_diag.diagnostic->tick(fix.header.stamp);
-    updater->update();
   }
 
  protected:
@@ -873,51 +1233,54 @@ class UbloxFirmware7Plus : public UbloxFirmware {
    * @brief Update the fix diagnostics from Nav PVT message.
    */
   void fixDiagnostic(diagnostic_updater::DiagnosticStatusWrapper& stat) {
+    const NavPVT last_nav_pvt = last_nav_pvt_.get();
     // check the last message, convert to diagnostic
-    if (last_nav_pvt_.fixType ==
+    if (last_nav_pvt.fixType ==
         ublox_msgs::NavPVT::FIX_TYPE_DEAD_RECKONING_ONLY) {
       stat.level = diagnostic_msgs::DiagnosticStatus::WARN;
       stat.message = "Dead reckoning only";
-    } else if (last_nav_pvt_.fixType == ublox_msgs::NavPVT::FIX_TYPE_2D) {
+    } else if (last_nav_pvt.fixType == ublox_msgs::NavPVT::FIX_TYPE_2D) {
       stat.level = diagnostic_msgs::DiagnosticStatus::WARN;
       stat.message = "2D fix";
-    } else if (last_nav_pvt_.fixType == ublox_msgs::NavPVT::FIX_TYPE_3D) {
+    } else if (last_nav_pvt.fixType == ublox_msgs::NavPVT::FIX_TYPE_3D) {
       stat.level = diagnostic_msgs::DiagnosticStatus::OK;
       stat.message = "3D fix";
-    } else if (last_nav_pvt_.fixType ==
+    } else if (last_nav_pvt.fixType ==
                ublox_msgs::NavPVT::FIX_TYPE_GNSS_DEAD_RECKONING_COMBINED) {
       stat.level = diagnostic_msgs::DiagnosticStatus::OK;
       stat.message = "GPS and dead reckoning combined";
-    } else if (last_nav_pvt_.fixType ==
+    } else if (last_nav_pvt.fixType ==
                ublox_msgs::NavPVT::FIX_TYPE_TIME_ONLY) {
       stat.level = diagnostic_msgs::DiagnosticStatus::OK;
       stat.message = "Time only fix";
     }
 
     // If fix not ok (w/in DOP & Accuracy Masks), raise the diagnostic level
-    if (!(last_nav_pvt_.flags & ublox_msgs::NavPVT::FLAGS_GNSS_FIX_OK)) {
+    if (!(last_nav_pvt.flags & ublox_msgs::NavPVT::FLAGS_GNSS_FIX_OK)) {
       stat.level = diagnostic_msgs::DiagnosticStatus::WARN;
       stat.message += ", fix not ok";
     }
     // Raise diagnostic level to error if no fix
-    if (last_nav_pvt_.fixType == ublox_msgs::NavPVT::FIX_TYPE_NO_FIX) {
+    if (last_nav_pvt.fixType == ublox_msgs::NavPVT::FIX_TYPE_NO_FIX) {
       stat.level = diagnostic_msgs::DiagnosticStatus::ERROR;
       stat.message = "No fix";
     }
 
     // append last fix position
-    stat.add("iTOW [ms]", last_nav_pvt_.iTOW);
-    stat.add("Latitude [deg]", last_nav_pvt_.lat * 1e-7);
-    stat.add("Longitude [deg]", last_nav_pvt_.lon * 1e-7);
-    stat.add("Altitude [m]", last_nav_pvt_.height * 1e-3);
-    stat.add("Height above MSL [m]", last_nav_pvt_.hMSL * 1e-3);
-    stat.add("Horizontal Accuracy [m]", last_nav_pvt_.hAcc * 1e-3);
-    stat.add("Vertical Accuracy [m]", last_nav_pvt_.vAcc * 1e-3);
-    stat.add("# SVs used", (int)last_nav_pvt_.numSV);
+    stat.add("iTOW [ms]", last_nav_pvt.iTOW);
+    stat.add("Latitude [deg]", last_nav_pvt.lat * 1e-7);
+    stat.add("Longitude [deg]", last_nav_pvt.lon * 1e-7);
+    stat.add("Altitude [m]", last_nav_pvt.height * 1e-3);
+    stat.add("Height above MSL [m]", last_nav_pvt.hMSL * 1e-3);
+    stat.add("Horizontal Accuracy [m]", last_nav_pvt.hAcc * 1e-3);
+    stat.add("Vertical Accuracy [m]", last_nav_pvt.vAcc * 1e-3);
+    stat.add("# SVs used", (int)last_nav_pvt.numSV);
   }
 
   //! The last received NavPVT message
-  NavPVT last_nav_pvt_;
+  ublox_gps::LastValue<NavPVT> last_nav_pvt_;
+  //! Whether to publish NavPVT messages, resolved when subscribing
+  bool publish_nav_pvt_ = false;
   // Whether or not to enable the given GNSS
   //! Whether or not to enable GPS
   bool enable_gps_;
@@ -1015,6 +1378,142 @@ class UbloxFirmware8 : public UbloxFirmware7Plus<ublox_msgs::NavPVT> {
   bool clear_bbr_;
 };
 
+/**
+ * @brief Assembles the NAV messages of each navigation epoch into a single
+ * NavEpoch message.
+ *
+ * @details The messages are grouped by their iTOW. The epoch is published
+ * when NAV-EOE arrives or, if NAV-EOE is not used, as soon as all configured
+ * messages arrived. A message of a later epoch publishes the open epoch as it
+ * is, e.g. if its NAV-EOE was lost. Requires firmware 8 or later (NavPVT).
+ */
+class EpochAssembler: public virtual ComponentInterface {
+ public:
+  EpochAssembler();
+
+  /**
+   * @brief Get the epoch parameters.
+   *
+   * @details Get the messages to enable and whether to close epochs on
+   * NAV-EOE.
+   */
+  void getRosParams();
+
+  /**
+   * @brief Does nothing since the messages are configured when subscribing.
+   * @return always returns true
+   */
+  bool configureUblox() { return true; }
+
+  /**
+   * @brief Subscribe to the NAV messages of the epoch and to NAV-EOE.
+   */
+  void subscribe();
+
+  /**
+   * @brief Does nothing since there are no epoch specific diagnostics.
+   */
+  void initializeRosDiagnostics() {}
+
+ private:
+  /**
+   * @brief Subscribe to a NAV message of the epoch.
+   * @param callback the callback which adds the message to the epoch
+   * @param received the NavEpoch RECEIVED_* flag of the message, the message
+   * is enabled on the device if it is one of the configured messages
+   */
+  template <typename T>
+  void subscribeNav(void (EpochAssembler::*callback)(const T&),
+                    uint8_t received) {
+    typename ublox_gps::CallbackHandler_<T>::Callback handler =
+        boost::bind(callback, this, _1);
+    if (configured_ & received) {
+      gps.subscribe<T>(handler, kSubscribeRate);
+      rate_manager.addUser<T>();
+    } else {
+      gps.subscribe<T>(handler);
+    }
+  }
+
+  /**
+   * @brief Open the epoch of a received message.
+   *
+   * @details Publishes the open epoch first if the message belongs to a
+   * later epoch.
+   * @param iTOW the time of week of the message [ms]
+   * @return false if the epoch of the message was already published
+   */
+  bool openEpoch(uint32_t iTOW);
+
+  /**
+   * @brief Mark a message as received, publish the epoch if it is complete.
+   * @param received the NavEpoch RECEIVED_* flag of the message
+   */
+  void addReceived(uint8_t received);
+
+  /**
+   * @brief Publish the open epoch.
+   */
+  void publishEpoch();
+
+  // Add the received message to the open epoch
+  void callbackNavPvt(const ublox_msgs::NavPVT& m);
+  void callbackNavPosEcef(const ublox_msgs::NavPOSECEF& m);
+  void callbackNavRelPosNed(const ublox_msgs::NavRELPOSNED& m);
+  void callbackNavDop(const ublox_msgs::NavDOP& m);
+  void callbackNavClock(const ublox_msgs::NavCLOCK& m);
+  void callbackNavEoe(const ublox_msgs::NavEOE& m);
+
+  //! The open epoch
+  ublox_msgs::NavEpoch epoch_;
+  //! Whether an epoch is open
+  bool open_;
+  //! Whether any epoch was published
+  bool published_;
+  //! The time of week of the last published epoch [ms]
+  uint32_t published_iTOW_;
+  //! Whether epochs are closed by NAV-EOE, or by the configured messages
+  bool use_eoe_;
+  //! The RECEIVED_* flags of the messages enabled on the device
+  uint8_t configured_;
+};
+
+/**
+ * @brief Writes RINEX observation and navigation files from the raw
+ * measurements and broadcast subframes.
+ *
+ * @details Enabled by setting rinex/dir. Requires firmware 8 or later
+ * (RxmRAWX). Replaying a raw data log (device file://<log>) converts it.
+ */
+class RinexLogger: public virtual ComponentInterface {
+ public:
+  /**
+   * @brief Get the RINEX output parameters and create the writer.
+   * @throws std::runtime_error if a parameter is invalid
+   */
+  void getRosParams();
+
+  /**
+   * @brief Does nothing since the messages are configured when subscribing.
+   * @return always returns true
+   */
+  bool configureUblox() { return true; }
+
+  /**
+   * @brief Subscribe to RxmRAWX & RxmSFRBX messages.
+   */
+  void subscribe();
+
+  /**
+   * @brief Does nothing since there are no RINEX specific diagnostics.
+   */
+  void initializeRosDiagnostics() {}
+
+ private:
+  //! Writes the RINEX files
+  boost::shared_ptr<ublox_gps::RinexWriter> writer_;
+};
+
 /**
  * @brief Implements functions for Raw Data products.
  */
@@ -1075,29 +1574,150 @@ class AdrUdrProduct: public virtual ComponentInterface {
    * @brief Subscribe to ADR/UDR messages.
    *
    * @details Subscribe to NavATT, ESF and HNR messages based on user
-   * parameters.
+   * parameters, and to the sensor input topics. Adds the rate and latency
+   * diagnostic of the sensor input, if enabled.
    */
   void subscribe();
 
   /**
    * @brief Initialize the ROS diagnostics for the ADR/UDR device.
-   * @todo unimplemented
+   *
+   * @details The sensor input diagnostic is added when subscribing, once
+   * its rate is known.
    */
-  void initializeRosDiagnostics() {
-    ROS_WARN("ROS Diagnostics specific to u-blox ADR/UDR devices is %s",
-             "unimplemented. See AdrUdrProduct class in node.h & node.cpp.");
-  }
+  void initializeRosDiagnostics() {}
 
  protected:
+  //! Minimum rate of the sensor input [Hz]
+  constexpr static double kEsfInputRateMin = 10;
+  //! Maximum rate of the sensor input [Hz]
+  constexpr static double kEsfInputRateMax = 50;
+  //! Tolerance of the sensor input rate [fraction]
+  constexpr static double kEsfInputFreqTol = 0.15;
+  //! Number of diagnostic updates to evaluate the input rate over
+  constexpr static int kEsfInputFreqWindow = 25;
+  //! Maximum number of measurements queued between writes
+  constexpr static std::size_t kEsfInputQueueSize = 32;
+  //! Queue size of the sensor input subscribers
+  constexpr static uint32_t kEsfInputSubscribeQueueSize = 10;
+
+  //! A time tag and its arrival, which later time tags are compared to
+  struct TimeTagCheck {
+    uint32_t time_tag = 0;
+    ros::Time arrival;
+  };
+
   //! Whether or not to enable dead reckoning
   bool use_adr_;
 
-   
+
   sensor_msgs::Imu imu_;
+  //! Host time of the ESF-MEAS sensor time tags
+  ublox_gps::ClockEstimator esf_clock_;
+  //! Decodes the inertial samples of the ESF-MEAS data words
+  ublox_gps::EsfImuDecoder esf_decoder_;
+  //! Samples of the pending time tag per axis, plus a spare element
+  double esf_values_[ublox_gps::ESF_NUM_AXES + 1];
+  //! Axes received for the pending time tag, 0 if none is pending
+  unsigned esf_axes_ = 0;
+  //! Axes the sensor provides per time tag, learned from past time tags
+  unsigned esf_full_axes_ = 0;
+  //! Sensor time tag of the pending samples [esf_time_tag_unit_]
+  uint32_t esf_time_tag_ = 0;
+  //! Unit of the ESF-MEAS time tags [s]
+  double esf_time_tag_unit_ = 1e-3;
+  //! Checks esf_time_tag_unit_ against the host clock
+  TimeTagCheck esf_check_;
+  //! Host time of the pending samples
+  ros::Time esf_stamp_;
+  //! Host time of the ESF-RAW time tags, estimated separately as they need
+  //! not share the time base of ESF-MEAS
+  ublox_gps::ClockEstimator esf_raw_clock_;
+  //! Unit of the ESF-RAW time tags [s]
+  double esf_raw_time_tag_unit_ = 1e-3;
+  //! Checks esf_raw_time_tag_unit_ against the host clock
+  TimeTagCheck esf_raw_check_;
+  //! Message of the raw samples, reused for each sample
+  sensor_msgs::Imu imu_raw_;
   sensor_msgs::TimeReference t_ref_;
   ublox_msgs::TimTM2 timtm2;
 
+  /**
+   * @brief Add the inertial samples of an ESF-MEAS message to the pending
+   * time tag.
+   *
+   * @details Publishes an Imu message once all axes of the time tag were
+   * received, or the next time tag starts.
+   * @param m the message to process
+   */
   void callbackEsfMEAS(const ublox_msgs::EsfMEAS &m);
+
+  /**
+   * @brief Warn if the sensor time tags, in the configured unit, don't
+   * advance at about the rate of the host clock.
+   * @param time_tag the newest time tag
+   * @param arrival the arrival time of the message of the time tag
+   * @param unit the configured unit of the time tags [s]
+   * @param check the time tag the rate is measured from, updated every 10 s
+   * @param message the name of the message, for the warning
+   * @param param the parameter of the unit, for the warning
+   */
+  void checkTimeTagRate(uint32_t time_tag, const ros::Time& arrival,
+                        double unit, TimeTagCheck& check,
+                        const char* message, const char* param);
+
+  /**
+   * @brief Publish the samples of the pending time tag as an Imu message and
+   * its time tag as a TimeReference.
+   */
+  void publishImu();
+
+  /**
+   * @brief Publish each inertial sample of an ESF-RAW message as an Imu
+   * message, stamped with its sensor time tag in host time.
+   * @param m the message to process
+   */
+  void callbackEsfRAW(const ublox_msgs::EsfRAW &m);
+
+  /**
+   * @brief Queue the forward speed of an odometry message as sensor input.
+   * @param m the odometry of the vehicle
+   */
+  void callbackOdometry(const nav_msgs::Odometry::ConstPtr &m);
+
+  /**
+   * @brief Queue an ESF-MEAS input message, e.g. with wheel ticks, as is.
+   * @param m the sensor input
+   */
+  void callbackEsfInput(const ublox_msgs::EsfMEAS::ConstPtr &m);
+
+  /**
+   * @brief Queue a sensor input message, dropping the oldest if the queue is
+   * full.
+   * @param m the sensor input
+   * @param stamp the measurement time, used for the latency diagnostic
+   */
+  void queueEsfInput(const ublox_msgs::EsfMEAS &m, const ros::Time &stamp);
+
+  /**
+   * @brief Send the queued sensor input to the device in one write.
+   */
+  void sendEsfInput(const ros::TimerEvent& event);
+
+  //! Rate of the sensor input writes [Hz], 0 if the input is disabled
+  double esf_input_rate_ = 0;
+  //! Subscriber of the odometry input
+  ros::Subscriber odom_sub_;
+  //! Subscriber of the ESF-MEAS input
+  ros::Subscriber esf_input_sub_;
+  //! Sends the queued sensor input at esf_input_rate_
+  ros::Timer esf_input_timer_;
+  //! Sensor input to send with the next write
+  std::vector<ublox_msgs::EsfMEAS> esf_input_;
+  //! Measurement time of each message in esf_input_
+  std::vector<ros::Time> esf_input_stamps_;
+  //! Rate and latency of the sensor input
+  boost::shared_ptr<ublox_gps::RateDiagnostic> esf_input_diag_;
 };
 
 /**
@@ -1173,7 +1793,7 @@ class HpgRefProduct: public virtual ComponentInterface {
   void initializeRosDiagnostics();
 
   /**
-   * @brief Update the last received NavSVIN message and call diagnostic updater
+   * @brief Update the last received NavSVIN message for the diagnostics
    *
    * @details When the survey in finishes, it changes the measurement &
    * navigation rate to the user configured values and enables the user
@@ -1199,7 +1819,7 @@ class HpgRefProduct: public virtual ComponentInterface {
   bool setTimeMode();
 
   //! The last received Nav SVIN message
-  ublox_msgs::NavSVIN last_nav_svin_;
+  ublox_gps::LastValue<ublox_msgs::NavSVIN> last_nav_svin_;
 
   //! TMODE3 to set, such as disabled, survey-in, fixed
   uint8_t tmode3_;
@@ -1241,6 +1861,9 @@ class HpgRefProduct: public virtual ComponentInterface {
     SURVEY_IN, //!< Survey-In mode
     TIME //!< Time mode, after survey-in or after configuring fixed mode
   } mode_;
+
+  //! Whether to publish NavSVIN messages, resolved when subscribing
+  bool publish_nav_svin_ = false;
 };
 
 /**
@@ -1292,7 +1915,7 @@ class HpgRovProduct: public virtual ComponentInterface {
       diagnostic_updater::DiagnosticStatusWrapper& stat);
 
   /**
-   * @brief Set the last received message and call rover diagnostic updater
+   * @brief Set the last received message for the rover diagnostics
    *
    * @details Publish received NavRELPOSNED messages if enabled
    */
@@ -1300,7 +1923,7 @@ class HpgRovProduct: public virtual ComponentInterface {
 
 
   //! Last relative position (used for diagnostic updater)
-  ublox_msgs::NavRELPOSNED last_rel_pos_;
+  ublox_gps::LastValue<ublox_msgs::NavRELPOSNED> last_rel_pos_;
 
   //! The DGNSS mode
   /*! see CfgDGNSS message for possible values */
@@ -1308,6 +1931,9 @@ class HpgRovProduct: public virtual ComponentInterface {
 
   //! The RTCM topic frequency diagnostic updater
   UbloxTopicDiagnostic freq_rtcm_;
+
+  //! Whether to publish NavRELPOSNED messages, resolved when subscribing
+  bool publish_nav_relposned_ = false;
 };
 
 /**
@@ -1348,6 +1974,8 @@ class TimProduct: public virtual ComponentInterface {
   void callbackTimTM2(const ublox_msgs::TimTM2 &m);
  
   sensor_msgs::TimeReference t_ref_;
+  //! Whether to publish TimTM2 messages, resolved when subscribing
+  bool publish_tim_tm2_ = false;
 };
 
 }
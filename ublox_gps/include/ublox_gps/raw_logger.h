@@ -0,0 +1,555 @@
+//==============================================================================
+// Copyright (c) 2012, Johannes Meyer, TU Darmstadt
+// All rights reserved.
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * Neither the name of the Flight Systems and Automatic Control group,
+//       TU Darmstadt, nor the names of its contributors may be used to
+//       endorse or promote products derived from this software without
+//       specific prior written permission.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//==============================================================================
+
+#ifndef UBLOX_GPS_RAW_LOGGER_H
+#define UBLOX_GPS_RAW_LOGGER_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/atomic.hpp>
+#include <boost/lockfree/spsc_queue.hpp>
+#include <boost/thread/condition.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+#include <ros/console.h>
+#include <ros/time.h>
+
+#include <ublox_gps/log_index.h>
+#include <ublox_gps/log_reader.h>
+
+namespace ublox_gps {
+
+/**
+ * @brief Writes the raw data stream to log files from a dedicated thread.
+ *
+ * @details The I/O thread appends the received bytes to the current buffer
+ * and hands full buffers to the logger thread through a lock-free queue, and
+ * gets empty buffers back through a second one. It never waits for the disk:
+ * if the logger thread falls behind and no empty buffer is left, the data is
+ * dropped and counted. A partially filled buffer is handed over once its
+ * first byte is older than the flush period, by the I/O thread or, when no
+ * more data arrives, by the logger thread. A crash loses at most that much
+ * data plus what the kernel has not written back yet (see
+ * Options::sync_period).
+ *
+ * Log files are rotated by size and age. Each file is preallocated to the
+ * rotation size, so appending does not allocate blocks on the way.
+ *
+ * If enabled, the logger thread also writes an index next to each log file,
+ * see LogIndexWriter. The I/O thread only records when each piece of data
+ * arrived, the frames are parsed on the logger thread.
+ *
+ * If compression is enabled, the logger thread compresses each buffer into
+ * an independently decodable block and writes the block index next to the
+ * log file, see LogReader. Sizes and rotation then refer to the compressed
+ * file, offsets in the log index to the uncompressed data.
+ */
+class RawLogger {
+ public:
+  //! Logging options
+  struct Options {
+    //! Size of each buffer [bytes]
+    std::size_t buffer_size = 65536;
+    //! Number of buffers
+    std::size_t buffers = 16;
+    //! Age of the first byte at which a partial buffer is written [s]
+    double flush_period = 1.0;
+    //! Period of fdatasync [s], 0 after each buffer, negative to never sync
+    double sync_period = 5.0;
+    //! Size at which the log file is rotated [bytes], 0 to not rotate by size
+    uint64_t rotate_size = 0;
+    //! Age at which the log file is rotated [s], 0 to not rotate by age
+    double rotate_period = 0;
+    //! Whether to preallocate log files to rotate_size
+    bool preallocate = true;
+    //! Whether to write an index of each log file
+    bool index = false;
+    //! Index every index_interval-th frame, 0 to only index index_types
+    std::size_t index_interval = 100;
+    //! Types to index every frame of, as class_id << 8 | message_id
+    std::set<uint16_t> index_types;
+    //! Whether to compress the log, needs UBLOX_GPS_LOG_COMPRESSION
+    bool compress = false;
+    //! Zstandard compression level, 0 for the default
+    int compression_level = 0;
+  };
+
+  /**
+   * @brief Open the first log file and start the logger thread.
+   * @param dir the directory of the log files
+   * @param options the logging options
+   * @throws std::runtime_error if the log file can not be created
+   */
+  RawLogger(const std::string& dir, const Options& options)
+      : dir_(dir), options_(options), full_(options.buffers),
+        free_(options.buffers), buffers_(options.buffers), current_(0),
+        current_start_(0), queued_(0), dropped_(0), max_backlog_(0),
+        stopping_(false), fd_(-1), file_offset_(0), file_start_(0),
+        last_sync_(0), writes_(0), bytes_written_(0), write_time_(0),
+        max_write_time_(0), stats_start_(0),
+        index_(options.index_interval, options.index_types),
+        compressor_(options.compression_level), blocks_fd_(-1),
+        raw_offset_(0), raw_written_(0) {
+    if (options_.compress && logBlockCodec() == kLogBlockStored) {
+      ROS_WARN("U-Blox raw data log compression is not built in, see "
+               "UBLOX_GPS_LOG_COMPRESSION");
+      options_.compress = false;
+    }
+    if (!dir_.empty() && dir_[dir_.size() - 1] != '/')
+      dir_ += '/';
+    for (std::size_t i = 0; i < buffers_.size(); ++i) {
+      buffers_[i].data.reserve(options_.buffer_size);
+      if (options_.index) buffers_[i].marks.reserve(kMaxMarks);
+      free_.push(&buffers_[i]);
+    }
+    if (!openFile())
+      throw std::runtime_error("Can't create raw data log in " + dir_);
+    thread_.reset(new boost::thread(boost::bind(&RawLogger::run, this)));
+  }
+
+  /**
+   * @brief Write the remaining data, close the log file and stop the thread.
+   */
+  ~RawLogger() {
+    {
+      boost::mutex::scoped_lock lock(current_mutex_);
+      if (current_) handOff();
+    }
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      stopping_ = true;
+    }
+    condition_.notify_one();
+    thread_->join();
+    closeFile();
+    if (dropped_ > 0)
+      ROS_WARN("U-Blox raw data log dropped %lu bytes",
+               (unsigned long) dropped_.load());
+  }
+
+  /**
+   * @brief Append received bytes to the log. Never waits for the disk, only
+   * call from the I/O thread.
+   * @param data the received bytes
+   * @param size the number of bytes
+   */
+  void write(const unsigned char* data, std::size_t size) {
+    boost::mutex::scoped_lock lock(current_mutex_);
+    int64_t stamp = 0;
+    while (size > 0) {
+      if (!current_) {
+        if (!free_.pop(current_)) {
+          dropped_.fetch_add(size, boost::memory_order_relaxed);
+          return;
+        }
+        current_start_ = monotonicSeconds();
+      }
+      std::vector<unsigned char>& buffer = current_->data;
+      // Once the marks are full, the following data gets the last mark's time
+      if (options_.index && current_->marks.size() < kMaxMarks) {
+        if (stamp == 0) stamp = ros::Time::now().toNSec();
+        current_->marks.push_back(std::make_pair(buffer.size(), stamp));
+      }
+      std::size_t n = std::min(size, options_.buffer_size - buffer.size());
+      buffer.insert(buffer.end(), data, data + n);
+      data += n;
+      size -= n;
+      if (buffer.size() == options_.buffer_size) handOff();
+    }
+    if (current_ && !current_->data.empty()
+        && monotonicSeconds() - current_start_ >= options_.flush_period)
+      handOff();
+  }
+
+  /**
+   * @brief Get the name of a new log file in the directory, named after the
+   * local time.
+   * @param dir the directory, ending with a '/'
+   * @param extension the extension, .logz for compressed logs
+   */
+  static std::string fileName(const std::string& dir,
+                              const std::string& extension = ".log") {
+    time_t t = time(NULL);
+    struct tm time_struct;
+    localtime_r(&t, &time_struct);
+    char name[32];
+    strftime(name, sizeof(name), "%Y_%m_%d_%H%M%S", &time_struct);
+    std::string base = dir + name;
+    // Files rotated within the same second get a counter
+    std::string file_name = base + extension;
+    struct stat stat_info;
+    for (int i = 1; stat(file_name.c_str(), &stat_info) == 0; ++i) {
+      char suffix[16];
+      snprintf(suffix, sizeof(suffix), "_%d", i);
+      file_name = base + suffix + extension;
+    }
+    return file_name;
+  }
+
+ private:
+  //! Data handed to the logger thread
+  struct Buffer {
+    //! The received bytes
+    std::vector<unsigned char> data;
+    //! Where each write started in data and when it was received [ns], only
+    //! recorded if the log is indexed
+    std::vector<std::pair<std::size_t, int64_t> > marks;
+  };
+  //! Period of the write latency and backlog reports [s]
+  constexpr static double kStatsPeriod = 60.0;
+  //! Number of arrival times recorded per buffer, so writes do not allocate
+  static const std::size_t kMaxMarks = 1024;
+
+  /**
+   * @brief Get the time of the monotonic clock in seconds.
+   */
+  static double monotonicSeconds() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+  }
+
+  /**
+   * @brief Pass the current buffer to the logger thread. Call with
+   * current_mutex_ locked.
+   */
+  void handOff() {
+    full_.push(current_);
+    current_ = 0;
+    std::size_t backlog = queued_.fetch_add(1, boost::memory_order_relaxed)
+                          + 1;
+    std::size_t max = max_backlog_.load(boost::memory_order_relaxed);
+    while (backlog > max && !max_backlog_.compare_exchange_weak(
+        max, backlog, boost::memory_order_relaxed)) {}
+    // The logger thread only holds the lock while it checks for work
+    boost::mutex::scoped_lock lock(mutex_);
+    condition_.notify_one();
+  }
+
+  /**
+   * @brief Write the handed off buffers until the logger is destroyed.
+   */
+  void run() {
+    while (true) {
+      Buffer* buffer;
+      while (full_.pop(buffer)) {
+        queued_.fetch_sub(1, boost::memory_order_relaxed);
+        writeBuffer(*buffer);
+        buffer->data.clear();
+        buffer->marks.clear();
+        free_.push(buffer);
+      }
+      flushStale();
+      sync(false);
+      reportStats();
+
+      boost::mutex::scoped_lock lock(mutex_);
+      if (full_.read_available() > 0) continue;
+      if (stopping_) break;
+      // Wake up in time to flush a buffer the I/O thread stopped filling
+      double wait = std::max(0.01, std::min(1.0, options_.flush_period / 2));
+      condition_.timed_wait(
+          lock, boost::posix_time::microseconds(int64_t(wait * 1e6)));
+    }
+  }
+
+  /**
+   * @brief Hand off the current buffer if its first byte is older than the
+   * flush period, when the I/O thread does not write anymore.
+   */
+  void flushStale() {
+    boost::mutex::scoped_lock lock(current_mutex_);
+    if (current_ && !current_->data.empty()
+        && monotonicSeconds() - current_start_ >= options_.flush_period)
+      handOff();
+  }
+
+  /**
+   * @brief Write a buffer to the log, rotating the file first if needed.
+   */
+  void writeBuffer(const Buffer& buffer) {
+    double now = monotonicSeconds();
+    const std::vector<unsigned char>* out = &buffer.data;
+    if (options_.compress) {
+      compressor_.compress(buffer.data.data(), buffer.data.size(),
+                           compressed_);
+      out = &compressed_;
+    }
+    const std::vector<unsigned char>& data = *out;
+    if ((options_.rotate_size > 0
+         && file_offset_ + data.size() > options_.rotate_size)
+        || (options_.rotate_period > 0
+            && now - file_start_ >= options_.rotate_period)) {
+      closeFile();
+      openFile();
+    }
+    if (fd_ < 0) {
+      dropped_.fetch_add(buffer.data.size(), boost::memory_order_relaxed);
+      return;
+    }
+
+    std::size_t offset = 0;
+    while (offset < data.size()) {
+      ssize_t n = ::write(fd_, data.data() + offset, data.size() - offset);
+      if (n < 0) {
+        if (errno == EINTR) continue;
+        ROS_ERROR_THROTTLE(10, "U-Blox raw data log write error: %s",
+                           strerror(errno));
+        break;
+      }
+      offset += n;
+    }
+    std::size_t raw_size = offset;
+    if (options_.compress && offset == data.size()) {
+      raw_size = buffer.data.size();
+      writeBlockEntry();
+    } else if (options_.compress) {
+      // Remove the partially written block, the blocks after it would not
+      // be found otherwise
+      raw_size = 0;
+      if (offset > 0 && (ftruncate(fd_, file_offset_) != 0
+                         || lseek(fd_, file_offset_, SEEK_SET) < 0))
+        ROS_ERROR_THROTTLE(10, "U-Blox raw data log truncate error: %s",
+                           strerror(errno));
+      offset = 0;
+    }
+    dropped_.fetch_add(buffer.data.size() - raw_size,
+                       boost::memory_order_relaxed);
+    file_offset_ += offset;
+    index(buffer, raw_size);
+
+    double write_time = monotonicSeconds() - now;
+    ++writes_;
+    bytes_written_ += offset;
+    raw_written_ += raw_size;
+    write_time_ += write_time;
+    max_write_time_ = std::max(max_write_time_, write_time);
+    if (options_.sync_period == 0) sync(true);
+  }
+
+  /**
+   * @brief Add the block which was just written to the block index.
+   */
+  void writeBlockEntry() {
+    LogBlockEntry entry;
+    entry.offset = raw_offset_;
+    entry.file_offset = file_offset_;
+    raw_offset_ += reinterpret_cast<const LogBlockHeader*>(
+        compressed_.data())->raw_size;
+    if (blocks_fd_ >= 0
+        && ::write(blocks_fd_, &entry, sizeof(entry)) != sizeof(entry))
+      ROS_ERROR_THROTTLE(10, "U-Blox raw data log block index write error: "
+                         "%s", strerror(errno));
+  }
+
+  /**
+   * @brief Index the written part of a buffer.
+   * @param buffer the buffer
+   * @param size the number of bytes of the buffer which were written
+   */
+  void index(const Buffer& buffer, std::size_t size) {
+    if (!options_.index) return;
+    const std::vector<std::pair<std::size_t, int64_t> >& marks = buffer.marks;
+    for (std::size_t i = 0; i < marks.size() && marks[i].first < size; ++i) {
+      std::size_t end = i + 1 < marks.size()
+                        ? std::min(marks[i + 1].first, size) : size;
+      index_.add(buffer.data.data() + marks[i].first, end - marks[i].first,
+                 marks[i].second);
+    }
+    index_.flush();
+  }
+
+  /**
+   * @brief Sync the log file if the sync period elapsed.
+   * @param force whether to sync regardless of the period
+   */
+  void sync(bool force) {
+    if (fd_ < 0 || options_.sync_period < 0) return;
+    double now = monotonicSeconds();
+    if (!force && now - last_sync_ < options_.sync_period) return;
+    fdatasync(fd_);
+    last_sync_ = now;
+  }
+
+  /**
+   * @brief Create a new log file.
+   * @return true if the file was created
+   */
+  bool openFile() {
+    file_name_ = fileName(dir_, options_.compress ? ".logz" : ".log");
+    fd_ = ::open(file_name_.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    file_offset_ = 0;
+    raw_offset_ = 0;
+    file_start_ = last_sync_ = monotonicSeconds();
+    if (fd_ < 0) {
+      ROS_ERROR("Can't create raw data log \"%s\": %s", file_name_.c_str(),
+                strerror(errno));
+      return false;
+    }
+    // Allocate the blocks up front, the file size stays 0
+    if (options_.preallocate && options_.rotate_size > 0
+        && fallocate(fd_, FALLOC_FL_KEEP_SIZE, 0, options_.rotate_size) != 0)
+      ROS_DEBUG("Can't preallocate raw data log: %s", strerror(errno));
+    if (options_.index) index_.open(file_name_);
+    if (options_.compress) {
+      std::string blocks_name = logBlocksName(file_name_);
+      blocks_fd_ = ::open(blocks_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC,
+                          0644);
+      if (blocks_fd_ < 0)
+        ROS_ERROR("Can't create raw data log block index \"%s\": %s",
+                  blocks_name.c_str(), strerror(errno));
+    }
+    ROS_INFO("Logging raw data to file \"%s\"", file_name_.c_str());
+    return true;
+  }
+
+  /**
+   * @brief Sync and close the log file, releasing unused preallocated blocks.
+   */
+  void closeFile() {
+    if (fd_ < 0) return;
+    if (options_.preallocate && options_.rotate_size > 0
+        && ftruncate(fd_, file_offset_) != 0)
+      ROS_DEBUG("Can't truncate raw data log: %s", strerror(errno));
+    sync(true);
+    ::close(fd_);
+    fd_ = -1;
+    index_.close();
+    if (blocks_fd_ >= 0) ::close(blocks_fd_);
+    blocks_fd_ = -1;
+  }
+
+  /**
+   * @brief Log the write latency, throughput and backlog, once per
+   * kStatsPeriod.
+   */
+  void reportStats() {
+    double now = monotonicSeconds();
+    if (stats_start_ == 0) {
+      stats_start_ = now;
+      return;
+    }
+    double period = now - stats_start_;
+    if (period < kStatsPeriod) return;
+
+    ROS_INFO("U-Blox raw data log: %.1f kB/s (compression ratio %.2f) in "
+             "%lu writes, write latency %.2f ms mean, %.2f ms max, backlog "
+             "%lu of %lu buffers, %lu bytes dropped",
+             bytes_written_ / period * 1e-3,
+             bytes_written_ > 0 ? (double) raw_written_ / bytes_written_
+                                : 1.0,
+             (unsigned long) writes_,
+             writes_ > 0 ? write_time_ / writes_ * 1e3 : 0.0,
+             max_write_time_ * 1e3,
+             (unsigned long) max_backlog_.exchange(0),
+             (unsigned long) buffers_.size(),
+             (unsigned long) dropped_.load());
+    if (max_write_time_ > options_.flush_period)
+      ROS_WARN("U-Blox raw data log: a write took %.2f s",
+               max_write_time_);
+    writes_ = 0;
+    bytes_written_ = 0;
+    raw_written_ = 0;
+    write_time_ = 0;
+    max_write_time_ = 0;
+    stats_start_ = now;
+  }
+
+  //! The directory of the log files, ending with a '/'
+  std::string dir_;
+  //! Logging options
+  Options options_;
+
+  //! Buffers handed to the logger thread, pushed with current_mutex_ locked
+  boost::lockfree::spsc_queue<Buffer*> full_;
+  //! Empty buffers handed back to the I/O thread
+  boost::lockfree::spsc_queue<Buffer*> free_;
+  //! Storage of the buffers
+  std::vector<Buffer> buffers_;
+
+  // I/O thread, and the logger thread to flush
+  //! Lock for current_ and current_start_, only contended when the logger
+  //! thread checks the age of the current buffer
+  boost::mutex current_mutex_;
+  //! The buffer being filled, null if none is held
+  Buffer* current_;
+  //! When the first byte of current_ was received [s, monotonic]
+  double current_start_;
+
+  // Shared
+  //! Number of buffers handed off and not written yet
+  boost::atomic<std::size_t> queued_;
+  //! Number of bytes which could not be logged
+  boost::atomic<uint64_t> dropped_;
+  //! Largest backlog since the last report [buffers]
+  boost::atomic<std::size_t> max_backlog_;
+  //! Lock for stopping_ and the wait of the logger thread
+  boost::mutex mutex_;
+  //! Wakes the logger thread
+  boost::condition condition_;
+  //! Whether the logger is being destroyed
+  bool stopping_;
+  //! The logger thread
+  boost::shared_ptr<boost::thread> thread_;
+
+  // Logger thread
+  std::string file_name_; //!< Name of the current log file
+  int fd_; //!< The current log file, -1 if it could not be created
+  uint64_t file_offset_; //!< Number of bytes in the current log file
+  double file_start_; //!< When the current log file was created [s]
+  double last_sync_; //!< When the log file was last synced [s]
+  std::size_t writes_; //!< Number of writes since the last report
+  uint64_t bytes_written_; //!< Bytes written since the last report
+  double write_time_; //!< Time spent writing since the last report [s]
+  double max_write_time_; //!< Longest write since the last report [s]
+  double stats_start_; //!< Start of the report period [s]
+  LogIndexWriter index_; //!< Writes the index of the current log file
+  LogBlockCompressor compressor_; //!< Compresses the buffers into blocks
+  std::vector<unsigned char> compressed_; //!< The block being written
+  int blocks_fd_; //!< The block index of the current log file, or -1
+  uint64_t raw_offset_; //!< Uncompressed bytes in the current log file
+  uint64_t raw_written_; //!< Uncompressed bytes since the last report
+};
+
+}  // namespace ublox_gps
+
+#endif  // UBLOX_GPS_RAW_LOGGER_H
@@ -0,0 +1,493 @@
+//==============================================================================
+// Copyright (c) 2012, Johannes Meyer, TU Darmstadt
+// All rights reserved.
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * Neither the name of the Flight Systems and Automatic Control group,
+//       TU Darmstadt, nor the names of its contributors may be used to
+//       endorse or promote products derived from this software without
+//       specific prior written permission.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//==============================================================================
+
+#ifndef UBLOX_GPS_REPLAY_WORKER_H
+#define UBLOX_GPS_REPLAY_WORKER_H
+
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/condition.hpp>
+
+#include <ros/console.h>
+#include <ros/time.h>
+
+#include <ublox_gps/log_index.h>
+#include <ublox_gps/log_reader.h>
+
+#include "worker.h"
+
+namespace ublox_gps {
+
+/**
+ * @brief Replays a raw data log through the read callbacks, instead of
+ * reading a device.
+ *
+ * @details The log is read with a LogReader, so it may be compressed, and
+ * copied piecewise into the input buffer from a dedicated thread, like the
+ * bytes read by the other workers.
+ * If the log has an index (see LogIndexWriter), each indexed frame and the
+ * bytes before it are delivered at the recorded arrival time of the frame,
+ * scaled by the replay speed, and are stamped with that time. Otherwise, or
+ * if the speed is 0, the log is replayed as fast as the callbacks process it.
+ *
+ * Data is only delivered after start(), so that the callbacks can be
+ * subscribed first. Polls sent before that are answered with the first
+ * message of the polled type in the log, e.g. MON-VER. The first frame of
+ * each type is taken from the index, or found by scanning the log once when
+ * it is opened without index, or when a type is polled which is not indexed.
+ * Configuration messages are acknowledged without effect, everything else
+ * which is sent is discarded.
+ */
+class ReplayWorker : public Worker {
+ public:
+  typedef boost::mutex Mutex;
+  typedef boost::mutex::scoped_lock ScopedLock;
+
+  /**
+   * @brief Map the log file and start the replay thread, which waits for
+   * start().
+   * @param log_name the name of the log file
+   * @param speed the replay speed relative to the recording, 0 to replay as
+   * fast as possible
+   * @throws std::runtime_error if the log can not be mapped
+   */
+  ReplayWorker(const std::string& log_name, double speed = 1.0)
+      : log_(log_name), size_(log_.size()), speed_(speed),
+        in_buffer_size_(0), started_(false), stopping_(false),
+        finished_(false), replayed_(0), scanned_(false) {
+    log_.advise(MADV_SEQUENTIAL);
+
+    try {
+      LogIndex index(log_name);
+      chunks_.reserve(index.size() + 1);
+      for (std::size_t i = 0; i < index.size(); ++i) {
+        uint64_t end = index[i].offset + index[i].length + 8;
+        if (end > size_) break;
+        chunks_.push_back(std::make_pair(end, index[i].stamp));
+        first_frames_.insert(std::make_pair(
+            index[i].class_id << 8 | index[i].message_id,
+            std::make_pair(index[i].offset, index[i].length)));
+      }
+      ROS_INFO("U-Blox: Replaying %s with %lu index entries",
+               log_name.c_str(), (unsigned long) chunks_.size());
+    } catch (std::runtime_error& e) {
+      ROS_INFO("U-Blox: Replaying %s without index: %s", log_name.c_str(),
+               e.what());
+      if (speed_ > 0)
+        ROS_WARN("U-Blox: Replaying %s as fast as possible, real time "
+                 "replay needs the log index", log_name.c_str());
+    }
+    // The bytes after the last indexed frame arrived no earlier than it
+    int64_t last = chunks_.empty() ? 0 : chunks_.back().second;
+    if (chunks_.empty() || chunks_.back().first < size_)
+      chunks_.push_back(std::make_pair(size_, last));
+    if (first_frames_.empty()) scanFrames();
+
+    background_thread_.reset(
+        new boost::thread(boost::bind(&ReplayWorker::run, this)));
+  }
+
+  virtual ~ReplayWorker() {
+    {
+      ScopedLock lock(state_mutex_);
+      stopping_ = true;
+    }
+    state_condition_.notify_all();
+    background_thread_->join();
+  }
+
+  /**
+   * @brief Set the callback function which handles input messages.
+   * @param callback the read callback which handles received messages
+   */
+  void setCallback(const ReadCallback& callback) { read_callback_ = callback; }
+
+  /**
+   * @brief Set the callback function which handles raw data.
+   * @param callback the write callback which handles raw data
+   */
+  void setRawDataCallback(const Callback& callback) {
+    write_callback_ = callback;
+  }
+
+  /**
+   * @brief Acknowledge configuration messages and answer polls from the log
+   * if the replay has not started, otherwise discard the data.
+   * @param data the buffer of data bytes to send
+   * @param size the size of the buffer
+   * @return true
+   */
+  bool send(const unsigned char* data, const unsigned int size) {
+    if (size < 8 || data[0] != 0xB5 || data[1] != 0x62) return true;
+    uint8_t class_id = data[2], message_id = data[3];
+    uint16_t length = data[4] | data[5] << 8;
+    std::vector<unsigned char> response;
+    if (class_id == kCfgClass && length > 0) {
+      const unsigned char ack[] = {kAckClass, kAckId, 2, 0, class_id,
+                                   message_id};
+      response.assign(ack, ack + sizeof(ack));
+      frame(response);
+    } else if (length == 0 && !started()) {
+      // Without holding state_mutex_, the replay thread keeps responding
+      if (!findFrame(class_id, message_id, response)) {
+        ROS_WARN("U-Blox: Replayed log has no response to poll "
+                 "0x%02x / 0x%02x", class_id, message_id);
+        return true;
+      }
+    } else {
+      return true;
+    }
+    ScopedLock lock(state_mutex_);
+    // Respond after the caller waits for the response, like a device
+    int delay_ms = kResponseDelayMs;
+    responses_.push_back(std::make_pair(
+        boost::posix_time::microsec_clock::universal_time()
+        + boost::posix_time::milliseconds(delay_ms), response));
+    state_condition_.notify_all();
+    return true;
+  }
+
+  /**
+   * @brief Wait for incoming messages.
+   * @param timeout the maximum time to wait
+   */
+  void wait(const boost::posix_time::time_duration& timeout) {
+    ScopedLock lock(read_mutex_);
+    read_condition_.timed_wait(lock, timeout);
+  }
+
+  /**
+   * @brief Whether the log has not been replayed completely.
+   */
+  bool isOpen() const { return !finished_; }
+
+  /**
+   * @brief Whether the replay was started.
+   */
+  bool started() {
+    ScopedLock lock(state_mutex_);
+    return started_;
+  }
+
+  /**
+   * @brief Start the replay of the log.
+   */
+  void start() {
+    {
+      ScopedLock lock(state_mutex_);
+      started_ = true;
+    }
+    state_condition_.notify_all();
+  }
+
+ private:
+  //! Size of the pieces the log is scanned in for poll responses [bytes]
+  static const uint64_t kScanSize = 1 << 20;
+  //! Size of the pieces the log is read in [bytes]
+  static const uint64_t kReadSize = 1 << 20;
+  //! Size of the pieces the log is delivered in [bytes]
+  static const std::size_t kChunkSize = 8192;
+  //! Delay of the responses to sent messages [ms]
+  static const int kResponseDelayMs = 5;
+  //! The u-blox classes & message ID the worker responds to
+  static const uint8_t kCfgClass = 0x06;
+  static const uint8_t kAckClass = 0x05;
+  static const uint8_t kAckId = 0x01;
+
+  //! Offset and payload length of the first frame of each type, by
+  //! class_id << 8 | message_id
+  typedef std::map<uint16_t, std::pair<uint64_t, uint16_t> > FirstFrames;
+
+  //! Records the first frame of each type, see UbxFramer::parse
+  struct FirstFrameFinder {
+    explicit FirstFrameFinder(FirstFrames& frames) : frames(frames) {}
+
+    void operator()(uint64_t offset, uint8_t class_id, uint8_t message_id,
+                    uint16_t length, uint32_t iTOW) {
+      frames.insert(std::make_pair(class_id << 8 | message_id,
+                                   std::make_pair(offset, length)));
+    }
+
+    FirstFrames& frames; //!< The first frames found so far
+  };
+
+  /**
+   * @brief Find the first frame of each type by scanning the whole log.
+   * Call with frames_mutex_ locked, or from the constructor.
+   */
+  void scanFrames() {
+    scanned_ = true;
+    FirstFrameFinder finder(first_frames_);
+    UbxFramer framer;
+    std::vector<uint8_t> buffer;
+    try {
+      for (uint64_t offset = 0; offset < size_; offset += kScanSize) {
+        uint64_t n = size_ - offset;
+        if (n > kScanSize) n = kScanSize;
+        framer.parse(log_.read(offset, n, buffer), n, offset, finder);
+      }
+    } catch (std::runtime_error& e) {
+      ROS_ERROR("U-Blox: Can't scan the replayed log for poll responses: %s",
+                e.what());
+    }
+  }
+
+  /**
+   * @brief Get the first frame of a message type in the log.
+   * @param frame set to the bytes of the frame
+   * @return true if the log has a frame of the type
+   */
+  bool findFrame(uint8_t class_id, uint8_t message_id,
+                 std::vector<unsigned char>& frame) {
+    std::pair<uint64_t, uint16_t> found;
+    {
+      ScopedLock lock(frames_mutex_);
+      uint16_t type = class_id << 8 | message_id;
+      FirstFrames::const_iterator it = first_frames_.find(type);
+      // The index may not have every type
+      if (it == first_frames_.end() && !scanned_) {
+        scanFrames();
+        it = first_frames_.find(type);
+      }
+      if (it == first_frames_.end()) return false;
+      found = it->second;
+    }
+    std::vector<uint8_t> buffer;
+    try {
+      const uint8_t* data = log_.read(found.first, found.second + 8, buffer);
+      frame.assign(data, data + found.second + 8);
+    } catch (std::runtime_error& e) {
+      ROS_ERROR("U-Blox: Can't read the response to poll 0x%02x / 0x%02x: "
+                "%s", class_id, message_id, e.what());
+      return false;
+    }
+    return true;
+  }
+
+  /**
+   * @brief Add the sync characters and the checksum to a message.
+   * @param bytes the class & message ID, length and payload, set to the frame
+   */
+  static void frame(std::vector<unsigned char>& bytes) {
+    uint8_t ck_a = 0, ck_b = 0;
+    for (std::size_t i = 0; i < bytes.size(); ++i) {
+      ck_a += bytes[i];
+      ck_b += ck_a;
+    }
+    bytes.insert(bytes.begin(), 0x62);
+    bytes.insert(bytes.begin(), 0xB5);
+    bytes.push_back(ck_a);
+    bytes.push_back(ck_b);
+  }
+
+  /**
+   * @brief Deliver the responses to sent messages.
+   * @param lock the lock of state_mutex_, released while delivering
+   * @param all whether to deliver the responses which are not due yet
+   */
+  void respond(ScopedLock& lock, bool all) {
+    while (!responses_.empty()) {
+      if (!all && boost::posix_time::microsec_clock::universal_time()
+          < responses_.front().first)
+        return;
+      std::vector<unsigned char> response;
+      response.swap(responses_.front().second);
+      responses_.pop_front();
+      lock.unlock();
+      deliver(response.data(), response.size(), ros::Time::now());
+      lock.lock();
+    }
+  }
+
+  /**
+   * @brief Answer polls until the replay starts, then replay the log.
+   */
+  void run() {
+    {
+      ScopedLock lock(state_mutex_);
+      while (!started_ && !stopping_) {
+        respond(lock, false);
+        if (started_ || stopping_) break;
+        if (responses_.empty())
+          state_condition_.wait(lock);
+        else
+          state_condition_.timed_wait(lock, responses_.front().first);
+      }
+      if (stopping_) return;
+    }
+    replay();
+  }
+
+  /**
+   * @brief Deliver the log chunk by chunk, at the scaled arrival times if
+   * they are known.
+   */
+  void replay() {
+    boost::posix_time::ptime wall_start =
+        boost::posix_time::microsec_clock::universal_time();
+    ros::Time ros_start = ros::Time::now();
+    int64_t first = chunks_.front().second;
+    double scale = speed_ > 0 ? 1.0 / speed_ : 1.0;
+
+    uint64_t offset = 0;
+    try {
+      for (std::size_t i = 0; i < chunks_.size(); ++i) {
+        int64_t recorded = chunks_[i].second;
+        ros::Time stamp = ros::Time::now();
+        boost::posix_time::ptime until = wall_start;
+        if (recorded != 0 && first != 0) {
+          double elapsed = (recorded - first) * 1e-9 * scale;
+          stamp = ros_start + ros::Duration(elapsed);
+          if (speed_ > 0)
+            until += boost::posix_time::microseconds(
+                (int64_t) (elapsed * 1e6));
+        }
+        while (offset < chunks_[i].first && !stopping_) {
+          uint64_t size = chunks_[i].first - offset;
+          if (size > kReadSize) size = kReadSize;
+          const unsigned char* data = log_.read(offset, size, read_buffer_);
+          for (uint64_t end = offset + size;
+               offset < end && sleepUntil(until);) {
+            uint64_t n = end - offset;
+            if (n > kChunkSize) n = kChunkSize;
+            deliver(data, n, stamp);
+            data += n;
+            offset += n;
+            replayed_ += n;
+          }
+        }
+        if (stopping_) break;
+      }
+    } catch (std::runtime_error& e) {
+      // e.g. a corrupt compressed block, the replay ends there
+      ROS_ERROR("U-Blox: Stopping the replay at byte %lu: %s",
+                (unsigned long) offset, e.what());
+    }
+
+    double duration = (boost::posix_time::microsec_clock::universal_time()
+                       - wall_start).total_microseconds() * 1e-6;
+    ROS_INFO("U-Blox: Replayed %lu bytes in %.3f s (%.1f MB/s)",
+             (unsigned long) replayed_, duration,
+             duration > 0 ? replayed_ / duration * 1e-6 : 0.0);
+    finished_ = true;
+    read_condition_.notify_all();
+  }
+
+  /**
+   * @brief Wait until the given time, or until the worker is destroyed,
+   * delivering the responses to sent messages meanwhile.
+   * @return false if the worker is being destroyed
+   */
+  bool sleepUntil(const boost::posix_time::ptime& until) {
+    ScopedLock lock(state_mutex_);
+    while (!stopping_ &&
+           boost::posix_time::microsec_clock::universal_time() < until) {
+      respond(lock, true);
+      state_condition_.timed_wait(lock, until);
+    }
+    respond(lock, true);
+    return !stopping_;
+  }
+
+  /**
+   * @brief Copy bytes of the log to the input buffer and process them.
+   * @param data the bytes
+   * @param size the number of bytes
+   * @param stamp the arrival time of the bytes
+   */
+  void deliver(const unsigned char* data, std::size_t size,
+               const ros::Time& stamp) {
+    ScopedLock lock(read_mutex_);
+    if (in_.size() < in_buffer_size_ + size)
+      in_.resize(in_buffer_size_ + size);
+    std::copy(data, data + size, in_.begin() + in_buffer_size_);
+    in_buffer_size_ += size;
+    arrivals_.add(in_buffer_size_, stamp);
+
+    if (write_callback_) {
+      std::size_t n = size;
+      write_callback_(in_.data() + in_buffer_size_ - size, n, stamp);
+    }
+    if (read_callback_) {
+      std::size_t buffer_size = in_buffer_size_;
+      read_callback_(in_.data(), in_buffer_size_, arrivals_);
+      arrivals_.consume(buffer_size - in_buffer_size_);
+    }
+    read_condition_.notify_all();
+  }
+
+  LogReader log_; //!< The log
+  uint64_t size_; //!< Size of the uncompressed log [bytes]
+  std::vector<unsigned char> read_buffer_; //!< Decompressed log blocks
+  double speed_; //!< Replay speed relative to the recording, 0 for maximum
+  //! End offset and recorded arrival time of each chunk [ns], 0 if unknown
+  std::vector<std::pair<uint64_t, int64_t> > chunks_;
+
+  Mutex read_mutex_; //!< Lock for the input buffer
+  boost::condition read_condition_;
+  std::vector<unsigned char> in_; //!< The input buffer
+  std::size_t in_buffer_size_; //!< number of bytes currently in the input
+                               //!< buffer
+  ArrivalTimes arrivals_; //!< Arrival times of the bytes in the input buffer
+
+  Mutex state_mutex_; //!< Lock for the replay state and poll responses
+  boost::condition state_condition_; //!< Wakes the replay thread
+  bool started_; //!< Whether start() was called
+  boost::atomic<bool> stopping_; //!< Whether or not the worker is being
+                                 //!< destroyed
+  boost::atomic<bool> finished_; //!< Whether the whole log was replayed
+  //! When to respond to sent messages, and the responses
+  std::deque<std::pair<boost::posix_time::ptime,
+                       std::vector<unsigned char> > > responses_;
+
+  boost::shared_ptr<boost::thread> background_thread_; //!< the replay thread
+  ReadCallback read_callback_; //!< Callback function to handle received
+                               //!< messages
+  Callback write_callback_; //!< Callback function to handle raw data
+  uint64_t replayed_; //!< Number of bytes replayed
+
+  Mutex frames_mutex_; //!< Lock for first_frames_ and scanned_
+  FirstFrames first_frames_; //!< The first frame of each type in the log
+  //! Whether first_frames_ has every type, not only the indexed ones
+  bool scanned_;
+};
+
+}  // namespace ublox_gps
+
+#endif  // UBLOX_GPS_REPLAY_WORKER_H
@@ -0,0 +1,865 @@
+//==============================================================================
+// Copyright (c) 2012, Johannes Meyer, TU Darmstadt
+// All rights reserved.
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * Neither the name of the Flight Systems and Automatic Control group,
+//       TU Darmstadt, nor the names of its contributors may be used to
+//       endorse or promote products derived from this software without
+//       specific prior written permission.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//==============================================================================
+
+#ifndef UBLOX_GPS_RINEX_WRITER_H
+#define UBLOX_GPS_RINEX_WRITER_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/condition.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+#include <ros/console.h>
+
+#include <ublox_msgs/RxmRAWX.h>
+#include <ublox_msgs/RxmSFRBX.h>
+
+namespace ublox_gps {
+
+/**
+ * @brief Format a number right aligned into a fixed width field, like the
+ * Fortran F format.
+ *
+ * @details Only uses integer arithmetic, which is several times faster than
+ * printf. The field is left blank if the value does not fit.
+ * @param out the field, exactly width characters are written
+ * @param value the value
+ * @param width the width of the field, must be larger than decimals + 1
+ * @param decimals the number of decimals, at most 9
+ */
+inline void formatFixed(char* out, double value, int width, int decimals) {
+  static const double kScales[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7,
+                                   1e8, 1e9};
+  double scaled = value * kScales[decimals];
+  if (!(std::fabs(scaled) < 9e18)) {
+    memset(out, ' ', width);
+    return;
+  }
+  long long n = llround(scaled);
+  bool negative = n < 0;
+  unsigned long long digits = negative ? -n : n;
+  char* p = out + width;
+  for (int i = 0; i < decimals; ++i) {
+    *--p = '0' + digits % 10;
+    digits /= 10;
+  }
+  if (decimals > 0) *--p = '.';
+  do {
+    *--p = '0' + digits % 10;
+    digits /= 10;
+  } while (digits > 0 && p > out);
+  if (digits > 0 || (negative && p == out)) {
+    memset(out, ' ', width);
+    return;
+  }
+  if (negative) *--p = '-';
+  while (p > out) *--p = ' ';
+}
+
+/**
+ * @brief Format an integer right aligned into a fixed width field.
+ * @param out the field, exactly width characters are written
+ * @param value the value
+ * @param width the width of the field
+ * @param fill the padding, '0' to zero pad non negative values
+ */
+inline void formatInt(char* out, long value, int width, char fill = ' ') {
+  formatFixed(out, value, width, 0);
+  for (int i = 0; i < width && out[i] == ' '; ++i) out[i] = fill;
+}
+
+/**
+ * @brief Writes RINEX 3 observation and navigation files from RXM-RAWX and
+ * RXM-SFRBX messages.
+ *
+ * @details The epochs and ephemerides are formatted on the calling thread,
+ * with formatFixed for the observations, and handed as text to a writer
+ * thread, which writes them at most once per flush period. Both files are
+ * rotated at multiples of the rotation period in GPS time, and named after
+ * the RINEX 3 long file name convention. The first files are named after
+ * their first epoch.
+ *
+ * The observation types of each system are all signals the receiver can
+ * track, see the constructor, so they don't depend on what is tracked when a file
+ * is opened. Trailing blank observations are omitted. The loss of lock
+ * indicator is set if the carrier phase lock time decreased and the half
+ * cycle flag if the half cycle ambiguity is not resolved.
+ *
+ * Only the GPS and QZSS LNAV ephemerides are decoded from the subframes.
+ * Each new navigation file starts with the latest ephemeris of each
+ * satellite.
+ */
+class RinexWriter {
+ public:
+  //! Output options
+  struct Options {
+    //! Nine character station name of the file names
+    std::string station = "UBLX00XXX";
+    //! Marker name of the headers
+    std::string marker = "UBLX";
+    //! Receiver type of the observation header
+    std::string receiver = "U-BLOX";
+    //! Antenna type of the observation header
+    std::string antenna = "";
+    //! Nominal measurement interval [s], 0 if unknown
+    double interval = 0;
+    //! Period at which the files are rotated [s], 0 to not rotate
+    int rotate_period = 3600;
+    //! Period at which the formatted text is written [s]
+    double flush_period = 1.0;
+  };
+
+  /**
+   * @brief Start the writer thread, the files are created with the first
+   * epoch.
+   * @param dir the directory of the files
+   * @param options the output options
+   */
+  RinexWriter(const std::string& dir, const Options& options)
+      : dir_(dir), options_(options), period_(-1), week_(0), leap_(-1),
+        lines_used_(0), stopping_(false) {
+    if (!dir_.empty() && dir_[dir_.size() - 1] != '/')
+      dir_ += '/';
+    // Signals of all u-blox receivers, the signal ID is 0 before protocol 27
+    static const Signal kSignals[] = {
+      {0, 0, "1C"}, {0, 3, "2L"}, {0, 4, "2S"}, {0, 6, "5I"}, {0, 7, "5Q"},
+      {1, 0, "1C"},
+      {2, 0, "1C"}, {2, 1, "1B"}, {2, 3, "5I"}, {2, 4, "5Q"}, {2, 5, "7I"},
+      {2, 6, "7Q"},
+      {3, 0, "2I"}, {3, 1, "2I"}, {3, 2, "7I"}, {3, 3, "7I"},
+      {5, 0, "1C"}, {5, 1, "1Z"}, {5, 4, "2S"}, {5, 5, "2L"}, {5, 8, "5I"},
+      {5, 9, "5Q"},
+      {6, 0, "1C"}, {6, 2, "2C"},
+      {7, 0, "5A"}};
+    for (std::size_t i = 0; i < sizeof(kSignals) / sizeof(kSignals[0]);
+         ++i) {
+      const Signal& signal = kSignals[i];
+      std::vector<std::string>& codes = codes_[signal.gnss_id];
+      std::size_t slot = 0;
+      while (slot < codes.size() && codes[slot] != signal.code) ++slot;
+      if (slot == codes.size()) codes.push_back(signal.code);
+      slots_[signal.gnss_id][signal.sig_id] = slot;
+    }
+    for (int i = 0; i < 2; ++i) fds_[i] = -1;
+    thread_.reset(new boost::thread(boost::bind(&RinexWriter::run, this)));
+  }
+
+  /**
+   * @brief Write the remaining text, close the files and stop the thread.
+   */
+  ~RinexWriter() {
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      stopping_ = true;
+    }
+    condition_.notify_one();
+    thread_->join();
+    for (int i = 0; i < 2; ++i)
+      if (fds_[i] >= 0) ::close(fds_[i]);
+  }
+
+  /**
+   * @brief Write an observation epoch, rotating the files first if it starts
+   * a new period.
+   * @param m the raw measurements of the epoch
+   */
+  void writeObservations(const ublox_msgs::RxmRAWX& m) {
+    week_ = m.week;
+    if (m.recStat & m.REC_STAT_LEAP_SEC) leap_ = m.leapS;
+    // Epoch time in units of 100 ns, the resolution of RINEX epochs
+    int64_t time = llround((m.week * 604800.0 + m.rcvTOW) * 1e7);
+    lines_used_ = 0;
+    for (std::size_t i = 0; i < m.meas.size(); ++i)
+      addMeasurement(m.meas[i]);
+    // After the measurements, so the header has their GLONASS channels
+    int64_t period = options_.rotate_period > 0
+                     ? time / (options_.rotate_period * 10000000LL) : 0;
+    if (period != period_) rotate(period, time);
+
+    // EPOCH/SAT: A1,1X,I4.4,4(1X,I2.2),F11.7,2X,I1,I3
+    epoch_.assign(35, ' ');
+    epoch_[0] = '>';
+    formatEpoch(&epoch_[1], time);
+    epoch_[31] = '0';
+    formatInt(&epoch_[32], lines_used_, 3);
+    epoch_ += '\n';
+    for (std::size_t i = 0; i < lines_used_; ++i) {
+      std::size_t end = lines_[i].text.find_last_not_of(' ') + 1;
+      epoch_.append(lines_[i].text, 0, end);
+      epoch_ += '\n';
+    }
+    append(kObservation, epoch_);
+  }
+
+  /**
+   * @brief Decode a subframe, and write the ephemeris if it completes a new
+   * one.
+   * @param m the subframe
+   */
+  void writeNavigation(const ublox_msgs::RxmSFRBX& m) {
+    // GPS and QZSS LNAV
+    if ((m.gnssId != 0 && m.gnssId != 5) || m.dwrd.size() < 10) return;
+    Subframes& subframes = subframes_[m.gnssId << 8 | m.svId];
+    uint32_t words[10];
+    for (int i = 0; i < 10; ++i) words[i] = m.dwrd[i] >> 6 & 0xFFFFFF;
+    if (bits(words, 0, 8) != 0x8B) return;
+    uint32_t id = bits(words, 43, 3);
+    if (id < 1 || id > 3) return;
+    memcpy(subframes.words[id - 1], words, sizeof(words));
+    subframes.received |= 1 << (id - 1);
+    if (subframes.received != 7) return;
+
+    Ephemeris ephemeris;
+    if (!decodeEphemeris(m.gnssId, m.svId, subframes, ephemeris)) return;
+    Ephemeris& latest = ephemerides_[m.gnssId << 8 | m.svId];
+    if (latest.valid && latest.iode == ephemeris.iode
+        && latest.toe == ephemeris.toe)
+      return;
+    latest = ephemeris;
+    // Without an observation epoch, the ephemeris is written with the first
+    // navigation file
+    if (period_ < 0) return;
+    navigation_.clear();
+    formatEphemeris(ephemeris, navigation_);
+    append(kNavigation, navigation_);
+  }
+
+ private:
+  //! Index of the files
+  enum File { kObservation, kNavigation };
+
+  //! The RINEX code of a u-blox signal
+  struct Signal {
+    uint8_t gnss_id; //!< The u-blox GNSS ID
+    uint8_t sig_id; //!< The u-blox signal ID
+    const char* code; //!< The RINEX band and attribute
+  };
+  //! Number of u-blox GNSS IDs
+  static const int kGnssIds = 8;
+  //! Number of u-blox signal IDs
+  static const int kSigIds = 16;
+  //! Width of an observation with its loss of lock and strength indicators
+  static const int kObservationWidth = 16;
+
+  //! The observations of a satellite in an epoch
+  struct Line {
+    int key; //!< GNSS ID << 8 | SV ID
+    std::string text; //!< The line, blank for missing observations
+  };
+
+  //! The subframes 1 to 3 of a satellite
+  struct Subframes {
+    Subframes() : received(0) {}
+    uint32_t words[3][10]; //!< The 24 data bits of each word
+    uint8_t received; //!< Bit i is set if subframe i + 1 was received
+  };
+
+  //! A decoded LNAV ephemeris
+  struct Ephemeris {
+    Ephemeris() : valid(false) {}
+    bool valid; //!< Whether the ephemeris was decoded
+    char system; //!< The RINEX system
+    int prn; //!< The RINEX satellite number
+    int week; //!< The 10 bit transmission week
+    int tow; //!< The transmission time of subframe 1 [s]
+    int iode, iodc, ura, health, code_l2, l2p, fit;
+    double toc, af0, af1, af2, tgd;
+    double crs, delta_n, m0, cuc, e, cus, sqrt_a, toe;
+    double cic, omega0, cis, i0, crc, omega, omega_dot, idot;
+  };
+
+  //! Text for a file, opening it first if name is set
+  struct Block {
+    File file; //!< The file
+    std::string name; //!< The name of a new file, empty to append
+    std::string text; //!< The text
+  };
+
+  /**
+   * @brief Get the RINEX system of a u-blox GNSS ID.
+   * @return the system, or ' ' if it is not supported, e.g. IMES
+   */
+  static char system(uint8_t gnss_id) {
+    return gnss_id < kGnssIds ? "GSEC JRI"[gnss_id] : ' ';
+  }
+
+  /**
+   * @brief Get the RINEX satellite number of a u-blox satellite.
+   * @return the number, or 0 if the satellite has none
+   */
+  static int prn(uint8_t gnss_id, uint8_t sv_id) {
+    switch (gnss_id) {
+      case 1: return sv_id >= 120 && sv_id <= 158 ? sv_id - 100 : 0;
+      case 6: return sv_id <= 32 ? sv_id : 0;
+      default: return sv_id <= 99 ? sv_id : 0;
+    }
+  }
+
+  /**
+   * @brief Add a measurement to the line of its satellite.
+   */
+  void addMeasurement(const ublox_msgs::RxmRAWX_Meas& meas) {
+    if (meas.gnssId >= kGnssIds || system(meas.gnssId) == ' ') return;
+    int sv = prn(meas.gnssId, meas.svId);
+    // Named reserved0 before protocol 27
+    uint8_t sig_id = meas.reserved0;
+    if (sv == 0 || sig_id >= kSigIds) return;
+    std::map<uint8_t, std::size_t>::const_iterator slot =
+        slots_[meas.gnssId].find(sig_id);
+    if (slot == slots_[meas.gnssId].end()) return;
+
+    int key = meas.gnssId << 8 | meas.svId;
+    std::size_t i = 0;
+    while (i < lines_used_ && lines_[i].key != key) ++i;
+    if (i == lines_used_) {
+      // The lines are reused, so they keep their capacity
+      if (lines_.size() == lines_used_) lines_.resize(lines_used_ + 1);
+      ++lines_used_;
+      Line& line = lines_[i];
+      line.key = key;
+      line.text.assign(
+          3 + codes_[meas.gnssId].size() * 4 * kObservationWidth, ' ');
+      line.text[0] = system(meas.gnssId);
+      formatInt(&line.text[1], sv, 2, '0');
+    }
+    char* field = &lines_[i].text[3 + slot->second * 4 * kObservationWidth];
+    if (meas.gnssId == 6) glonass_channels_[sv] = meas.freqId - 7;
+
+    // Loss of lock if the lock time decreased
+    uint16_t& locktime = locktimes_[key << 8 | sig_id];
+    int lli = meas.locktime < locktime ? 1 : 0;
+    locktime = meas.locktime;
+    if (!(meas.trkStat & meas.TRK_STAT_HALF_CYC)) lli |= 2;
+    char ssi = '0' + std::min(std::max(meas.cno / 6, 1), 9);
+
+    if (meas.trkStat & meas.TRK_STAT_PR_VALID) {
+      formatFixed(field, meas.prMes, 14, 3);
+      field[15] = ssi;
+    }
+    field += kObservationWidth;
+    if (meas.trkStat & meas.TRK_STAT_CP_VALID) {
+      formatFixed(field, meas.cpMes, 14, 3);
+      if (lli) field[14] = '0' + lli;
+      field[15] = ssi;
+    }
+    field += kObservationWidth;
+    formatFixed(field, meas.doMes, 14, 3);
+    field += kObservationWidth;
+    formatFixed(field, meas.cno, 14, 3);
+  }
+
+  /**
+   * @brief Convert a GPS time to the calendar date and time.
+   * @param time the time since the GPS epoch [100 ns]
+   * @param date the year, month, day, hour and minute
+   * @param seconds the seconds of the minute [100 ns]
+   * @param doy the day of the year
+   */
+  static void calendar(int64_t time, int date[5], int64_t& seconds,
+                       int& doy) {
+    const int64_t kDay = 864000000000LL;
+    // Days since 1970-01-01 of the GPS epoch 1980-01-06
+    int64_t days = time / kDay + 3657;
+    int64_t of_day = time % kDay;
+    // Civil from days, see http://howardhinnant.github.io/date_algorithms.html
+    int64_t z = days + 719468;
+    int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+    int64_t doe = z - era * 146097;
+    int64_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    int64_t day_of_year = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    int64_t mp = (5 * day_of_year + 2) / 153;
+    date[2] = day_of_year - (153 * mp + 2) / 5 + 1;
+    date[1] = mp < 10 ? mp + 3 : mp - 9;
+    date[0] = yoe + era * 400 + (date[1] <= 2);
+    // Day of the year from January 1st
+    static const int kDaysBefore[] = {0, 31, 59, 90, 120, 151, 181, 212, 243,
+                                      273, 304, 334};
+    bool leap = date[0] % 4 == 0
+                && (date[0] % 100 != 0 || date[0] % 400 == 0);
+    doy = kDaysBefore[date[1] - 1] + date[2] + (leap && date[1] > 2);
+    date[3] = of_day / 36000000000LL;
+    date[4] = of_day / 600000000 % 60;
+    seconds = of_day % 600000000;
+  }
+
+  /**
+   * @brief Format an epoch as 1X,I4.4,4(1X,I2.2),F11.7 (28 characters).
+   * @param out the field
+   * @param time the time since the GPS epoch [100 ns]
+   */
+  static void formatEpoch(char* out, int64_t time) {
+    int date[5], doy;
+    int64_t seconds;
+    calendar(time, date, seconds, doy);
+    *out++ = ' ';
+    formatInt(out, date[0], 4, '0');
+    out += 4;
+    for (int i = 1; i < 5; ++i) {
+      *out++ = ' ';
+      formatInt(out, date[i], 2, '0');
+      out += 2;
+    }
+    formatFixed(out, seconds * 1e-7, 11, 7);
+  }
+
+  /**
+   * @brief Format a header line, the label starts at column 61.
+   */
+  static void headerLine(std::string& out, const std::string& content,
+                         const char* label) {
+    std::string line(content, 0, 60);
+    line.resize(60, ' ');
+    out += line;
+    out += label;
+    out += '\n';
+  }
+
+  /**
+   * @brief Get the RINEX 3 long file name of the files of a period.
+   * @param time the nominal start of the file [100 ns]
+   * @param type MO for the observation file, MN for the navigation file
+   */
+  std::string fileName(int64_t time, const char* type) const {
+    int date[5], doy;
+    int64_t seconds;
+    calendar(time, date, seconds, doy);
+    char name[64];
+    int n = snprintf(name, sizeof(name), "%.9s_R_%04d%03d%02d%02d_",
+                     options_.station.c_str(), date[0], doy, date[3],
+                     date[4]);
+    int period = options_.rotate_period;
+    if (period > 0 && period % 86400 == 0)
+      n += snprintf(name + n, sizeof(name) - n, "%02dD_", period / 86400);
+    else if (period > 0 && period % 3600 == 0)
+      n += snprintf(name + n, sizeof(name) - n, "%02dH_", period / 3600);
+    else if (period > 0 && period % 60 == 0)
+      n += snprintf(name + n, sizeof(name) - n, "%02dM_", period / 60);
+    else
+      n += snprintf(name + n, sizeof(name) - n, "00U_");
+    if (type[1] == 'O') {
+      double interval = options_.interval;
+      if (interval >= 1 && interval < 100)
+        n += snprintf(name + n, sizeof(name) - n, "%02dS_",
+                      (int) lround(interval));
+      else if (interval > 0.01 && interval < 1)
+        n += snprintf(name + n, sizeof(name) - n, "%02dZ_",
+                      (int) lround(1 / interval));
+      else
+        n += snprintf(name + n, sizeof(name) - n, "00U_");
+    }
+    snprintf(name + n, sizeof(name) - n, "%s.rnx", type);
+    return dir_ + name;
+  }
+
+  /**
+   * @brief Get the program, run by and date header line.
+   */
+  static std::string programLine() {
+    time_t t = ::time(NULL);
+    struct tm time_struct;
+    gmtime_r(&t, &time_struct);
+    char date[32];
+    strftime(date, sizeof(date), "%Y%m%d %H%M%S UTC", &time_struct);
+    char line[96];
+    snprintf(line, sizeof(line), "%-20s%-20s%-20.20s", "ublox_gps", "", date);
+    return line;
+  }
+
+  /**
+   * @brief Start the files of a new period.
+   * @param period the period
+   * @param time the first epoch of the period [100 ns]
+   */
+  void rotate(int64_t period, int64_t time) {
+    // The first files are named after their first epoch
+    int64_t start = period_ >= 0 && options_.rotate_period > 0
+                    ? period * options_.rotate_period * 10000000LL : time;
+    period_ = period;
+    char line[96];
+
+    std::string header;
+    snprintf(line, sizeof(line), "%9.2f%-11s%-20s%-20s", 3.04, "",
+             "OBSERVATION DATA", "M: Mixed");
+    headerLine(header, line, "RINEX VERSION / TYPE");
+    headerLine(header, programLine(), "PGM / RUN BY / DATE");
+    headerLine(header, options_.marker, "MARKER NAME");
+    headerLine(header, "NON_GEODETIC", "MARKER TYPE");
+    headerLine(header, "", "OBSERVER / AGENCY");
+    snprintf(line, sizeof(line), "%-20s%-20.20s%-20s", "",
+             options_.receiver.c_str(), "");
+    headerLine(header, line, "REC # / TYPE / VERS");
+    snprintf(line, sizeof(line), "%-20s%-20.20s", "",
+             options_.antenna.c_str());
+    headerLine(header, line, "ANT # / TYPE");
+    snprintf(line, sizeof(line), "%14.4f%14.4f%14.4f", 0.0, 0.0, 0.0);
+    headerLine(header, line, "APPROX POSITION XYZ");
+    headerLine(header, line, "ANTENNA: DELTA H/E/N");
+    static const char kTypes[] = "CLDS";
+    for (const char* system = "GRECJSI"; *system; ++system) {
+      int gnss_id = 0;
+      while (this->system(gnss_id) != *system) ++gnss_id;
+      const std::vector<std::string>& codes = codes_[gnss_id];
+      std::string types;
+      for (std::size_t i = 0; i < codes.size(); ++i)
+        for (int j = 0; j < 4; ++j)
+          types += std::string(" ") + kTypes[j] + codes[i];
+      int count = types.size() / 4;
+      snprintf(line, sizeof(line), "%c  %3d", *system, count);
+      // 13 types per line
+      for (std::size_t i = 0; i < types.size(); i += 52)
+        headerLine(header, (i == 0 ? line : "      ") + types.substr(i, 52),
+                   "SYS / # / OBS TYPES");
+    }
+    if (options_.interval > 0) {
+      snprintf(line, sizeof(line), "%10.3f", options_.interval);
+      headerLine(header, line, "INTERVAL");
+    }
+    int date[5], doy;
+    int64_t seconds;
+    calendar(time, date, seconds, doy);
+    snprintf(line, sizeof(line), "%6d%6d%6d%6d%6d%13.7f     GPS", date[0],
+             date[1], date[2], date[3], date[4], seconds * 1e-7);
+    headerLine(header, line, "TIME OF FIRST OBS");
+    for (const char* system = "GRECJSI"; *system; ++system)
+      headerLine(header, std::string(1, *system), "SYS / PHASE SHIFT");
+    // GLONASS SLOT / FRQ #: I3,1X,8(A1,I2.2,1X,I2,1X)
+    std::string slots;
+    for (std::map<int, int>::const_iterator it = glonass_channels_.begin();
+         it != glonass_channels_.end(); ++it) {
+      snprintf(line, sizeof(line), "R%02d %2d ", it->first, it->second);
+      slots += line;
+    }
+    snprintf(line, sizeof(line), "%3d ", (int) glonass_channels_.size());
+    for (std::size_t i = 0; i == 0 || i < slots.size(); i += 56)
+      headerLine(header, (i == 0 ? line : "    ") + slots.substr(i, 56),
+                 "GLONASS SLOT / FRQ #");
+    headerLine(header, " C1C    0.000 C1P    0.000 C2C    0.000 C2P    0.000",
+               "GLONASS COD/PHS/BIS");
+    if (leap_ >= 0) {
+      snprintf(line, sizeof(line), "%6d", leap_);
+      headerLine(header, line, "LEAP SECONDS");
+    }
+    headerLine(header, "", "END OF HEADER");
+    open(kObservation, fileName(start, "MO"), header);
+
+    header.clear();
+    snprintf(line, sizeof(line), "%9.2f%-11s%-20s%-20s", 3.04, "",
+             "N: GNSS NAV DATA", "M: MIXED");
+    headerLine(header, line, "RINEX VERSION / TYPE");
+    headerLine(header, programLine(), "PGM / RUN BY / DATE");
+    if (leap_ >= 0) {
+      snprintf(line, sizeof(line), "%6d", leap_);
+      headerLine(header, line, "LEAP SECONDS");
+    }
+    headerLine(header, "", "END OF HEADER");
+    for (std::map<int, Ephemeris>::const_iterator it = ephemerides_.begin();
+         it != ephemerides_.end(); ++it)
+      formatEphemeris(it->second, header);
+    open(kNavigation, fileName(start, "MN"), header);
+  }
+
+  /**
+   * @brief Get bits of subframe words packed with 24 data bits each.
+   */
+  static uint32_t bits(const uint32_t* words, int start, int length) {
+    uint32_t value = 0;
+    for (int i = start; i < start + length; ++i)
+      value = value << 1 | (words[i / 24] >> (23 - i % 24) & 1);
+    return value;
+  }
+
+  /**
+   * @brief Get a two's complement number of subframe words.
+   */
+  static double signedBits(const uint32_t* words, int start, int length,
+                           double scale) {
+    uint32_t value = bits(words, start, length);
+    if (length < 32 && value >> (length - 1))
+      value |= ~0u << length;
+    return static_cast<int32_t>(value) * scale;
+  }
+
+  /**
+   * @brief Decode a LNAV ephemeris from subframes 1 to 3.
+   * @return false if the issues of data don't match
+   */
+  static bool decodeEphemeris(uint8_t gnss_id, uint8_t sv_id,
+                              const Subframes& subframes, Ephemeris& eph) {
+    const uint32_t* s1 = subframes.words[0];
+    const uint32_t* s2 = subframes.words[1];
+    const uint32_t* s3 = subframes.words[2];
+    eph.iodc = bits(s1, 70, 2) << 8 | bits(s1, 168, 8);
+    eph.iode = bits(s2, 48, 8);
+    if (eph.iode != (int) bits(s3, 216, 8) || eph.iode != (eph.iodc & 0xFF))
+      return false;
+
+    eph.system = system(gnss_id);
+    eph.prn = prn(gnss_id, sv_id);
+    eph.tow = bits(s1, 24, 17) * 6 - 6;
+    eph.week = bits(s1, 48, 10);
+    eph.code_l2 = bits(s1, 58, 2);
+    eph.ura = bits(s1, 60, 4);
+    eph.health = bits(s1, 64, 6);
+    eph.l2p = bits(s1, 72, 1);
+    eph.tgd = signedBits(s1, 160, 8, std::ldexp(1.0, -31));
+    eph.toc = bits(s1, 176, 16) * 16.0;
+    eph.af2 = signedBits(s1, 192, 8, std::ldexp(1.0, -55));
+    eph.af1 = signedBits(s1, 200, 16, std::ldexp(1.0, -43));
+    eph.af0 = signedBits(s1, 216, 22, std::ldexp(1.0, -31));
+
+    eph.crs = signedBits(s2, 56, 16, std::ldexp(1.0, -5));
+    eph.delta_n = signedBits(s2, 72, 16, std::ldexp(M_PI, -43));
+    eph.m0 = signedBits(s2, 88, 32, std::ldexp(M_PI, -31));
+    eph.cuc = signedBits(s2, 120, 16, std::ldexp(1.0, -29));
+    eph.e = bits(s2, 136, 32) * std::ldexp(1.0, -33);
+    eph.cus = signedBits(s2, 168, 16, std::ldexp(1.0, -29));
+    eph.sqrt_a = bits(s2, 184, 32) * std::ldexp(1.0, -19);
+    eph.toe = bits(s2, 216, 16) * 16.0;
+    eph.fit = bits(s2, 232, 1);
+
+    eph.cic = signedBits(s3, 48, 16, std::ldexp(1.0, -29));
+    eph.omega0 = signedBits(s3, 64, 32, std::ldexp(M_PI, -31));
+    eph.cis = signedBits(s3, 96, 16, std::ldexp(1.0, -29));
+    eph.i0 = signedBits(s3, 112, 32, std::ldexp(M_PI, -31));
+    eph.crc = signedBits(s3, 144, 16, std::ldexp(1.0, -5));
+    eph.omega = signedBits(s3, 160, 32, std::ldexp(M_PI, -31));
+    eph.omega_dot = signedBits(s3, 192, 24, std::ldexp(M_PI, -43));
+    eph.idot = signedBits(s3, 224, 14, std::ldexp(M_PI, -43));
+    eph.valid = true;
+    return true;
+  }
+
+  /**
+   * @brief Format an ephemeris as a RINEX 3 navigation record.
+   * @param eph the ephemeris
+   * @param out the text to append to
+   */
+  void formatEphemeris(const Ephemeris& eph, std::string& out) const {
+    // Resolve the 10 bit week with the week of the observations
+    int week = week_ + ((eph.week - week_) % 1024 + 1536) % 1024 - 512;
+    // The reference times may be in the week after the transmission
+    int toc_week = week + (eph.toc - eph.tow < -302400 ? 1 : 0);
+    int toe_week = week + (eph.toe - eph.tow < -302400 ? 1 : 0);
+    int64_t toc = llround((toc_week * 604800.0 + eph.toc) * 1e7);
+    int date[5], doy;
+    int64_t seconds;
+    calendar(toc, date, seconds, doy);
+
+    static const double kUra[] = {2.4, 3.4, 4.85, 6.85, 9.65, 13.65, 24,
+                                  48, 96, 192, 384, 768, 1536, 3072, 6144,
+                                  6144};
+    double fit = eph.fit;
+    if (eph.system == 'G') {
+      // IS-GPS-200 table 20-XII
+      if (!eph.fit) fit = 4;
+      else if (eph.iodc >= 240 && eph.iodc <= 247) fit = 8;
+      else if ((eph.iodc >= 248 && eph.iodc <= 255) || eph.iodc == 496)
+        fit = 14;
+      else if ((eph.iodc >= 497 && eph.iodc <= 503) || eph.iodc >= 1021)
+        fit = 26;
+      else fit = 6;
+    }
+    double tow = eph.tow < 0 ? eph.tow + 604800 : eph.tow;
+    const double orbits[7][4] = {
+      {(double) eph.iode, eph.crs, eph.delta_n, eph.m0},
+      {eph.cuc, eph.e, eph.cus, eph.sqrt_a},
+      {eph.toe, eph.cic, eph.omega0, eph.cis},
+      {eph.i0, eph.crc, eph.omega, eph.omega_dot},
+      {eph.idot, (double) eph.code_l2, (double) toe_week, (double) eph.l2p},
+      {kUra[eph.ura], (double) eph.health, eph.tgd, (double) eph.iodc},
+      {tow, fit, 0, 0}};
+
+    // SV / EPOCH / SV CLK: A1,I2.2,1X,I4,5(1X,I2.2),3D19.12
+    char line[160];
+    snprintf(line, sizeof(line), "%c%02d %04d %02d %02d %02d %02d %02d"
+             "%19.12E%19.12E%19.12E\n", eph.system, eph.prn, date[0], date[1],
+             date[2], date[3], date[4], (int) (seconds / 10000000), eph.af0,
+             eph.af1, eph.af2);
+    out += line;
+    // BROADCAST ORBIT: 4X,4D19.12, the spare values are omitted
+    for (int i = 0; i < 7; ++i) {
+      int count = i == 6 ? 2 : 4;
+      out += "    ";
+      for (int j = 0; j < count; ++j) {
+        snprintf(line, sizeof(line), "%19.12E", orbits[i][j]);
+        out += line;
+      }
+      out += '\n';
+    }
+  }
+
+  /**
+   * @brief Queue a new file with its header.
+   */
+  void open(File file, const std::string& name, const std::string& header) {
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      pending_.push_back(Block());
+      pending_.back().file = file;
+      pending_.back().name = name;
+      pending_.back().text = header;
+    }
+    condition_.notify_one();
+  }
+
+  /**
+   * @brief Queue text to append to a file.
+   */
+  void append(File file, const std::string& text) {
+    boost::mutex::scoped_lock lock(mutex_);
+    if (pending_.empty() || pending_.back().file != file) {
+      pending_.push_back(Block());
+      pending_.back().file = file;
+    }
+    pending_.back().text += text;
+  }
+
+  /**
+   * @brief Write the queued text once per flush period until the writer is
+   * destroyed.
+   */
+  void run() {
+    std::vector<Block> blocks;
+    while (true) {
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+        if (pending_.empty() && !stopping_)
+          condition_.timed_wait(lock, boost::posix_time::microseconds(
+              static_cast<int64_t>(options_.flush_period * 1e6)));
+        blocks.swap(pending_);
+        if (blocks.empty() && stopping_) break;
+      }
+      for (std::size_t i = 0; i < blocks.size(); ++i)
+        writeBlock(blocks[i]);
+      blocks.clear();
+    }
+  }
+
+  /**
+   * @brief Write a block, opening its file first if it starts a new one.
+   */
+  void writeBlock(const Block& block) {
+    int& fd = fds_[block.file];
+    if (!block.name.empty()) {
+      if (fd >= 0) ::close(fd);
+      std::string name = block.name;
+      // Don't overwrite the files of a previous run
+      struct stat stat_info;
+      for (int i = 1; stat(name.c_str(), &stat_info) == 0; ++i) {
+        char suffix[16];
+        snprintf(suffix, sizeof(suffix), "_%d.rnx", i);
+        name = block.name.substr(0, block.name.size() - 4) + suffix;
+      }
+      fd = ::open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (fd < 0)
+        ROS_ERROR("Can't create RINEX file \"%s\": %s", name.c_str(),
+                  strerror(errno));
+      else
+        ROS_INFO("Writing RINEX file \"%s\"", name.c_str());
+    }
+    if (fd < 0) return;
+    std::size_t offset = 0;
+    while (offset < block.text.size()) {
+      ssize_t n = ::write(fd, block.text.data() + offset,
+                          block.text.size() - offset);
+      if (n < 0) {
+        if (errno == EINTR) continue;
+        ROS_ERROR_THROTTLE(10, "RINEX write error: %s", strerror(errno));
+        break;
+      }
+      offset += n;
+    }
+  }
+
+  //! The directory of the files, ending with a '/'
+  std::string dir_;
+  //! Output options
+  Options options_;
+  //! The RINEX codes of the signals of each u-blox GNSS ID
+  std::vector<std::string> codes_[kGnssIds];
+  //! The index in codes_ of each u-blox signal ID
+  std::map<uint8_t, std::size_t> slots_[kGnssIds];
+
+  // Calling thread
+  //! The rotation period of the current files, -1 before the first epoch
+  int64_t period_;
+  //! The GPS week of the latest epoch
+  int week_;
+  //! The GPS leap seconds, -1 if unknown
+  int leap_;
+  //! The observation lines of the epoch being formatted
+  std::vector<Line> lines_;
+  //! The number of lines_ used by the epoch
+  std::size_t lines_used_;
+  //! The frequency channel of each GLONASS satellite
+  std::map<int, int> glonass_channels_;
+  //! The formatted epoch
+  std::string epoch_;
+  //! The formatted ephemeris
+  std::string navigation_;
+  //! The latest lock time of each signal, by GNSS ID, SV ID and signal ID
+  std::map<int, uint16_t> locktimes_;
+  //! The latest subframes of each satellite
+  std::map<int, Subframes> subframes_;
+  //! The latest ephemeris of each satellite
+  std::map<int, Ephemeris> ephemerides_;
+
+  // Shared
+  //! Text waiting to be written
+  std::vector<Block> pending_;
+  //! Lock for pending_ and stopping_
+  boost::mutex mutex_;
+  //! Wakes the writer thread
+  boost::condition condition_;
+  //! Whether the writer is being destroyed
+  bool stopping_;
+  //! The writer thread
+  boost::shared_ptr<boost::thread> thread_;
+
+  // Writer thread
+  //! The observation and navigation files, -1 if not open
+  int fds_[2];
+};
+
+}  // namespace ublox_gps
+
+#endif  // UBLOX_GPS_RINEX_WRITER_H
@@ -0,0 +1,460 @@
+//==============================================================================
+// Copyright (c) 2012, Johannes Meyer, TU Darmstadt
+// All rights reserved.
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * Neither the name of the Flight Systems and Automatic Control group,
+//       TU Darmstadt, nor the names of its contributors may be used to
+//       endorse or promote products derived from this software without
+//       specific prior written permission.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//==============================================================================
+
+#ifndef UBLOX_GPS_SERIAL_WORKER_H
+#define UBLOX_GPS_SERIAL_WORKER_H
+
+#include <ublox_gps/gps.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+#include <linux/serial.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+
+#include <stdexcept>
+
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/format.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/condition.hpp>
+
+#include "worker.h"
+
+namespace ublox_gps {
+//! Terminal speeds for each of kBaudrates
+constexpr static speed_t kSerialSpeeds[] = { B4800,
+                                             B9600,
+                                             B19200,
+                                             B38400,
+                                             B57600,
+                                             B115200,
+                                             B230400,
+                                             B460800 };
+
+/**
+ * @brief Open a serial port for low latency raw I/O.
+ *
+ * @details Puts the terminal in raw mode so that any single byte makes the
+ * port readable and requests ASYNC_LOW_LATENCY from the driver (for USB-serial
+ * adapters this lowers the adapter latency timer).
+ * @param port the device port address
+ * @return the non-blocking file descriptor of the port
+ * @throws std::runtime_error if the port can not be opened or configured
+ */
+inline int openSerialPort(const std::string& port) {
+  int fd = ::open(port.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK);
+  if (fd < 0)
+    throw std::runtime_error(std::string(strerror(errno)));
+
+  // Raw mode, deliver data as soon as a single byte is available
+  termios tio;
+  if (tcgetattr(fd, &tio) != 0) {
+    ::close(fd);
+    throw std::runtime_error(std::string(strerror(errno)));
+  }
+  cfmakeraw(&tio);
+  tio.c_cflag |= CLOCAL | CREAD;
+  tio.c_cflag &= ~CRTSCTS;
+  tio.c_cc[VMIN] = 1;
+  tio.c_cc[VTIME] = 0;
+  if (tcsetattr(fd, TCSANOW, &tio) != 0 || tcflush(fd, TCIOFLUSH) != 0) {
+    std::string error = strerror(errno);
+    ::close(fd);
+    throw std::runtime_error(error);
+  }
+
+  // Ask the driver not to buffer input, not supported by all drivers
+  serial_struct serial;
+  if (ioctl(fd, TIOCGSERIAL, &serial) == 0) {
+    serial.flags |= ASYNC_LOW_LATENCY;
+    if (ioctl(fd, TIOCSSERIAL, &serial) != 0)
+      ROS_WARN("U-Blox: Could not set serial port to low latency: %s",
+               strerror(errno));
+  } else {
+    ROS_DEBUG("U-Blox: Serial driver does not support low latency mode");
+  }
+  return fd;
+}
+
+/**
+ * @brief Get the current baudrate of a serial port.
+ * @param fd the file descriptor of the port
+ * @return the baudrate, or 0 if it is not one of kBaudrates
+ */
+inline unsigned int getSerialBaudrate(int fd) {
+  termios tio;
+  tcgetattr(fd, &tio);
+  speed_t speed = cfgetospeed(&tio);
+  for (std::size_t i = 0; i < sizeof(kBaudrates) / sizeof(kBaudrates[0]);
+       ++i)
+    if (kSerialSpeeds[i] == speed) return kBaudrates[i];
+  return 0;
+}
+
+/**
+ * @brief Set the baudrate of a serial port.
+ * @param fd the file descriptor of the port
+ * @param baudrate one of kBaudrates
+ * @return true if the baudrate was set
+ */
+inline bool setSerialBaudrate(int fd, unsigned int baudrate) {
+  for (std::size_t i = 0; i < sizeof(kBaudrates) / sizeof(kBaudrates[0]);
+       ++i) {
+    if (kBaudrates[i] != baudrate) continue;
+    termios tio;
+    tcgetattr(fd, &tio);
+    cfsetispeed(&tio, kSerialSpeeds[i]);
+    cfsetospeed(&tio, kSerialSpeeds[i]);
+    return tcsetattr(fd, TCSANOW, &tio) == 0;
+  }
+  return false;
+}
+
+/**
+ * @brief Handles serial I/O on Linux with minimal latency.
+ *
+ * @details Opens the port with openSerialPort and reads with epoll on a
+ * dedicated thread. Optionally, after each read the thread keeps polling the
+ * port for a bounded time before sleeping again, which avoids the wakeup
+ * latency for the remaining bytes of a burst. The thread stops reading when
+ * the port hangs up or fails, e.g. when a USB receiver is unplugged, after
+ * which the worker is no longer open.
+ */
+class SerialWorker : public Worker {
+ public:
+  typedef boost::mutex Mutex;
+  typedef boost::mutex::scoped_lock ScopedLock;
+
+  /**
+   * @brief Open the serial port and start the read thread.
+   * @param port the device port address
+   * @param spin_us how long to busy-poll for more bytes after a read [us],
+   * 0 disables busy-polling
+   * @param buffer_size the size of the input buffer
+   * @throws std::runtime_error if the port or the read thread can not be set
+   * up
+   */
+  SerialWorker(const std::string& port, unsigned int spin_us = 0,
+               std::size_t buffer_size = 8192)
+      : spin_us_(spin_us), in_buffer_size_(0), stopping_(false),
+        closed_(false), reads_(0), bytes_read_(0) {
+    in_.resize(buffer_size);
+
+    fd_ = openSerialPort(port);
+
+    epoll_fd_ = epoll_create1(0);
+    if (epoll_fd_ < 0) {
+      int error = errno;
+      ::close(fd_);
+      throw std::runtime_error("epoll_create1: " +
+                               std::string(strerror(error)));
+    }
+    wake_fd_ = eventfd(0, EFD_NONBLOCK);
+    if (wake_fd_ < 0) {
+      int error = errno;
+      ::close(epoll_fd_);
+      ::close(fd_);
+      throw std::runtime_error("eventfd: " + std::string(strerror(error)));
+    }
+    epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = fd_;
+    int ret = epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd_, &event);
+    if (ret == 0) {
+      event.data.fd = wake_fd_;
+      ret = epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wake_fd_, &event);
+    }
+    if (ret != 0) {
+      int error = errno;
+      ::close(wake_fd_);
+      ::close(epoll_fd_);
+      ::close(fd_);
+      throw std::runtime_error("epoll_ctl: " + std::string(strerror(error)));
+    }
+
+    background_thread_.reset(
+        new boost::thread(boost::bind(&SerialWorker::run, this)));
+  }
+
+  virtual ~SerialWorker() {
+    stopping_ = true;
+    uint64_t one = 1;
+    if (::write(wake_fd_, &one, sizeof(one)) < 0)
+      ROS_ERROR("U-Blox SerialWorker: Could not wake read thread");
+    background_thread_->join();
+    ::close(epoll_fd_);
+    ::close(wake_fd_);
+    ::close(fd_);
+    if (reads_ > 0)
+      ROS_INFO("U-Blox serial received %lu bytes in %lu reads (%.1f B/read)",
+               bytes_read_, reads_,
+               static_cast<double>(bytes_read_) / reads_);
+  }
+
+  /**
+   * @brief Set the callback function which handles input messages.
+   * @param callback the read callback which handles received messages
+   */
+  void setCallback(const ReadCallback& callback) { read_callback_ = callback; }
+
+  /**
+   * @brief Set the callback function which handles raw data.
+   * @param callback the write callback which handles raw data
+   */
+  void setRawDataCallback(const Callback& callback) {
+    write_callback_ = callback;
+  }
+
+  /**
+   * @brief Write the data bytes to the serial port.
+   *
+   * @details Unlike the AsyncWorker, the data is written on the calling thread
+   * so it reaches the port without a hand-off to the I/O thread.
+   * @param data the buffer of data bytes to send
+   * @param size the size of the buffer
+   * @return true if all bytes were written
+   */
+  bool send(const unsigned char* data, const unsigned int size) {
+    ScopedLock lock(write_mutex_);
+    if (closed_) {
+      ROS_ERROR_THROTTLE(1, "Ublox SerialWorker::send: The port is closed");
+      return false;
+    }
+    if (size == 0) {
+      ROS_ERROR("Ublox SerialWorker::send: Size of message to send is 0");
+      return true;
+    }
+    std::size_t written = 0;
+    while (written < size) {
+      ssize_t n = ::write(fd_, data + written, size - written);
+      if (n > 0) {
+        written += n;
+      } else if (n < 0 && errno == EAGAIN) {
+        pollfd pfd = {fd_, POLLOUT, 0};
+        ::poll(&pfd, 1, kWriteTimeoutMs);
+        if (!(pfd.revents & POLLOUT)) {
+          ROS_ERROR("Ublox SerialWorker::send: Timed out writing message");
+          return false;
+        }
+      } else if (n < 0 && errno != EINTR) {
+        ROS_ERROR("Ublox SerialWorker::send: %s", strerror(errno));
+        return false;
+      }
+    }
+    UBLOX_TRACE2(send_queued, size, false);
+    UBLOX_TRACE1(send_completed, size);
+    ROS_DEBUG_COND(debug >= 2, "U-Blox sent %u bytes", size);
+    return true;
+  }
+
+  /**
+   * @brief Wait for incoming messages.
+   * @param timeout the maximum time to wait
+   */
+  void wait(const boost::posix_time::time_duration& timeout) {
+    ScopedLock lock(read_mutex_);
+    read_condition_.timed_wait(lock, timeout);
+  }
+
+  /**
+   * @brief Whether the port is still read, false once it hung up or failed.
+   */
+  bool isOpen() const { return !closed_; }
+
+  /**
+   * @brief Get the current baudrate of the port.
+   */
+  unsigned int baudrate() const { return getSerialBaudrate(fd_); }
+
+  /**
+   * @brief Set the baudrate of the port.
+   * @param baudrate one of kBaudrates
+   * @return true if the baudrate was set
+   */
+  bool setBaudrate(unsigned int baudrate) {
+    return setSerialBaudrate(fd_, baudrate);
+  }
+
+ private:
+  //! Timeout for a blocked write [ms]
+  constexpr static int kWriteTimeoutMs = 1000;
+
+  /**
+   * @brief Read the port until the worker is destroyed.
+   */
+  void run() {
+    epoll_event events[2];
+    while (!stopping_) {
+      int n = epoll_wait(epoll_fd_, events, 2, -1);
+      if (n < 0 && errno != EINTR) {
+        ROS_ERROR("U-Blox SerialWorker epoll error: %s", strerror(errno));
+        close();
+        break;
+      }
+      if (stopping_) break;
+      if (n <= 0) continue;
+
+      bool hangup = false;
+      for (int i = 0; i < n; ++i)
+        if (events[i].data.fd == fd_
+            && (events[i].events & (EPOLLHUP | EPOLLERR)))
+          hangup = true;
+      if (hangup) {
+        // Process what is left, then stop instead of spinning on the event
+        while (readSome() > 0) {}
+        epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd_, 0);
+        ROS_ERROR("U-Blox serial port hung up or failed, stopped reading");
+        if (recorder_) recorder_->event("Serial port hung up");
+        if (metrics_) metrics_->add(Metrics::kReadErrors);
+        close();
+        break;
+      }
+
+      // Read what is available, then keep polling within the spin budget
+      boost::posix_time::ptime spin_until =
+          boost::posix_time::microsec_clock::universal_time() +
+          boost::posix_time::microseconds(spin_us_);
+      do {
+        readSome();
+      } while (!stopping_ && spin_us_ > 0 &&
+               boost::posix_time::microsec_clock::universal_time()
+                   < spin_until);
+    }
+  }
+
+  /**
+   * @brief Mark the port as closed once it is no longer read, and wake the
+   * threads waiting for data. The fd stays valid until the worker is
+   * destroyed, so concurrent calls never use a reused fd.
+   */
+  void close() {
+    closed_ = true;
+    ScopedLock lock(read_mutex_);
+    read_condition_.notify_all();
+  }
+
+  /**
+   * @brief Read the available bytes and process them.
+   * @return the number of bytes read
+   */
+  std::size_t readSome() {
+    ScopedLock lock(read_mutex_);
+    if (in_buffer_size_ == in_.size()) {
+      // The callback can't consume a full buffer, so reading into it would
+      // only spin. Drop it and read on.
+      ROS_ERROR("U-Blox SerialWorker: input buffer full, dropping %lu bytes",
+                in_buffer_size_);
+      if (recorder_)
+        recorder_->event("Input buffer full, dropped %lu bytes",
+                         in_buffer_size_);
+      if (metrics_) metrics_->add(Metrics::kDroppedBytes, in_buffer_size_);
+      in_buffer_size_ = 0;
+      arrivals_.clear();
+    }
+    ssize_t n = ::read(fd_, in_.data() + in_buffer_size_,
+                       in_.size() - in_buffer_size_);
+    ros::Time stamp = ros::Time::now();
+    if (n < 0) {
+      if (errno != EAGAIN && errno != EINTR) {
+        ROS_ERROR("U-Blox serial read error: %s", strerror(errno));
+        if (recorder_) recorder_->event("Read error: %s", strerror(errno));
+        if (metrics_) metrics_->add(Metrics::kReadErrors);
+      }
+      return 0;
+    }
+    if (n == 0) return 0;
+
+    ++reads_;
+    bytes_read_ += n;
+    std::size_t bytes_transfered = n;
+    in_buffer_size_ += bytes_transfered;
+    arrivals_.add(in_buffer_size_, stamp);
+
+    unsigned char *pRawDataStart =
+        in_.data() + (in_buffer_size_ - bytes_transfered);
+    if (write_callback_)
+      write_callback_(pRawDataStart, bytes_transfered, stamp);
+
+    if (debug >= 4) {
+      std::ostringstream oss;
+      for (unsigned char* it = pRawDataStart;
+           it != in_.data() + in_buffer_size_; ++it)
+        oss << boost::format("%02x") % static_cast<unsigned int>(*it) << " ";
+      ROS_DEBUG("U-Blox received %li bytes \n%s", bytes_transfered,
+               oss.str().c_str());
+    }
+
+    if (read_callback_) {
+      std::size_t size = in_buffer_size_;
+      UBLOX_TRACE1(read_dispatch, bytes_transfered);
+      read_callback_(in_.data(), in_buffer_size_, arrivals_);
+      arrivals_.consume(size - in_buffer_size_);
+    }
+
+    read_condition_.notify_all();
+    return bytes_transfered;
+  }
+
+  int fd_; //!< The serial port file descriptor
+  int epoll_fd_; //!< The epoll instance watching fd_ and wake_fd_
+  int wake_fd_; //!< Event used to wake the read thread on shutdown
+  unsigned int spin_us_; //!< Busy-poll budget after each read [us]
+
+  Mutex read_mutex_; //!< Lock for the input buffer
+  boost::condition read_condition_;
+  std::vector<unsigned char> in_; //!< The input buffer
+  std::size_t in_buffer_size_; //!< number of bytes currently in the input
+                               //!< buffer
+  ArrivalTimes arrivals_; //!< Arrival times of the bytes in the input buffer
+
+  Mutex write_mutex_; //!< Lock for writes to the port
+
+  boost::shared_ptr<boost::thread> background_thread_; //!< the read thread
+  ReadCallback read_callback_; //!< Callback function to handle received
+                               //!< messages
+  Callback write_callback_; //!< Callback function to handle raw data
+
+  boost::atomic<bool> stopping_; //!< Whether or not the worker is being
+                                 //!< destroyed
+  //! Whether the port hung up or failed and is no longer read
+  boost::atomic<bool> closed_;
+
+  std::size_t reads_; //!< Number of reads which returned data
+  std::size_t bytes_read_; //!< Number of bytes read
+};
+
+}  // namespace ublox_gps
+
+#endif  // UBLOX_GPS_SERIAL_WORKER_H
@@ -0,0 +1,266 @@
+//==============================================================================
+// Copyright (c) 2012, Johannes Meyer, TU Darmstadt
+// All rights reserved.
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * Neither the name of the Flight Systems and Automatic Control group,
+//       TU Darmstadt, nor the names of its contributors may be used to
+//       endorse or promote products derived from this software without
+//       specific prior written permission.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//==============================================================================
+
+#ifndef UBLOX_GPS_STARTUP_PROFILER_H
+#define UBLOX_GPS_STARTUP_PROFILER_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include <boost/thread/mutex.hpp>
+
+namespace ublox_gps {
+
+/**
+ * @brief Times the phases of the node startup and the device round trips
+ * within them, e.g. configuration messages waiting for their ACK.
+ *
+ * @details Phases may be nested, each round trip belongs to the innermost
+ * open phase. Once finished, the profiler ignores further phases and round
+ * trips, so later reconfigurations don't change the report.
+ */
+class StartupProfiler {
+ public:
+  /**
+   * @brief Times a phase while it is in scope.
+   */
+  class Phase {
+   public:
+    /**
+     * @param profiler the profiler, nothing is timed if it is null
+     * @param name the name of the phase
+     */
+    Phase(StartupProfiler* profiler, const std::string& name)
+        : profiler_(profiler) {
+      if (profiler_) profiler_->begin(name);
+    }
+
+    ~Phase() {
+      if (profiler_) profiler_->end();
+    }
+
+   private:
+    StartupProfiler* profiler_; //!< The profiler, if any
+  };
+
+  StartupProfiler() : start_(now()), end_(0), finished_(false) {}
+
+  /**
+   * @brief Get the monotonic time [s].
+   */
+  static double now() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+  }
+
+  /**
+   * @brief Begin a phase, within the open phase if any.
+   * @param name the name of the phase
+   */
+  void begin(const std::string& name) {
+    boost::mutex::scoped_lock lock(mutex_);
+    if (finished_) return;
+    Record phase;
+    phase.name = open_.empty() ? name : phases_[open_.back()].name + "/" + name;
+    phase.depth = open_.size();
+    phase.start = now() - start_;
+    phase.duration = -1;
+    open_.push_back(phases_.size());
+    phases_.push_back(phase);
+  }
+
+  /**
+   * @brief End the innermost open phase.
+   */
+  void end() {
+    boost::mutex::scoped_lock lock(mutex_);
+    if (finished_ || open_.empty()) return;
+    Record& phase = phases_[open_.back()];
+    phase.duration = now() - start_ - phase.start;
+    open_.pop_back();
+  }
+
+  /**
+   * @brief Record an operation of the innermost open phase.
+   * @param name the name of the operation
+   * @param seconds how long it took [s]
+   * @param ok whether it succeeded
+   */
+  void operation(const std::string& name, double seconds, bool ok) {
+    boost::mutex::scoped_lock lock(mutex_);
+    if (finished_) return;
+    Operation operation;
+    operation.phase = open_.empty() ? -1 : open_.back();
+    operation.name = name;
+    operation.start = now() - start_ - seconds;
+    operation.duration = seconds;
+    operation.ok = ok;
+    operations_.push_back(operation);
+  }
+
+  /**
+   * @brief Record a round trip to the device.
+   * @param kind the kind of round trip, e.g. CFG for a configuration message
+   * acknowledged by the device
+   * @param class_id the class ID of the message
+   * @param message_id the message ID of the message
+   * @param seconds how long it took [s]
+   * @param ok whether the device answered, e.g. with an ACK
+   */
+  void roundTrip(const char* kind, uint8_t class_id, uint8_t message_id,
+                 double seconds, bool ok) {
+    char name[32];
+    snprintf(name, sizeof(name), "%s 0x%02x / 0x%02x", kind, class_id,
+             message_id);
+    operation(name, seconds, ok);
+  }
+
+  /**
+   * @brief End the startup, closing the open phases.
+   */
+  void finish() {
+    boost::mutex::scoped_lock lock(mutex_);
+    if (finished_) return;
+    finished_ = true;
+    end_ = now() - start_;
+    for (; !open_.empty(); open_.pop_back())
+      phases_[open_.back()].duration = end_ - phases_[open_.back()].start;
+  }
+
+  /**
+   * @brief Get a readable report of the phases and their round trips.
+   */
+  std::string report() const {
+    boost::mutex::scoped_lock lock(mutex_);
+    std::string report;
+    char line[160];
+    snprintf(line, sizeof(line), "U-Blox startup took %.3f s\n", total());
+    report += line;
+    for (std::size_t i = 0; i < phases_.size(); ++i) {
+      const Record& phase = phases_[i];
+      double round_trips = 0;
+      int count = 0, failed = 0;
+      for (std::size_t j = 0; j < operations_.size(); ++j) {
+        if (operations_[j].phase != static_cast<int>(i)) continue;
+        round_trips += operations_[j].duration;
+        ++count;
+        if (!operations_[j].ok) ++failed;
+      }
+      // Nested phases are indented under their parent
+      std::string name = phase.name.substr(phase.name.rfind('/') + 1);
+      snprintf(line, sizeof(line), "  %*s%-*s %8.3f s", 2 * phase.depth, "",
+               std::max(40 - 2 * phase.depth, 0), name.c_str(),
+               phase.duration);
+      report += line;
+      if (count > 0) {
+        snprintf(line, sizeof(line), "  round trips: %d, %.3f s, %d failed",
+                 count, round_trips, failed);
+        report += line;
+      }
+      report += "\n";
+    }
+    return report;
+  }
+
+  /**
+   * @brief Get the report as JSON, with the start and duration of each
+   * phase and round trip in seconds since the profiler was created.
+   */
+  std::string json() const {
+    boost::mutex::scoped_lock lock(mutex_);
+    std::string json;
+    char text[256];
+    snprintf(text, sizeof(text), "{\"total_s\": %.6f, \"phases\": [",
+             total());
+    json += text;
+    for (std::size_t i = 0; i < phases_.size(); ++i) {
+      const Record& phase = phases_[i];
+      snprintf(text, sizeof(text),
+               "%s{\"name\": \"%s\", \"depth\": %d, \"start_s\": %.6f, "
+               "\"duration_s\": %.6f}", i ? ", " : "", phase.name.c_str(),
+               phase.depth, phase.start, phase.duration);
+      json += text;
+    }
+    json += "], \"round_trips\": [";
+    for (std::size_t i = 0; i < operations_.size(); ++i) {
+      const Operation& operation = operations_[i];
+      snprintf(text, sizeof(text),
+               "%s{\"name\": \"%s\", \"phase\": \"%s\", \"start_s\": %.6f, "
+               "\"duration_s\": %.6f, \"ok\": %s}", i ? ", " : "",
+               operation.name.c_str(),
+               operation.phase < 0 ? ""
+                                   : phases_[operation.phase].name.c_str(),
+               operation.start, operation.duration,
+               operation.ok ? "true" : "false");
+      json += text;
+    }
+    json += "]}";
+    return json;
+  }
+
+ private:
+  //! A phase
+  struct Record {
+    std::string name; //!< The names of the phase and its parents
+    int depth; //!< Number of parents
+    double start; //!< Start, since the profiler was created [s]
+    double duration; //!< Duration, negative while it is open [s]
+  };
+
+  //! An operation, e.g. a round trip to the device
+  struct Operation {
+    int phase; //!< Index of the phase, -1 if outside of any phase
+    std::string name; //!< The name of the operation
+    double start; //!< Start, since the profiler was created [s]
+    double duration; //!< Duration [s]
+    bool ok; //!< Whether it succeeded
+  };
+
+  /**
+   * @brief Get the startup time so far, or in total once finished [s].
+   */
+  double total() const { return finished_ ? end_ : now() - start_; }
+
+  mutable boost::mutex mutex_; //!< Lock for the members below
+  double start_; //!< Monotonic time the profiler was created [s]
+  double end_; //!< End of the startup, since start_ [s]
+  bool finished_; //!< Whether the startup ended
+  std::vector<Record> phases_; //!< The phases in the order they began
+  std::vector<std::size_t> open_; //!< Indices of the open phases
+  std::vector<Operation> operations_; //!< The operations in order
+};
+
+}  // namespace ublox_gps
+
+#endif  // UBLOX_GPS_STARTUP_PROFILER_H
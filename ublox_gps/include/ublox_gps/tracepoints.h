@@ -0,0 +1,70 @@
+//==============================================================================
+// Copyright (c) 2012, Johannes Meyer, TU Darmstadt
+// All rights reserved.
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * Neither the name of the Flight Systems and Automatic Control group,
+//       TU Darmstadt, nor the names of its contributors may be used to
+//       endorse or promote products derived from this software without
+//       specific prior written permission.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//==============================================================================
+
+#ifndef UBLOX_GPS_TRACEPOINTS_H
+#define UBLOX_GPS_TRACEPOINTS_H
+
+/**
+ * @file
+ * @brief Static tracepoints (USDT probes) of the ublox_gps provider on the
+ * receive, decode, dispatch and send path, for perf and bpftrace, e.g.
+ *
+ *   bpftrace -e 'usdt:/path/to/ublox_gps:ublox_gps:frame_found
+ *                { @[arg0, arg1] = count(); }'
+ *
+ * The probes are built whenever sys/sdt.h from systemtap is found, unless
+ * UBLOX_GPS_USDT is set to OFF. Without them the macros expand to nothing. With
+ * it each probe is a single nop until a tracer attaches, and its arguments
+ * are only read by the tracer.
+ *
+ * The probes and their arguments:
+ * - read_dispatch(size): the worker passes received data to the callbacks
+ * - frame_found(class, id, length): a message frame was found
+ * - checksum_failed(class, id, length): a message has a wrong checksum
+ * - handler_dispatch(class, id): the handlers of a message are called
+ * - handler_done(class, id): the handlers of a message returned
+ * - publish(): a ROS message was published from a message handler
+ * - send_queued(size, priority): bytes were queued to be sent
+ * - send_completed(size): queued bytes were written to the device
+ */
+
+#ifdef UBLOX_GPS_USDT
+#include <sys/sdt.h>
+
+#define UBLOX_TRACE(name) DTRACE_PROBE(ublox_gps, name)
+#define UBLOX_TRACE1(name, a) DTRACE_PROBE1(ublox_gps, name, a)
+#define UBLOX_TRACE2(name, a, b) DTRACE_PROBE2(ublox_gps, name, a, b)
+#define UBLOX_TRACE3(name, a, b, c) DTRACE_PROBE3(ublox_gps, name, a, b, c)
+#else
+#define UBLOX_TRACE(name)
+#define UBLOX_TRACE1(name, a)
+#define UBLOX_TRACE2(name, a, b)
+#define UBLOX_TRACE3(name, a, b, c)
+#endif
+
+#endif  // UBLOX_GPS_TRACEPOINTS_H
@@ -0,0 +1,656 @@
+//==============================================================================
+// Copyright (c) 2012, Johannes Meyer, TU Darmstadt
+// All rights reserved.
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * Neither the name of the Flight Systems and Automatic Control group,
+//       TU Darmstadt, nor the names of its contributors may be used to
+//       endorse or promote products derived from this software without
+//       specific prior written permission.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//==============================================================================
+
+#ifndef UBLOX_GPS_URING_WORKER_H
+#define UBLOX_GPS_URING_WORKER_H
+
+#include <ublox_gps/gps.h>
+#include <ublox_gps/serial_worker.h>
+
+#include <liburing.h>
+#include <time.h>
+
+#include <algorithm>
+#include <deque>
+
+#include <boost/atomic.hpp>
+
+#include "worker.h"
+
+namespace ublox_gps {
+
+/**
+ * @brief Handles serial I/O and raw data logging through a single io_uring.
+ *
+ * @details One thread owns the ring. Reads from the port land in registered
+ * read slots; each completed read is handed to the callbacks and, if a log
+ * file is set, copied to a registered log slot and appended to the log. Log
+ * appends have their own slots, so a slow disk never holds up the reads;
+ * data which finds no free log slot waits in a bounded backlog. Messages
+ * queued with send are written to the port one at a time in queue order,
+ * each one from the completion of the previous one. Every new submission
+ * produced while handling a batch of completions (the next read, log appends
+ * and writes to the port) enters the kernel with a single io_uring_enter
+ * call, which also waits for the next completion.
+ */
+class UringWorker : public Worker {
+ public:
+  typedef boost::mutex Mutex;
+  typedef boost::mutex::scoped_lock ScopedLock;
+
+  /**
+   * @brief Open the serial port, set up the ring and start the ring thread.
+   * @param port the device port address
+   * @param buffer_size the size of the input buffer, and of the messages
+   * queued to be sent
+   * @throws std::runtime_error if the port or the ring can not be set up
+   */
+  UringWorker(const std::string& port, std::size_t buffer_size = 8192)
+      : log_fd_(-1), log_offset_(0), pending_log_fd_(-1), read_queued_(false),
+        writes_in_flight_(0), pending_bytes_(0),
+        max_pending_bytes_(buffer_size), send_offset_(0),
+        send_in_flight_(false),
+        in_buffer_size_(0), stopping_(false), closed_(false), reads_(0),
+        bytes_read_(0),
+        log_writes_(0), log_dropped_(0), sends_(0), enters_(0),
+        cpu_time_(0) {
+    in_.resize(buffer_size);
+
+    fd_ = openSerialPort(port);
+    // Let the ring wait for data instead of failing reads with EAGAIN
+    fcntl(fd_, F_SETFL, fcntl(fd_, F_GETFL) & ~O_NONBLOCK);
+    wake_fd_ = eventfd(0, 0);
+    if (wake_fd_ < 0) {
+      int error = errno;
+      ::close(fd_);
+      throw std::runtime_error("eventfd: " + std::string(strerror(error)));
+    }
+
+    int ret = io_uring_queue_init(kQueueDepth, &ring_, 0);
+    if (ret < 0) {
+      ::close(wake_fd_);
+      ::close(fd_);
+      throw std::runtime_error("io_uring_queue_init: " +
+                               std::string(strerror(-ret)));
+    }
+
+    // Register the read and log slots once instead of mapping them for every
+    // read and append
+    slots_.resize((kReadSlots + kLogSlots) * kSlotSize);
+    iovec iov[kReadSlots + kLogSlots];
+    for (unsigned int i = 0; i < kReadSlots + kLogSlots; ++i) {
+      iov[i].iov_base = &slots_[i * kSlotSize];
+      iov[i].iov_len = kSlotSize;
+      if (i < kReadSlots)
+        free_slots_.push_back(i);
+      else
+        free_log_slots_.push_back(i);
+    }
+    ret = io_uring_register_buffers(&ring_, iov, kReadSlots + kLogSlots);
+    if (ret < 0) {
+      io_uring_queue_exit(&ring_);
+      ::close(wake_fd_);
+      ::close(fd_);
+      throw std::runtime_error("io_uring_register_buffers: " +
+                               std::string(strerror(-ret)));
+    }
+
+    background_thread_.reset(
+        new boost::thread(boost::bind(&UringWorker::run, this)));
+  }
+
+  virtual ~UringWorker() {
+    stopping_ = true;
+    wake();
+    background_thread_->join();
+    io_uring_queue_exit(&ring_);
+    ::close(wake_fd_);
+    ::close(fd_);
+    if (log_fd_ >= 0) ::close(log_fd_);
+    if (pending_log_fd_ >= 0) ::close(pending_log_fd_);
+    ROS_INFO("U-Blox io_uring: %lu reads (%lu bytes), %lu log writes "
+             "(%lu bytes dropped) and %lu sends in %lu io_uring_enter calls, "
+             "%.3f s CPU", reads_, bytes_read_, log_writes_, log_dropped_,
+             sends_, enters_, cpu_time_);
+  }
+
+  /**
+   * @brief Set the callback function which handles input messages.
+   * @param callback the read callback which handles received messages
+   */
+  void setCallback(const ReadCallback& callback) { read_callback_ = callback; }
+
+  /**
+   * @brief Set the callback function which handles raw data.
+   * @param callback the write callback which handles raw data
+   */
+  void setRawDataCallback(const Callback& callback) {
+    write_callback_ = callback;
+  }
+
+  /**
+   * @brief Append all data read from the port to the given file.
+   *
+   * @details The worker takes ownership of the file descriptor and closes it
+   * when destroyed.
+   * @param fd the file descriptor of the log file
+   */
+  void setLogFile(int fd) {
+    {
+      ScopedLock lock(send_mutex_);
+      pending_log_fd_ = fd;
+    }
+    wake();
+  }
+
+  /**
+   * @brief Queue the data bytes to be written to the port.
+   * @param data the buffer of data bytes to send
+   * @param size the size of the buffer
+   * @return false if the queue is too full, e.g. if the port stalls
+   */
+  bool send(const unsigned char* data, const unsigned int size) {
+    return enqueue(data, size, false);
+  }
+
+  /**
+   * @brief Queue the data bytes to be written to the port ahead of the
+   * queued data which is not being written yet.
+   * @param data the buffer of data bytes to send
+   * @param size the size of the buffer
+   * @return false if the queue is too full, e.g. if the port stalls
+   */
+  bool sendPriority(const unsigned char* data, const unsigned int size) {
+    return enqueue(data, size, true);
+  }
+
+  /**
+   * @brief Wait for incoming messages.
+   * @param timeout the maximum time to wait
+   */
+  void wait(const boost::posix_time::time_duration& timeout) {
+    ScopedLock lock(read_mutex_);
+    read_condition_.timed_wait(lock, timeout);
+  }
+
+  bool isOpen() const { return !closed_; }
+
+  /**
+   * @brief Get the current baudrate of the port.
+   */
+  unsigned int baudrate() const { return getSerialBaudrate(fd_); }
+
+  /**
+   * @brief Set the baudrate of the port.
+   * @param baudrate one of kBaudrates
+   * @return true if the baudrate was set
+   */
+  bool setBaudrate(unsigned int baudrate) {
+    return setSerialBaudrate(fd_, baudrate);
+  }
+
+ private:
+  //! Number of submission queue entries
+  constexpr static unsigned int kQueueDepth = 64;
+  //! Number of registered read buffers, one is read into while the data of
+  //! the other is handled
+  constexpr static unsigned int kReadSlots = 2;
+  //! Number of registered log buffers
+  constexpr static unsigned int kLogSlots = 8;
+  //! Size of each registered buffer
+  constexpr static unsigned int kSlotSize = 4096;
+  //! Largest amount of data waiting for a free log slot
+  constexpr static std::size_t kMaxLogBacklog = 1 << 20;
+  //! Delay before reading again after the port reported end of file [ns]
+  constexpr static long kRetryDelay = 100000000;
+
+  //! The kind of a submitted operation, stored in the upper 32 bits of the
+  //! user data of its submission
+  enum Operation {
+    READ,
+    LOG,
+    SEND,
+    WAKE,
+    RETRY
+  };
+
+  /**
+   * @brief Wake the ring thread.
+   */
+  void wake() {
+    uint64_t one = 1;
+    if (::write(wake_fd_, &one, sizeof(one)) < 0)
+      ROS_ERROR("U-Blox UringWorker: Could not wake ring thread");
+  }
+
+  /**
+   * @brief Mark the port as closed once it is no longer read, and wake the
+   * threads waiting for data. The fd stays valid until the worker is
+   * destroyed, so the ring never uses a reused fd.
+   */
+  void close() {
+    closed_ = true;
+    ScopedLock lock(read_mutex_);
+    read_condition_.notify_all();
+  }
+
+  /**
+   * @brief Queue a message for the ring thread and wake it.
+   * @param data the buffer of data bytes to send
+   * @param size the size of the buffer
+   * @param priority whether to queue the message ahead of the others
+   * @return false if the queued messages would exceed max_pending_bytes_
+   */
+  bool enqueue(const unsigned char* data, const unsigned int size,
+               bool priority) {
+    if (closed_) {
+      ROS_ERROR_THROTTLE(1, "Ublox UringWorker::send: The port is closed");
+      return false;
+    }
+    if (size == 0) {
+      ROS_ERROR("Ublox UringWorker::send: Size of message to send is 0");
+      return true;
+    }
+    {
+      ScopedLock lock(send_mutex_);
+      if (max_pending_bytes_ - pending_bytes_ < size) {
+        ROS_ERROR("Ublox UringWorker::send: Output queue too full to send "
+                  "message");
+        return false;
+      }
+      pending_bytes_ += size;
+      if (priority)
+        pending_sends_.push_front(
+            std::vector<unsigned char>(data, data + size));
+      else
+        pending_sends_.push_back(
+            std::vector<unsigned char>(data, data + size));
+    }
+    wake();
+    UBLOX_TRACE2(send_queued, size, priority);
+    ROS_DEBUG_COND(debug >= 2, "U-Blox queued %u bytes", size);
+    return true;
+  }
+
+  /**
+   * @brief Get a submission queue entry, flushing the queue if it is full.
+   */
+  io_uring_sqe* getSqe(Operation operation, uint32_t index) {
+    io_uring_sqe* sqe = io_uring_get_sqe(&ring_);
+    if (!sqe) {
+      io_uring_submit(&ring_);
+      ++enters_;
+      sqe = io_uring_get_sqe(&ring_);
+    }
+    sqe->user_data = (static_cast<uint64_t>(operation) << 32) | index;
+    return sqe;
+  }
+
+  /**
+   * @brief Queue a read from the port into a free slot.
+   */
+  void queueRead() {
+    if (read_queued_ || free_slots_.empty()) return;
+    unsigned int slot = free_slots_.front();
+    free_slots_.pop_front();
+    io_uring_prep_read_fixed(getSqe(READ, slot), fd_,
+                             &slots_[slot * kSlotSize], kSlotSize, 0, slot);
+    read_queued_ = true;
+  }
+
+  /**
+   * @brief Queue a read from the port after kRetryDelay.
+   */
+  void queueRetry() {
+    retry_delay_.tv_sec = 0;
+    retry_delay_.tv_nsec = kRetryDelay;
+    io_uring_prep_timeout(getSqe(RETRY, 0), &retry_delay_, 0, 0);
+  }
+
+  /**
+   * @brief Queue a read of the wake event.
+   */
+  void queueWake() {
+    io_uring_prep_read(getSqe(WAKE, 0), wake_fd_, &wake_value_,
+                       sizeof(wake_value_), 0);
+  }
+
+  /**
+   * @brief Append data to the log from a free log slot, or add it to the
+   * backlog if there is none.
+   */
+  void queueLog(const unsigned char* data, std::size_t size) {
+    if (log_backlog_.empty() && !free_log_slots_.empty()) {
+      unsigned int slot = free_log_slots_.front();
+      free_log_slots_.pop_front();
+      std::copy(data, data + size, &slots_[slot * kSlotSize]);
+      submitLog(slot, size);
+    } else if (log_backlog_.size() + size <= kMaxLogBacklog) {
+      log_backlog_.insert(log_backlog_.end(), data, data + size);
+    } else {
+      ROS_WARN_THROTTLE(10, "U-Blox raw data log can not keep up, dropping "
+                        "data");
+      log_dropped_ += size;
+    }
+  }
+
+  /**
+   * @brief Append the data in a log slot to the log.
+   */
+  void submitLog(unsigned int slot, std::size_t size) {
+    log_sizes_[slot] = size;
+    io_uring_prep_write_fixed(getSqe(LOG, slot), log_fd_,
+                              &slots_[slot * kSlotSize], size, log_offset_,
+                              slot);
+    log_offset_ += size;
+    ++writes_in_flight_;
+    ++log_writes_;
+  }
+
+  /**
+   * @brief Start writing the next queued message to the port, unless a
+   * message is being written.
+   */
+  void startSend() {
+    if (send_in_flight_) return;
+    {
+      ScopedLock lock(send_mutex_);
+      if (pending_sends_.empty()) return;
+      send_.swap(pending_sends_.front());
+      pending_sends_.pop_front();
+      pending_bytes_ -= send_.size();
+    }
+    send_offset_ = 0;
+    send_in_flight_ = true;
+    ++sends_;
+    queueSend();
+  }
+
+  /**
+   * @brief Queue the remainder of the message to be written to the port.
+   */
+  void queueSend() {
+    io_uring_prep_write(getSqe(SEND, 0), fd_, &send_[send_offset_],
+                        send_.size() - send_offset_, 0);
+    ++writes_in_flight_;
+  }
+
+  /**
+   * @brief Run the ring until the worker is destroyed.
+   */
+  void run() {
+    queueRead();
+    queueWake();
+    while (!stopping_ || writes_in_flight_ > 0) {
+      int ret = io_uring_submit_and_wait(&ring_, 1);
+      ++enters_;
+      if (ret < 0 && ret != -EINTR) {
+        ROS_ERROR("U-Blox io_uring error: %s", strerror(-ret));
+        if (recorder_) recorder_->event("io_uring error: %s", strerror(-ret));
+        if (metrics_) metrics_->add(Metrics::kReadErrors);
+        close();
+        break;
+      }
+
+      io_uring_cqe* cqe;
+      unsigned int head;
+      unsigned int count = 0;
+      io_uring_for_each_cqe(&ring_, head, cqe) {
+        ++count;
+        uint64_t data = cqe->user_data;
+        uint32_t index = static_cast<uint32_t>(data);
+        switch (static_cast<Operation>(data >> 32)) {
+          case READ:
+            handleRead(index, cqe->res);
+            break;
+          case LOG:
+            handleLog(index, cqe->res);
+            break;
+          case SEND:
+            handleSend(cqe->res);
+            break;
+          case WAKE:
+            handleWake();
+            break;
+          case RETRY:
+            if (!stopping_) queueRead();
+            break;
+        }
+      }
+      io_uring_cq_advance(&ring_, count);
+    }
+
+    timespec cpu;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+    cpu_time_ = cpu.tv_sec + cpu.tv_nsec * 1e-9;
+  }
+
+  /**
+   * @brief Process the bytes read into a slot, then log them.
+   */
+  void handleRead(uint32_t slot, int res) {
+    read_queued_ = false;
+    ros::Time stamp = ros::Time::now();
+    if (res <= 0) {
+      free_slots_.push_back(slot);
+      if (res == -EINTR || res == -EAGAIN) {
+        queueRead();
+      } else if (stopping_) {
+        return;
+      } else if (res == 0) {
+        // The device hung up or the read timed out, keep reading without
+        // spinning
+        ROS_WARN_THROTTLE(10, "U-Blox serial read: end of file");
+        if (recorder_) recorder_->event("Read end of file");
+        queueRetry();
+      } else {
+        // The read is not queued again, so stop reporting the port as open
+        ROS_ERROR("U-Blox serial read error: %s, stopped reading",
+                  strerror(-res));
+        if (recorder_) recorder_->event("Read error: %s", strerror(-res));
+        if (metrics_) metrics_->add(Metrics::kReadErrors);
+        close();
+      }
+      return;
+    }
+    unsigned char* data = &slots_[slot * kSlotSize];
+    std::size_t bytes_transfered = res;
+    ++reads_;
+    bytes_read_ += bytes_transfered;
+
+    // Keep the port busy while the data is processed
+    queueRead();
+
+    if (log_fd_ >= 0) queueLog(data, bytes_transfered);
+
+    ScopedLock lock(read_mutex_);
+    if (bytes_transfered > in_.size() - in_buffer_size_) {
+      ROS_ERROR("U-Blox UringWorker: input buffer full, dropping %lu bytes",
+                in_buffer_size_);
+      if (recorder_)
+        recorder_->event("Input buffer full, dropped %lu bytes",
+                         in_buffer_size_);
+      if (metrics_) metrics_->add(Metrics::kDroppedBytes, in_buffer_size_);
+      in_buffer_size_ = 0;
+      arrivals_.clear();
+      bytes_transfered = std::min(bytes_transfered, in_.size());
+    }
+    unsigned char *pRawDataStart = in_.data() + in_buffer_size_;
+    std::copy(data, data + bytes_transfered, pRawDataStart);
+    in_buffer_size_ += bytes_transfered;
+    free_slots_.push_back(slot);
+    arrivals_.add(in_buffer_size_, stamp);
+
+    if (write_callback_)
+      write_callback_(pRawDataStart, bytes_transfered, stamp);
+
+    if (debug >= 4) {
+      std::ostringstream oss;
+      for (unsigned char* it = pRawDataStart;
+           it != in_.data() + in_buffer_size_; ++it)
+        oss << boost::format("%02x") % static_cast<unsigned int>(*it) << " ";
+      ROS_DEBUG("U-Blox received %li bytes \n%s", bytes_transfered,
+               oss.str().c_str());
+    }
+
+    if (read_callback_) {
+      std::size_t size = in_buffer_size_;
+      UBLOX_TRACE1(read_dispatch, bytes_transfered);
+      read_callback_(in_.data(), in_buffer_size_, arrivals_);
+      arrivals_.consume(size - in_buffer_size_);
+    }
+
+    read_condition_.notify_all();
+  }
+
+  /**
+   * @brief Refill the slot of a completed log append from the backlog, or
+   * release it.
+   */
+  void handleLog(uint32_t slot, int res) {
+    --writes_in_flight_;
+    // The next appends are already placed after this one, so the bytes which
+    // were not written are lost and leave a hole in the log
+    std::size_t written = res < 0 ? 0 : res;
+    if (written < log_sizes_[slot]) {
+      std::size_t dropped = log_sizes_[slot] - written;
+      if (res < 0) {
+        ROS_ERROR_THROTTLE(10, "U-Blox raw data log write error: %s",
+                           strerror(-res));
+        if (recorder_) recorder_->event("Log write error: %s", strerror(-res));
+      } else {
+        ROS_ERROR_THROTTLE(10, "U-Blox raw data log write was short");
+        if (recorder_)
+          recorder_->event("Short log write, dropped %lu bytes", dropped);
+      }
+      log_dropped_ += dropped;
+    }
+    if (log_backlog_.empty()) {
+      free_log_slots_.push_back(slot);
+      return;
+    }
+    std::size_t size = std::min<std::size_t>(log_backlog_.size(), kSlotSize);
+    std::copy(log_backlog_.begin(), log_backlog_.begin() + size,
+              &slots_[slot * kSlotSize]);
+    log_backlog_.erase(log_backlog_.begin(), log_backlog_.begin() + size);
+    submitLog(slot, size);
+  }
+
+  /**
+   * @brief Finish the message written to the port and start the next one,
+   * or write the rest of it.
+   */
+  void handleSend(int res) {
+    --writes_in_flight_;
+    if (res < 0) {
+      ROS_ERROR("Ublox UringWorker::send: %s", strerror(-res));
+      if (metrics_) metrics_->add(Metrics::kSendsFailed);
+    } else if (send_offset_ + res < send_.size()) {
+      send_offset_ += res;
+      queueSend();
+      return;
+    } else {
+      UBLOX_TRACE1(send_completed, send_.size());
+      ROS_DEBUG_COND(debug >= 2, "U-Blox sent %lu bytes", send_.size());
+    }
+    send_in_flight_ = false;
+    startSend();
+  }
+
+  /**
+   * @brief Use a newly set log file and start writing the queued messages.
+   */
+  void handleWake() {
+    {
+      ScopedLock lock(send_mutex_);
+      if (pending_log_fd_ >= 0 && log_fd_ < 0) {
+        log_fd_ = pending_log_fd_;
+        pending_log_fd_ = -1;
+        log_offset_ = lseek(log_fd_, 0, SEEK_END);
+        if (log_offset_ < 0) log_offset_ = 0;
+      }
+    }
+    startSend();
+    if (!stopping_) queueWake();
+  }
+
+  int fd_; //!< The serial port file descriptor
+  int wake_fd_; //!< Event used to wake the ring thread
+  uint64_t wake_value_; //!< Target of the wake event reads
+  int log_fd_; //!< The raw data log file descriptor, -1 if not logging
+  off_t log_offset_; //!< Offset of the next log append
+  int pending_log_fd_; //!< Log file set but not yet used by the ring thread
+
+  io_uring ring_; //!< The ring, only used from the ring thread
+  std::vector<unsigned char> slots_; //!< Registered read buffers
+  std::deque<unsigned int> free_slots_; //!< Read slots not being read into
+  std::deque<unsigned int> free_log_slots_; //!< Log slots not being written
+  //! Size of the append submitted from each log slot
+  std::size_t log_sizes_[kReadSlots + kLogSlots];
+  std::deque<unsigned char> log_backlog_; //!< Data waiting for a log slot
+  bool read_queued_; //!< Whether a read from the port is submitted
+  __kernel_timespec retry_delay_; //!< Delay of the submitted read retry
+  std::size_t writes_in_flight_; //!< Number of submitted writes
+
+  Mutex send_mutex_; //!< Lock for the queued messages and pending_log_fd_
+  std::deque<std::vector<unsigned char> > pending_sends_; //!< Messages to send
+  std::size_t pending_bytes_; //!< Size of the messages in pending_sends_
+  std::size_t max_pending_bytes_; //!< Largest size of pending_sends_
+  std::vector<unsigned char> send_; //!< The message being sent
+  std::size_t send_offset_; //!< Number of bytes of send_ already written
+  bool send_in_flight_; //!< Whether send_ is being written
+
+  Mutex read_mutex_; //!< Lock for the input buffer
+  boost::condition read_condition_;
+  std::vector<unsigned char> in_; //!< The input buffer
+  std::size_t in_buffer_size_; //!< number of bytes currently in the input
+                               //!< buffer
+  ArrivalTimes arrivals_; //!< Arrival times of the bytes in the input buffer
+
+  boost::shared_ptr<boost::thread> background_thread_; //!< the ring thread
+  ReadCallback read_callback_; //!< Callback function to handle received
+                               //!< messages
+  Callback write_callback_; //!< Callback function to handle raw data
+
+  boost::atomic<bool> stopping_; //!< Whether or not the worker is being
+                                 //!< destroyed
+  //! Whether the port failed and is no longer read
+  boost::atomic<bool> closed_;
+
+  std::size_t reads_; //!< Number of reads which returned data
+  std::size_t bytes_read_; //!< Number of bytes read
+  std::size_t log_writes_; //!< Number of log appends
+  std::size_t log_dropped_; //!< Number of bytes dropped from the log
+  std::size_t sends_; //!< Number of messages sent
+  std::size_t enters_; //!< Number of io_uring_enter calls
+  double cpu_time_; //!< CPU time of the ring thread [s]
+};
+
+}  // namespace ublox_gps
+
+#endif  // UBLOX_GPS_URING_WORKER_H
@@ -29,28 +29,92 @@
 #ifndef UBLOX_GPS_WORKER_H
 #define UBLOX_GPS_WORKER_H
 
+#include <deque>
+#include <utility>
+
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <ros/time.h>
+
+#include <ublox_gps/flight_recorder.h>
+#include <ublox_gps/metrics.h>
+#include <ublox_gps/tracepoints.h>
 
 namespace ublox_gps {
 
+/**
+ * @brief Records when the bytes of an input buffer were received.
+ *
+ * @details Each chunk of received bytes is stored as the offset of its end in
+ * the input buffer and its arrival time. Offsets are relative to the start of
+ * the buffer and are shifted when bytes are consumed from the front.
+ */
+class ArrivalTimes {
+ public:
+  /**
+   * @brief Record the arrival of a chunk.
+   * @param end the offset of the end of the chunk in the input buffer
+   * @param stamp the time the chunk was received
+   */
+  void add(std::size_t end, const ros::Time& stamp) {
+    chunks_.push_back(std::make_pair(end, stamp));
+  }
+
+  /**
+   * @brief Get the arrival time of a byte.
+   * @param offset the offset of the byte in the input buffer
+   * @return the time the byte was received, or zero if unknown
+   */
+  ros::Time at(std::size_t offset) const {
+    for (Chunks::const_iterator it = chunks_.begin(); it != chunks_.end(); ++it)
+      if (it->first > offset) return it->second;
+    return ros::Time();
+  }
+
+  /**
+   * @brief Remove bytes from the front of the input buffer.
+   * @param size the number of bytes removed
+   */
+  void consume(std::size_t size) {
+    while (!chunks_.empty() && chunks_.front().first <= size)
+      chunks_.pop_front();
+    for (Chunks::iterator it = chunks_.begin(); it != chunks_.end(); ++it)
+      it->first -= size;
+  }
+
+  /**
+   * @brief Forget all chunks, e.g. when the input buffer is discarded.
+   */
+  void clear() { chunks_.clear(); }
+
+ private:
+  typedef std::deque<std::pair<std::size_t, ros::Time> > Chunks;
+  Chunks chunks_; //!< End offset and arrival time of each chunk
+};
+
 /**
  * @brief Handles I/O reading and writing.
  */
 class Worker {
  public:
-  typedef boost::function<void(unsigned char*, std::size_t&)> Callback;
+  typedef boost::function<void(unsigned char*, std::size_t&,
+                               const ros::Time&)> Callback;
+  typedef boost::function<void(unsigned char*, std::size_t&,
+                               const ArrivalTimes&)> ReadCallback;
   virtual ~Worker() {}
 
   /**
    * @brief Set the callback function for received messages.
-   * @param callback the callback function which process messages in the buffer
+   * @param callback the callback function which process messages in the
+   * buffer, given the arrival times of the bytes in the buffer
    */
-  virtual void setCallback(const Callback& callback) = 0;
+  virtual void setCallback(const ReadCallback& callback) = 0;
 
   /**
    * @brief Set the callback function which handles raw data.
-   * @param callback the write callback which handles raw data
+   * @param callback the write callback which handles raw data, given the
+   * arrival time of its first byte
    */
   virtual void setRawDataCallback(const Callback& callback) = 0;
 
@@ -60,6 +124,18 @@ class Worker {
    * @param size the size of the buffer
    */
   virtual bool send(const unsigned char* data, const unsigned int size) = 0;
+
+  /**
+   * @brief Send the data in the buffer ahead of the data queued by send(),
+   * for time critical input such as sensor measurements.
+   * @details Workers without an output queue send the data immediately.
+   * @param data the bytes to send
+   * @param size the size of the buffer
+   */
+  virtual bool sendPriority(const unsigned char* data,
+                            const unsigned int size) {
+    return send(data, size);
+  }
   
   /**
    * @brief Wait for an incoming message.
@@ -71,6 +147,28 @@ class Worker {
    * @brief Whether or not the I/O stream is open.
    */
   virtual bool isOpen() const = 0;
+
+  /**
+   * @brief Set the flight recorder of dropped data and read errors.
+   * @param recorder the flight recorder, empty to not record
+   */
+  void setFlightRecorder(const boost::shared_ptr<FlightRecorder>& recorder) {
+    recorder_ = recorder;
+  }
+
+  /**
+   * @brief Set the metrics of dropped data and read errors.
+   * @param metrics the metrics, empty to not count
+   */
+  void setMetrics(const boost::shared_ptr<Metrics>& metrics) {
+    metrics_ = metrics;
+  }
+
+ protected:
+  //! Records dropped data and read errors, if set
+  boost::shared_ptr<FlightRecorder> recorder_;
+  //! Counts dropped data and read errors, if set
+  boost::shared_ptr<Metrics> metrics_;
 };
 
 }  // namespace ublox_gps
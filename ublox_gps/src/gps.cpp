@@ -28,17 +28,37 @@
 //==============================================================================
 
 #include <ublox_gps/gps.h>
+#include <ublox_gps/replay_worker.h>
+#include <ublox_gps/serial_worker.h>
+#ifdef UBLOX_GPS_IO_URING
+#include <ublox_gps/uring_worker.h>
+#endif
+#include <boost/lexical_cast.hpp>
 #include <boost/version.hpp>
 
 namespace ublox_gps {
 
 using namespace ublox_msgs;
 
+/**
+ * @brief Let the kernel stamp the data received on a socket.
+ * @param fd the socket file descriptor
+ */
+static void enableReceiveTimestamps(int fd) {
+  int on = 1;
+  if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) != 0)
+    ROS_WARN("U-Blox: Could not enable socket receive timestamps: %s",
+             strerror(errno));
+}
+
 const boost::posix_time::time_duration Gps::default_timeout_ =
     boost::posix_time::milliseconds(
         static_cast<int>(Gps::kDefaultAckTimeout * 1000));
 
-Gps::Gps() : configured_(false), config_on_startup_flag_(true) {
+Gps::Gps() : configured_(false), config_on_startup_flag_(true),
+             low_latency_serial_(false), serial_spin_us_(0),
+             io_uring_serial_(false), coalesce_bytes_(0),
+             coalesce_timeout_ms_(0), coalesce_epoch_(false), udp_(false) {
  subscribeAcks();
 }
 
@@ -48,7 +68,11 @@ void Gps::setWorker(const boost::shared_ptr<Worker>& worker) {
   if (worker_) return;
   worker_ = worker;
   worker_->setCallback(boost::bind(&CallbackHandlers::readCallback,
-                                   &callbacks_, _1, _2));
+                                   &callbacks_, _1, _2, _3));
+  if (recorder_) worker_->setFlightRecorder(recorder_);
+  if (metrics_) worker_->setMetrics(metrics_);
+  worker_->setRawDataCallback(
+      boost::bind(&Gps::recordRawData, this, _1, _2, _3));
   configured_ = static_cast<bool>(worker);
 }
 
@@ -74,6 +98,8 @@ void Gps::processAck(const ublox_msgs::Ack &m) {
   ack_.store(ack, boost::memory_order_seq_cst);
   ROS_DEBUG_COND(debug >= 2, "U-blox: received ACK: 0x%02x / 0x%02x",
                  m.clsID, m.msgID);
+  if (recorder_) recorder_->event("ACK 0x%02x / 0x%02x", m.clsID, m.msgID);
+  if (metrics_) metrics_->add(Metrics::kAcks);
 }
 
 void Gps::processNack(const ublox_msgs::Ack &m) {
@@ -85,6 +111,8 @@ void Gps::processNack(const ublox_msgs::Ack &m) {
   // store the ack atomically
   ack_.store(ack, boost::memory_order_seq_cst);
   ROS_ERROR("U-blox: received NACK: 0x%02x / 0x%02x", m.clsID, m.msgID);
+  if (recorder_) recorder_->event("NACK 0x%02x / 0x%02x", m.clsID, m.msgID);
+  if (metrics_) metrics_->add(Metrics::kNacks);
 }
 
 void Gps::processUpdSosAck(const ublox_msgs::UpdSOS_Ack &m) {
@@ -99,12 +127,20 @@ void Gps::processUpdSosAck(const ublox_msgs::UpdSOS_Ack &m) {
                    "U-blox: received UPD SOS Backup ACK");
     if(ack.type == NACK)
       ROS_ERROR("U-blox: received UPD SOS Backup NACK");
+    if (recorder_)
+      recorder_->event("UPD SOS Backup %s", ack.type == ACK ? "ACK" : "NACK");
+    if (metrics_)
+      metrics_->add(ack.type == ACK ? Metrics::kAcks : Metrics::kNacks);
   }
 }
 
 void Gps::initializeSerial(std::string port, unsigned int baudrate,
                            uint16_t uart_in, uint16_t uart_out) {
   port_ = port;
+  if (low_latency_serial_ || io_uring_serial_) {
+    initializeLowLatencySerial(port, baudrate, uart_in, uart_out);
+    return;
+  }
   boost::shared_ptr<boost::asio::io_service> io_service(
       new boost::asio::io_service);
   boost::shared_ptr<boost::asio::serial_port> serial(
@@ -134,7 +170,7 @@ void Gps::initializeSerial(std::string port, unsigned int baudrate,
 
   // Set the I/O worker
   if (worker_) return;
-  setWorker(boost::shared_ptr<Worker>(
+  setAsyncWorker(boost::shared_ptr<AsyncWorker<boost::asio::serial_port> >(
       new AsyncWorker<boost::asio::serial_port>(serial, io_service)));
 
   configured_ = false;
@@ -149,12 +185,18 @@ void Gps::initializeSerial(std::string port, unsigned int baudrate,
     // Don't step down, unless the desired baudrate is lower
     if(current_baudrate.value() > kBaudrates[i] && baudrate > kBaudrates[i])
       continue;
+    double start = StartupProfiler::now();
     serial->set_option(
         boost::asio::serial_port_base::baud_rate(kBaudrates[i]));
     boost::this_thread::sleep(
         boost::posix_time::milliseconds(kSetBaudrateSleepMs));
     serial->get_option(current_baudrate);
     ROS_DEBUG("U-Blox: Set ASIO baudrate to %u", current_baudrate.value());
+    if (profiler_)
+      profiler_->operation(
+          "baud rate " + boost::lexical_cast<std::string>(kBaudrates[i]),
+          StartupProfiler::now() - start,
+          current_baudrate.value() == kBaudrates[i]);
   }
   if (config_on_startup_flag_) {
     configured_ = configUart1(baudrate, uart_in, uart_out);
@@ -166,15 +208,94 @@ void Gps::initializeSerial(std::string port, unsigned int baudrate,
   }
 }
 
+boost::shared_ptr<Worker> Gps::createLowLatencySerial(
+    const std::string& port, boost::function<unsigned int()>& get_baudrate,
+    boost::function<bool(unsigned int)>& set_baudrate) {
+#ifdef UBLOX_GPS_IO_URING
+  if (io_uring_serial_) {
+    boost::shared_ptr<UringWorker> uring(new UringWorker(port));
+    get_baudrate = boost::bind(&UringWorker::baudrate, uring.get());
+    set_baudrate = boost::bind(&UringWorker::setBaudrate, uring.get(), _1);
+    return uring;
+  }
+#else
+  if (io_uring_serial_)
+    ROS_WARN("U-Blox: Built without io_uring support, using the low latency "
+             "serial worker");
+#endif
+  boost::shared_ptr<SerialWorker> serial(
+      new SerialWorker(port, serial_spin_us_));
+  get_baudrate = boost::bind(&SerialWorker::baudrate, serial.get());
+  set_baudrate = boost::bind(&SerialWorker::setBaudrate, serial.get(), _1);
+  return serial;
+}
+
+void Gps::initializeLowLatencySerial(std::string port, unsigned int baudrate,
+                                     uint16_t uart_in, uint16_t uart_out) {
+  boost::shared_ptr<Worker> serial;
+  boost::function<unsigned int()> get_baudrate;
+  boost::function<bool(unsigned int)> set_baudrate;
+  try {
+    serial = createLowLatencySerial(port, get_baudrate, set_baudrate);
+  } catch (std::runtime_error& e) {
+    throw std::runtime_error("U-Blox: Could not open serial port :"
+                             + port + " " + e.what());
+  }
+
+  ROS_INFO("U-Blox: Opened serial port %s (low latency)", port.c_str());
+
+  // Set the I/O worker
+  if (worker_) return;
+  setWorker(serial);
+
+  configured_ = false;
+
+  // Incrementally increase the baudrate to the desired value
+  unsigned int current_baudrate = get_baudrate();
+  for (int i = 0; i < sizeof(kBaudrates)/sizeof(kBaudrates[0]); i++) {
+    if (current_baudrate == baudrate)
+      break;
+    // Don't step down, unless the desired baudrate is lower
+    if(current_baudrate > kBaudrates[i] && baudrate > kBaudrates[i])
+      continue;
+    double start = StartupProfiler::now();
+    set_baudrate(kBaudrates[i]);
+    boost::this_thread::sleep(
+        boost::posix_time::milliseconds(kSetBaudrateSleepMs));
+    current_baudrate = get_baudrate();
+    ROS_DEBUG("U-Blox: Set serial baudrate to %u", current_baudrate);
+    if (profiler_)
+      profiler_->operation(
+          "baud rate " + boost::lexical_cast<std::string>(kBaudrates[i]),
+          StartupProfiler::now() - start, current_baudrate == kBaudrates[i]);
+  }
+  if (config_on_startup_flag_) {
+    configured_ = configUart1(baudrate, uart_in, uart_out);
+    if(!configured_ || current_baudrate != baudrate) {
+      throw std::runtime_error("Could not configure serial baud rate");
+    }
+  } else {
+    configured_ = true;
+  }
+}
+
 void Gps::resetSerial(std::string port) {
-  boost::shared_ptr<boost::asio::io_service> io_service(
-      new boost::asio::io_service);
-  boost::shared_ptr<boost::asio::serial_port> serial(
-      new boost::asio::serial_port(*io_service));
+  boost::shared_ptr<boost::asio::io_service> io_service;
+  boost::shared_ptr<boost::asio::serial_port> serial;
+  boost::shared_ptr<Worker> low_latency_serial;
+  boost::function<unsigned int()> get_baudrate;
+  boost::function<bool(unsigned int)> set_baudrate;
 
   // open serial port
   try {
-    serial->open(port);
+    if (low_latency_serial_ || io_uring_serial_) {
+      low_latency_serial = createLowLatencySerial(port, get_baudrate,
+                                                  set_baudrate);
+    } else {
+      io_service.reset(new boost::asio::io_service);
+      serial.reset(new boost::asio::serial_port(*io_service));
+      serial->open(port);
+    }
   } catch (std::runtime_error& e) {
     throw std::runtime_error("U-Blox: Could not open serial port :"
                              + port + " " + e.what());
@@ -184,8 +305,11 @@ void Gps::resetSerial(std::string port) {
 
   // Set the I/O worker
   if (worker_) return;
-  setWorker(boost::shared_ptr<Worker>(
-      new AsyncWorker<boost::asio::serial_port>(serial, io_service)));
+  if (low_latency_serial)
+    setWorker(low_latency_serial);
+  else
+    setAsyncWorker(boost::shared_ptr<AsyncWorker<boost::asio::serial_port> >(
+        new AsyncWorker<boost::asio::serial_port>(serial, io_service)));
   configured_ = false;
 
   // Poll UART PRT Config
@@ -203,7 +327,10 @@ void Gps::resetSerial(std::string port) {
   }
 
   // Set the baudrate
-  serial->set_option(boost::asio::serial_port_base::baud_rate(prt.baudRate));
+  if (low_latency_serial)
+    set_baudrate(prt.baudRate);
+  else
+    serial->set_option(boost::asio::serial_port_base::baud_rate(prt.baudRate));
   configured_ = true;
 }
 
@@ -236,13 +363,73 @@ void Gps::initializeTcp(std::string host, std::string port) {
 
   ROS_INFO("U-Blox: Connected to %s:%s.", endpoint->host_name().c_str(),
            endpoint->service_name().c_str());
+  enableReceiveTimestamps(socket->native_handle());
 
   if (worker_) return;
-  setWorker(boost::shared_ptr<Worker>(
+  setAsyncWorker(boost::shared_ptr<AsyncWorker<boost::asio::ip::tcp::socket> >(
       new AsyncWorker<boost::asio::ip::tcp::socket>(socket,
                                                     io_service)));
 }
 
+void Gps::initializeUdp(std::string host, std::string port) {
+  host_ = host;
+  port_ = port;
+  udp_ = true;
+  boost::shared_ptr<boost::asio::io_service> io_service(
+      new boost::asio::io_service);
+  boost::asio::ip::udp::resolver::iterator endpoint;
+
+  try {
+    boost::asio::ip::udp::resolver resolver(*io_service);
+    endpoint =
+        resolver.resolve(boost::asio::ip::udp::resolver::query(host, port));
+  } catch (std::runtime_error& e) {
+    throw std::runtime_error("U-Blox: Could not resolve" + host + " " +
+                             port + " " + e.what());
+  }
+
+  boost::shared_ptr<boost::asio::ip::udp::socket> socket(
+    new boost::asio::ip::udp::socket(*io_service));
+
+  try {
+    // Listen on the device port and only accept datagrams from the device
+    boost::asio::ip::udp::endpoint remote = *endpoint;
+    socket->open(remote.protocol());
+    socket->set_option(boost::asio::socket_base::reuse_address(true));
+    socket->set_option(
+        boost::asio::socket_base::receive_buffer_size(kUdpBufferSize));
+    socket->bind(
+        boost::asio::ip::udp::endpoint(remote.protocol(), remote.port()));
+    socket->connect(remote);
+  } catch (std::runtime_error& e) {
+    throw std::runtime_error("U-Blox: Could not open UDP socket for " +
+                             endpoint->host_name() + ":" +
+                             endpoint->service_name() + ": " + e.what());
+  }
+
+  ROS_INFO("U-Blox: Exchanging datagrams with %s:%s.",
+           endpoint->host_name().c_str(), endpoint->service_name().c_str());
+  enableReceiveTimestamps(socket->native_handle());
+
+  if (worker_) return;
+  setAsyncWorker(boost::shared_ptr<AsyncWorker<boost::asio::ip::udp::socket> >(
+      new AsyncWorker<boost::asio::ip::udp::socket>(socket,
+                                                    io_service,
+                                                    kUdpBufferSize)));
+}
+
+void Gps::initializeReplay(std::string log_name, double speed) {
+  port_ = log_name;
+  if (worker_) return;
+  setWorker(boost::shared_ptr<Worker>(new ReplayWorker(log_name, speed)));
+}
+
+void Gps::startReplay() {
+  boost::shared_ptr<ReplayWorker> replay =
+      boost::dynamic_pointer_cast<ReplayWorker>(worker_);
+  if (replay) replay->start();
+}
+
 void Gps::close() {
   if(save_on_shutdown_) {
     if(saveOnShutdown())
@@ -261,6 +448,8 @@ void Gps::reset(const boost::posix_time::time_duration& wait) {
   boost::this_thread::sleep(wait);
   if (host_ == "")
     resetSerial(port_);
+  else if (udp_)
+    initializeUdp(host_, port_);
   else
     initializeTcp(host_, port_);
 }
@@ -462,14 +651,15 @@ bool Gps::disableTmode3() {
   return configure(tmode3);
 }
 
-bool Gps::setRate(uint8_t class_id, uint8_t message_id, uint8_t rate) {
+bool Gps::setRate(uint8_t class_id, uint8_t message_id, uint8_t rate,
+                  bool wait) {
   ROS_DEBUG_COND(debug >= 2, "Setting rate 0x%02x, 0x%02x, %u", class_id,
                  message_id, rate);
   ublox_msgs::CfgMSG msg;
   msg.msgClass = class_id;
   msg.msgID = message_id;
   msg.rate = rate;
-  return configure(msg);
+  return configure(msg, wait);
 }
 
 bool Gps::setDynamicModel(uint8_t model) {
@@ -525,10 +715,37 @@ bool Gps::setUseAdr(bool enable) {
 }
 
 bool Gps::sendRtcm(const std::vector<uint8_t>& rtcm) {
-  worker_->send(rtcm.data(), rtcm.size());
+  if (send(rtcm.data(), rtcm.size()) && metrics_)
+    metrics_->add(Metrics::kRtcmBytes, rtcm.size());
   return true;
 }
 
+bool Gps::sendSensorData(
+    const std::vector<ublox_msgs::EsfMEAS>& measurements) {
+  if (!worker_ || measurements.empty()) return false;
+
+  std::vector<unsigned char> out(kWriterSize);
+  ublox::Writer writer(out.data(), out.size());
+  bool sent = true;
+  for (std::size_t i = 0; i < measurements.size(); ++i) {
+    // Send the buffer once the next message does not fit, and encode the
+    // rest into a new one
+    std::size_t size = writer.end() - out.data()
+        + ublox::Serializer<ublox_msgs::EsfMEAS>::serializedLength(
+              measurements[i])
+        + ublox::Options().wrapper_length();
+    if (size > out.size() && writer.end() != out.data()) {
+      sent = send(out.data(), writer.end() - out.data(), true) && sent;
+      writer = ublox::Writer(out.data(), out.size());
+    }
+    if (!writer.write(measurements[i])) {
+      ROS_ERROR("Failed to encode ESF-MEAS input message");
+      return false;
+    }
+  }
+  return send(out.data(), writer.end() - out.data(), true) && sent;
+}
+
 bool Gps::poll(uint8_t class_id, uint8_t message_id,
                const std::vector<uint8_t>& payload) {
   if (!worker_) return false;
@@ -537,7 +754,7 @@ bool Gps::poll(uint8_t class_id, uint8_t message_id,
   ublox::Writer writer(out.data(), out.size());
   if (!writer.write(payload.data(), payload.size(), class_id, message_id))
     return false;
-  worker_->send(out.data(), writer.end() - out.data());
+  send(out.data(), writer.end() - out.data());
 
   return true;
 }
@@ -546,6 +763,8 @@ bool Gps::waitForAcknowledge(const boost::posix_time::time_duration& timeout,
                              uint8_t class_id, uint8_t msg_id) {
   ROS_DEBUG_COND(debug >= 2, "Waiting for ACK 0x%02x / 0x%02x",
                  class_id, msg_id);
+  boost::posix_time::ptime start =
+      boost::posix_time::microsec_clock::universal_time();
   boost::posix_time::ptime wait_until(
       boost::posix_time::second_clock::local_time() + timeout);
 
@@ -557,15 +776,40 @@ bool Gps::waitForAcknowledge(const boost::posix_time::time_duration& timeout,
     worker_->wait(timeout);
     ack = ack_.load(boost::memory_order_seq_cst);
   }
-  bool result = ack.type == ACK
-                && ack.class_id == class_id
-                && ack.msg_id == msg_id;
+  bool answered = ack.type != WAIT
+                  && ack.class_id == class_id
+                  && ack.msg_id == msg_id;
+  bool result = answered && ack.type == ACK;
+  if (!result && recorder_)
+    recorder_->event("No ACK for 0x%02x / 0x%02x", class_id, msg_id);
+  if (metrics_) {
+    metrics_->add(Metrics::kAckWaits);
+    metrics_->add(Metrics::kAckWaitMicroseconds,
+                  (boost::posix_time::microsec_clock::universal_time()
+                   - start).total_microseconds());
+    // A NACK is counted when it is received
+    if (!answered) metrics_->add(Metrics::kAckTimeouts);
+  }
   return result;
 }
 
 void Gps::setRawDataCallback(const Worker::Callback& callback) {
   if (! worker_) return;
-  worker_->setRawDataCallback(callback);
+  // The worker already runs and passes the raw data to recordRawData
+  boost::mutex::scoped_lock lock(raw_data_mutex_);
+  raw_data_callback_ = callback;
+}
+
+bool Gps::setRawDataLog(int fd) {
+#ifdef UBLOX_GPS_IO_URING
+  boost::shared_ptr<UringWorker> uring =
+      boost::dynamic_pointer_cast<UringWorker>(worker_);
+  if (uring) {
+    uring->setLogFile(fd);
+    return true;
+  }
+#endif
+  return false;
 }
 
 bool Gps::setUTCtime() {
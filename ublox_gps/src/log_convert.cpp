@@ -0,0 +1,997 @@
+//==============================================================================
+// Copyright (c) 2012, Johannes Meyer, TU Darmstadt
+// All rights reserved.
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * Neither the name of the Flight Systems and Automatic Control group,
+//       TU Darmstadt, nor the names of its contributors may be used to
+//       endorse or promote products derived from this software without
+//       specific prior written permission.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//==============================================================================
+
+// Converts raw data logs into rosbags or per message type column files.
+//
+// A log is split at frame boundaries, taken from its index or found by
+// scanning for a valid frame near each nominal chunk boundary. The chunks are
+// decoded in parallel and the results are merged in log order.
+//
+// Column output writes a directory per message type, with one file per field
+// of fixed width values in host byte order and a schema.txt describing them.
+// Variable length arrays go to a table of their own, named after the array,
+// whose _parent column holds the row of the containing message. Top level
+// tables have a _stamp column with the host arrival time [ns], if the log is
+// indexed, and an _itow column with the latest NAV iTOW [ms]. Strings are not
+// converted.
+
+#include <errno.h>
+#include <getopt.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/condition.hpp>
+
+#include <ros/console.h>
+#include <ros/serialization.h>
+#include <rosbag/bag.h>
+#include <topic_tools/shape_shifter.h>
+
+#include <ublox_msgs/ublox_msgs.h>
+#include <ublox_gps/log_index.h>
+#include <ublox_gps/log_reader.h>
+
+namespace ublox_log_convert {
+
+using ublox_gps::LogIndex;
+using ublox_gps::LogIndexEntry;
+using ublox_gps::LogReader;
+using ublox_gps::UbxFramer;
+
+//! Bytes of a frame besides the payload: sync chars, IDs, length & checksum
+static const uint32_t kFrameOverhead = 8;
+//! Size of the pieces the log is scanned in for chunk boundaries [bytes]
+static const uint64_t kScanSize = 1 << 16;
+
+//
+// Message definitions
+//
+
+/**
+ * @brief A field of a ROS message definition.
+ */
+struct Field {
+  std::string type; //!< Primitive or full message type, without array suffix
+  std::string name; //!< The field name
+  int array; //!< -1 if not an array, 0 if variable length, else the length
+  std::size_t size; //!< Size of a primitive value, 0 for strings & messages
+};
+
+//! The fields of each message type in a definition
+typedef std::map<std::string, std::vector<Field> > Definitions;
+
+/**
+ * @brief Get the serialized size of a primitive type.
+ * @return the size, 0 if the type is not a fixed size primitive
+ */
+std::size_t primitiveSize(const std::string& type) {
+  if (type == "bool" || type == "int8" || type == "uint8" || type == "byte"
+      || type == "char")
+    return 1;
+  if (type == "int16" || type == "uint16") return 2;
+  if (type == "int32" || type == "uint32" || type == "float32") return 4;
+  if (type == "int64" || type == "uint64" || type == "float64"
+      || type == "time" || type == "duration")
+    return 8;
+  return 0;
+}
+
+/**
+ * @brief Parse the full definition of a ROS message, including the
+ * definitions of the message types it contains.
+ * @param datatype the message type, e.g. ublox_msgs/NavPVT
+ * @param text the definition, see ros::message_traits::Definition
+ */
+Definitions parseDefinitions(const std::string& datatype,
+                             const std::string& text) {
+  Definitions definitions;
+  std::string current = datatype;
+  std::istringstream lines(text);
+  std::string line;
+  while (std::getline(lines, line)) {
+    std::size_t comment = line.find('#');
+    if (comment != std::string::npos) line.erase(comment);
+    if (line.compare(0, 3, "===") == 0) continue;
+    std::istringstream tokens(line);
+    std::string type, name;
+    if (!(tokens >> type >> name)) continue;
+    if (type == "MSG:") {
+      current = name;
+      continue;
+    }
+    // Constants are not serialized
+    if (name.find('=') != std::string::npos) continue;
+    std::string rest;
+    if (tokens >> rest && rest[0] == '=') continue;
+
+    Field field;
+    field.name = name;
+    field.array = -1;
+    std::size_t bracket = type.find('[');
+    if (bracket != std::string::npos) {
+      field.array = atoi(type.c_str() + bracket + 1);
+      type.erase(bracket);
+    }
+    field.size = primitiveSize(type);
+    if (field.size == 0 && type != "string") {
+      if (type == "Header")
+        type = "std_msgs/Header";
+      else if (type.find('/') == std::string::npos)
+        type = current.substr(0, current.find('/') + 1) + type;
+    }
+    field.type = type;
+    definitions[current].push_back(field);
+  }
+  return definitions;
+}
+
+//
+// Decoding
+//
+
+/**
+ * @brief Decodes the payload of a u-blox message type into its serialized
+ * ROS message.
+ */
+class Decoder {
+ public:
+  virtual ~Decoder() {}
+
+  /**
+   * @brief Decode a payload.
+   * @param payload the payload of the frame
+   * @param length the payload length
+   * @param out the ROS serialized message is appended to it
+   * @return false if the payload could not be decoded
+   */
+  virtual bool decode(const uint8_t* payload, uint32_t length,
+                      std::vector<uint8_t>& out) const = 0;
+
+  std::string name; //!< The type name without package, e.g. NavPVT
+  std::string topic; //!< The bag topic, the lower case name
+  std::string datatype; //!< The ROS data type
+  std::string md5sum; //!< The MD5 sum of the ROS message definition
+  std::string definition; //!< The full ROS message definition
+  Definitions definitions; //!< The parsed definition
+  uint32_t length; //!< Payload length of a default constructed message
+};
+
+/**
+ * @brief Decodes a u-blox message type with its ublox::Serializer.
+ */
+template <typename T>
+class MessageDecoder : public Decoder {
+ public:
+  MessageDecoder() {
+    datatype = ros::message_traits::datatype<T>();
+    md5sum = ros::message_traits::md5sum<T>();
+    definition = ros::message_traits::definition<T>();
+    name = datatype.substr(datatype.find('/') + 1);
+    topic = name;
+    for (std::size_t i = 0; i < topic.size(); ++i)
+      topic[i] = tolower(topic[i]);
+    definitions = parseDefinitions(datatype, definition);
+    T message;
+    length = ublox::Serializer<T>::serializedLength(message);
+  }
+
+  bool decode(const uint8_t* payload, uint32_t length,
+              std::vector<uint8_t>& out) const {
+    T message;
+    try {
+      ublox::Serializer<T>::read(payload, length, message);
+    } catch (std::exception& e) {
+      return false;
+    }
+    std::size_t start = out.size();
+    out.resize(start + ros::serialization::serializationLength(message));
+    ros::serialization::OStream stream(out.data() + start, out.size() - start);
+    ros::serialization::serialize(stream, message);
+    return true;
+  }
+};
+
+/**
+ * @brief The decoders of the u-blox message types.
+ */
+class Decoders {
+ public:
+  Decoders() {
+    add<ublox_msgs::NavATT>();
+    add<ublox_msgs::NavCLOCK>();
+    add<ublox_msgs::NavDGPS>();
+    add<ublox_msgs::NavDOP>();
+    add<ublox_msgs::NavEOE>();
+    add<ublox_msgs::NavPOSECEF>();
+    add<ublox_msgs::NavPOSLLH>();
+    add<ublox_msgs::NavRELPOSNED>();
+    add<ublox_msgs::NavSBAS>();
+    add<ublox_msgs::NavSOL>();
+    add<ublox_msgs::NavPVT>();
+    add<ublox_msgs::NavPVT7>();
+    add<ublox_msgs::NavSAT>();
+    add<ublox_msgs::NavSTATUS>();
+    add<ublox_msgs::NavSVIN>();
+    add<ublox_msgs::NavSVINFO>();
+    add<ublox_msgs::NavTIMEGPS>();
+    add<ublox_msgs::NavTIMEUTC>();
+    add<ublox_msgs::NavVELECEF>();
+    add<ublox_msgs::NavVELNED>();
+    add<ublox_msgs::RxmRAW>();
+    add<ublox_msgs::RxmRAWX>();
+    add<ublox_msgs::RxmRTCM>();
+    add<ublox_msgs::RxmSFRB>();
+    add<ublox_msgs::RxmSFRBX>();
+    add<ublox_msgs::RxmSVSI>();
+    add<ublox_msgs::MonGNSS>();
+    add<ublox_msgs::MonHW>();
+    add<ublox_msgs::MonHW6>();
+    add<ublox_msgs::EsfINS>();
+    add<ublox_msgs::EsfMEAS>();
+    add<ublox_msgs::EsfRAW>();
+    add<ublox_msgs::EsfSTATUS>();
+    add<ublox_msgs::HnrPVT>();
+    add<ublox_msgs::TimTM2>();
+  }
+
+  /**
+   * @brief Find the decoder of a frame.
+   * @details If several types share the IDs, e.g. for different firmware
+   * versions, the one with the frame's payload length is preferred.
+   * @return the decoder, 0 if the type is unknown
+   */
+  const Decoder* find(uint8_t class_id, uint8_t message_id,
+                      uint32_t length) const {
+    Map::const_iterator it = decoders_.find(class_id << 8 | message_id);
+    if (it == decoders_.end()) return 0;
+    for (std::size_t i = 0; i < it->second.size(); ++i)
+      if (it->second[i]->length == length) return it->second[i].get();
+    return it->second.front().get();
+  }
+
+ private:
+  typedef std::map<uint16_t, std::vector<boost::shared_ptr<Decoder> > > Map;
+
+  template <typename T>
+  void add() {
+    decoders_[T::CLASS_ID << 8 | T::MESSAGE_ID].push_back(
+        boost::shared_ptr<Decoder>(new MessageDecoder<T>));
+  }
+
+  Map decoders_; //!< The decoders of each class_id << 8 | message_id
+};
+
+//
+// Chunk results
+//
+
+/**
+ * @brief A column of fixed width values.
+ */
+struct Column {
+  std::string type; //!< The primitive type
+  std::size_t count; //!< Number of values per row
+  std::vector<char> data; //!< The values
+};
+
+/**
+ * @brief The rows of a table decoded from a chunk.
+ */
+struct Table {
+  Table() : rows(0) {}
+
+  //! Get a column, creating it if needed
+  Column& column(const std::string& name, const std::string& type,
+                 std::size_t count) {
+    std::map<std::string, Column>::iterator it = columns.find(name);
+    if (it != columns.end()) return it->second;
+    names.push_back(name);
+    Column& column = columns[name];
+    column.type = type;
+    column.count = count;
+    return column;
+  }
+
+  //! Append a value to a column
+  template <typename V>
+  void append(const std::string& name, const std::string& type, V value) {
+    std::vector<char>& data = column(name, type, 1).data;
+    const char* bytes = reinterpret_cast<const char*>(&value);
+    data.insert(data.end(), bytes, bytes + sizeof(value));
+  }
+
+  std::string parent; //!< The table of the containing messages, if any
+  uint64_t rows; //!< Number of rows
+  std::vector<std::string> names; //!< Column names in creation order
+  std::map<std::string, Column> columns; //!< The columns
+};
+
+/**
+ * @brief A decoded message for bag output.
+ */
+struct Record {
+  const Decoder* decoder; //!< The message type
+  int64_t stamp; //!< Host arrival time [ns], 0 if unknown
+  uint32_t iTOW; //!< Latest NAV iTOW [ms]
+  std::size_t offset; //!< Offset of the serialized message in the bytes
+  std::size_t size; //!< Size of the serialized message
+};
+
+/**
+ * @brief The output decoded from a chunk of the log.
+ */
+struct Result {
+  Result() : frames(0), unknown(0), errors(0),
+             iTOW(LogIndexEntry::kUnknownTow) {}
+
+  std::vector<Record> records; //!< Messages for bag output
+  std::vector<uint8_t> bytes; //!< Serialized messages for bag output
+  std::map<std::string, Table> tables; //!< Tables for column output
+  std::size_t frames; //!< Number of frames
+  std::size_t unknown; //!< Number of frames without a decoder
+  std::size_t errors; //!< Number of frames which could not be decoded
+  //! The latest NAV iTOW at the end of the chunk [ms], kUnknownTow if the
+  //! chunk has no NAV message and no index entry
+  uint32_t iTOW;
+  //! Why the chunk could not be read, empty if it was
+  std::string error;
+};
+
+/**
+ * @brief Appends serialized ROS messages to tables, based on their
+ * definition.
+ */
+class ColumnWalker {
+ public:
+  /**
+   * @param definitions the definition of the message and contained types
+   * @param tables the tables to append to
+   */
+  ColumnWalker(const Definitions& definitions,
+               std::map<std::string, Table>& tables)
+      : definitions_(definitions), tables_(tables) {}
+
+  /**
+   * @brief Append a message as a row of a table.
+   * @param table the table name
+   * @param type the message type
+   * @param data the serialized message
+   * @param size the size of the serialized message
+   * @return the row of the message
+   * @throws std::runtime_error if the message is shorter than its definition
+   */
+  uint64_t walk(const std::string& table, const std::string& type,
+                const uint8_t* data, std::size_t size) {
+    data_ = data;
+    end_ = data + size;
+    uint64_t row = tables_[table].rows++;
+    walk(table, row, type, "");
+    return row;
+  }
+
+ private:
+  //! Take bytes from the serialized message
+  const uint8_t* take(std::size_t size) {
+    if ((std::size_t) (end_ - data_) < size)
+      throw std::runtime_error("message shorter than its definition");
+    const uint8_t* data = data_;
+    data_ += size;
+    return data;
+  }
+
+  //! Read an array length or a string length
+  uint32_t length() {
+    uint32_t length;
+    memcpy(&length, take(4), 4);
+    return length;
+  }
+
+  void walk(const std::string& table, uint64_t row, const std::string& type,
+            const std::string& prefix) {
+    Definitions::const_iterator it = definitions_.find(type);
+    if (it == definitions_.end())
+      throw std::runtime_error("no definition of " + type);
+    for (std::size_t i = 0; i < it->second.size(); ++i) {
+      const Field& field = it->second[i];
+      std::string name = prefix + field.name;
+      if (field.size > 0 && field.array != 0) {
+        // Fixed width value or fixed length array
+        std::size_t count = field.array > 0 ? field.array : 1;
+        const uint8_t* bytes = take(field.size * count);
+        std::vector<char>& data =
+            tables_[table].column(name, field.type, count).data;
+        data.insert(data.end(), bytes, bytes + field.size * count);
+      } else if (field.array >= 0) {
+        // Arrays of messages & variable length arrays get their own table
+        uint32_t count = field.array > 0 ? field.array : length();
+        std::string child = table + "." + name;
+        for (uint32_t j = 0; j < count; ++j) {
+          Table& child_table = tables_[child];
+          child_table.parent = table;
+          uint64_t child_row = child_table.rows++;
+          child_table.append("_parent", "uint64", row);
+          element(child, child_row, field);
+        }
+      } else if (field.type == "string") {
+        take(length());
+      } else {
+        walk(table, row, field.type, name + ".");
+      }
+    }
+  }
+
+  //! Append an array element to its table
+  void element(const std::string& table, uint64_t row, const Field& field) {
+    if (field.size > 0) {
+      const uint8_t* bytes = take(field.size);
+      std::vector<char>& data =
+          tables_[table].column("value", field.type, 1).data;
+      data.insert(data.end(), bytes, bytes + field.size);
+    } else if (field.type == "string") {
+      take(length());
+    } else {
+      walk(table, row, field.type, "");
+    }
+  }
+
+  const Definitions& definitions_; //!< The message definitions
+  std::map<std::string, Table>& tables_; //!< The tables to append to
+  const uint8_t* data_; //!< The next byte of the serialized message
+  const uint8_t* end_; //!< The end of the serialized message
+};
+
+//
+// Conversion
+//
+
+/**
+ * @brief A part of the log which starts at a frame boundary.
+ */
+struct Chunk {
+  uint64_t begin; //!< Offset of the first frame
+  uint64_t end; //!< Offset of the next chunk
+  std::size_t entry; //!< The index entry at begin, if the log is indexed
+};
+
+/**
+ * @brief Converts logs in parallel.
+ */
+class Converter {
+ public:
+  /**
+   * @param threads the number of decoding threads
+   * @param chunk_size the approximate size of the chunks [bytes]
+   * @param columns whether to write columns instead of a bag
+   * @param output the bag file or the column directory
+   */
+  Converter(std::size_t threads, uint64_t chunk_size, bool columns,
+            const std::string& output)
+      : threads_(threads), chunk_size_(chunk_size), columns_(columns),
+        output_(output), iTOW_(LogIndexEntry::kUnknownTow), frames_(0),
+        unknown_(0), errors_(0), failed_chunks_(0) {
+    if (columns_) {
+      if (mkdir(output_.c_str(), 0755) != 0 && errno != EEXIST)
+        throw std::runtime_error("Can't create " + output_ + ": "
+                                 + strerror(errno));
+    } else {
+      bag_.open(output_, rosbag::bagmode::Write);
+    }
+  }
+
+  ~Converter() {
+    for (std::map<std::string, FILE*>::iterator it = files_.begin();
+         it != files_.end(); ++it)
+      fclose(it->second);
+  }
+
+  /**
+   * @brief Convert a log.
+   * @param log_name the name of the log file
+   * @throws std::runtime_error if the log can not be read
+   */
+  void convert(const std::string& log_name) {
+    struct stat stat_info;
+    if (stat(log_name.c_str(), &stat_info) == 0 && stat_info.st_size == 0)
+      return;
+    log_.reset(new LogReader(log_name));
+    size_ = log_->size();
+
+    try {
+      index_.reset(new LogIndex(log_name));
+    } catch (std::runtime_error& e) {
+      ROS_INFO("%s, splitting the log by scanning", e.what());
+      index_.reset();
+    }
+    split();
+    boost::posix_time::ptime start =
+        boost::posix_time::microsec_clock::universal_time();
+
+    // Decode in parallel, merge in order
+    results_.assign(chunks_.size(), boost::shared_ptr<Result>());
+    next_ = 0;
+    merged_ = 0;
+    boost::thread_group workers;
+    for (std::size_t i = 0; i < threads_; ++i)
+      workers.create_thread(boost::bind(&Converter::work, this));
+    for (std::size_t i = 0; i < chunks_.size(); ++i) {
+      boost::shared_ptr<Result> result;
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+        while (!results_[i]) condition_.wait(lock);
+        result.swap(results_[i]);
+        ++merged_;
+      }
+      condition_.notify_all();
+      if (!result->error.empty()) {
+        ROS_ERROR("Can't convert bytes %lu to %lu of %s: %s",
+                  (unsigned long) chunks_[i].begin,
+                  (unsigned long) chunks_[i].end, log_name.c_str(),
+                  result->error.c_str());
+        ++failed_chunks_;
+        continue;
+      }
+      merge(*result);
+    }
+    workers.join_all();
+    double duration = (boost::posix_time::microsec_clock::universal_time()
+                       - start).total_microseconds() * 1e-6;
+    ROS_INFO("Converted %lu MB in %lu chunks in %.2f s (%.1f MB/s)",
+             (unsigned long) (size_ >> 20), (unsigned long) chunks_.size(),
+             duration, duration > 0 ? size_ / duration * 1e-6 : 0.0);
+
+    log_.reset();
+    index_.reset();
+  }
+
+  /**
+   * @brief Write the column schemas and log the totals.
+   */
+  void finish() {
+    for (std::map<std::string, Schema>::iterator it = schemas_.begin();
+         it != schemas_.end(); ++it) {
+      std::string name = output_ + "/" + it->first + "/schema.txt";
+      FILE* file = fopen(name.c_str(), "w");
+      if (!file) {
+        ROS_ERROR("Can't write %s: %s", name.c_str(), strerror(errno));
+        continue;
+      }
+      fprintf(file, "# rows %lu\n", (unsigned long) rows_[it->first]);
+      if (!it->second.parent.empty())
+        fprintf(file, "# parent %s\n", it->second.parent.c_str());
+      for (std::size_t i = 0; i < it->second.columns.size(); ++i)
+        fprintf(file, "%s\n", it->second.columns[i].c_str());
+      fclose(file);
+    }
+    if (!columns_) bag_.close();
+    ROS_INFO("Converted %lu frames, %lu of unknown types, %lu not decodable",
+             (unsigned long) frames_, (unsigned long) unknown_,
+             (unsigned long) errors_);
+    if (failed_chunks_ > 0)
+      ROS_ERROR("%lu chunks could not be read and are missing",
+                (unsigned long) failed_chunks_);
+  }
+
+  /**
+   * @brief Get the number of chunks which could not be read.
+   */
+  std::size_t failedChunks() const { return failed_chunks_; }
+
+ private:
+  //! The columns and parent of an output table
+  struct Schema {
+    std::string parent; //!< The table of the containing messages
+    std::vector<std::string> columns; //!< Name, type & count of each column
+    std::set<std::string> names; //!< The column names
+  };
+
+  /**
+   * @brief Check whether a valid frame starts at an offset.
+   */
+  static bool validFrame(const uint8_t* frame, uint64_t size) {
+    if (kFrameOverhead > size) return false;
+    if (frame[0] != 0xB5 || frame[1] != 0x62) return false;
+    uint32_t length = frame[4] | frame[5] << 8;
+    if (length > UbxFramer::kMaxLength || length + kFrameOverhead > size)
+      return false;
+    uint8_t ck_a = 0, ck_b = 0;
+    for (uint32_t i = 2; i < length + 6; ++i) {
+      ck_a += frame[i];
+      ck_b += ck_a;
+    }
+    return frame[length + 6] == ck_a && frame[length + 7] == ck_b;
+  }
+
+  /**
+   * @brief Find the first valid frame at or after an offset.
+   * @return the offset of the frame, or the size of the log if there is none
+   */
+  uint64_t findFrame(uint64_t offset) const {
+    std::vector<uint8_t> buffer;
+    while (offset < size_) {
+      // Read enough to check the frames starting in the piece
+      uint64_t n = std::min(size_ - offset,
+                            kScanSize + UbxFramer::kMaxLength
+                            + kFrameOverhead);
+      const uint8_t* data = log_->read(offset, n, buffer);
+      for (uint64_t i = 0; i < kScanSize && i < n; ++i)
+        if (validFrame(data + i, n - i)) return offset + i;
+      offset += kScanSize;
+    }
+    return size_;
+  }
+
+  /**
+   * @brief Split the log into chunks at frame boundaries.
+   */
+  void split() {
+    chunks_.clear();
+    Chunk chunk;
+    chunk.begin = 0;
+    chunk.entry = 0;
+    if (index_) {
+      // Split at the indexed frames
+      for (std::size_t i = 1; i < index_->size(); ++i) {
+        uint64_t offset = (*index_)[i].offset;
+        if (offset - chunk.begin < chunk_size_ || offset >= size_) continue;
+        chunk.end = offset;
+        chunks_.push_back(chunk);
+        chunk.begin = offset;
+        chunk.entry = i;
+      }
+    } else {
+      // Split at the first valid frame after each nominal boundary
+      for (uint64_t offset = chunk_size_; offset < size_;) {
+        offset = findFrame(offset);
+        if (offset >= size_) break;
+        chunk.end = offset;
+        chunks_.push_back(chunk);
+        chunk.begin = offset;
+        offset += chunk_size_;
+      }
+    }
+    chunk.end = size_;
+    chunks_.push_back(chunk);
+  }
+
+  /**
+   * @brief Decode chunks until all are taken.
+   */
+  void work() {
+    while (true) {
+      std::size_t i = next_.fetch_add(1);
+      if (i >= chunks_.size()) return;
+      {
+        // Bound the memory of the results waiting to be merged
+        boost::mutex::scoped_lock lock(mutex_);
+        while (i >= merged_ + 2 * threads_) condition_.wait(lock);
+      }
+      boost::shared_ptr<Result> result(new Result);
+      try {
+        decode(chunks_[i], *result);
+      } catch (std::exception& e) {
+        // e.g. a corrupt compressed block, the other chunks are still valid
+        *result = Result();
+        result->error = e.what();
+      }
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+        results_[i] = result;
+      }
+      condition_.notify_all();
+    }
+  }
+
+  /**
+   * @brief Handles the frames of a chunk.
+   */
+  class FrameHandler {
+   public:
+    FrameHandler(const Converter& converter, const Chunk& chunk,
+                 const uint8_t* data, Result& result)
+        : converter_(converter), chunk_(chunk), data_(data), result_(result),
+          entry_(chunk.entry), stamp_(0),
+          iTOW_(LogIndexEntry::kUnknownTow) {
+      if (converter_.index_ && entry_ < converter_.index_->size()) {
+        stamp_ = (*converter_.index_)[entry_].stamp;
+        iTOW_ = (*converter_.index_)[entry_].iTOW;
+      }
+    }
+
+    void operator()(uint64_t offset, uint8_t class_id, uint8_t message_id,
+                    uint16_t length, uint32_t iTOW) {
+      // Frames starting in the next chunk belong to it
+      if (offset >= chunk_.end) return;
+      ++result_.frames;
+      if (iTOW != LogIndexEntry::kUnknownTow) iTOW_ = iTOW;
+      const LogIndex* index = converter_.index_.get();
+      if (index) {
+        while (entry_ + 1 < index->size()
+               && (*index)[entry_ + 1].offset <= offset)
+          ++entry_;
+        stamp_ = (*index)[entry_].stamp;
+      }
+
+      const Decoder* decoder =
+          converter_.decoders_.find(class_id, message_id, length);
+      if (!decoder) {
+        ++result_.unknown;
+        return;
+      }
+      std::size_t start = result_.bytes.size();
+      if (!decoder->decode(data_ + (offset - chunk_.begin) + 6, length,
+                           result_.bytes)) {
+        ++result_.errors;
+        result_.bytes.resize(start);
+        return;
+      }
+      if (converter_.columns_) {
+        // Only the row is kept
+        try {
+          ColumnWalker walker(decoder->definitions, result_.tables);
+          walker.walk(decoder->name, decoder->datatype,
+                      result_.bytes.data() + start,
+                      result_.bytes.size() - start);
+          Table& table = result_.tables[decoder->name];
+          if (index) table.append("_stamp", "int64", stamp_);
+          table.append("_itow", "uint32", iTOW_);
+        } catch (std::runtime_error& e) {
+          ROS_ERROR_THROTTLE(10, "Can't convert %s: %s",
+                             decoder->name.c_str(), e.what());
+          ++result_.errors;
+        }
+        result_.bytes.resize(start);
+        return;
+      }
+      Record record;
+      record.decoder = decoder;
+      record.stamp = stamp_;
+      record.iTOW = iTOW_;
+      record.offset = start;
+      record.size = result_.bytes.size() - start;
+      result_.records.push_back(record);
+    }
+
+    //! Get the latest NAV iTOW [ms]
+    uint32_t iTOW() const { return iTOW_; }
+
+   private:
+    const Converter& converter_; //!< The converter
+    const Chunk& chunk_; //!< The chunk being decoded
+    const uint8_t* data_; //!< The chunk's data, from its beginning
+    Result& result_; //!< The output of the chunk
+    std::size_t entry_; //!< The latest index entry at or before the frame
+    int64_t stamp_; //!< The arrival time of the frame [ns]
+    uint32_t iTOW_; //!< The latest NAV iTOW [ms]
+  };
+
+  /**
+   * @brief Decode the frames which start in a chunk.
+   */
+  void decode(const Chunk& chunk, Result& result) const {
+    // Continue past the end to complete the last frame
+    uint64_t end = std::min<uint64_t>(
+        size_, chunk.end + UbxFramer::kMaxLength + kFrameOverhead);
+    std::vector<uint8_t> buffer;
+    const uint8_t* data = log_->read(chunk.begin, end - chunk.begin, buffer);
+    FrameHandler handler(*this, chunk, data, result);
+    UbxFramer framer;
+    framer.parse(data, end - chunk.begin, chunk.begin, handler);
+    result.iTOW = handler.iTOW();
+  }
+
+  /**
+   * @brief Write the output of a chunk.
+   */
+  void merge(Result& result) {
+    frames_ += result.frames;
+    unknown_ += result.unknown;
+    errors_ += result.errors;
+    if (columns_)
+      mergeTables(result);
+    else
+      mergeRecords(result);
+    // The latest NAV iTOW carries over to the next chunk
+    if (result.iTOW != LogIndexEntry::kUnknownTow) iTOW_ = result.iTOW;
+  }
+
+  /**
+   * @brief Write the messages of a chunk to the bag.
+   */
+  void mergeRecords(Result& result) {
+    for (std::size_t i = 0; i < result.records.size(); ++i) {
+      const Record& record = result.records[i];
+      // Frames before the first NAV message of the chunk
+      uint32_t iTOW = record.iTOW != LogIndexEntry::kUnknownTow
+                      ? record.iTOW : iTOW_;
+      // Without arrival times, the bag time is the GPS time of week
+      ros::Time time = ros::TIME_MIN;
+      if (record.stamp > 0)
+        time.fromNSec(record.stamp);
+      else if (iTOW != LogIndexEntry::kUnknownTow)
+        time = ros::TIME_MIN + ros::Duration(iTOW * 1e-3);
+
+      const Decoder& decoder = *record.decoder;
+      topic_tools::ShapeShifter message;
+      message.morph(decoder.md5sum, decoder.datatype, decoder.definition, "");
+      ros::serialization::IStream stream(result.bytes.data() + record.offset,
+                                         record.size);
+      message.read(stream);
+      bag_.write(decoder.topic, time, message);
+    }
+  }
+
+  /**
+   * @brief Append the tables of a chunk to the column files.
+   */
+  void mergeTables(Result& result) {
+    // Rows of the tables before this chunk
+    std::map<std::string, uint64_t> base(rows_);
+    for (std::map<std::string, Table>::iterator it = result.tables.begin();
+         it != result.tables.end(); ++it) {
+      Table& table = it->second;
+      Schema& schema = schemas_[it->first];
+      schema.parent = table.parent;
+      for (std::size_t i = 0; i < table.names.size(); ++i) {
+        const std::string& name = table.names[i];
+        Column& column = table.columns[name];
+        if (name == "_parent") {
+          // Rows of the chunk to rows of the output
+          uint64_t* parents = reinterpret_cast<uint64_t*>(column.data.data());
+          for (std::size_t j = 0; j < column.data.size() / 8; ++j)
+            parents[j] += base[table.parent];
+        } else if (name == "_itow") {
+          // Frames before the first NAV message of the chunk
+          uint32_t* tows = reinterpret_cast<uint32_t*>(column.data.data());
+          for (std::size_t j = 0; j < column.data.size() / 4; ++j)
+            if (tows[j] == LogIndexEntry::kUnknownTow) tows[j] = iTOW_;
+        }
+        if (schema.names.insert(name).second) {
+          std::ostringstream line;
+          line << name << " " << column.type << " " << column.count;
+          schema.columns.push_back(line.str());
+        }
+        FILE* file = this->file(it->first, name);
+        if (file && fwrite(column.data.data(), 1, column.data.size(), file)
+            != column.data.size())
+          ROS_ERROR_THROTTLE(10, "Can't write column %s/%s: %s",
+                             it->first.c_str(), name.c_str(),
+                             strerror(errno));
+      }
+      rows_[it->first] += table.rows;
+    }
+  }
+
+  /**
+   * @brief Get the file of a column, opening it if needed.
+   */
+  FILE* file(const std::string& table, const std::string& column) {
+    std::string name = output_ + "/" + table + "/" + column;
+    std::map<std::string, FILE*>::iterator it = files_.find(name);
+    if (it != files_.end()) return it->second;
+    mkdir((output_ + "/" + table).c_str(), 0755);
+    FILE* file = fopen(name.c_str(), "w");
+    if (!file)
+      ROS_ERROR("Can't create %s: %s", name.c_str(), strerror(errno));
+    files_[name] = file;
+    return file;
+  }
+
+  std::size_t threads_; //!< Number of decoding threads
+  uint64_t chunk_size_; //!< Approximate size of the chunks [bytes]
+  bool columns_; //!< Whether to write columns instead of a bag
+  std::string output_; //!< The bag file or the column directory
+  Decoders decoders_; //!< The message decoders
+
+  boost::scoped_ptr<LogReader> log_; //!< The log
+  uint64_t size_; //!< Uncompressed size of the log [bytes]
+  boost::scoped_ptr<LogIndex> index_; //!< The log index, if any
+  std::vector<Chunk> chunks_; //!< The chunks of the log
+
+  boost::atomic<std::size_t> next_; //!< The next chunk to decode
+  boost::mutex mutex_; //!< Lock for results_ & merged_
+  boost::condition condition_; //!< Signals results & merges
+  std::vector<boost::shared_ptr<Result> > results_; //!< Decoded chunks
+  std::size_t merged_; //!< Number of merged chunks
+
+  rosbag::Bag bag_; //!< The output bag
+  std::map<std::string, FILE*> files_; //!< The output column files
+  std::map<std::string, Schema> schemas_; //!< The output tables
+  std::map<std::string, uint64_t> rows_; //!< Rows of the output tables
+  uint32_t iTOW_; //!< The latest NAV iTOW which was merged [ms]
+  std::size_t frames_; //!< Number of frames
+  std::size_t unknown_; //!< Number of frames of unknown types
+  std::size_t errors_; //!< Number of frames which could not be decoded
+  std::size_t failed_chunks_; //!< Number of chunks which could not be read
+};
+
+}  // namespace ublox_log_convert
+
+void usage(const char* program) {
+  fprintf(stderr,
+          "Usage: %s [-j threads] [-c chunk_mb] (-b bag | -d dir) log...\n"
+          "  -j  number of decoding threads, default: number of cores\n"
+          "  -c  approximate size of the decoded chunks [MB], default: 16\n"
+          "  -b  write the messages to a bag\n"
+          "  -d  write a column file per field to the directory\n",
+          program);
+}
+
+int main(int argc, char** argv) {
+  std::size_t threads = boost::thread::hardware_concurrency();
+  uint64_t chunk_mb = 16;
+  std::string bag, dir;
+  int option;
+  while ((option = getopt(argc, argv, "j:c:b:d:h")) != -1) {
+    switch (option) {
+      case 'j': threads = atoi(optarg); break;
+      case 'c': chunk_mb = atoi(optarg); break;
+      case 'b': bag = optarg; break;
+      case 'd': dir = optarg; break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+  if (optind >= argc || bag.empty() == dir.empty() || chunk_mb == 0) {
+    usage(argv[0]);
+    return 1;
+  }
+  if (threads == 0) threads = 1;
+
+  try {
+    ublox_log_convert::Converter converter(
+        threads, chunk_mb << 20, !dir.empty(), dir.empty() ? bag : dir);
+    for (int i = optind; i < argc; ++i) {
+      ROS_INFO("Converting %s", argv[i]);
+      converter.convert(argv[i]);
+    }
+    converter.finish();
+    if (converter.failedChunks() > 0) return 1;
+  } catch (std::exception& e) {
+    ROS_ERROR("%s", e.what());
+    return 1;
+  }
+  return 0;
+}
@@ -28,14 +28,24 @@
 //==============================================================================
 
 #include "ublox_gps/node.h"
+#include <algorithm>
 #include <cmath>
+#include <cstdlib>
+#include <exception>
+#include <fstream>
 #include <string>
 #include <sstream>
+#include <typeinfo>
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <time.h>
 
+#include <boost/core/demangle.hpp>
+#include <ros/callback_queue.h>
+#include <ros/file_log.h>
 #include <rtcm_msgs/Message.h>
 ros::Subscriber subRTCM;
 
@@ -87,6 +97,166 @@ uint8_t ublox_node::fixModeFromString(const std::string& mode) {
                            " is not a valid fix mode.");
 }
 
+ros::Time ublox_node::epochStamp(uint32_t iTOW, int32_t nano) {
+  if (!estimate_clock)
+    return gps.arrivalTime();
+  // The offset of the epoch from the nearest ms, in [-0.5, 0.5) ms. nano
+  // may be negative, and % keeps its sign.
+  int32_t sub_ms = nano % 1000000;
+  if (sub_ms >= 500000)
+    sub_ms -= 1000000;
+  else if (sub_ms < -500000)
+    sub_ms += 1000000;
+  double tow = iTOW * 1e-3 + sub_ms * 1e-9;
+  gnss_clock.update(tow, gps.arrivalTime());
+  if (!gnss_clock.valid())
+    return gps.arrivalTime();
+  return gnss_clock.toHost(tow);
+}
+
+void ublox_node::recordFixQuality(int quality) {
+  static const char* const kQualities[] = {"no fix", "fix", "float RTK",
+                                           "fixed RTK"};
+  static int last_quality = -1;
+  static ros::WallTime last_dump;
+  if (quality == last_quality) return;
+  flight_recorder->event("Fix quality: %s", kQualities[quality]);
+  if (quality < last_quality && flight_recorder_fix_period > 0
+      && (last_dump.isZero() || (ros::WallTime::now() - last_dump).toSec()
+                                >= flight_recorder_fix_period)) {
+    last_dump = ros::WallTime::now();
+    flight_recorder->dump(std::string("Fix degraded from ")
+                          + kQualities[last_quality] + " to "
+                          + kQualities[quality]);
+  }
+  last_quality = quality;
+}
+
+void ublox_node::recordPublished() {
+  UBLOX_TRACE(publish);
+  if (latency_stats) latency_stats->mark(ublox_gps::LatencyStats::kPublished);
+}
+
+//! The terminate handler replaced by dumpOnTerminate
+static std::terminate_handler previous_terminate = 0;
+
+/**
+ * @brief Dump the flight recorder before the process terminates, e.g. on an
+ * uncaught exception.
+ */
+static void dumpOnTerminate() {
+  std::string reason = "Terminated";
+  try {
+    if (std::current_exception())
+      std::rethrow_exception(std::current_exception());
+  } catch (const std::exception& e) {
+    reason += " by exception: " + std::string(e.what());
+  } catch (...) {
+    reason += " by an unknown exception";
+  }
+  if (flight_recorder) flight_recorder->dump(reason, true);
+  if (previous_terminate) previous_terminate();
+  std::abort();
+}
+
+//
+// Raw data stream
+//
+void RawDataPublisher::initialize(const std::string& topic,
+                                  std::size_t chunk_size,
+                                  double chunk_period) {
+  publisher_ = nh->advertise<ublox_msgs::RawData>(topic, kROSQueueSize);
+  chunk_size_ = chunk_size;
+  chunk_period_ = ros::Duration(chunk_period);
+  chunk_.reset(new ublox_msgs::RawData);
+  chunk_->data.reserve(chunk_size_);
+  // Check twice per period, a chunk is at most 1.5 periods old
+  if (chunk_period > 0)
+    timer_ = nh->createTimer(ros::Duration(chunk_period / 2),
+                             &RawDataPublisher::checkAge, this);
+}
+
+void RawDataPublisher::add(const unsigned char* data, std::size_t size,
+                           const ros::Time& stamp) {
+  boost::mutex::scoped_lock lock(mutex_);
+  if (!chunk_ || size == 0)
+    return;
+  ros::Time now = ros::Time::now();
+  if (chunk_->data.empty())
+    chunk_->header.stamp = stamp.isZero() ? now : stamp;
+  chunk_->data.insert(chunk_->data.end(), data, data + size);
+  if (chunk_->data.size() >= chunk_size_
+      || now - chunk_->header.stamp >= chunk_period_)
+    publishChunk();
+}
+
+void RawDataPublisher::flush() {
+  boost::mutex::scoped_lock lock(mutex_);
+  if (chunk_ && !chunk_->data.empty())
+    publishChunk();
+}
+
+void RawDataPublisher::checkAge(const ros::TimerEvent& event) {
+  boost::mutex::scoped_lock lock(mutex_);
+  if (chunk_ && !chunk_->data.empty()
+      && ros::Time::now() - chunk_->header.stamp >= chunk_period_)
+    publishChunk();
+}
+
+void RawDataPublisher::publishChunk() {
+  chunk_->sequence = sequence_++;
+  chunk_->offset = offset_;
+  offset_ += chunk_->data.size();
+  publisher_.publish(ublox_msgs::RawDataConstPtr(chunk_));
+
+  // Subscribers may still hold the published chunk
+  chunk_.reset(new ublox_msgs::RawData);
+  chunk_->data.reserve(chunk_size_);
+}
+
+//
+// Demand driven output rates
+//
+void RateManager::start() {
+  if (outputs_.empty())
+    return;
+  timer_ = nh->createTimer(ros::Duration(kCheckPeriod), &RateManager::update,
+                           this);
+  ROS_INFO("Enabling %zu u-blox messages only while subscribed.",
+           outputs_.size());
+}
+
+void RateManager::setOutput(Output& output, bool on) {
+  if (output.on == on)
+    return;
+  output.on = on;
+  if (!on && users_.count(key(output.class_id, output.message_id)))
+    return;
+  ROS_DEBUG("%s %s", on ? "Enabling" : "Disabling",
+            output.publisher.getTopic().c_str());
+  // Don't block the spin thread, a NACK is logged when it is received
+  if (!gps.setRate(output.class_id, output.message_id, on ? output.rate : 0,
+                   false))
+    ROS_WARN("Failed to %s message 0x%02x 0x%02x.",
+             on ? "enable" : "disable", output.class_id, output.message_id);
+}
+
+void RateManager::update(const ros::TimerEvent& event) {
+  for (std::size_t i = 0; i < outputs_.size(); ++i) {
+    Output& output = outputs_[i];
+    if (output.publisher.getNumSubscribers() > 0) {
+      output.idle_since = ros::Time();
+      setOutput(output, true);
+    } else if (output.on) {
+      if (output.idle_since.isZero())
+        output.idle_since = event.current_real;
+      else if ((event.current_real - output.idle_since).toSec() >=
+               kIdleTimeout)
+        setOutput(output, false);
+    }
+  }
+}
+
 //
 // u-blox ROS Node
 //
@@ -107,6 +277,31 @@ void UbloxNode::addFirmwareInterface() {
     ublox_version = 8;
   }
   ROS_INFO("U-Blox Firmware Version: %d", ublox_version);
+
+  // Consolidated navigation epochs, needs NavPVT
+  nh->param("publish/nav/epoch", enabled["nav_epoch"], false);
+  if (enabled["nav_epoch"]) {
+    if (ublox_version < 8) {
+      ROS_WARN("Navigation epochs require firmware version 8 or later.");
+    } else {
+      ComponentPtr assembler(new EpochAssembler);
+      assembler->getRosParams();
+      components_.push_back(assembler);
+    }
+  }
+
+  // RINEX files of the raw measurements, needs RxmRAWX
+  std::string rinex_dir;
+  nh->param("rinex/dir", rinex_dir, std::string(""));
+  if (!rinex_dir.empty()) {
+    if (ublox_version < 8) {
+      ROS_WARN("RINEX output requires firmware version 8 or later.");
+    } else {
+      ComponentPtr rinex(new RinexLogger);
+      rinex->getRosParams();
+      components_.push_back(rinex);
+    }
+  }
 }
 
 
@@ -131,6 +326,9 @@ void UbloxNode::addProductInterface(std::string product_category,
 
 void UbloxNode::getRosParams() {
   nh->param("device", device_, std::string("/dev/ttyACM0"));
+  // Replay of file://<log> devices
+  nh->param("replay/speed", replay_speed_, 1.0);
+  nh->param("replay/exit", replay_exit_, true);
   nh->param("frame_id", frame_id, std::string("gps"));
 
   // Save configuration parameters
@@ -145,6 +343,13 @@ void UbloxNode::getRosParams() {
                                     | ublox_msgs::CfgPRT::PROTO_NMEA
                                     | ublox_msgs::CfgPRT::PROTO_RTCM);
   getRosUint("uart1/out", uart_out_, ublox_msgs::CfgPRT::PROTO_UBX);
+  nh->param("uart1/low_latency", low_latency_serial_, false);
+  getRosUint("uart1/spin_us", serial_spin_us_, 0);
+  nh->param("uart1/io_uring", io_uring_serial_, false);
+  // Read coalescing, trades latency for fewer wakeups
+  getRosUint("coalesce/min_bytes", coalesce_bytes_, 0);
+  getRosUint("coalesce/timeout_ms", coalesce_timeout_ms_, 0);
+  nh->param("coalesce/epoch", coalesce_epoch_, false);
   // USB params
   set_usb_ = false;
   if (nh->hasParam("usb/in") || nh->hasParam("usb/out")) {
@@ -221,16 +426,79 @@ void UbloxNode::getRosParams() {
 
   nh->param<std::string>("raw_data_stream/dir", raw_data_stream_dir_, "");
   nh->param("raw_data_stream/publish", raw_data_stream_flag_, false);
+  nh->param("raw_data_stream/publish_string", raw_data_string_flag_, false);
+  getRosUint("raw_data_stream/chunk_size", raw_data_chunk_size_, 4096);
+  nh->param("raw_data_stream/chunk_period", raw_data_chunk_period_, 0.1);
+  getRosUint("raw_data_stream/buffer_size",
+             raw_data_log_options_.buffer_size, 65536);
+  getRosUint("raw_data_stream/buffers", raw_data_log_options_.buffers, 16);
+  nh->param("raw_data_stream/flush_period",
+            raw_data_log_options_.flush_period, 1.0);
+  nh->param("raw_data_stream/sync_period",
+            raw_data_log_options_.sync_period, 5.0);
+  uint32_t rotate_size_mb;
+  getRosUint("raw_data_stream/rotate_size_mb", rotate_size_mb, 0);
+  raw_data_log_options_.rotate_size = (uint64_t) rotate_size_mb << 20;
+  nh->param("raw_data_stream/rotate_period",
+            raw_data_log_options_.rotate_period, 0.0);
+  nh->param("raw_data_stream/preallocate",
+            raw_data_log_options_.preallocate, true);
+  // Sidecar index of the log files
+  nh->param("raw_data_stream/index", raw_data_log_options_.index, false);
+  getRosUint("raw_data_stream/index_interval",
+             raw_data_log_options_.index_interval, 100);
+  std::vector<uint8_t> index_classes, index_ids;
+  getRosUint("raw_data_stream/index_classes", index_classes);
+  getRosUint("raw_data_stream/index_ids", index_ids);
+  if(index_classes.size() != index_ids.size())
+    throw std::runtime_error(std::string("Invalid settings: size of ") +
+                             "raw_data_stream/index_classes must match size " +
+                             "of raw_data_stream/index_ids");
+  for(size_t i = 0; i < index_classes.size(); ++i)
+    raw_data_log_options_.index_types.insert(
+        index_classes[i] << 8 | index_ids[i]);
+  nh->param("raw_data_stream/compress", raw_data_log_options_.compress, false);
+  nh->param("raw_data_stream/compression_level",
+            raw_data_log_options_.compression_level, 0);
+  // Flight recorder of the latest I/O and events, 0 size disables it
+  uint32_t flight_recorder_kb;
+  getRosUint("flight_recorder/size_kb", flight_recorder_kb, 4096);
+  std::string flight_recorder_dir;
+  nh->param("flight_recorder/dir", flight_recorder_dir,
+            ros::file_log::getLogDirectory());
+  nh->param("flight_recorder/fix_period", flight_recorder_fix_period, 300.0);
+  if (flight_recorder_kb > 0 && !flight_recorder) {
+    flight_recorder.reset(new ublox_gps::FlightRecorder(
+        flight_recorder_dir, (std::size_t) flight_recorder_kb << 10));
+    previous_terminate = std::set_terminate(dumpOnTerminate);
+  }
+  // Latency of the received messages from byte arrival to publish
+  bool latency;
+  nh->param("latency/enable", latency, true);
+  if (latency && !latency_stats)
+    latency_stats.reset(new ublox_gps::LatencyStats);
+  // Throughput & error counters, published and served over HTTP
+  bool metrics_enabled;
+  nh->param("metrics/enable", metrics_enabled, true);
+  nh->param("metrics/period", metrics_period_, 1.0);
+  getRosUint("metrics/port", metrics_port_, 0);
+  nh->param<std::string>("metrics/address", metrics_address_, "127.0.0.1");
+  if (metrics_enabled && !metrics)
+    metrics.reset(new ublox_gps::Metrics);
   nh->param("config_on_startup", config_on_startup_flag_, true);
+  // Stamp outputs with the measurement time instead of the arrival time
+  nh->param("clock/estimate", estimate_clock, false);
+  // Enable published messages only while their topics are subscribed
+  nh->param("publish/on_demand", on_demand, false);
 }
 
 void UbloxNode::pollMessages(const ros::TimerEvent& event) {
   static std::vector<uint8_t> payload(1, 1);
-  if (enabled["aid_alm"])
+  if (poll_aid_alm_)
     gps.poll(ublox_msgs::Class::AID, ublox_msgs::Message::AID::ALM, payload);
-  if (enabled["aid_eph"])
+  if (poll_aid_eph_)
     gps.poll(ublox_msgs::Class::AID, ublox_msgs::Message::AID::EPH, payload);
-  if (enabled["aid_hui"])
+  if (poll_aid_hui_)
     gps.poll(ublox_msgs::Class::AID, ublox_msgs::Message::AID::HUI);
 
   payload[0]++;
@@ -239,6 +507,17 @@ void UbloxNode::pollMessages(const ros::TimerEvent& event) {
   }
 }
 
+void UbloxNode::updateDiagnostics(const ros::TimerEvent& event) {
+  updater->update();
+}
+
+void UbloxNode::checkReplay(const ros::TimerEvent& event) {
+  if (!gps.isOpen()) {
+    ROS_INFO("Replay of %s finished.", device_.c_str());
+    shutdown_requested = 1;
+  }
+}
+
 void UbloxNode::printInf(const ublox_msgs::Inf &m, uint8_t id) {
   if (id == ublox_msgs::Message::INF::ERROR)
     ROS_ERROR_STREAM("INF: " << std::string(m.str.begin(), m.str.end()));
@@ -263,18 +542,15 @@ void UbloxNode::subscribe() {
   // Nav Messages
   nh->param("publish/nav/status", enabled["nav_status"], enabled["nav"]);
   if (enabled["nav_status"])
-    gps.subscribe<ublox_msgs::NavSTATUS>(boost::bind(
-        publish<ublox_msgs::NavSTATUS>, _1, "navstatus"), kSubscribeRate);
+    subscribeTopic<ublox_msgs::NavSTATUS>("navstatus", kSubscribeRate);
 
   nh->param("publish/nav/posecef", enabled["nav_posecef"], enabled["nav"]);
   if (enabled["nav_posecef"])
-    gps.subscribe<ublox_msgs::NavPOSECEF>(boost::bind(
-        publish<ublox_msgs::NavPOSECEF>, _1, "navposecef"), kSubscribeRate);
+    subscribeTopic<ublox_msgs::NavPOSECEF>("navposecef", kSubscribeRate);
 
   nh->param("publish/nav/clock", enabled["nav_clock"], enabled["nav"]);
   if (enabled["nav_clock"])
-    gps.subscribe<ublox_msgs::NavCLOCK>(boost::bind(
-        publish<ublox_msgs::NavCLOCK>, _1, "navclock"), kSubscribeRate);
+    subscribeTopic<ublox_msgs::NavCLOCK>("navclock", kSubscribeRate);
 
   // INF messages
   nh->param("inf/debug", enabled["inf_debug"], false);
@@ -327,6 +603,9 @@ void UbloxNode::subscribe() {
   if (enabled["aid_hui"])
     gps.subscribe<ublox_msgs::AidHUI>(boost::bind(
         publish<ublox_msgs::AidHUI>, _1, "aidhui"), kSubscribeRate);
+  poll_aid_alm_ = enabled["aid_alm"];
+  poll_aid_eph_ = enabled["aid_eph"];
+  poll_aid_hui_ = enabled["aid_hui"];
 
   for(int i = 0; i < components_.size(); i++)
     components_[i]->subscribe();
@@ -342,6 +621,8 @@ void UbloxNode::initializeRosDiagnostics() {
   // configure diagnostic updater for frequency
   freq_diag = FixDiagnostic(std::string("fix"), kFixFreqTol,
                             kFixFreqWindow, kTimeStampStatusMin);
+  if (latency_stats)
+    updater->add("latency", this, &UbloxNode::latencyDiagnostics);
   for(int i = 0; i < components_.size(); i++)
     components_[i]->initializeRosDiagnostics();
 }
@@ -413,6 +694,8 @@ void UbloxNode::processMonVer() {
 }
 
 bool UbloxNode::configureUblox() {
+  ublox_gps::StartupProfiler::Phase phase(startup_profiler_.get(),
+                                          "configureUblox");
   try {
     if (!gps.isInitialized())
       throw std::runtime_error("Failed to initialize.");
@@ -467,6 +750,9 @@ bool UbloxNode::configureUblox() {
         throw std::runtime_error("Failed to set user-defined datum.");
       // Configure each component
       for (int i = 0; i < components_.size(); i++) {
+        ublox_gps::StartupProfiler::Phase phase(
+            startup_profiler_.get(),
+            boost::core::demangle(typeid(*components_[i]).name()));
         if(!components_[i]->configureUblox())
           return false;
       }
@@ -517,17 +803,32 @@ void UbloxNode::configureInf() {
 
 void UbloxNode::initializeIo() {
   gps.setConfigOnStartup(config_on_startup_flag_);
+  if (flight_recorder) {
+    gps.setFlightRecorder(flight_recorder);
+    flight_recorder->event("Opening %s", device_.c_str());
+  }
+  if (latency_stats) gps.setLatencyStats(latency_stats);
+  if (metrics) gps.setMetrics(metrics);
+  gps.setLowLatencySerial(low_latency_serial_, serial_spin_us_);
+  gps.setIoUringSerial(io_uring_serial_);
+  gps.setCoalescing(coalesce_bytes_, coalesce_timeout_ms_, coalesce_epoch_);
 
   boost::smatch match;
-  if (boost::regex_match(device_, match,
-                         boost::regex("(tcp|udp)://(.+):(\\d+)"))) {
+  if (boost::regex_match(device_, match, boost::regex("file://(.+)"))) {
+    ROS_INFO("Replaying %s at %.2fx speed ...", std::string(match[1]).c_str(),
+             replay_speed_);
+    gps.initializeReplay(match[1], replay_speed_);
+  } else if (boost::regex_match(device_, match,
+                                boost::regex("(tcp|udp)://(.+):(\\d+)"))) {
     std::string proto(match[1]);
+    std::string host(match[2]);
+    std::string port(match[3]);
+    ROS_INFO("Connecting to %s://%s:%s ...", proto.c_str(), host.c_str(),
+             port.c_str());
     if (proto == "tcp") {
-      std::string host(match[2]);
-      std::string port(match[3]);
-      ROS_INFO("Connecting to %s://%s:%s ...", proto.c_str(), host.c_str(),
-               port.c_str());
       gps.initializeTcp(host, port);
+    } else if (proto == "udp") {
+      gps.initializeUdp(host, port);
     } else {
       throw std::runtime_error("Protocol '" + proto + "' is unsupported");
     }
@@ -535,11 +836,14 @@ void UbloxNode::initializeIo() {
     gps.initializeSerial(device_, baudrate_, uart_in_, uart_out_);
   }
 
-  if (raw_data_stream_flag_ || (!raw_data_stream_dir_.empty())) {
-    gps.setRawDataCallback(
-      boost::bind(&UbloxNode::rawDataCallback,this, _1, _2));
-
+  if (raw_data_stream_flag_ || raw_data_string_flag_
+      || (!raw_data_stream_dir_.empty())) {
     if (raw_data_stream_flag_) {
+      ROS_INFO("Publishing raw data chunks.");
+      raw_data_publisher_.initialize("raw_data_chunks", raw_data_chunk_size_,
+                                     raw_data_chunk_period_);
+    }
+    if (raw_data_string_flag_) {
       ROS_INFO("Publishing raw data stream.");
       std_msgs::String msg;
       ublox_node::publish(msg, "raw_data_stream");
@@ -560,42 +864,60 @@ void UbloxNode::initializeIo() {
           raw_data_stream_dir_ += '/';
         }
 
-        time_t t = time(NULL);
-        struct tm time_struct = *localtime(&t);
-
-        std::stringstream filename;
-        filename.width(4); filename.fill('0');
-          filename << time_struct.tm_year + 1900;
-          filename.width(0); filename << '_';
-        filename.width(2); filename.fill('0');
-          filename << time_struct.tm_mon  + 1;
-          filename.width(0); filename << '_';
-        filename.width(2); filename.fill('0'); filename << time_struct.tm_mday;
-          filename.width(0); filename << '_';
-        filename.width(2); filename.fill('0'); filename << time_struct.tm_hour;
-        filename.width(2); filename.fill('0'); filename << time_struct.tm_min ;
-        filename.width(0); filename << ".log";
-        raw_data_stream_filename_ = raw_data_stream_dir_ + filename.str();
-
-        try {
-          raw_data_stream_file_.open(raw_data_stream_filename_);
-          ROS_INFO("Logging raw data to file \"%s\"", 
+        // Let the io_uring worker append the log along with its port I/O,
+        // unless the log needs the index, compression or rotation of the
+        // RawLogger
+        const ublox_gps::RawLogger::Options& options = raw_data_log_options_;
+        bool plain_log = !options.index && !options.compress
+            && options.rotate_size == 0 && options.rotate_period <= 0;
+        raw_data_stream_filename_ =
+            ublox_gps::RawLogger::fileName(raw_data_stream_dir_);
+        int fd = io_uring_serial_ && plain_log
+            ? ::open(raw_data_stream_filename_.c_str(),
+                     O_WRONLY | O_CREAT | O_TRUNC, 0644)
+            : -1;
+        if (fd >= 0 && gps.setRawDataLog(fd)) {
+          ROS_INFO("Logging raw data to file \"%s\" through io_uring",
             raw_data_stream_filename_.c_str());
-        } catch(const std::exception& e) {
-          ROS_ERROR("Can't log raw data to file. "
-            "Can't create file \"%s\".", raw_data_stream_filename_.c_str());
+        } else {
+          if (fd >= 0) {
+            ::close(fd);
+            ::unlink(raw_data_stream_filename_.c_str());
+          }
+          try {
+            raw_data_logger_.reset(new ublox_gps::RawLogger(
+                raw_data_stream_dir_, raw_data_log_options_));
+          } catch(const std::exception& e) {
+            ROS_ERROR("Can't log raw data to file. %s", e.what());
+          }
         }
       }
     }
+
+    // Set the callback once the publisher and the logger are ready
+    gps.setRawDataCallback(
+      boost::bind(&UbloxNode::rawDataCallback,this, _1, _2, _3));
   }
 }
 
 void UbloxNode::initialize() {
+  typedef ublox_gps::StartupProfiler::Phase Phase;
+  startup_profiler_.reset(new ublox_gps::StartupProfiler);
+  gps.setStartupProfiler(startup_profiler_);
   // Params must be set before initializing IO
-  getRosParams();
-  initializeIo();
+  {
+    Phase phase(startup_profiler_.get(), "getRosParams");
+    getRosParams();
+  }
+  {
+    Phase phase(startup_profiler_.get(), "initializeIo");
+    initializeIo();
+  }
   // Must process Mon VER before setting firmware/hardware params
-  processMonVer();
+  {
+    Phase phase(startup_profiler_.get(), "processMonVer");
+    processMonVer();
+  }
   // if(protocol_version_ <= 14) {
   //   if(nh->param("raw_data", false))
   //     components_.push_back(ComponentPtr(new RawDataProduct));
@@ -604,21 +926,66 @@ void UbloxNode::initialize() {
   // for (int i = 0; i < components_.size(); i++)
   //   components_[i]->getRosParams();
   // Do this last
-  initializeRosDiagnostics();
+  {
+    Phase phase(startup_profiler_.get(), "initializeRosDiagnostics");
+    initializeRosDiagnostics();
+  }
 
   //if (configureUblox()) {
     ROS_INFO("U-Blox configured successfully.");
     // Subscribe to all U-Blox messages
-    subscribe();
+    {
+      Phase phase(startup_profiler_.get(), "subscribe");
+      subscribe();
+    }
     // Configure INF messages (needs INF params, call after subscribing)
-    configureInf();
+    {
+      Phase phase(startup_profiler_.get(), "configureInf");
+      configureInf();
+    }
+    if (on_demand)
+      rate_manager.start();
+    // Replay a log once all messages are subscribed
+    gps.startReplay();
+    if (flight_recorder)
+      dump_service_ = nh->advertiseService(
+          "dump_flight_recorder", &UbloxNode::dumpFlightRecorder, this);
+    if (latency_stats)
+      latency_service_ = nh->advertiseService(
+          "dump_latency", &UbloxNode::dumpLatency, this);
+    ros::Timer metrics_timer;
+    if (metrics && metrics_period_ > 0) {
+      metrics_publisher_ = nh->advertise<diagnostic_msgs::DiagnosticStatus>(
+          "metrics", kROSQueueSize);
+      metrics_timer = nh->createTimer(ros::Duration(metrics_period_),
+                                      &UbloxNode::publishMetrics, this);
+    }
+    if (metrics && metrics_port_ > 0) {
+      try {
+        metrics_server_.reset(new ublox_gps::MetricsServer(
+            metrics, metrics_address_, metrics_port_));
+      } catch (std::exception& e) {
+        ROS_ERROR("Can't serve the u-blox metrics on %s:%u: %s",
+                  metrics_address_.c_str(), metrics_port_, e.what());
+      }
+    }
+    ros::Timer replay;
+    if (replay_exit_ && device_.compare(0, 7, "file://") == 0)
+      replay = nh->createTimer(ros::Duration(kPollDuration),
+                               &UbloxNode::checkReplay, this);
 
     ros::Timer poller;
     poller = nh->createTimer(ros::Duration(kPollDuration),
                              &UbloxNode::pollMessages,
                              this);
     poller.start();
-    ros::spin();
+    // Aggregate & publish all diagnostics at a fixed rate
+    ros::Timer diagnostics = nh->createTimer(
+        ros::Duration(kDiagnosticPeriod), &UbloxNode::updateDiagnostics, this);
+    reportStartup();
+    // Spin like ros::spin, but stop before ROS shuts down
+    while (ros::ok() && !shutdown_requested)
+      ros::getGlobalCallbackQueue()->callAvailable(ros::WallDuration(0.1));
   //}
   shutdown();
 }
@@ -628,26 +995,125 @@ void UbloxNode::shutdown() {
     gps.close();
     ROS_INFO("Closed connection to %s.", device_.c_str());
   }
+  // Publish the rest of the raw data once no more data is received
+  if (raw_data_stream_flag_) raw_data_publisher_.flush();
+  // Write the rest of the raw data log once no more data is received
+  raw_data_logger_.reset();
+  if (latency_stats) ROS_INFO("%s", latency_stats->report().c_str());
+  metrics_server_.reset();
 }
 
 void UbloxNode::rawDataCallback(const unsigned char* data,
-  const std::size_t size) {
+  const std::size_t size, const ros::Time& stamp) {
+
+  if (raw_data_stream_flag_)
+    raw_data_publisher_.add(data, size, stamp);
 
-  std::string str((const char*) data, size);
-  if (raw_data_stream_flag_) {
+  // The type raw_data_stream had before the chunks, for old subscribers
+  if (raw_data_string_flag_) {
     std_msgs::String msg;
-    msg.data = str;
+    msg.data.assign((const char*) data, size);
     ublox_node::publish(msg, "raw_data_stream");
   }
 
-  if (raw_data_stream_file_.is_open()) {
-    try {
-      raw_data_stream_file_ << str;
-      // raw_data_stream_file_.flush();
-    } catch(const std::exception& e) {
-      ROS_WARN("Error writing to file \"%s\"", raw_data_stream_filename_.c_str());
+  if (raw_data_logger_)
+    raw_data_logger_->write(data, size);
+}
+
+bool UbloxNode::dumpFlightRecorder(std_srvs::Trigger::Request& req,
+                                   std_srvs::Trigger::Response& res) {
+  res.message = flight_recorder->dump("Requested");
+  res.success = !res.message.empty();
+  if (!res.success) res.message = "A dump is still being written";
+  return true;
+}
+
+void UbloxNode::latencyDiagnostics(
+    diagnostic_updater::DiagnosticStatusWrapper& stat) {
+  std::vector<ublox_gps::LatencyStats::Summary> summaries =
+      latency_stats->summaries(true);
+  stat.level = diagnostic_msgs::DiagnosticStatus::OK;
+  stat.message = "Latency after the last byte arrived [us]";
+  for (std::size_t i = 0; i < summaries.size(); ++i) {
+    const ublox_gps::LatencyStats::Summary& summary = summaries[i];
+    stat.addf(summary.type, "%s p50 %ld, p99 %ld, max %ld",
+              ublox_gps::LatencyStats::stageName(summary.stage),
+              (long) summary.p50, (long) summary.p99, (long) summary.max);
+  }
+}
+
+bool UbloxNode::dumpLatency(std_srvs::Trigger::Request& req,
+                            std_srvs::Trigger::Response& res) {
+  res.message = latency_stats->report();
+  res.success = true;
+  return true;
+}
+
+void UbloxNode::reportStartup() {
+  startup_profiler_->finish();
+  ROS_INFO("%s", startup_profiler_->report().c_str());
+  std::string json = startup_profiler_->json();
+  nh->setParam("startup/report", json);
+  std::string file;
+  nh->param<std::string>("startup/report_file", file, "");
+  if (!file.empty()) {
+    std::ofstream out(file.c_str());
+    out << json << std::endl;
+    if (!out)
+      ROS_WARN("Can't write the u-blox startup report to %s", file.c_str());
+  }
+}
+
+void UbloxNode::publishMetrics(const ros::TimerEvent& event) {
+  ros::WallTime now = ros::WallTime::now();
+  double period = last_metrics_time_.isZero()
+                  ? 0 : (now - last_metrics_time_).toSec();
+  last_metrics_time_ = now;
+
+  diagnostic_msgs::DiagnosticStatus status;
+  status.name = "ublox metrics";
+  status.hardware_id = "ublox";
+  diagnostic_msgs::KeyValue value;
+  last_metrics_.resize(ublox_gps::Metrics::kCounters);
+  for (int i = 0; i < ublox_gps::Metrics::kCounters; ++i) {
+    ublox_gps::Metrics::Counter counter =
+        static_cast<ublox_gps::Metrics::Counter>(i);
+    uint64_t count = metrics->get(counter);
+    value.key = ublox_gps::Metrics::name(counter);
+    value.value = boost::lexical_cast<std::string>(count);
+    status.values.push_back(value);
+    // Rates of the throughput counters
+    if (period > 0 && (counter == ublox_gps::Metrics::kBytesReceived
+                       || counter == ublox_gps::Metrics::kBytesSent)) {
+      value.key += "/s";
+      value.value = boost::str(
+          boost::format("%.0f") % ((count - last_metrics_[i]) / period));
+      status.values.push_back(value);
     }
+    last_metrics_[i] = count;
   }
+  // Rate of each message type, both lists are sorted by class & message ID
+  std::vector<ublox_gps::Metrics::FrameCount> frames = metrics->frames();
+  std::size_t last = 0;
+  for (std::size_t i = 0; i < frames.size() && period > 0; ++i) {
+    while (last < last_frames_.size()
+           && (last_frames_[last].class_id << 8 | last_frames_[last].message_id)
+              < (frames[i].class_id << 8 | frames[i].message_id))
+      ++last;
+    uint64_t previous = 0;
+    if (last < last_frames_.size()
+        && last_frames_[last].class_id == frames[i].class_id
+        && last_frames_[last].message_id == frames[i].message_id)
+      previous = last_frames_[last].count;
+    value.key = boost::str(boost::format("frames/s 0x%02x/0x%02x")
+                           % static_cast<unsigned int>(frames[i].class_id)
+                           % static_cast<unsigned int>(frames[i].message_id));
+    value.value = boost::str(
+        boost::format("%.1f") % ((frames[i].count - previous) / period));
+    status.values.push_back(value);
+  }
+  last_frames_.swap(frames);
+  metrics_publisher_.publish(status);
 }
 
 //
@@ -719,6 +1185,9 @@ void UbloxFirmware6::subscribe() {
   nh->param("publish/nav/posllh", enabled["nav_posllh"], enabled["nav"]);
   nh->param("publish/nav/sol", enabled["nav_sol"], enabled["nav"]);
   nh->param("publish/nav/velned", enabled["nav_velned"], enabled["nav"]);
+  publish_nav_posllh_ = enabled["nav_posllh"];
+  publish_nav_sol_ = enabled["nav_sol"];
+  publish_nav_velned_ = enabled["nav_velned"];
 
   // Always subscribes to these messages, but may not publish to ROS topic
   // Subscribe to Nav POSLLH
@@ -734,64 +1203,65 @@ void UbloxFirmware6::subscribe() {
   // Subscribe to Nav SVINFO
   nh->param("publish/nav/svinfo", enabled["nav_svinfo"], enabled["nav"]);
   if (enabled["nav_svinfo"])
-    gps.subscribe<ublox_msgs::NavSVINFO>(boost::bind(
-        publish<ublox_msgs::NavSVINFO>, _1, "navsvinfo"),
-        kNavSvInfoSubscribeRate);
+    subscribeTopic<ublox_msgs::NavSVINFO>("navsvinfo",
+                                          kNavSvInfoSubscribeRate);
 
   // Subscribe to Mon HW
   nh->param("publish/mon_hw", enabled["mon_hw"], enabled["mon"]);
   if (enabled["mon_hw"])
-    gps.subscribe<ublox_msgs::MonHW6>(boost::bind(
-        publish<ublox_msgs::MonHW6>, _1, "monhw"), kSubscribeRate);
+    subscribeTopic<ublox_msgs::MonHW6>("monhw", kSubscribeRate);
 }
 
 void UbloxFirmware6::fixDiagnostic(
     diagnostic_updater::DiagnosticStatusWrapper& stat) {
+  const ublox_msgs::NavPOSLLH last_nav_pos = diag_nav_pos_.get();
+  const ublox_msgs::NavSOL last_nav_sol = diag_nav_sol_.get();
   // Set the diagnostic level based on the fix status
-  if (last_nav_sol_.gpsFix == ublox_msgs::NavSOL::GPS_DEAD_RECKONING_ONLY) {
+  if (last_nav_sol.gpsFix == ublox_msgs::NavSOL::GPS_DEAD_RECKONING_ONLY) {
     stat.level = diagnostic_msgs::DiagnosticStatus::WARN;
     stat.message = "Dead reckoning only";
-  } else if (last_nav_sol_.gpsFix == ublox_msgs::NavSOL::GPS_2D_FIX) {
+  } else if (last_nav_sol.gpsFix == ublox_msgs::NavSOL::GPS_2D_FIX) {
     stat.level = diagnostic_msgs::DiagnosticStatus::OK;
     stat.message = "2D fix";
-  } else if (last_nav_sol_.gpsFix == ublox_msgs::NavSOL::GPS_3D_FIX) {
+  } else if (last_nav_sol.gpsFix == ublox_msgs::NavSOL::GPS_3D_FIX) {
     stat.level = diagnostic_msgs::DiagnosticStatus::OK;
     stat.message = "3D fix";
-  } else if (last_nav_sol_.gpsFix ==
+  } else if (last_nav_sol.gpsFix ==
              ublox_msgs::NavSOL::GPS_GPS_DEAD_RECKONING_COMBINED) {
     stat.level = diagnostic_msgs::DiagnosticStatus::OK;
     stat.message = "GPS and dead reckoning combined";
-  } else if (last_nav_sol_.gpsFix == ublox_msgs::NavSOL::GPS_TIME_ONLY_FIX) {
+  } else if (last_nav_sol.gpsFix == ublox_msgs::NavSOL::GPS_TIME_ONLY_FIX) {
     stat.level = diagnostic_msgs::DiagnosticStatus::OK;
     stat.message = "Time fix only";
   }
   // If fix is not ok (within DOP & Accuracy Masks), raise the diagnostic level
-  if (!(last_nav_sol_.flags & ublox_msgs::NavSOL::FLAGS_GPS_FIX_OK)) {
+  if (!(last_nav_sol.flags & ublox_msgs::NavSOL::FLAGS_GPS_FIX_OK)) {
     stat.level = diagnostic_msgs::DiagnosticStatus::WARN;
     stat.message += ", fix not ok";
   }
   // Raise diagnostic level to error if no fix
-  if (last_nav_sol_.gpsFix == ublox_msgs::NavSOL::GPS_NO_FIX) {
+  if (last_nav_sol.gpsFix == ublox_msgs::NavSOL::GPS_NO_FIX) {
     stat.level = diagnostic_msgs::DiagnosticStatus::ERROR;
     stat.message = "No fix";
   }
 
   // Add last fix position
-  stat.add("iTOW [ms]", last_nav_pos_.iTOW);
-  stat.add("Latitude [deg]", last_nav_pos_.lat * 1e-7);
-  stat.add("Longitude [deg]", last_nav_pos_.lon * 1e-7);
-  stat.add("Altitude [m]", last_nav_pos_.height * 1e-3);
-  stat.add("Height above MSL [m]", last_nav_pos_.hMSL * 1e-3);
-  stat.add("Horizontal Accuracy [m]", last_nav_pos_.hAcc * 1e-3);
-  stat.add("Vertical Accuracy [m]", last_nav_pos_.vAcc * 1e-3);
-  stat.add("# SVs used", (int)last_nav_sol_.numSV);
+  stat.add("iTOW [ms]", last_nav_pos.iTOW);
+  stat.add("Latitude [deg]", last_nav_pos.lat * 1e-7);
+  stat.add("Longitude [deg]", last_nav_pos.lon * 1e-7);
+  stat.add("Altitude [m]", last_nav_pos.height * 1e-3);
+  stat.add("Height above MSL [m]", last_nav_pos.hMSL * 1e-3);
+  stat.add("Horizontal Accuracy [m]", last_nav_pos.hAcc * 1e-3);
+  stat.add("Vertical Accuracy [m]", last_nav_pos.vAcc * 1e-3);
+  stat.add("# SVs used", (int)last_nav_sol.numSV);
 }
 
 void UbloxFirmware6::callbackNavPosLlh(const ublox_msgs::NavPOSLLH& m) {
-  if(enabled["nav_posllh"]) {
+  if(publish_nav_posllh_) {
     static ros::Publisher publisher =
         nh->advertise<ublox_msgs::NavPOSLLH>("navposllh", kROSQueueSize);
     publisher.publish(m);
+    recordPublished();
   }
 
   // Position message
@@ -800,7 +1270,7 @@ void UbloxFirmware6::callbackNavPosLlh(const ublox_msgs::NavPOSLLH& m) {
   if (m.iTOW == last_nav_vel_.iTOW)
     fix_.header.stamp = velocity_.header.stamp; // use last timestamp
   else
-    fix_.header.stamp = ros::Time::now(); // new timestamp
+    fix_.header.stamp = epochStamp(m.iTOW); // new timestamp
 
   fix_.header.frame_id = frame_id;
   fix_.latitude = m.lat * 1e-7;
@@ -824,17 +1294,19 @@ void UbloxFirmware6::callbackNavPosLlh(const ublox_msgs::NavPOSLLH& m) {
 
   fix_.status.service = fix_.status.SERVICE_GPS;
   fixPublisher.publish(fix_);
+  recordPublished();
   last_nav_pos_ = m;
+  diag_nav_pos_.set(m);
   //  update diagnostics
   freq_diag.diagnostic->tick(fix_.header.stamp);
-  updater->update();
 }
 
 void UbloxFirmware6::callbackNavVelNed(const ublox_msgs::NavVELNED& m) {
-  if(enabled["nav_velned"]) {
+  if(publish_nav_velned_) {
     static ros::Publisher publisher =
         nh->advertise<ublox_msgs::NavVELNED>("navvelned", kROSQueueSize);
     publisher.publish(m);
+    recordPublished();
   }
 
   // Example geometry message
@@ -844,7 +1316,7 @@ void UbloxFirmware6::callbackNavVelNed(const ublox_msgs::NavVELNED& m) {
   if (m.iTOW == last_nav_pos_.iTOW)
     velocity_.header.stamp = fix_.header.stamp; // same time as last navposllh
   else
-    velocity_.header.stamp = ros::Time::now(); // create a new timestamp
+    velocity_.header.stamp = epochStamp(m.iTOW); // create a new timestamp
   velocity_.header.frame_id = frame_id;
 
   //  convert to XYZ linear velocity
@@ -861,16 +1333,19 @@ void UbloxFirmware6::callbackNavVelNed(const ublox_msgs::NavVELNED& m) {
   velocity_.twist.covariance[cols * 3 + 3] = -1;  //  angular rate unsupported
 
   velocityPublisher.publish(velocity_);
+  recordPublished();
   last_nav_vel_ = m;
 }
 
 void UbloxFirmware6::callbackNavSol(const ublox_msgs::NavSOL& m) {
-  if(enabled["nav_sol"]) {
+  if(publish_nav_sol_) {
     static ros::Publisher publisher =
         nh->advertise<ublox_msgs::NavSOL>("navsol", kROSQueueSize);
     publisher.publish(m);
+    recordPublished();
   }
   last_nav_sol_ = m;
+  diag_nav_sol_.set(m);
 }
 
 //
@@ -1037,6 +1512,7 @@ bool UbloxFirmware7::configureUblox() {
 void UbloxFirmware7::subscribe() {
   // Whether to publish Nav PVT messages to a ROS topic
   nh->param("publish/nav/pvt", enabled["nav_pvt"], enabled["nav"]);
+  publish_nav_pvt_ = enabled["nav_pvt"];
   // Subscribe to Nav PVT (always does so since fix information is published
   // from this)
   gps.subscribe<ublox_msgs::NavPVT7>(boost::bind(
@@ -1046,15 +1522,13 @@ void UbloxFirmware7::subscribe() {
   // Subscribe to Nav SVINFO
   nh->param("publish/nav/svinfo", enabled["nav_svinfo"], enabled["nav"]);
   if (enabled["nav_svinfo"])
-    gps.subscribe<ublox_msgs::NavSVINFO>(boost::bind(
-        publish<ublox_msgs::NavSVINFO>, _1, "navsvinfo"),
-        kNavSvInfoSubscribeRate);
+    subscribeTopic<ublox_msgs::NavSVINFO>("navsvinfo",
+                                          kNavSvInfoSubscribeRate);
 
   // Subscribe to Mon HW
   nh->param("publish/mon_hw", enabled["mon_hw"], enabled["mon"]);
   if (enabled["mon_hw"])
-    gps.subscribe<ublox_msgs::MonHW>(boost::bind(
-        publish<ublox_msgs::MonHW>, _1, "monhw"), kSubscribeRate);
+    subscribeTopic<ublox_msgs::MonHW>("monhw", kSubscribeRate);
 }
 
 //
@@ -1270,6 +1744,7 @@ bool UbloxFirmware8::configureUblox() {
 void UbloxFirmware8::subscribe() {
   // Whether to publish Nav PVT messages
   nh->param("publish/nav/pvt", enabled["nav_pvt"], enabled["nav"]);
+  publish_nav_pvt_ = enabled["nav_pvt"];
   // Subscribe to Nav PVT
   gps.subscribe<ublox_msgs::NavPVT>(
     boost::bind(&UbloxFirmware7Plus::callbackNavPvt, this, _1), kSubscribeRate);
@@ -1277,20 +1752,233 @@ void UbloxFirmware8::subscribe() {
   // Subscribe to Nav SAT messages
   nh->param("publish/nav/sat", enabled["nav_sat"], enabled["nav"]);
   if (enabled["nav_sat"])
-    gps.subscribe<ublox_msgs::NavSAT>(boost::bind(
-        publish<ublox_msgs::NavSAT>, _1, "navsat"), kNavSvInfoSubscribeRate);
+    subscribeTopic<ublox_msgs::NavSAT>("navsat", kNavSvInfoSubscribeRate);
 
   // Subscribe to Mon HW
   nh->param("publish/mon/hw", enabled["mon_hw"], enabled["mon"]);
   if (enabled["mon_hw"])
-    gps.subscribe<ublox_msgs::MonHW>(boost::bind(
-        publish<ublox_msgs::MonHW>, _1, "monhw"), kSubscribeRate);
+    subscribeTopic<ublox_msgs::MonHW>("monhw", kSubscribeRate);
 
   // Subscribe to RTCM messages
   nh->param("publish/rxm/rtcm", enabled["rxm_rtcm"], enabled["rxm"]);
   if (enabled["rxm_rtcm"])
-    gps.subscribe<ublox_msgs::RxmRTCM>(boost::bind(
-        publish<ublox_msgs::RxmRTCM>, _1, "rxmrtcm"), kSubscribeRate);
+    subscribeTopic<ublox_msgs::RxmRTCM>("rxmrtcm", kSubscribeRate);
+}
+
+//
+// Navigation Epoch Assembler
+//
+EpochAssembler::EpochAssembler() : open_(false), published_(false),
+                                   published_iTOW_(0), use_eoe_(true),
+                                   configured_(0) {}
+
+void EpochAssembler::getRosParams() {
+  std::vector<std::string> defaults;
+  defaults.push_back("pvt");
+  defaults.push_back("dop");
+  std::vector<std::string> messages;
+  nh->param("epoch/messages", messages, defaults);
+  // NAV-EOE is supported from protocol version 18
+  nh->param("epoch/eoe", use_eoe_, true);
+
+  configured_ = 0;
+  for (size_t i = 0; i < messages.size(); ++i) {
+    std::string name = boost::algorithm::to_lower_copy(messages[i]);
+    if (name == "pvt")
+      configured_ |= ublox_msgs::NavEpoch::RECEIVED_PVT;
+    else if (name == "posecef")
+      configured_ |= ublox_msgs::NavEpoch::RECEIVED_POSECEF;
+    else if (name == "relposned")
+      configured_ |= ublox_msgs::NavEpoch::RECEIVED_RELPOSNED;
+    else if (name == "dop")
+      configured_ |= ublox_msgs::NavEpoch::RECEIVED_DOP;
+    else if (name == "clock")
+      configured_ |= ublox_msgs::NavEpoch::RECEIVED_CLOCK;
+    else
+      throw std::runtime_error("Invalid settings: epoch/messages " + name +
+                               " must be pvt, posecef, relposned, dop or clock");
+  }
+  if (!use_eoe_ && configured_ == 0)
+    throw std::runtime_error(std::string("Invalid settings: epoch/messages ") +
+                             "must be set if epoch/eoe is false");
+}
+
+void EpochAssembler::subscribe() {
+  // Messages which are not configured are only added if the device outputs
+  // them anyway
+  subscribeNav<ublox_msgs::NavPVT>(&EpochAssembler::callbackNavPvt,
+                                   ublox_msgs::NavEpoch::RECEIVED_PVT);
+  subscribeNav<ublox_msgs::NavPOSECEF>(&EpochAssembler::callbackNavPosEcef,
+                                       ublox_msgs::NavEpoch::RECEIVED_POSECEF);
+  subscribeNav<ublox_msgs::NavRELPOSNED>(
+      &EpochAssembler::callbackNavRelPosNed,
+      ublox_msgs::NavEpoch::RECEIVED_RELPOSNED);
+  subscribeNav<ublox_msgs::NavDOP>(&EpochAssembler::callbackNavDop,
+                                   ublox_msgs::NavEpoch::RECEIVED_DOP);
+  subscribeNav<ublox_msgs::NavCLOCK>(&EpochAssembler::callbackNavClock,
+                                     ublox_msgs::NavEpoch::RECEIVED_CLOCK);
+  if (use_eoe_)
+    gps.subscribe<ublox_msgs::NavEOE>(boost::bind(
+        &EpochAssembler::callbackNavEoe, this, _1), kSubscribeRate);
+}
+
+bool EpochAssembler::openEpoch(uint32_t iTOW) {
+  if (open_ && epoch_.iTOW == iTOW)
+    return true;
+  if (open_)
+    publishEpoch();
+  // Late message of a published epoch
+  if (published_ && published_iTOW_ == iTOW)
+    return false;
+
+  epoch_ = ublox_msgs::NavEpoch();
+  epoch_.header.frame_id = frame_id;
+  // Stamp with the estimated measurement time of the epoch, or with the
+  // arrival of its first message if the clock is not estimated
+  epoch_.header.stamp = epochStamp(iTOW);
+  epoch_.iTOW = iTOW;
+  open_ = true;
+  return true;
+}
+
+void EpochAssembler::addReceived(uint8_t received) {
+  epoch_.received |= received;
+  if (!use_eoe_ && (epoch_.received & configured_) == configured_)
+    publishEpoch();
+}
+
+void EpochAssembler::publishEpoch() {
+  publish(epoch_, "navepoch");
+  open_ = false;
+  published_ = true;
+  published_iTOW_ = epoch_.iTOW;
+}
+
+void EpochAssembler::callbackNavPvt(const ublox_msgs::NavPVT& m) {
+  if (!openEpoch(m.iTOW))
+    return;
+  sensor_msgs::NavSatFix& fix = epoch_.fix;
+  fix.header = epoch_.header;
+  fix.latitude = m.lat * 1e-7; // to deg
+  fix.longitude = m.lon * 1e-7; // to deg
+  fix.altitude = m.height * 1e-3; // to [m]
+  if ((m.flags & m.FLAGS_GNSS_FIX_OK) && m.fixType >= m.FIX_TYPE_2D) {
+    fix.status.status = fix.status.STATUS_FIX;
+    if (m.flags & m.CARRIER_PHASE_FIXED)
+      fix.status.status = fix.status.STATUS_GBAS_FIX;
+  } else {
+    fix.status.status = fix.status.STATUS_NO_FIX;
+  }
+  fix.status.service = fix_status_service;
+  const double varH = pow(m.hAcc / 1000.0, 2); // to [m^2]
+  const double varV = pow(m.vAcc / 1000.0, 2); // to [m^2]
+  fix.position_covariance[0] = varH;
+  fix.position_covariance[4] = varH;
+  fix.position_covariance[8] = varV;
+  fix.position_covariance_type =
+      sensor_msgs::NavSatFix::COVARIANCE_TYPE_DIAGONAL_KNOWN;
+
+  epoch_.fixType = m.fixType;
+  epoch_.flags = m.flags;
+  epoch_.numSV = m.numSV;
+  epoch_.velNED[0] = m.velN * 1e-3; // to [m/s]
+  epoch_.velNED[1] = m.velE * 1e-3;
+  epoch_.velNED[2] = m.velD * 1e-3;
+  epoch_.sAcc = m.sAcc * 1e-3; // to [m/s]
+  epoch_.heading = m.heading * 1e-5; // to [deg]
+  epoch_.headAcc = m.headAcc * 1e-5; // to [deg]
+  epoch_.hAcc = m.hAcc * 1e-3; // to [m]
+  epoch_.vAcc = m.vAcc * 1e-3; // to [m]
+  epoch_.tAcc = m.tAcc * 1e-9; // to [s]
+  addReceived(ublox_msgs::NavEpoch::RECEIVED_PVT);
+}
+
+void EpochAssembler::callbackNavPosEcef(const ublox_msgs::NavPOSECEF& m) {
+  if (!openEpoch(m.iTOW))
+    return;
+  epoch_.posECEF[0] = m.ecefX * 1e-2; // to [m]
+  epoch_.posECEF[1] = m.ecefY * 1e-2;
+  epoch_.posECEF[2] = m.ecefZ * 1e-2;
+  epoch_.pAcc = m.pAcc * 1e-2; // to [m]
+  addReceived(ublox_msgs::NavEpoch::RECEIVED_POSECEF);
+}
+
+void EpochAssembler::callbackNavRelPosNed(const ublox_msgs::NavRELPOSNED& m) {
+  if (!openEpoch(m.iTow))
+    return;
+  epoch_.relPosNED[0] = (m.relPosN + m.relPosHPN * 1e-2) * 1e-2; // to [m]
+  epoch_.relPosNED[1] = (m.relPosE + m.relPosHPE * 1e-2) * 1e-2;
+  epoch_.relPosNED[2] = (m.relPosD + m.relPosHPD * 1e-2) * 1e-2;
+  epoch_.relPosAcc[0] = m.accN * 1e-4; // to [m]
+  epoch_.relPosAcc[1] = m.accE * 1e-4;
+  epoch_.relPosAcc[2] = m.accD * 1e-4;
+  epoch_.relPosFlags = m.flags;
+  addReceived(ublox_msgs::NavEpoch::RECEIVED_RELPOSNED);
+}
+
+void EpochAssembler::callbackNavDop(const ublox_msgs::NavDOP& m) {
+  if (!openEpoch(m.iTOW))
+    return;
+  epoch_.gDOP = m.gDOP * 1e-2;
+  epoch_.pDOP = m.pDOP * 1e-2;
+  epoch_.tDOP = m.tDOP * 1e-2;
+  epoch_.vDOP = m.vDOP * 1e-2;
+  epoch_.hDOP = m.hDOP * 1e-2;
+  epoch_.nDOP = m.nDOP * 1e-2;
+  epoch_.eDOP = m.eDOP * 1e-2;
+  addReceived(ublox_msgs::NavEpoch::RECEIVED_DOP);
+}
+
+void EpochAssembler::callbackNavClock(const ublox_msgs::NavCLOCK& m) {
+  if (!openEpoch(m.iTOW))
+    return;
+  epoch_.clkB = m.clkB * 1e-9; // to [s]
+  epoch_.clkD = m.clkD * 1e-9; // to [s/s]
+  addReceived(ublox_msgs::NavEpoch::RECEIVED_CLOCK);
+}
+
+void EpochAssembler::callbackNavEoe(const ublox_msgs::NavEOE& m) {
+  // Nothing of this epoch was received
+  if (!open_)
+    return;
+  // Otherwise the end of the open epoch was lost, publish it as it is
+  if (epoch_.iTOW == m.iTOW)
+    epoch_.received |= ublox_msgs::NavEpoch::RECEIVED_EOE;
+  publishEpoch();
+}
+
+//
+// RINEX output
+//
+void RinexLogger::getRosParams() {
+  std::string dir;
+  nh->param("rinex/dir", dir, std::string(""));
+  ublox_gps::RinexWriter::Options options;
+  nh->param("rinex/station", options.station, options.station);
+  nh->param("rinex/marker", options.marker, options.marker);
+  nh->param("rinex/receiver", options.receiver, options.receiver);
+  nh->param("rinex/antenna", options.antenna, options.antenna);
+  nh->param("rinex/rotate_period", options.rotate_period,
+            options.rotate_period);
+  nh->param("rinex/flush_period", options.flush_period,
+            options.flush_period);
+  checkMin(options.rotate_period, 0, "rinex/rotate_period");
+  if (options.station.size() != 9)
+    throw std::runtime_error("Invalid settings: rinex/station must have 9 "
+                             "characters");
+  options.interval = meas_rate * 1e-3;
+  writer_.reset(new ublox_gps::RinexWriter(dir, options));
+}
+
+void RinexLogger::subscribe() {
+  gps.subscribe<ublox_msgs::RxmRAWX>(boost::bind(
+      &ublox_gps::RinexWriter::writeObservations, writer_.get(), _1),
+      kSubscribeRate);
+  gps.subscribe<ublox_msgs::RxmSFRBX>(boost::bind(
+      &ublox_gps::RinexWriter::writeNavigation, writer_.get(), _1),
+      kSubscribeRate);
+  rate_manager.addUser<ublox_msgs::RxmRAWX>();
+  rate_manager.addUser<ublox_msgs::RxmSFRBX>();
 }
 
 //
@@ -1303,26 +1991,22 @@ void RawDataProduct::subscribe() {
   // Subscribe to RXM Raw
   nh->param("publish/rxm/raw", enabled["rxm_raw"], enabled["rxm"]);
   if (enabled["rxm_raw"])
-    gps.subscribe<ublox_msgs::RxmRAW>(boost::bind(
-        publish<ublox_msgs::RxmRAW>, _1, "rxmraw"), kSubscribeRate);
+    subscribeTopic<ublox_msgs::RxmRAW>("rxmraw", kSubscribeRate);
 
   // Subscribe to RXM SFRB
   nh->param("publish/rxm/sfrb", enabled["rxm_sfrb"], enabled["rxm"]);
   if (enabled["rxm_sfrb"])
-    gps.subscribe<ublox_msgs::RxmSFRB>(boost::bind(
-        publish<ublox_msgs::RxmSFRB>, _1, "rxmsfrb"), kSubscribeRate);
+    subscribeTopic<ublox_msgs::RxmSFRB>("rxmsfrb", kSubscribeRate);
 
   // Subscribe to RXM EPH
   nh->param("publish/rxm/eph", enabled["rxm_eph"], enabled["rxm"]);
   if (enabled["rxm_eph"])
-    gps.subscribe<ublox_msgs::RxmEPH>(boost::bind(
-        publish<ublox_msgs::RxmEPH>, _1, "rxmeph"), kSubscribeRate);
+    subscribeTopic<ublox_msgs::RxmEPH>("rxmeph", kSubscribeRate);
 
   // Subscribe to RXM ALM
   nh->param("publish/rxm/almRaw", enabled["rxm_alm"], enabled["rxm"]);
   if (enabled["rxm_alm"])
-    gps.subscribe<ublox_msgs::RxmALM>(boost::bind(
-        publish<ublox_msgs::RxmALM>, _1, "rxmalm"), kSubscribeRate);
+    subscribeTopic<ublox_msgs::RxmALM>("rxmalm", kSubscribeRate);
 }
 
 void RawDataProduct::initializeRosDiagnostics() {
@@ -1364,141 +2048,243 @@ void AdrUdrProduct::subscribe() {
   // Subscribe to NAV ATT messages
   nh->param("publish/nav/att", enabled["nav_att"], enabled["nav"]);
   if (enabled["nav_att"])
-    gps.subscribe<ublox_msgs::NavATT>(boost::bind(
-        publish<ublox_msgs::NavATT>, _1, "navatt"), kSubscribeRate);
+    subscribeTopic<ublox_msgs::NavATT>("navatt", kSubscribeRate);
 
   // Subscribe to ESF INS messages
   nh->param("publish/esf/ins", enabled["esf_ins"], enabled["esf"]);
   if (enabled["esf_ins"])
-    gps.subscribe<ublox_msgs::EsfINS>(boost::bind(
-        publish<ublox_msgs::EsfINS>, _1, "esfins"), kSubscribeRate);
+    subscribeTopic<ublox_msgs::EsfINS>("esfins", kSubscribeRate);
 
   // Subscribe to ESF Meas messages
   nh->param("publish/esf/meas", enabled["esf_meas"], enabled["esf"]);
-  if (enabled["esf_meas"])
+  nh->param("esf/meas_time_tag_unit", esf_time_tag_unit_, 1e-3);
+  if (enabled["esf_meas"]) {
     gps.subscribe<ublox_msgs::EsfMEAS>(boost::bind(
         publish<ublox_msgs::EsfMEAS>, _1, "esfmeas"), kSubscribeRate);
     // also publish sensor_msgs::Imu
     gps.subscribe<ublox_msgs::EsfMEAS>(boost::bind(
-      &AdrUdrProduct::callbackEsfMEAS, this, _1), kSubscribeRate);
- 
+        &AdrUdrProduct::callbackEsfMEAS, this, _1));
+  }
+
   // Subscribe to ESF Raw messages
   nh->param("publish/esf/raw", enabled["esf_raw"], enabled["esf"]);
-  if (enabled["esf_raw"])
+  nh->param("publish/esf/raw_imu", enabled["esf_raw_imu"], false);
+  nh->param("esf/raw_time_tag_unit", esf_raw_time_tag_unit_, 1e-3);
+  if (enabled["esf_raw_imu"]) {
+    // also publish each raw sample as sensor_msgs::Imu
     gps.subscribe<ublox_msgs::EsfRAW>(boost::bind(
-        publish<ublox_msgs::EsfRAW>, _1, "esfraw"), kSubscribeRate);
+        &AdrUdrProduct::callbackEsfRAW, this, _1), kSubscribeRate);
+    if (enabled["esf_raw"])
+      gps.subscribe<ublox_msgs::EsfRAW>(boost::bind(
+          publish<ublox_msgs::EsfRAW>, _1, "esfraw"));
+  } else if (enabled["esf_raw"]) {
+    subscribeTopic<ublox_msgs::EsfRAW>("esfraw", kSubscribeRate);
+  }
 
   // Subscribe to ESF Status messages
   nh->param("publish/esf/status", enabled["esf_status"], enabled["esf"]);
   if (enabled["esf_status"])
-    gps.subscribe<ublox_msgs::EsfSTATUS>(boost::bind(
-        publish<ublox_msgs::EsfSTATUS>, _1, "esfstatus"), kSubscribeRate);
+    subscribeTopic<ublox_msgs::EsfSTATUS>("esfstatus", kSubscribeRate);
 
   // Subscribe to HNR PVT messages
   nh->param("publish/hnr/pvt", enabled["hnr_pvt"], true);
   if (enabled["hnr_pvt"])
-    gps.subscribe<ublox_msgs::HnrPVT>(boost::bind(
-        publish<ublox_msgs::HnrPVT>, _1, "hnrpvt"), kSubscribeRate);
+    subscribeTopic<ublox_msgs::HnrPVT>("hnrpvt", kSubscribeRate);
+
+  // Sensor input to the dead reckoning, e.g. wheel speed or ticks
+  std::string odom_topic, esf_input_topic;
+  nh->param("esf/input/odom", odom_topic, std::string());
+  nh->param("esf/input/meas", esf_input_topic, std::string());
+  if (odom_topic.empty() && esf_input_topic.empty())
+    return;
+  nh->param("esf/input/rate", esf_input_rate_, 20.0);
+  if (esf_input_rate_ < kEsfInputRateMin
+      || esf_input_rate_ > kEsfInputRateMax) {
+    ROS_WARN("esf/input/rate must be in [%.0f, %.0f] Hz",
+             kEsfInputRateMin, kEsfInputRateMax);
+    if (esf_input_rate_ < kEsfInputRateMin)
+      esf_input_rate_ = kEsfInputRateMin;
+    else
+      esf_input_rate_ = kEsfInputRateMax;
+  }
+  esf_input_.reserve(kEsfInputQueueSize);
+  esf_input_stamps_.reserve(kEsfInputQueueSize);
+  if (!odom_topic.empty())
+    odom_sub_ = nh->subscribe(odom_topic, kEsfInputSubscribeQueueSize,
+                              &AdrUdrProduct::callbackOdometry, this);
+  if (!esf_input_topic.empty())
+    esf_input_sub_ = nh->subscribe(esf_input_topic,
+                                   kEsfInputSubscribeQueueSize,
+                                   &AdrUdrProduct::callbackEsfInput, this);
+  esf_input_timer_ = nh->createTimer(ros::Duration(1.0 / esf_input_rate_),
+                                     &AdrUdrProduct::sendEsfInput, this);
+
+  // The diagnostic needs the rate, which is only known here, after the
+  // diagnostics were initialized. A measurement waits at most one write
+  // period.
+  esf_input_diag_.reset(new ublox_gps::RateDiagnostic(
+      "esf input", kEsfInputRateMin, kEsfInputRateMax, kEsfInputFreqTol,
+      kEsfInputFreqWindow, 0, 2.0 / esf_input_rate_));
+  updater->add(*esf_input_diag_);
+}
+
+void AdrUdrProduct::callbackOdometry(const nav_msgs::Odometry::ConstPtr &m) {
+  ublox_msgs::EsfMEAS meas;
+  // The time tag is the measurement time in ms, the device only uses the
+  // differences between the time tags
+  meas.timeTag = m->header.stamp.toNSec() / 1000000;
+  meas.data.push_back(ublox_gps::esfDataWord(
+      ublox_msgs::EsfMEAS::DATA_TYPE_SPEED,
+      std::floor(m->twist.twist.linear.x * 1e3 + 0.5)));
+  queueEsfInput(meas, m->header.stamp);
+}
+
+void AdrUdrProduct::callbackEsfInput(const ublox_msgs::EsfMEAS::ConstPtr &m) {
+  queueEsfInput(*m, ros::Time::now());
+}
+
+void AdrUdrProduct::queueEsfInput(const ublox_msgs::EsfMEAS &m,
+                                  const ros::Time &stamp) {
+  if (esf_input_.size() == kEsfInputQueueSize) {
+    ROS_WARN_THROTTLE(1, "U-Blox sensor input queue full, dropping input");
+    esf_input_.erase(esf_input_.begin());
+    esf_input_stamps_.erase(esf_input_stamps_.begin());
+  }
+  esf_input_.push_back(m);
+  esf_input_stamps_.push_back(stamp);
+}
+
+void AdrUdrProduct::sendEsfInput(const ros::TimerEvent& event) {
+  if (esf_input_.empty())
+    return;
+  if (!gps.sendSensorData(esf_input_))
+    ROS_WARN_THROTTLE(1, "U-Blox failed to send sensor input");
+  else if (esf_input_diag_)
+    for (std::size_t i = 0; i < esf_input_stamps_.size(); ++i)
+      esf_input_diag_->tick(esf_input_stamps_[i]);
+  esf_input_.clear();
+  esf_input_stamps_.clear();
 }
 
 void AdrUdrProduct::callbackEsfMEAS(const ublox_msgs::EsfMEAS &m) {
-  if (enabled["esf_meas"]) {
-    static ros::Publisher imu_pub = 
-	nh->advertise<sensor_msgs::Imu>("imu_meas", kROSQueueSize);
-    static ros::Publisher time_ref_pub =
-	nh->advertise<sensor_msgs::TimeReference>("interrupt_time", kROSQueueSize);
-    
-    imu_.header.stamp = ros::Time::now();
-    imu_.header.frame_id = frame_id;
-    
-    float deg_per_sec = pow(2, -12);
-    float m_per_sec_sq = pow(2, -10);
-    float deg_c = 1e-2;
-     
-    std::vector<unsigned int> imu_data = m.data;
-    for (int i=0; i < imu_data.size(); i++){
-      unsigned int data_type = imu_data[i] >> 24; //grab the last six bits of data
-      double data_sign = (imu_data[i] & (1 << 23)); //grab the sign (+/-) of the rest of the data
-      unsigned int data_value = imu_data[i] & 0x7FFFFF; //grab the rest of the data...should be 23 bits
-      
-      if (data_sign == 0) {
-        data_sign = -1;
-      } else {
-        data_sign = 1;
-      }
-           
-      //ROS_INFO("data sign (+/-): %f", data_sign); //either 1 or -1....set by bit 23 in the data bitarray
-  
-      imu_.orientation_covariance[0] = -1;
-      imu_.linear_acceleration_covariance[0] = -1;
-      imu_.angular_velocity_covariance[0] = -1;
+  // Use the sensor time tag in host time once the sensor clock is known
+  ros::Time stamp = gps.arrivalTime();
+  checkTimeTagRate(m.timeTag, stamp, esf_time_tag_unit_, esf_check_,
+                   "ESF-MEAS", "esf/meas_time_tag_unit");
+  if (estimate_clock) {
+    esf_clock_.update(m.timeTag * esf_time_tag_unit_, stamp);
+    if (esf_clock_.valid())
+      stamp = esf_clock_.toHost(m.timeTag * esf_time_tag_unit_);
+  }
 
-      if (data_type == 14) {
-        if (data_sign == 1) {
-	  imu_.angular_velocity.x = 2048 - data_value * deg_per_sec;
-        } else {
-          imu_.angular_velocity.x = data_sign * data_value * deg_per_sec;
-        }
-      } else if (data_type == 16) {
-        //ROS_INFO("data_sign: %f", data_sign);
-        //ROS_INFO("data_value: %u", data_value * m);
-        if (data_sign == 1) {
-	  imu_.linear_acceleration.x = 8191 - data_value * m_per_sec_sq;
-        } else {
-          imu_.linear_acceleration.x = data_sign * data_value * m_per_sec_sq;
-        }
-      } else if (data_type == 13) {
-        if (data_sign == 1) {
-	  imu_.angular_velocity.y = 2048 - data_value * deg_per_sec;
-        } else {
-          imu_.angular_velocity.y = data_sign * data_value * deg_per_sec;
-        }
-      } else if (data_type == 17) {
-        if (data_sign == 1) {
-	  imu_.linear_acceleration.y = 8191 - data_value * m_per_sec_sq;
-        } else {
-          imu_.linear_acceleration.y = data_sign * data_value * m_per_sec_sq;
-        }
-      } else if (data_type == 5) {
-        if (data_sign == 1) {
-	  imu_.angular_velocity.z = 2048 - data_value * deg_per_sec;
-        } else {
-          imu_.angular_velocity.z = data_sign * data_value * deg_per_sec;
-        }
-      } else if (data_type == 18) {
-        if (data_sign == 1) {
-	  imu_.linear_acceleration.z = 8191 - data_value * m_per_sec_sq;
-        } else {
-          imu_.linear_acceleration.z = data_sign * data_value * m_per_sec_sq;
-        }
-      } else if (data_type == 12) {
-        //ROS_INFO("Temperature in celsius: %f", data_value * deg_c); 
-      } else {
-        ROS_INFO("data_type: %u", data_type);
-        ROS_INFO("data_value: %u", data_value);
-      } 
-     
-      // create time ref message and put in the data
-      //t_ref_.header.seq = m.risingEdgeCount;
-      //t_ref_.header.stamp = ros::Time::now();
-      //t_ref_.header.frame_id = frame_id;
-
-      //t_ref_.time_ref = ros::Time((m.wnR * 604800 + m.towMsR / 1000), (m.towMsR % 1000) * 1000000 + m.towSubMsR); 
-    
-      //std::ostringstream src;
-      //src << "TIM" << int(m.ch); 
-      //t_ref_.source = src.str();
-
-      t_ref_.header.stamp = ros::Time::now(); // create a new timestamp
-      t_ref_.header.frame_id = frame_id;
-   
-      time_ref_pub.publish(t_ref_);
-      imu_pub.publish(imu_);
-    }
+  // A new time tag, the pending one will not get more samples
+  if (esf_axes_ && m.timeTag != esf_time_tag_) {
+    esf_full_axes_ |= esf_axes_;
+    publishImu();
+  }
+  if (!esf_axes_) {
+    std::fill(esf_values_, esf_values_ + ublox_gps::ESF_NUM_AXES, 0.0);
+    esf_time_tag_ = m.timeTag;
+    esf_stamp_ = stamp;
+  }
+
+  esf_axes_ |= esf_decoder_.decode(m.data.data(), m.data.size(), esf_values_);
+  if (esf_axes_ && esf_axes_ == esf_full_axes_)
+    publishImu();
+}
+
+void AdrUdrProduct::checkTimeTagRate(uint32_t time_tag,
+                                     const ros::Time& arrival, double unit,
+                                     TimeTagCheck& check, const char* message,
+                                     const char* param) {
+  // No sensor clock runs at half or twice the host rate, the unit is wrong
+  if (check.arrival.isZero()) {
+    check.arrival = arrival;
+    check.time_tag = time_tag;
+  } else if (arrival - check.arrival >= ros::Duration(10.0)) {
+    double rate = (time_tag - check.time_tag) * unit
+                  / (arrival - check.arrival).toSec();
+    if (rate < 0.5 || rate > 2.0)
+      ROS_WARN_THROTTLE(60, "%s time tags advance %.3g times as fast as the "
+                        "host clock, check %s (%g s)", message, rate, param,
+                        unit);
+    check.arrival = arrival;
+    check.time_tag = time_tag;
+  }
+}
+
+void AdrUdrProduct::publishImu() {
+  static ros::Publisher imu_pub =
+      nh->advertise<sensor_msgs::Imu>("imu_meas", kROSQueueSize);
+  static ros::Publisher time_ref_pub =
+      nh->advertise<sensor_msgs::TimeReference>("interrupt_time",
+                                                kROSQueueSize);
+
+  imu_.header.stamp = esf_stamp_;
+  imu_.header.frame_id = frame_id;
+  ublox_gps::setImu(esf_values_, esf_axes_, imu_);
+  imu_pub.publish(imu_);
+  recordPublished();
+
+  // The sensor time tag of the samples
+  t_ref_.header.stamp = esf_stamp_;
+  t_ref_.header.frame_id = frame_id;
+  t_ref_.time_ref = ros::Time(esf_time_tag_ * esf_time_tag_unit_);
+  t_ref_.source = "ESF";
+  time_ref_pub.publish(t_ref_);
+  recordPublished();
+
+  esf_axes_ = 0;
+}
+
+void AdrUdrProduct::callbackEsfRAW(const ublox_msgs::EsfRAW &m) {
+  static ros::Publisher imu_pub =
+      nh->advertise<sensor_msgs::Imu>("imu_raw", kROSQueueSize);
+  if (m.blocks.empty())
+    return;
+
+  // Map the sensor time tags to host time. The interface description gives
+  // no unit for sTtag and does not say that it shares the time base of the
+  // ESF-MEAS timeTag, so ESF-RAW has its own estimator and a configurable
+  // unit. Without an estimate, the newest sample is stamped with the arrival
+  // time.
+  const double unit = esf_raw_time_tag_unit_;
+  ros::Time arrival = gps.arrivalTime();
+  uint32_t newest = m.blocks.back().sTtag;
+  bool estimated = false;
+  if (estimate_clock) {
+    esf_raw_clock_.update(newest * unit, arrival);
+    estimated = esf_raw_clock_.valid();
+  }
+
+  checkTimeTagRate(newest, arrival, unit, esf_raw_check_, "ESF-RAW",
+                   "esf/raw_time_tag_unit");
+
+  // Blocks with the same time tag are the axes of one sample
+  imu_raw_.header.frame_id = frame_id;
+  double values[ublox_gps::ESF_NUM_AXES + 1];
+  std::size_t i = 0;
+  while (i < m.blocks.size()) {
+    uint32_t time_tag = m.blocks[i].sTtag;
+    std::fill(values, values + ublox_gps::ESF_NUM_AXES, 0.0);
+    unsigned axes = 0;
+    for (; i < m.blocks.size() && m.blocks[i].sTtag == time_tag; ++i)
+      axes |= esf_decoder_.decode(m.blocks[i].data, values);
+    // e.g. only a temperature
+    if (!axes)
+      continue;
+
+    if (estimated)
+      imu_raw_.header.stamp = esf_raw_clock_.toHost(time_tag * unit);
+    else
+      imu_raw_.header.stamp =
+          arrival - ros::Duration((newest - time_tag) * unit);
+    ublox_gps::setImu(values, axes, imu_raw_);
+    imu_pub.publish(imu_raw_);
+    recordPublished();
   }
-  
-  updater->force_update();
 }
+
 //
 // u-blox High Precision GNSS Reference Station
 //
@@ -1606,25 +2392,25 @@ bool HpgRefProduct::configureUblox() {
 void HpgRefProduct::subscribe() {
   // Whether to publish Nav Survey-In messages
   nh->param("publish/nav/svin", enabled["nav_svin"], enabled["nav"]);
+  publish_nav_svin_ = enabled["nav_svin"];
   // Subscribe to Nav Survey-In
   gps.subscribe<ublox_msgs::NavSVIN>(boost::bind(
       &HpgRefProduct::callbackNavSvIn, this, _1), kSubscribeRate);
 }
 
 void HpgRefProduct::callbackNavSvIn(ublox_msgs::NavSVIN m) {
-  if(enabled["nav_svin"]) {
+  if(publish_nav_svin_) {
     static ros::Publisher publisher =
         nh->advertise<ublox_msgs::NavSVIN>("navsvin", kROSQueueSize);
     publisher.publish(m);
+    recordPublished();
   }
 
-  last_nav_svin_ = m;
+  last_nav_svin_.set(m);
 
   if(!m.active && m.valid && mode_ == SURVEY_IN) {
     setTimeMode();
   }
-
-  updater->update();
 }
 
 bool HpgRefProduct::setTimeMode() {
@@ -1651,6 +2437,7 @@ void HpgRefProduct::initializeRosDiagnostics() {
 
 void HpgRefProduct::tmode3Diagnostics(
     diagnostic_updater::DiagnosticStatusWrapper& stat) {
+  const ublox_msgs::NavSVIN last_nav_svin = last_nav_svin_.get();
   if (mode_ == INIT) {
     stat.level = diagnostic_msgs::DiagnosticStatus::WARN;
     stat.message = "Not configured";
@@ -1658,30 +2445,30 @@ void HpgRefProduct::tmode3Diagnostics(
     stat.level = diagnostic_msgs::DiagnosticStatus::WARN;
     stat.message = "Disabled";
   } else if (mode_ == SURVEY_IN) {
-    if (!last_nav_svin_.active && !last_nav_svin_.valid) {
+    if (!last_nav_svin.active && !last_nav_svin.valid) {
       stat.level = diagnostic_msgs::DiagnosticStatus::ERROR;
       stat.message = "Survey-In inactive and invalid";
-    } else if (last_nav_svin_.active && !last_nav_svin_.valid) {
+    } else if (last_nav_svin.active && !last_nav_svin.valid) {
       stat.level = diagnostic_msgs::DiagnosticStatus::WARN;
       stat.message = "Survey-In active but invalid";
-    } else if (!last_nav_svin_.active && last_nav_svin_.valid) {
+    } else if (!last_nav_svin.active && last_nav_svin.valid) {
       stat.level = diagnostic_msgs::DiagnosticStatus::OK;
       stat.message = "Survey-In complete";
-    } else if (last_nav_svin_.active && last_nav_svin_.valid) {
+    } else if (last_nav_svin.active && last_nav_svin.valid) {
       stat.level = diagnostic_msgs::DiagnosticStatus::OK;
       stat.message = "Survey-In active and valid";
     }
 
-    stat.add("iTOW [ms]", last_nav_svin_.iTOW);
-    stat.add("Duration [s]", last_nav_svin_.dur);
-    stat.add("# observations", last_nav_svin_.obs);
-    stat.add("Mean X [m]", last_nav_svin_.meanX * 1e-2);
-    stat.add("Mean Y [m]", last_nav_svin_.meanY * 1e-2);
-    stat.add("Mean Z [m]", last_nav_svin_.meanZ * 1e-2);
-    stat.add("Mean X HP [m]", last_nav_svin_.meanXHP * 1e-4);
-    stat.add("Mean Y HP [m]", last_nav_svin_.meanYHP * 1e-4);
-    stat.add("Mean Z HP [m]", last_nav_svin_.meanZHP * 1e-4);
-    stat.add("Mean Accuracy [m]", last_nav_svin_.meanAcc * 1e-4);
+    stat.add("iTOW [ms]", last_nav_svin.iTOW);
+    stat.add("Duration [s]", last_nav_svin.dur);
+    stat.add("# observations", last_nav_svin.obs);
+    stat.add("Mean X [m]", last_nav_svin.meanX * 1e-2);
+    stat.add("Mean Y [m]", last_nav_svin.meanY * 1e-2);
+    stat.add("Mean Z [m]", last_nav_svin.meanZ * 1e-2);
+    stat.add("Mean X HP [m]", last_nav_svin.meanXHP * 1e-4);
+    stat.add("Mean Y HP [m]", last_nav_svin.meanYHP * 1e-4);
+    stat.add("Mean Z HP [m]", last_nav_svin.meanZHP * 1e-4);
+    stat.add("Mean Accuracy [m]", last_nav_svin.meanAcc * 1e-4);
   } else if(mode_ == FIXED) {
     stat.level = diagnostic_msgs::DiagnosticStatus::OK;
     stat.message = "Fixed Position";
@@ -1710,6 +2497,7 @@ bool HpgRovProduct::configureUblox() {
 void HpgRovProduct::subscribe() {
   // Whether to publish Nav Relative Position NED
   nh->param("publish/nav/relposned", enabled["nav_relposned"], enabled["nav"]);
+  publish_nav_relposned_ = enabled["nav_relposned"];
   // Subscribe to Nav Relative Position NED messages (also updates diagnostics)
   gps.subscribe<ublox_msgs::NavRELPOSNED>(boost::bind(
      &HpgRovProduct::callbackNavRelPosNed, this, _1), kSubscribeRate);
@@ -1726,47 +2514,62 @@ void HpgRovProduct::initializeRosDiagnostics() {
 
 void HpgRovProduct::carrierPhaseDiagnostics(
     diagnostic_updater::DiagnosticStatusWrapper& stat) {
-  uint32_t carr_soln = last_rel_pos_.flags & last_rel_pos_.FLAGS_CARR_SOLN_MASK;
-  stat.add("iTow", last_rel_pos_.iTow);
-  if (carr_soln & last_rel_pos_.FLAGS_CARR_SOLN_NONE ||
-      !(last_rel_pos_.flags & last_rel_pos_.FLAGS_DIFF_SOLN &&
-        last_rel_pos_.flags & last_rel_pos_.FLAGS_REL_POS_VALID)) {
+  const ublox_msgs::NavRELPOSNED last_rel_pos = last_rel_pos_.get();
+  uint32_t carr_soln = last_rel_pos.flags & last_rel_pos.FLAGS_CARR_SOLN_MASK;
+  stat.add("iTow", last_rel_pos.iTow);
+  if (carr_soln & last_rel_pos.FLAGS_CARR_SOLN_NONE ||
+      !(last_rel_pos.flags & last_rel_pos.FLAGS_DIFF_SOLN &&
+        last_rel_pos.flags & last_rel_pos.FLAGS_REL_POS_VALID)) {
     stat.level = diagnostic_msgs::DiagnosticStatus::ERROR;
     stat.message = "None";
   } else {
-    if (carr_soln & last_rel_pos_.FLAGS_CARR_SOLN_FLOAT) {
+    if (carr_soln & last_rel_pos.FLAGS_CARR_SOLN_FLOAT) {
       stat.level = diagnostic_msgs::DiagnosticStatus::WARN;
       stat.message = "Float";
-    } else if (carr_soln & last_rel_pos_.FLAGS_CARR_SOLN_FIXED) {
+    } else if (carr_soln & last_rel_pos.FLAGS_CARR_SOLN_FIXED) {
       stat.level = diagnostic_msgs::DiagnosticStatus::OK;
       stat.message = "Fixed";
     }
-    stat.add("Ref Station ID", last_rel_pos_.refStationId);
-
-    double rel_pos_n = (last_rel_pos_.relPosN
-                       + (last_rel_pos_.relPosHPN * 1e-2)) * 1e-2;
-    double rel_pos_e = (last_rel_pos_.relPosE
-                       + (last_rel_pos_.relPosHPE * 1e-2)) * 1e-2;
-    double rel_pos_d = (last_rel_pos_.relPosD
-                       + (last_rel_pos_.relPosHPD * 1e-2)) * 1e-2;
+    stat.add("Ref Station ID", last_rel_pos.refStationId);
+
+    double rel_pos_n = (last_rel_pos.relPosN
+                       + (last_rel_pos.relPosHPN * 1e-2)) * 1e-2;
+    double rel_pos_e = (last_rel_pos.relPosE
+                       + (last_rel_pos.relPosHPE * 1e-2)) * 1e-2;
+    double rel_pos_d = (last_rel_pos.relPosD
+                       + (last_rel_pos.relPosHPD * 1e-2)) * 1e-2;
     stat.add("Relative Position N [m]", rel_pos_n);
-    stat.add("Relative Accuracy N [m]", last_rel_pos_.accN * 1e-4);
+    stat.add("Relative Accuracy N [m]", last_rel_pos.accN * 1e-4);
     stat.add("Relative Position E [m]", rel_pos_e);
-    stat.add("Relative Accuracy E [m]", last_rel_pos_.accE * 1e-4);
+    stat.add("Relative Accuracy E [m]", last_rel_pos.accE * 1e-4);
     stat.add("Relative Position D [m]", rel_pos_d);
-    stat.add("Relative Accuracy D [m]", last_rel_pos_.accD * 1e-4);
+    stat.add("Relative Accuracy D [m]", last_rel_pos.accD * 1e-4);
   }
 }
 
 void HpgRovProduct::callbackNavRelPosNed(const ublox_msgs::NavRELPOSNED &m) {
-  if (enabled["nav_relposned"]) {
+  if (publish_nav_relposned_) {
     static ros::Publisher publisher =
         nh->advertise<ublox_msgs::NavRELPOSNED>("navrelposned", kROSQueueSize);
     publisher.publish(m);
+    recordPublished();
+
+    // NavRELPOSNED has no header, publish the relative position stamped with
+    // its epoch as well
+    static ros::Publisher ned_publisher =
+        nh->advertise<geometry_msgs::Vector3Stamped>("navrelposned_ned",
+                                                     kROSQueueSize);
+    geometry_msgs::Vector3Stamped ned;
+    ned.header.stamp = epochStamp(m.iTow);
+    ned.header.frame_id = frame_id;
+    ned.vector.x = (m.relPosN + m.relPosHPN * 1e-2) * 1e-2; // to [m]
+    ned.vector.y = (m.relPosE + m.relPosHPE * 1e-2) * 1e-2;
+    ned.vector.z = (m.relPosD + m.relPosHPD * 1e-2) * 1e-2;
+    ned_publisher.publish(ned);
+    recordPublished();
   }
 
-  last_rel_pos_ = m;
-  updater->update();
+  last_rel_pos_.set(m);
 }
 
 //
@@ -1792,6 +2595,7 @@ void TimProduct::subscribe() {
   ROS_INFO("TIM-TM2 is Enabled: %u", enabled["tim_tm2"]);
   // Subscribe to TIM-TM2 messages (Time mark messages)
   nh->param("publish/tim/tm2", enabled["tim_tm2"], enabled["tim"]);
+  publish_tim_tm2_ = enabled["tim_tm2"];
 
   gps.subscribe<ublox_msgs::TimTM2>(boost::bind(
     &TimProduct::callbackTimTM2, this, _1), kSubscribeRate);
@@ -1801,19 +2605,17 @@ void TimProduct::subscribe() {
   // Subscribe to SFRBX messages
   nh->param("publish/rxm/sfrb", enabled["rxm_sfrb"], enabled["rxm"]);
   if (enabled["rxm_sfrb"])
-    gps.subscribe<ublox_msgs::RxmSFRBX>(boost::bind(
-        publish<ublox_msgs::RxmSFRBX>, _1, "rxmsfrb"), kSubscribeRate);
+    subscribeTopic<ublox_msgs::RxmSFRBX>("rxmsfrb", kSubscribeRate);
 	
    // Subscribe to RawX messages
    nh->param("publish/rxm/raw", enabled["rxm_raw"], enabled["rxm"]);
    if (enabled["rxm_raw"])
-     gps.subscribe<ublox_msgs::RxmRAWX>(boost::bind(
-        publish<ublox_msgs::RxmRAWX>, _1, "rxmraw"), kSubscribeRate);
+     subscribeTopic<ublox_msgs::RxmRAWX>("rxmraw", kSubscribeRate);
 }
 
 void TimProduct::callbackTimTM2(const ublox_msgs::TimTM2 &m) {
   
-  if (enabled["tim_tm2"]) {
+  if (publish_tim_tm2_) {
     static ros::Publisher publisher =
     	nh->advertise<ublox_msgs::TimTM2>("timtm2", kROSQueueSize);
     static ros::Publisher time_ref_pub =
@@ -1821,7 +2623,7 @@ void TimProduct::callbackTimTM2(const ublox_msgs::TimTM2 &m) {
     
     // create time ref message and put in the data
     t_ref_.header.seq = m.risingEdgeCount;
-    t_ref_.header.stamp = ros::Time::now();
+    t_ref_.header.stamp = gps.arrivalTime();
     t_ref_.header.frame_id = frame_id;
 
     t_ref_.time_ref = ros::Time((m.wnR * 604800 + m.towMsR / 1000), (m.towMsR % 1000) * 1000000 + m.towSubMsR); 
@@ -1830,14 +2632,13 @@ void TimProduct::callbackTimTM2(const ublox_msgs::TimTM2 &m) {
     src << "TIM" << int(m.ch); 
     t_ref_.source = src.str();
 
-    t_ref_.header.stamp = ros::Time::now(); // create a new timestamp
+    t_ref_.header.stamp = gps.arrivalTime(); // create a new timestamp
     t_ref_.header.frame_id = frame_id;
   
     publisher.publish(m);
     time_ref_pub.publish(t_ref_);
+    recordPublished();
   }
-  
-  updater->force_update();
 }
 
 void TimProduct::initializeRosDiagnostics() {
@@ -1851,8 +2652,17 @@ void rtcmCallback(const rtcm_msgs::Message::ConstPtr &msg)
 }
 
 
+/**
+ * @brief Request the node to shut down, e.g. on SIGINT.
+ */
+static void requestShutdown(int signal) {
+  shutdown_requested = 1;
+}
+
 int main(int argc, char** argv) {
-  ros::init(argc, argv, "ublox_gps");
+  // The node shuts down on SIGINT, then ROS
+  ros::init(argc, argv, "ublox_gps", ros::init_options::NoSigintHandler);
+  signal(SIGINT, requestShutdown);
   nh.reset(new ros::NodeHandle("~"));
   nh->param("debug", ublox_gps::debug, 1);
 
@@ -1869,6 +2679,9 @@ int main(int argc, char** argv) {
      ros::console::notifyLoggerLevelsChanged();
 
   }
-  UbloxNode node;
+  {
+    UbloxNode node;
+  }
+  ros::shutdown();
   return 0;
 }
@@ -787,7 +787,7 @@ struct Serializer<ublox_msgs::EsfMEAS_<ContainerAllocator> > {
   }
 
   static uint32_t serializedLength (typename CallTraits::param_type m) {
-    return 4 + 8 * m.data.size() + 4 * m.calibTtag.size();
+    return 8 + 4 * m.data.size() + 4 * m.calibTtag.size();
   }
 
   static void write(uint8_t *data, uint32_t size, 